@@ -46,6 +46,7 @@
 #include "scd_hal.h"
 #include "scd_io.h"
 #include "scd_logger.h"
+#include "scd_tasks.h"
 #include "scd_values.h"
 #include "serial.h"
 #include "terminal.h"
@@ -80,6 +81,96 @@ static char* strPINOK = "PIN OK";
 static char* strPINBAD = "PIN BAD";
 #endif
 
+static log_struct_t *taskLogger;    // log of the app running the tasks
+static uint32_t taskTraceTime;      // sync counter at the last trace frame
+static uint8_t taskCounter;         // transaction shown on the LCD
+static uint8_t taskStop;            // set when button C is pressed
+
+static uint16_t logWriteAddr;       // next byte of the record being copied
+static uint16_t logWriteLeft;       // bytes of that record still to copy
+
+
+/* Tasks run while the applications wait for the lines, see scd_tasks.h */
+
+/**
+ * Task answering the control commands sent by the host, see
+ * ServiceHostControl
+ */
+static void HostTask()
+{
+  ServiceHostControl(taskLogger);
+}
+
+/**
+ * Task streaming the log to the host during a live trace (AT+CLIVE).
+ * A frame is sent once HOST_TRACE_CHUNK bytes are pending, or after
+ * HOST_TRACE_PERIOD if less are pending, so that the frames are not
+ * mostly overhead.
+ */
+static void LogTask()
+{
+  uint16_t pending;
+
+  if(taskLogger == NULL || !taskLogger->live)
+    return;
+
+  pending = taskLogger->position - taskLogger->sent;
+  if(pending == 0)
+    return;
+  if(pending < HOST_TRACE_CHUNK &&
+      GetCounter() - taskTraceTime < HOST_TRACE_PERIOD)
+    return;
+
+  SendLogHost(taskLogger, HOST_TRACE_CHUNK);
+  taskTraceTime = GetCounter();
+}
+
+/**
+ * Task showing the number of transactions on the LCD and checking
+ * button C, which stops the application at the next terminal reset
+ */
+static void InterfaceTask()
+{
+  if(lcdAvailable && taskCounter != nCounter)
+  {
+    taskCounter = nCounter;
+    fprintf(stderr, "Trans:  %u\n", nCounter);
+  }
+
+  if(GetButtonC() == 0)
+    taskStop = 1;
+}
+
+/**
+ * Adds the tasks of the applications to the scheduler and runs them
+ * while the lines wait
+ *
+ * @param logger the log structure or NULL if log is not desired
+ */
+static void StartAppTasks(log_struct_t *logger)
+{
+  taskLogger = logger;
+  taskTraceTime = GetCounter();
+  taskCounter = nCounter;
+  taskStop = 0;
+
+  AddTask(HostTask, TASK_GROUP_HOST, TASK_RUN);
+  AddTask(LogTask, TASK_GROUP_HOST, TASK_RUN);
+  AddTask(InterfaceTask, TASK_GROUP_UI, TASK_RUN);
+  SetLineIdleHook(RunTasks);
+}
+
+/**
+ * Stops the tasks started by StartAppTasks
+ */
+static void StopAppTasks()
+{
+  SetLineIdleHook(NULL);
+  SetGroupMode(TASK_GROUP_HOST, TASK_STOP);
+  SetGroupMode(TASK_GROUP_UI, TASK_STOP);
+  taskLogger = NULL;
+}
+
 /**
  * Virtual Serial Port application
  *
@@ -87,8 +178,9 @@ static char* strPINBAD = "PIN BAD";
  */
 uint8_t VirtualSerial(log_struct_t *logger)
 {
-  char *buf;
-  char *response = NULL;
+  const char *buf;
+  uint16_t len;
+  const char *response = NULL;
 
   if(GetLCDState() == 0)
     InitLCD();
@@ -110,20 +202,18 @@ uint8_t VirtualSerial(log_struct_t *logger)
 
   for (;;)
   {
-    buf = GetHostData(256);
+    buf = GetHostLine(&len);
     if(buf == NULL)
     {
       _delay_ms(100);
       continue;
     }
 
-    response = (char*)ProcessSerialData(buf, logger);
-    free(buf);
+    response = ProcessSerialData(buf, logger);
 
     if(response != NULL)
     {
       SendHostData(response);
-      free(response);
       response = NULL;
     }
 
@@ -147,7 +237,7 @@ uint8_t VirtualSerial(log_struct_t *logger)
 uint8_t SerialInterface(uint16_t baudUBRR, log_struct_t *logger)
 {
   char *buf;
-  char *response = NULL;
+  const char *response = NULL;
 
   InitLCD();
   fprintf(stderr, "\n");
@@ -176,13 +266,12 @@ uint8_t SerialInterface(uint16_t baudUBRR, log_struct_t *logger)
     fprintf(stderr, "Got:%s\n", buf);
     _delay_ms(500);
 
-    response = (char*)ProcessSerialData(buf, logger);
+    response = ProcessSerialData(buf, logger);
     free(buf);
 
     if(response != NULL)
     {
       SendLineUSART(response);
-      free(response);
     }
   }
 }
@@ -216,13 +305,20 @@ void EraseEEPROM()
 /** 
  * Reset the data in EEPROM to default values. This method
  * will first erase the EEPROM contents and then set the
- * default values.
+ * default values. The event mask of the logger is kept and
+ * the log session is changed, so a host pulling the log with
+ * AT+CGLOG knows that it was erased.
  * Interrupts are disabled during operation.
  * 
  * @sa EraseEEPROM
  */
 void ResetEEPROM()
 {
+  uint8_t mask, session;
+
+  mask = eeprom_read_byte((uint8_t*)EEPROM_LOG_MASK);
+  session = eeprom_read_byte((uint8_t*)EEPROM_LOG_SESSION);
+
   EraseEEPROM();
 
   eeprom_write_byte((uint8_t*)EEPROM_WARM_RESET, 0);
@@ -231,10 +327,9 @@ void ResetEEPROM()
   eeprom_write_dword((uint32_t*)EEPROM_TEMP_2, 0);
   eeprom_write_byte((uint8_t*)EEPROM_APPLICATION, 0);
   eeprom_write_byte((uint8_t*)EEPROM_COUNTER, 0);
-  eeprom_write_byte(
-      (uint8_t*)EEPROM_TLOG_POINTER_HI, (EEPROM_TLOG_DATA >> 8) & 0xFF);
-  eeprom_write_byte(
-      (uint8_t*)EEPROM_TLOG_POINTER_LO, EEPROM_TLOG_DATA & 0xFF);
+  eeprom_write_byte((uint8_t*)EEPROM_LOG_VERSION, EEPROM_LOG_FORMAT);
+  eeprom_write_byte((uint8_t*)EEPROM_LOG_MASK, mask);
+  eeprom_write_byte((uint8_t*)EEPROM_LOG_SESSION, session + 1);
 }
 
 /**
@@ -344,6 +439,8 @@ uint8_t Terminal(log_struct_t *logger)
   uint8_t convention, proto, TC1, TA3, TB3;
   uint8_t error;
   uint8_t tmp;
+  uint16_t lstart;
+  uint32_t tstart;
   RAPDU *response = NULL;
   FCITemplate *fci = NULL;
   APPINFO *appInfo = NULL;
@@ -356,7 +453,7 @@ uint8_t Terminal(log_struct_t *logger)
   ByteArray *atcData = NULL;
   ByteArray *lastAtcData = NULL;
   GENERATE_AC_PARAMS acParams;
-  const TLV *cdol = NULL;
+  TLVCursor cdol;
 
   // Visual signal for this app
   Led1Off();
@@ -383,11 +480,13 @@ uint8_t Terminal(log_struct_t *logger)
   DisableWDT();
   DisableTerminalResetInterrupt();
   DisableICCInsertInterrupt();
+  StartAppTasks(logger);
 
   // Expect the card to be inserted first and then start
   if(lcdAvailable)
     fprintf(stderr, "%s\n", strInsertCard);
-  while(IsICCInserted() == 0);
+  while(IsICCInserted() == 0)
+    RunTasks();
   if(lcdAvailable)
     fprintf(stderr, "%s\n", strCardInserted);
   if(logger)
@@ -398,6 +497,8 @@ uint8_t Terminal(log_struct_t *logger)
   EnableWDT(4000);
 
   // Initialize card
+  lstart = LogMark(logger);
+  tstart = GetCounter();
   error = ResetICC(0, &convention, &proto, &TC1, &TA3, &TB3, logger);
   if(error)
   {
@@ -405,13 +506,10 @@ uint8_t Terminal(log_struct_t *logger)
     _delay_ms(1000);
     goto endtransaction;
   }
-  if(proto != 0)
-  {
-    error = RET_ICC_BAD_PROTO;
-    fprintf(stderr, "Error:  %d\n", error);
-    _delay_ms(1000);
-    goto endtransaction;
-  }
+
+  // update transaction counter and index the transaction
+  nCounter++;
+  LogTransaction(logger, lstart, tstart, nCounter);
   ResetWDT();
 
   // Select application. You can use one of the following options:
@@ -554,8 +652,7 @@ uint8_t Terminal(log_struct_t *logger)
   acParams.transactionDate[0] = 0x01;
   acParams.transactionDate[1] = 0x01;
   acParams.transactionDate[2] = 0x01;
-  cdol = GetTLVFromRECORD(tData, 0x8C, 0);
-  if(cdol == NULL)
+  if(GetTLVFromRECORD(tData, 0x8C, 0, &cdol))
   {
     error = RET_ERROR;
     fprintf(stderr, "Error:  %d\n", error);
@@ -565,7 +662,7 @@ uint8_t Terminal(log_struct_t *logger)
 
   if(response != NULL) FreeRAPDU(response);
   response = SendGenerateAC(
-      convention, TC1, AC_REQ_ARQC, cdol, &acParams, logger);
+      convention, TC1, AC_REQ_ARQC, &cdol, &acParams, logger);
   if(response == NULL)
   {
     error = RET_EMV_GENERATE_AC;
@@ -595,6 +692,7 @@ endfci:
 endtransaction:
   DisableWDT();
   DeactivateICC();
+  StopAppTasks();
 
   if(logger)
   {
@@ -632,6 +730,8 @@ uint8_t FilterGenerateAC(log_struct_t *logger)
   uint8_t posCDOL1 = 0;
   uint8_t amount[12];	
   uint8_t gotGAC = 0;
+  uint16_t lstart;
+  uint32_t tstart;
   CAPDU *cmd;
   RAPDU *response;	
   RECORD *record;
@@ -667,11 +767,17 @@ uint8_t FilterGenerateAC(log_struct_t *logger)
 
   EnableWDT(4000);
 
+  lstart = LogMark(logger);
+  tstart = GetCounter();
   error = InitSCDTransaction(t_inverse, t_TC1, &cInverse, 
       &cProto, &cTC1, &cTA3, &cTB3, logger);
   if(error)
     goto enderror;
 
+  // update transaction counter and index the transaction
+  nCounter++;
+  LogTransaction(logger, lstart, tstart, nCounter);
+
   // forward commands until Read Record is received
   while(posCDOL1 == 0)
   {
@@ -694,7 +800,8 @@ uint8_t FilterGenerateAC(log_struct_t *logger)
         goto enderror;
       }
 
-      response = ReceiveT0Response(cInverse, cmd->cmdHeader, logger);
+      response = ReceiveT0Response(cInverse, cmd->cmdHeader,
+          T0_NULL_TO_TERMINAL(t_inverse), logger);
       if(response == NULL)
       {	
         error = RET_ICC_GET_RESPONSE;
@@ -926,6 +1033,8 @@ uint8_t DummyPIN(log_struct_t *logger)
   RAPDU *response;	
   ByteArray *pin = NULL;
   uint8_t error;
+  uint16_t lstart;
+  uint32_t tstart;
 
   if(lcdAvailable)
   {
@@ -966,13 +1075,16 @@ uint8_t DummyPIN(log_struct_t *logger)
   // communication several times (e.g. warm reset).
   while(1) // external while
   {
+    lstart = LogMark(logger);
+    tstart = GetCounter();
     error = InitSCDTransaction(t_inverse, t_TC1, &cInverse, 
         &cProto, &cTC1, &cTA3, &cTB3, logger);
     if(error)
       goto enderror;
 
-    // update transaction counter
+    // update transaction counter and index the transaction
     nCounter++;
+    LogTransaction(logger, lstart, tstart, nCounter);
 
     // forward commands and change VERIFY
     while(1) // internal while
@@ -1005,6 +1117,8 @@ uint8_t DummyPIN(log_struct_t *logger)
           FreeCAPDU(cmd);
           goto enderror;
         }		
+        // the PIN bytes are shared with pin, which is freed at the end
+        tcmd->cmdData = NULL;
 
         response = ForwardResponse(t_inverse, cInverse, tcmd->cmdHeader, LOG_DIR_TERMINAL, logger);
         if(response == NULL)
@@ -1076,7 +1190,15 @@ enderror:
  * is not too large.
  *
  * The log will be stored in EEPROM and can be retrieved using any programmer,
- * but I recommend using the Python tools.
+ * but I recommend using the Python tools. If logger->live is set (AT+CLIVE)
+ * the log is instead streamed to the USB host while the lines wait, so the
+ * transaction is not limited by the size of the log buffer or EEPROM.
+ *
+ * The USB host, the log and the LCD are serviced by the tasks of the
+ * scheduler (see scd_tasks.h), which run while the lines wait. So the
+ * host can send control commands (see ServiceHostControl) during the
+ * transaction, and pressing button C stops the relay at the next
+ * terminal reset.
  *
  * @param logger the log structure or NULL if log is not desired
  * @return 0 if successful, non-zero otherwise. See scd_values.h for details.
@@ -1086,6 +1208,8 @@ uint8_t ForwardData(log_struct_t *logger)
   uint8_t t_inverse = 0, t_TC1 = 0, error = 0;
   uint8_t cInverse, cProto, cTC1, cTA3, cTB3;
   CRP *crp = NULL;
+  uint16_t lstart;
+  uint32_t tstart;
 
   // Visual signal for this app
   Led1On();
@@ -1105,16 +1229,19 @@ uint8_t ForwardData(log_struct_t *logger)
   DisableWDT();
   DisableTerminalResetInterrupt();
   DisableICCInsertInterrupt();
+  StartAppTasks(logger);
 
   // Expect the card to be inserted first and then wait a for terminal reset
   if(lcdAvailable)
     fprintf(stderr, "%s\n", strInsertCard);
-  while(IsICCInserted() == 0);
+  while(IsICCInserted() == 0)
+    RunTasks();
   if(lcdAvailable)
     fprintf(stderr, "Connect terminal\n");
   if(logger)
     LogByte1(logger, LOG_ICC_INSERTED, 0);
-  while(GetTerminalResetLine() != 0);
+  while(GetTerminalResetLine() != 0)
+    RunTasks();
   if(lcdAvailable)
     fprintf(stderr, "Working ...\n");
   if(logger)
@@ -1123,15 +1250,18 @@ uint8_t ForwardData(log_struct_t *logger)
   // Loop until there is no clock from terminal or a timeout occurs.
   // This allows to log transactions where the reader might reset the
   // communication several times (e.g. warm reset).
-  while(1) // external while
+  while(taskStop == 0) // external while
   {
+    lstart = LogMark(logger);
+    tstart = GetCounter();
     error = InitSCDTransaction(t_inverse, t_TC1, &cInverse,
         &cProto, &cTC1, &cTA3, &cTB3, logger);
     if(error)
       goto enderror;
 
-    // update transaction counter
+    // update transaction counter and index the transaction
     nCounter++;
+    LogTransaction(logger, lstart, tstart, nCounter);
 
     // Continually exchange commands until a terminal reset or timeout
     while(1) // internal while
@@ -1147,12 +1277,19 @@ uint8_t ForwardData(log_struct_t *logger)
 
 enderror:
   DeactivateICC();
+  StopAppTasks();
   if((error == RET_TERMINAL_TIME_OUT) || (error == RET_TERMINAL_NO_CLOCK))
   {
     // these errors are logged and used as a signal to stop
     error = 0;
   }
-  if(logger)
+  if(logger && logger->live)
+  {
+    LogByte1(logger, LOG_ICC_DEACTIVATED, 0);
+    SendLogHost(logger, LOG_BUFFER_SIZE);
+    ResetLogger(logger);
+  }
+  else if(logger)
   {
     LogByte1(logger, LOG_ICC_DEACTIVATED, 0);
     if(lcdAvailable)
@@ -1165,20 +1302,566 @@ enderror:
 }
 
 
+/**
+ * Returns the EEPROM address found by moving forward in the log ring.
+ *
+ * @param addr address inside the log ring
+ * @param offset number of bytes to move forward
+ * @return the address, wrapped to the start of the ring if needed
+ */
+uint16_t LogRingAddress(uint16_t addr, uint16_t offset)
+{
+  addr = addr - EEPROM_TLOG_DATA + offset;
+  if(addr >= EEPROM_TLOG_SIZE)
+    addr -= EEPROM_TLOG_SIZE;
+
+  return addr + EEPROM_TLOG_DATA;
+}
+
+/**
+ * Reads bytes from the log ring, continuing from the start of the
+ * ring when the end of the log area is reached.
+ *
+ * @param addr address inside the log ring
+ * @param data buffer where the bytes are stored
+ * @param len number of bytes to read
+ * @return the address following the last byte read
+ */
+uint16_t ReadLogRing(uint16_t addr, uint8_t *data, uint16_t len)
+{
+  uint16_t part;
+
+  part = EEPROM_MAX_ADDRESS - addr;
+  if(part > len)
+    part = len;
+  eeprom_read_block(data, (void*)addr, part);
+  if(part < len)
+    eeprom_read_block(data + part, (void*)EEPROM_TLOG_DATA, len - part);
+
+  return LogRingAddress(addr, len);
+}
+
+/**
+ * Writes bytes to the log ring, continuing from the start of the
+ * ring when the end of the log area is reached. Bytes that already
+ * have the right value are not written again.
+ *
+ * @param addr address inside the log ring
+ * @param data bytes to write
+ * @param len number of bytes to write
+ * @return the address following the last byte written
+ */
+static uint16_t WriteLogRing(uint16_t addr, const uint8_t *data, uint16_t len)
+{
+  uint16_t part;
+
+  part = EEPROM_MAX_ADDRESS - addr;
+  if(part > len)
+    part = len;
+  eeprom_update_block(data, (void*)addr, part);
+  if(part < len)
+    eeprom_update_block(data + part, (void*)EEPROM_TLOG_DATA, len - part);
+
+  return LogRingAddress(addr, len);
+}
+
+/**
+ * Returns the number of bytes used in the log ring.
+ *
+ * @param ring state of the log ring
+ * @return bytes between tail and head, including record headers
+ */
+uint16_t LogRingUsed(const log_ring_t *ring)
+{
+  if(ring->head >= ring->tail)
+    return ring->head - ring->tail;
+
+  return EEPROM_TLOG_SIZE - (ring->tail - ring->head);
+}
+
+/**
+ * Reads the state of the log ring. The state is kept in
+ * EEPROM_LOG_NSLOTS metadata slots that are written in turn, so
+ * that a single location is not rewritten at every log flush. A slot
+ * is valid if its check word and addresses are consistent and the
+ * newest valid slot (by sequence number) gives the state of the ring.
+ * If no slot is valid (e.g. after an erase) or the log has an older
+ * format (EEPROM_LOG_VERSION) the ring is empty.
+ *
+ * @param ring structure where the state is stored
+ */
+void ReadLogRingState(log_ring_t *ring)
+{
+  uint8_t slot[EEPROM_LOG_SLOT_SIZE];
+  uint16_t seq, head, tail, check;
+  uint8_t i, found = 0;
+
+  ring->seq = 0;
+  ring->head = EEPROM_TLOG_DATA;
+  ring->tail = EEPROM_TLOG_DATA;
+
+  // the log of an older format is not used
+  if(eeprom_read_byte((uint8_t*)EEPROM_LOG_VERSION) != EEPROM_LOG_FORMAT)
+    return;
+
+  for(i = 0; i < EEPROM_LOG_NSLOTS; i++)
+  {
+    eeprom_read_block(slot,
+        (void*)(EEPROM_LOG_SLOTS + i * EEPROM_LOG_SLOT_SIZE),
+        EEPROM_LOG_SLOT_SIZE);
+    seq = slot[0] | (slot[1] << 8);
+    head = slot[2] | (slot[3] << 8);
+    tail = slot[4] | (slot[5] << 8);
+    check = slot[6] | (slot[7] << 8);
+
+    if(check != (seq ^ head ^ tail ^ 0xA55A) ||
+        head < EEPROM_TLOG_DATA || head >= EEPROM_MAX_ADDRESS ||
+        tail < EEPROM_TLOG_DATA || tail >= EEPROM_MAX_ADDRESS)
+      continue;
+
+    if(!found || (int16_t)(seq - ring->seq) > 0)
+    {
+      ring->seq = seq;
+      ring->head = head;
+      ring->tail = tail;
+      found = 1;
+    }
+  }
+}
+
+/**
+ * Writes the state of the log ring to the metadata slot
+ * given by its sequence number, overwriting the oldest slot.
+ *
+ * @param ring state of the log ring
+ */
+static void WriteLogRingState(const log_ring_t *ring)
+{
+  uint8_t slot[EEPROM_LOG_SLOT_SIZE];
+  uint16_t check;
+
+  check = ring->seq ^ ring->head ^ ring->tail ^ 0xA55A;
+  slot[0] = ring->seq & 0xFF;
+  slot[1] = (ring->seq >> 8) & 0xFF;
+  slot[2] = ring->head & 0xFF;
+  slot[3] = (ring->head >> 8) & 0xFF;
+  slot[4] = ring->tail & 0xFF;
+  slot[5] = (ring->tail >> 8) & 0xFF;
+  slot[6] = check & 0xFF;
+  slot[7] = (check >> 8) & 0xFF;
+
+  eeprom_update_block(slot,
+      (void*)(EEPROM_LOG_SLOTS +
+        (ring->seq % EEPROM_LOG_NSLOTS) * EEPROM_LOG_SLOT_SIZE),
+      EEPROM_LOG_SLOT_SIZE);
+}
+
+/**
+ * Returns the check word of the log flush pending in the logger.
+ *
+ * @param logger the log structure
+ * @return the check word, see FlushLogEEPROM
+ */
+static uint16_t LogFlushCheck(const log_struct_t *logger)
+{
+  return logger->flush_addr ^ logger->flush_seq ^ logger->flush_len ^
+    logger->flush_tail ^ logger->flush_end ^ 0x5AA5;
+}
+
+/**
+ * Writes a block of the encoded log to the record being copied by
+ * FlushLogEEPROM, dropping the bytes after the end of the record.
+ *
+ * @param data the encoded bytes
+ * @param len the number of bytes
+ * @sa LogEncode
+ */
+static void WriteLogBlock(const uint8_t *data, uint8_t len)
+{
+  if(len > logWriteLeft)
+    len = logWriteLeft;
+  logWriteAddr = WriteLogRing(logWriteAddr, data, len);
+  logWriteLeft -= len;
+}
+
+/**
+ * Drops the oldest records of the log ring until a new record fits
+ * at its head. One byte of the ring is always kept free, so that head
+ * == tail means that the ring is empty.
+ *
+ * @param ring state of the log ring, where the tail is updated
+ * @param len number of bytes of the log in the new record
+ */
+static void DropLogRecords(log_ring_t *ring, uint16_t len)
+{
+  uint8_t header[EEPROM_LOG_RECORD_HEADER];
+  uint16_t used, rlen;
+
+  used = LogRingUsed(ring);
+  while(EEPROM_TLOG_SIZE - 1 - used < len + EEPROM_LOG_RECORD_HEADER)
+  {
+    ReadLogRing(ring->tail, header, EEPROM_LOG_RECORD_HEADER);
+    rlen = EEPROM_LOG_RECORD_HEADER +
+      ((header[2] | (header[3] << 8)) & ~EEPROM_LOG_RECORD_PENDING);
+    if(rlen > used)
+    {
+      // inconsistent record, drop everything
+      ring->tail = ring->head;
+      break;
+    }
+    ring->tail = LogRingAddress(ring->tail, rlen);
+    used -= rlen;
+  }
+}
+
+/**
+ * This method commits to the EEPROM log ring a record for the log in
+ * the logger, without copying the log itself. The log is not encoded
+ * here: the record takes the length of the entries in the logger, as
+ * the log encoded by LogEncode is never longer, and FlushLogEEPROM
+ * gives the rest back to the ring once it has the encoded length.
+ * The new state of the ring is written first, then the record header.
+ * The copy is left pending in the logger and done by
+ * FlushLogEEPROM, which can run after a reset as the logger is kept
+ * in SRAM over a reset (see scd_logger in scd.c). Until the copy is
+ * done the length in the record header has the flag
+ * EEPROM_LOG_RECORD_PENDING, so readers skip the record instead of
+ * taking the old bytes of the ring as its log.
+ *
+ * When the ring is full the oldest records are dropped to make space
+ * for the new one, and a log longer than the ring is truncated.
+ * Only the transaction counter is updated if the logger is empty.
+ *
+ * The work done here does not depend on the size of the log. In the
+ * worst case it writes 13 bytes: the transaction counter, a slot
+ * (EEPROM_LOG_SLOT_SIZE) and the record header (EEPROM_LOG_RECORD_HEADER).
+ * Only the bytes that change are written, at 3.4 ms each, so this takes
+ * up to 44 ms. Dropping the oldest records reads the header of each one.
+ * A full ring of the smallest records (6 bytes) has 631 of them, so
+ * together with the state of the ring and the checks of the bytes
+ * updated up to 2600 bytes are read. That is about 5 ms of CPU time, an
+ * estimate as the host simulation does not model it (the log-commit
+ * scenario counts the bytes). Only the first log written in a new format
+ * (EEPROM_LOG_FORMAT) also clears the state and index of the old log,
+ * 193 more bytes or 0.66 s, once. INT0_vect and WDT_vect stop the
+ * watchdog while they commit and start it again after, so its 15 ms
+ * period does not cover the commit: the SCD restarts up to about 50 ms
+ * after the reset from the terminal or the watchdog interrupt.
+ *
+ * @param logger the log structure
+ * @sa WriteLogEEPROM
+ */
+void CommitLogEEPROM(log_struct_t *logger)
+{
+  log_ring_t ring;
+  uint8_t header[EEPROM_LOG_RECORD_HEADER];
+  uint16_t len, addr;
+
+  if(logger == NULL)
+    return;
+
+  if(logger->position == 0)
+  {
+    // Update transaction counter in case it was modified
+    eeprom_update_byte((uint8_t*)EEPROM_COUNTER, nCounter);
+    return;
+  }
+
+  ReadLogRingState(&ring);
+
+  len = EEPROM_TLOG_SIZE - EEPROM_LOG_RECORD_HEADER - 1;
+  if(logger->position < len)
+    len = logger->position;
+  logger->flush_tail = ring.tail;
+  DropLogRecords(&ring, len);
+
+  // from here on a reset leaves a copy pending, see FlushLogEEPROM
+  logger->flush_addr = ring.head;
+  logger->flush_seq = ring.seq;
+  logger->flush_len = len;
+  logger->flush_end = logger->position;
+  logger->flush_check = LogFlushCheck(logger);
+
+  eeprom_update_byte((uint8_t*)EEPROM_COUNTER, nCounter);
+  if(eeprom_read_byte((uint8_t*)EEPROM_LOG_VERSION) != EEPROM_LOG_FORMAT)
+  {
+    // clear the state and index of an older log before using the format
+    for(addr = 0; addr < EEPROM_LOG_NSLOTS * EEPROM_LOG_SLOT_SIZE; addr++)
+      eeprom_update_byte((uint8_t*)(EEPROM_LOG_SLOTS + addr), 0xFF);
+    for(addr = 0; addr < EEPROM_LOG_NINDEX * EEPROM_LOG_INDEX_SIZE; addr++)
+      eeprom_update_byte((uint8_t*)(EEPROM_LOG_INDEX + addr), 0xFF);
+    eeprom_write_byte((uint8_t*)EEPROM_LOG_VERSION, EEPROM_LOG_FORMAT);
+  }
+
+  ring.head = LogRingAddress(ring.head, EEPROM_LOG_RECORD_HEADER + len);
+  ring.seq++;
+  WriteLogRingState(&ring);
+
+  header[0] = logger->flush_seq & 0xFF;
+  header[1] = (logger->flush_seq >> 8) & 0xFF;
+  header[2] = len & 0xFF;
+  header[3] = ((len | EEPROM_LOG_RECORD_PENDING) >> 8) & 0xFF;
+  WriteLogRing(logger->flush_addr, header, EEPROM_LOG_RECORD_HEADER);
+}
+
+/**
+ * Writes a little endian value to a buffer.
+ *
+ * @param data the buffer
+ * @param value the value to write
+ * @param len the number of bytes of the value
+ */
+static void PutLittleEndian(uint8_t *data, uint32_t value, uint8_t len)
+{
+  for(; len > 0; len--, value >>= 8)
+    *data++ = value & 0xFF;
+}
+
+/**
+ * Returns the check byte of an index entry.
+ *
+ * @param entry the bytes of the entry, see ReadLogIndex
+ * @return the check byte, stored in entry[1]
+ */
+static uint8_t LogIndexCheck(const uint8_t *entry)
+{
+  uint8_t i, check = 0x5A ^ entry[0];
+
+  for(i = 2; i < EEPROM_LOG_INDEX_SIZE; i++)
+    check ^= entry[i];
+
+  return check;
+}
+
+/**
+ * Writes the transactions of the log pending in the logger to the
+ * EEPROM index, each one to the entry given by its transaction number
+ * and its offset in the record (see LogEncode). Transactions that start
+ * after the end of the record (as it may be truncated) are not indexed.
+ *
+ * @param logger the log structure
+ * @sa LogTransaction
+ */
+static void WriteLogIndex(const log_struct_t *logger)
+{
+  uint8_t entry[EEPROM_LOG_INDEX_SIZE];
+  const log_index_t *trans;
+  uint16_t end, last;
+  uint8_t i;
+
+  for(i = 0; i < logger->nindex; i++)
+  {
+    trans = &logger->index[i];
+    if(trans->encoded >= logger->flush_len)
+      break;
+    end = logger->flush_len;
+    last = logger->flush_end;
+    if(i + 1 < logger->nindex)
+    {
+      if(logger->index[i + 1].encoded < end)
+        end = logger->index[i + 1].encoded;
+      if(logger->index[i + 1].offset < last)
+        last = logger->index[i + 1].offset;
+    }
+
+    entry[0] = trans->number;
+    PutLittleEndian(&entry[2], logger->flush_seq, 2);
+    PutLittleEndian(&entry[4], logger->flush_addr, 2);
+    PutLittleEndian(&entry[6], trans->encoded, 2);
+    PutLittleEndian(&entry[8], end - trans->encoded, 2);
+    PutLittleEndian(&entry[10], trans->time, 4);
+    PutLittleEndian(&entry[14], LogATRCRC32(logger, trans->offset, last), 4);
+    entry[1] = LogIndexCheck(entry);
+    eeprom_update_block(entry, (void*)(EEPROM_LOG_INDEX +
+          (trans->number % EEPROM_LOG_NINDEX) * EEPROM_LOG_INDEX_SIZE),
+        EEPROM_LOG_INDEX_SIZE);
+  }
+}
+
+/**
+ * Reads an entry of the transaction index. Each entry has the
+ * transaction number (1 byte), a check byte, the sequence number and
+ * EEPROM address of the record holding the transaction, the offset
+ * and length of the transaction in the log entries of the record
+ * (2 bytes each), the time when it started and the CRC32 of the ATR
+ * (4 bytes each), all of them LSB first. Transaction n is in entry
+ * n % EEPROM_LOG_NINDEX, so it is found without reading the log.
+ *
+ * An entry is only valid while its record is in the log ring, as older
+ * records are overwritten, and its log was copied.
+ *
+ * @param slot the index entry, up to EEPROM_LOG_NINDEX - 1
+ * @param trans structure where the entry is stored
+ * @return zero if the entry is valid, non-zero otherwise
+ */
+uint8_t ReadLogIndex(uint8_t slot, log_trans_t *trans)
+{
+  uint8_t entry[EEPROM_LOG_INDEX_SIZE];
+  log_ring_t ring;
+  uint16_t dist;
+
+  eeprom_read_block(entry,
+      (void*)(EEPROM_LOG_INDEX + slot * EEPROM_LOG_INDEX_SIZE),
+      EEPROM_LOG_INDEX_SIZE);
+  if(entry[1] != LogIndexCheck(entry))
+    return RET_ERROR;
+
+  trans->number = entry[0];
+  trans->seq = entry[2] | (entry[3] << 8);
+  trans->record = entry[4] | (entry[5] << 8);
+  trans->offset = entry[6] | (entry[7] << 8);
+  trans->length = entry[8] | (entry[9] << 8);
+  trans->time = entry[10] | ((uint32_t)entry[11] << 8) |
+    ((uint32_t)entry[12] << 16) | ((uint32_t)entry[13] << 24);
+  trans->atr = entry[14] | ((uint32_t)entry[15] << 8) |
+    ((uint32_t)entry[16] << 16) | ((uint32_t)entry[17] << 24);
+
+  // check that the record was not overwritten
+  ReadLogRingState(&ring);
+  if(trans->record < EEPROM_TLOG_DATA || trans->record >= EEPROM_MAX_ADDRESS)
+    return RET_ERROR;
+  if(trans->record >= ring.tail)
+    dist = trans->record - ring.tail;
+  else
+    dist = EEPROM_TLOG_SIZE - (ring.tail - trans->record);
+  if(dist >= LogRingUsed(&ring))
+    return RET_ERROR;
+  ReadLogRing(trans->record, entry, EEPROM_LOG_RECORD_HEADER);
+  if((entry[0] | (entry[1] << 8)) != trans->seq ||
+      ((entry[3] << 8) & EEPROM_LOG_RECORD_PENDING) ||
+      (entry[2] | (entry[3] << 8)) < trans->offset + trans->length)
+    return RET_ERROR;
+
+  return 0;
+}
+
+/**
+ * This method copies to EEPROM the log committed by CommitLogEEPROM,
+ * encoded with LogEncode. If a reset stopped the commit before the
+ * state of the ring was written, the commit is done again, which gives
+ * the same record as the log and the ring did not change.
+ *
+ * The log is encoded a first time to get its length, then the record
+ * is given that length: the oldest records are dropped again from the
+ * tail found by the commit, so those dropped only for the part of the
+ * committed length that is not used are kept, and the state of the
+ * ring is written again in the same slot. This is done before the log
+ * is copied, as the copy may overwrite the headers of the records that
+ * are read. A reset while the slot is written leaves the state of the
+ * ring before the commit, so the commit is done again. The record
+ * header is written again as well, as a reset may have stopped the
+ * commit just after the state of the ring. Since bytes already written
+ * are skipped, a copy stopped by a reset continues where it was when
+ * called again.
+ * The pending flag of the record is cleared once the copy is done,
+ * then the transactions of the log are added to the index.
+ * Nothing is done if there is no valid pending copy (e.g. after a
+ * power-on reset).
+ *
+ * @param logger the log structure
+ * @return zero if a pending copy was done, non-zero otherwise
+ */
+uint8_t FlushLogEEPROM(log_struct_t *logger)
+{
+  uint8_t header[EEPROM_LOG_RECORD_HEADER];
+  log_ring_t ring;
+  uint16_t len;
+
+  if(logger == NULL || logger->flush_len == 0 ||
+      logger->flush_len > EEPROM_TLOG_SIZE ||
+      logger->flush_end > LOG_BUFFER_SIZE ||
+      logger->flush_addr < EEPROM_TLOG_DATA ||
+      logger->flush_addr >= EEPROM_MAX_ADDRESS ||
+      logger->flush_tail < EEPROM_TLOG_DATA ||
+      logger->flush_tail >= EEPROM_MAX_ADDRESS ||
+      logger->flush_check != LogFlushCheck(logger))
+    return RET_ERROR;
+
+  ReadLogRingState(&ring);
+  if(ring.seq == logger->flush_seq)
+    CommitLogEEPROM(logger);
+  else if(ring.seq != (uint16_t)(logger->flush_seq + 1))
+  {
+    // the ring changed since the commit, the record is gone
+    logger->flush_len = 0;
+    logger->flush_check = 0;
+    return RET_ERROR;
+  }
+
+  len = LogEncode(logger, logger->flush_end, NULL);
+  if(len < logger->flush_len)
+  {
+    ring.seq = logger->flush_seq;
+    ring.head = logger->flush_addr;
+    ring.tail = logger->flush_tail;
+    DropLogRecords(&ring, len);
+    ring.head = LogRingAddress(ring.head, EEPROM_LOG_RECORD_HEADER + len);
+    ring.seq++;
+    WriteLogRingState(&ring);
+    logger->flush_len = len;
+    logger->flush_check = LogFlushCheck(logger);
+  }
+
+  header[0] = logger->flush_seq & 0xFF;
+  header[1] = (logger->flush_seq >> 8) & 0xFF;
+  header[2] = logger->flush_len & 0xFF;
+  header[3] = ((logger->flush_len | EEPROM_LOG_RECORD_PENDING) >> 8) & 0xFF;
+  logWriteAddr = WriteLogRing(logger->flush_addr, header,
+      EEPROM_LOG_RECORD_HEADER);
+  logWriteLeft = logger->flush_len;
+  LogEncode(logger, logger->flush_end, WriteLogBlock);
+
+  // the record is complete
+  header[3] = (logger->flush_len >> 8) & 0xFF;
+  WriteLogRing(logger->flush_addr, header, EEPROM_LOG_RECORD_HEADER);
+  WriteLogIndex(logger);
+
+  logger->flush_len = 0;
+  logger->flush_check = 0;
+
+  return 0;
+}
+
+/**
+ * This method copies to EEPROM the log committed before a reset, as
+ * InitSCD does after each reset (see FlushLogEEPROM). Nothing is done
+ * after a power-on or brown-out reset, as the logger kept in SRAM is
+ * lost then and a pending copy found in it would be garbage.
+ *
+ * The reset flags must be those of this reset only: MCUSR is not
+ * cleared by a reset, so main clears it after reading it, otherwise
+ * the power-on flag would stay set over all the resets that follow.
+ *
+ * @param logger the log structure, kept in SRAM over the reset
+ * @param resetFlags the value of MCUSR at this reset
+ * @return zero if a pending copy was done, non-zero otherwise
+ */
+uint8_t RecoverLogEEPROM(log_struct_t *logger, uint8_t resetFlags)
+{
+  if(resetFlags & (_BV(PORF) | _BV(BORF)))
+    return RET_ERROR;
+
+  return FlushLogEEPROM(logger);
+}
+
 /**
  * This method writes to EEPROM the log of the last transaction.
  * The log is done either while monitoring a card-terminal
  * transaction or by enabling logging while running  other application
  * (e.g. the Terminal() application).
  *
+ * The EEPROM log is a ring of records, each one holding the log
+ * of one flush after a header with its sequence number and length.
+ * The record is committed first and the log copied after it, see
+ * CommitLogEEPROM and FlushLogEEPROM. Interrupt routines that must
+ * finish before a reset only commit the record.
+ *
  * @param logger the log structure. If this is NULL the function
  * will exit promptly.
+ * @sa ReadLogRingState
  */
 void WriteLogEEPROM(log_struct_t *logger)
 {
-  uint16_t addrStream, write_size;
-  uint8_t addrHi, addrLo;
-
   if(logger == NULL)
     return;
 
@@ -1188,30 +1871,8 @@ void WriteLogEEPROM(log_struct_t *logger)
   Led3On();
   Led4Off();
 
-  // Update transaction counter in case it was modified
-  eeprom_write_byte((uint8_t*)EEPROM_COUNTER, nCounter);
-
-  // Get current transaction log pointer
-  addrHi = eeprom_read_byte((uint8_t*)EEPROM_TLOG_POINTER_HI);
-  addrLo = eeprom_read_byte((uint8_t*)EEPROM_TLOG_POINTER_LO);
-  addrStream = ((addrHi << 8) | addrLo);
-
-  if(logger->position > 0 && addrStream < EEPROM_MAX_ADDRESS)
-  {
-    // copy all possible data from log structure to EEPROM
-    if(EEPROM_MAX_ADDRESS - addrStream < logger->position)
-      write_size = EEPROM_MAX_ADDRESS - addrStream;
-    else
-      write_size = logger->position;
-    eeprom_write_block(logger->log_buffer, (void*)addrStream, write_size);
-    addrStream += write_size;
-
-    // update log address
-    addrHi = (uint8_t)((addrStream >> 8) & 0x00FF);
-    addrLo = (uint8_t)(addrStream & 0x00FF);
-    eeprom_write_byte((uint8_t*)EEPROM_TLOG_POINTER_HI, addrHi);
-    eeprom_write_byte((uint8_t*)EEPROM_TLOG_POINTER_LO, addrLo);
-  }
+  CommitLogEEPROM(logger);
+  FlushLogEEPROM(logger);
 
   Led3Off();
 }
@@ -78,6 +78,26 @@ static char* appStrings[] = {
 };
 
 
+/// State of the log ring in EEPROM, see WriteLogEEPROM
+typedef struct {
+    uint16_t seq;       // sequence number of the next record
+    uint16_t head;      // EEPROM address of the next record
+    uint16_t tail;      // EEPROM address of the oldest record
+} log_ring_t;
+
+
+/// Transaction in the EEPROM log, see ReadLogIndex
+typedef struct {
+    uint8_t number;     // transaction number
+    uint16_t seq;       // sequence number of the record holding it
+    uint16_t record;    // EEPROM address of that record
+    uint16_t offset;    // offset of the transaction in the record entries
+    uint16_t length;    // length of the transaction in the log
+    uint32_t time;      // time when it started (ms counter)
+    uint32_t atr;       // CRC32 of the ATR bytes from the ICC
+} log_trans_t;
+
+
 /* Global external variables */
 extern uint8_t warmResetByte;                   // stores the status of last card reset (warm/cold)
 extern CRP* transactionData[MAX_EXCHANGES]; 	// used to log data
@@ -92,7 +112,7 @@ extern volatile uint32_t usCounter;			    // micro-second counter
 uint8_t VirtualSerial();
 
 /// Serial Port interface (send/receive command strings)
-uint8_t SerialInterface();
+uint8_t SerialInterface(uint16_t baudUBRR, log_struct_t *logger);
 
 /// Clears the contents of the EEPROM
 void EraseEEPROM();
@@ -118,5 +138,29 @@ uint8_t Terminal(log_struct_t *logger);
 /// Write the log of the last transaction to EEPROM
 void WriteLogEEPROM(log_struct_t *logger);
 
+/// Commit a record for the log to EEPROM, leaving the copy pending
+void CommitLogEEPROM(log_struct_t *logger);
+
+/// Copy to EEPROM the log committed by CommitLogEEPROM
+uint8_t FlushLogEEPROM(log_struct_t *logger);
+
+/// Copy to EEPROM the log committed before a reset, if SRAM was kept
+uint8_t RecoverLogEEPROM(log_struct_t *logger, uint8_t resetFlags);
+
+/// Read the newest valid state of the log ring
+void ReadLogRingState(log_ring_t *ring);
+
+/// Number of bytes used in the log ring, including record headers
+uint16_t LogRingUsed(const log_ring_t *ring);
+
+/// Address found by moving forward in the log ring
+uint16_t LogRingAddress(uint16_t addr, uint16_t offset);
+
+/// Read bytes from the log ring, wrapping around its end
+uint16_t ReadLogRing(uint16_t addr, uint8_t *data, uint16_t len);
+
+/// Read an entry of the transaction index of the EEPROM log
+uint8_t ReadLogIndex(uint8_t slot, log_trans_t *trans);
+
 #endif // _APPS_H_
 
@@ -37,8 +37,9 @@
 
 #include <stdint.h>
 
-volatile uint32_t counter_t2; // this will be updated and used in both C and asm code
+extern volatile uint32_t counter_t2; // this will be updated and used in both C and asm code
 #define counter_res_us 1024 // each counter unit represents 1024 micro-seconds
+#define timestamp_res_us (counter_res_us / 256) // unit of GetTimestamp
 #define SYNC_COUNTER_SIZE (sizeof(counter_t2)) // size of counter variable in bytes
 
 #endif /* ASSEMBLER */
@@ -50,6 +50,245 @@
 
 #define DEBUG 1   // Set DEBUG to 1 to enable debug code
 
+/// Arena holding the objects of the current command-response exchange
+static uint8_t exchangeArena[EXCHANGE_ARENA_SIZE]
+  __attribute__((aligned(sizeof(void*))));
+/// Bytes of exchangeArena handed out since it was last rewound
+static uint16_t exchangeArenaUsed;
+/// Blocks of exchangeArena not yet released with ExchangeFree
+static uint16_t exchangeArenaBlocks;
+
+/// Non-zero if ExchangeData relays the bytes with RelayData
+uint8_t forwardCutThrough = FORWARD_CUT_THROUGH;
+
+/// TA1 offered to the terminal in the ATR, see TERMINAL_TA1
+uint8_t terminalTA1 = TERMINAL_TA1;
+
+/// TA1 sent to the terminal in the last ATR while the terminal may still
+/// send a PPS request, 0 otherwise
+static uint8_t terminalPPSTA1;
+
+/// Protocol selected by the ICC in its last ATR, 0 for T=0 or 1 for T=1
+uint8_t iccProtocol;
+
+/// Work waiting time of the ICC for T=0, in ETUs, see InitT0ICC
+static uint32_t iccWWT = 960UL * 10 + ICC_WWT_EXTRA;
+
+/// T=1 state of the link with the ICC
+static struct {
+  uint8_t ifsc;                         // IFSC of the ICC
+  uint8_t ns;                           // N(S) of the next I-block sent
+  uint8_t nr;                           // N(S) expected from the ICC
+  uint16_t cwt;                         // character waiting time, in ETUs
+  uint32_t bwt;                         // block waiting time, in ETUs
+} iccT1;
+
+/// Information field of the last T=1 block received
+static uint8_t t1Block[T1_MAX_INF];
+
+/// Command or response APDU exchanged with T=1
+static uint8_t t1Apdu[T1_APDU_SIZE];
+
+
+/**
+ * Returns the clock rate conversion factor F coded by FI in TA1
+ *
+ * @param FI the high nibble of TA1
+ * @return the value of F, or 0 if FI is reserved for future use
+ */
+static uint16_t GetRateF(uint8_t FI)
+{
+  switch(FI)
+  {
+    case 0x0:
+    case 0x1:
+      return 372;
+    case 0x2:
+      return 558;
+    case 0x3:
+      return 744;
+    case 0x4:
+      return 1116;
+    case 0x5:
+      return 1488;
+    case 0x6:
+      return 1860;
+    case 0x9:
+      return 512;
+    case 0xA:
+      return 768;
+    case 0xB:
+      return 1024;
+    case 0xC:
+      return 1536;
+    case 0xD:
+      return 2048;
+  }
+
+  return 0;
+}
+
+/**
+ * Returns the baud rate adjustment factor D coded by DI in TA1
+ *
+ * @param DI the low nibble of TA1
+ * @return the value of D, or 0 if DI is reserved for future use or
+ * codes a fractional value, which the SCD does not use
+ */
+static uint8_t GetRateD(uint8_t DI)
+{
+  switch(DI)
+  {
+    case 0x1:
+      return 1;
+    case 0x2:
+      return 2;
+    case 0x3:
+      return 4;
+    case 0x4:
+      return 8;
+    case 0x5:
+      return 16;
+    case 0x6:
+      return 32;
+    case 0x7:
+      return 64;
+    case 0x8:
+      return 12;
+    case 0x9:
+      return 20;
+  }
+
+  return 0;
+}
+
+/**
+ * Selects the fastest rate allowed by the TA1 byte of an ICC that the
+ * ICC byte routines can handle. The SCD keeps the F value of the ICC
+ * and may use a smaller D value than the one in TA1, which the ICC must
+ * also accept.
+ *
+ * @param TA1 the TA1 byte from the ATR of the ICC
+ * @param etu contains on return the ETU for the selected rate, in
+ * timer 1 clocks
+ * @return the PPS1 byte coding the selected rate, or ICC_DEFAULT_RATE
+ * if the default rate is the fastest one
+ */
+static uint8_t SelectICCRate(uint8_t TA1, uint16_t *etu)
+{
+  uint8_t DI, D, Dmax, pps1;
+  uint16_t F;
+  uint32_t value;
+
+  *etu = ETU_ICC;
+  pps1 = ICC_DEFAULT_RATE;
+  F = GetRateF(TA1 >> 4);
+  Dmax = GetRateD(TA1 & 0x0F);
+  if(F == 0 || Dmax == 0)
+    return pps1;
+
+  for(DI = 1; DI < 10; DI++)
+  {
+    D = GetRateD(DI);
+    if(D > Dmax)
+      continue;
+
+    // ETU_ICC holds 372 ICC clocks
+    value = ((uint32_t)ETU_ICC * F) / (372UL * D);
+    if(value >= ICC_MIN_ETU && value < *etu)
+    {
+      *etu = (uint16_t)value;
+      pps1 = (TA1 & 0xF0) | DI;
+    }
+  }
+
+  return pps1;
+}
+
+/**
+ * Sends a PPS request to the ICC and checks the response, as in
+ * ISO/IEC 7816-3, section 9. The request contains PPS1 only.
+ *
+ * @param inverse_convention different than 0 if inverse
+ * convention is to be used
+ * @param proto the protocol to select, 0 for T=0 and 1 for T=1
+ * @param TC1 the N parameter received in byte TC1 of ATR
+ * @param pps1 the PPS1 byte to request. On return it contains the
+ * PPS1 confirmed by the ICC, or ICC_DEFAULT_RATE if the ICC keeps
+ * the default rate
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return zero if the ICC sent a valid response, RET_ICC_PPS otherwise.
+ * In the later case the ICC must be reset
+ */
+uint8_t SendPPSICC(
+    uint8_t inverse_convention,
+    uint8_t proto,
+    uint8_t TC1,
+    uint8_t *pps1,
+    log_struct_t *logger)
+{
+  uint8_t request[4], response[4];
+  uint8_t tdelay, i, n, check;
+
+  if(pps1 == NULL)
+    return RET_ERR_PARAM;
+
+  tdelay = 1 + TC1;
+  request[0] = 0xFF;
+  request[1] = 0x10 | (proto & 0x0F);
+  request[2] = *pps1;
+  request[3] = request[0] ^ request[1] ^ request[2];
+
+  // the ICC needs at least 16 ETUs since the last ATR byte
+  LoopICCETU(16);
+  for(i = 0; i < 4; i++)
+  {
+    if(SendByteICCParity(request[i], inverse_convention))
+    {
+      if(logger)
+        LogByte1(logger, LOG_ICC_ERROR_SEND, request[i]);
+      return RET_ICC_PPS;
+    }
+    if(logger)
+      LogByte1(logger, LOG_BYTE_TO_ICC, request[i]);
+    if(i < 3)
+      LoopICCETU(tdelay);
+  }
+
+  // PPSS and PPS0, then PPS1 if present and PCK
+  n = 2;
+  for(i = 0; i < n; i++)
+  {
+    if(WaitForICCData(ICC_RST_WAIT) ||
+        GetByteICCParity(inverse_convention, &response[i]))
+    {
+      if(logger)
+        LogByte1(logger, LOG_ICC_ERROR_RECEIVE, 0);
+      return RET_ICC_PPS;
+    }
+    if(logger)
+      LogByte1(logger, LOG_BYTE_FROM_ICC, response[i]);
+    if(i == 1)
+      n = (response[1] & 0x10) ? 4 : 3;
+  }
+
+  check = 0;
+  for(i = 0; i < n; i++)
+    check ^= response[i];
+  if(check != 0 || response[0] != 0xFF ||
+      (response[1] & 0x0F) != (proto & 0x0F) ||
+      (response[1] & 0x60) != 0 ||
+      (n == 4 && response[2] != *pps1))
+    return RET_ICC_PPS;
+
+  if(n == 3)
+    *pps1 = ICC_DEFAULT_RATE;
+
+  // the next command must start at least 16 ETUs after the start of PCK
+  LoopICCETU(6);
+
+  return 0;
+}
 
 /**
  * Starts activation sequence for ICC
@@ -73,11 +312,11 @@ uint8_t ResetICC(
     uint8_t *TB3,
     log_struct_t *logger)
 {
-  uint16_t atr_selection;
+  uint16_t atr_selection, etu;
   uint8_t atr_bytes[32];
   uint8_t atr_tck;
   uint8_t icc_T0, icc_TS;
-  uint8_t error;
+  uint8_t error, pps1 = ICC_DEFAULT_RATE;
 
   // Activate the ICC
   error = ActivateICC(warm);
@@ -124,6 +363,32 @@ uint8_t ResetICC(
   *TA3 = atr_bytes[8];
   *TB3 = atr_bytes[9];
 
+  // Select the fastest rate allowed by TA1. After a warm reset the ICC
+  // keeps the default rate, so a failed PPS is not repeated
+  if(warm == 0 && (atr_selection & (1 << 15)))
+  {
+    pps1 = SelectICCRate(atr_bytes[0], &etu);
+    if(pps1 != ICC_DEFAULT_RATE)
+    {
+      error = SendPPSICC(*inverse_convention, *proto, *TC1, &pps1, logger);
+      if(error)
+        return ResetICC(1, inverse_convention, proto, TC1, TA3, TB3, logger);
+      if(pps1 != ICC_DEFAULT_RATE)
+        SetICCETU(etu);
+    }
+  }
+
+  // EMV requires the IFSD to be sent before the first T=1 command
+  iccProtocol = *proto;
+  InitT0ICC((atr_selection & (1 << 9)) ? atr_bytes[6] : 0x0A, pps1);
+  if(*proto == 1)
+  {
+    InitT1ICC(*TA3, *TB3);
+    error = SendT1IFSD(*inverse_convention, *TC1, logger);
+    if(error)
+      goto enderror;
+  }
+
   return 0;
 
 enderror:
@@ -140,7 +405,36 @@ enderror:
 /* All responses are received from the ICC and sent to the terminal */
 
 /**
- * Sends default ATR for T=0 to terminal
+ * Sets the work waiting time (WWT) of the ICC for T=0, which is the
+ * longest time the ICC may take to send a byte after the previous one.
+ * This must be called after each reset of the ICC and after the rate
+ * of the ICC has been selected, as the waiting time is kept in ETUs
+ * of the selected rate.
+ *
+ * @param TC2 the WI from the ATR, 0x0A if absent
+ * @param pps1 the PPS1 byte of the rate used with the ICC, or
+ * ICC_DEFAULT_RATE if the ICC keeps the default rate
+ */
+void InitT0ICC(uint8_t TC2, uint8_t pps1)
+{
+  uint8_t D;
+
+  // WI = 0 is reserved, so the default WI is used instead
+  if(TC2 == 0)
+    TC2 = 0x0A;
+  D = GetRateD(pps1 & 0x0F);
+  if(D == 0)
+    D = 1;
+
+  // WWT = 960 * D * WI ETUs, plus the margin of ICC_WWT_EXTRA. Unlike
+  // the BWT of T=1 this does not depend on F
+  iccWWT = (960UL * TC2 + ICC_WWT_EXTRA) * D;
+}
+
+/**
+ * Sends default ATR for T=0 to terminal. If terminalTA1 is set the ATR
+ * also contains this TA1 byte and the terminal may then request a faster
+ * rate with PPS, which ReceiveT0CmdHeader handles.
  *
  * @param inverse_convention specifies if direct (0) or inverse
  * convention (non-zero) is to be used. Only direct convention should
@@ -155,6 +449,8 @@ void SendT0ATRTerminal(
     uint8_t TC1,
     log_struct_t *logger)
 {
+  uint8_t T0;
+
   if(inverse_convention)
   {
     SendByteTerminalNoParity(0x3F, inverse_convention);
@@ -168,11 +464,19 @@ void SendT0ATRTerminal(
       LogByte1(logger, LOG_BYTE_ATR_TO_TERMINAL, 0x3B);
   }
 
+  T0 = (terminalTA1 != 0) ? 0x70 : 0x60;
   LoopTerminalETU(250);
-  SendByteTerminalNoParity(0x60, inverse_convention);
+  SendByteTerminalNoParity(T0, inverse_convention);
   if(logger)
-    LogByte1(logger, LOG_BYTE_ATR_TO_TERMINAL, 0x60);
+    LogByte1(logger, LOG_BYTE_ATR_TO_TERMINAL, T0);
   LoopTerminalETU(2);
+  if(terminalTA1 != 0)
+  {
+    SendByteTerminalNoParity(terminalTA1, inverse_convention);
+    if(logger)
+      LogByte1(logger, LOG_BYTE_ATR_TO_TERMINAL, terminalTA1);
+    LoopTerminalETU(2);
+  }
   SendByteTerminalNoParity(0x00, inverse_convention);
   if(logger)
     LogByte1(logger, LOG_BYTE_ATR_TO_TERMINAL, 0x00);
@@ -181,6 +485,129 @@ void SendT0ATRTerminal(
   if(logger)
     LogByte1(logger, LOG_BYTE_ATR_TO_TERMINAL, TC1);
   LoopTerminalETU(2);
+
+  terminalPPSTA1 = terminalTA1;
+}
+
+/**
+ * Returns the terminal ETU for the PPS1 byte requested by the terminal,
+ * if the SCD accepts it. The terminal must keep the F value of the TA1
+ * offered in the ATR and may use a smaller D value.
+ *
+ * @param TA1 the TA1 byte sent to the terminal in the ATR
+ * @param pps1 the PPS1 byte requested by the terminal
+ * @return the ETU in terminal clocks for pps1, or 0 if the SCD does
+ * not accept this rate
+ */
+static uint16_t SelectTerminalRate(uint8_t TA1, uint8_t pps1)
+{
+  uint16_t F, etu;
+  uint8_t D, Dmax;
+
+  if(pps1 == ICC_DEFAULT_RATE)
+    return ETU_TERMINAL;
+
+  F = GetRateF(pps1 >> 4);
+  D = GetRateD(pps1 & 0x0F);
+  Dmax = GetRateD(TA1 & 0x0F);
+  if((pps1 & 0xF0) != (TA1 & 0xF0) || F == 0 || D == 0 || D > Dmax)
+    return 0;
+
+  etu = F / D;
+  if(etu < TERMINAL_MIN_ETU)
+    return 0;
+
+  return etu;
+}
+
+/**
+ * Receives the rest of a PPS request from the terminal, after PPSS, and
+ * sends the response, as in ISO/IEC 7816-3, section 9. The SCD confirms
+ * PPS1 if it accepts the rate and otherwise keeps the default rate.
+ * PPS2 and PPS3 are never confirmed.
+ *
+ * @param inverse_convention different than 0 if inverse
+ * convention is to be used
+ * @param TA1 the TA1 byte sent to the terminal in the ATR
+ * @param proto the protocol indicated in the ATR, 0 for T=0 or 1 for T=1
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return zero if successful, RET_TERMINAL_PPS if the request is not
+ * valid, in which case no response is sent and the terminal should
+ * reset the SCD, or the error from GetByteTerminalParity
+ */
+static uint8_t ReceivePPSTerminal(
+    uint8_t inverse_convention,
+    uint8_t TA1,
+    uint8_t proto,
+    log_struct_t *logger)
+{
+  uint8_t request[6], response[4];
+  uint8_t i, n, check, result;
+  uint16_t etu;
+
+  // PPSS was already received, then PPS0, optional PPS1 to PPS3 and PCK
+  request[0] = 0xFF;
+  n = 2;
+  for(i = 1; i < n; i++)
+  {
+    result = GetByteTerminalParity(
+        inverse_convention, &request[i], MAX_WAIT_TERMINAL_CMD);
+    if(result != 0)
+      return result;
+    if(logger)
+      LogByte1(logger, LOG_BYTE_FROM_TERMINAL, request[i]);
+    if(i == 1)
+      n = 3 + ((request[1] >> 4) & 0x01) + ((request[1] >> 5) & 0x01) +
+        ((request[1] >> 6) & 0x01);
+  }
+
+  check = 0;
+  for(i = 0; i < n; i++)
+    check ^= request[i];
+  if(check != 0 || (request[1] & 0x0F) != proto)
+    return RET_TERMINAL_PPS;
+
+  etu = 0;
+  if(request[1] & 0x10)
+    etu = SelectTerminalRate(TA1, request[2]);
+
+  response[0] = 0xFF;
+  if(etu != 0)
+  {
+    response[1] = 0x10 | proto;
+    response[2] = request[2];
+    n = 4;
+  }
+  else
+  {
+    response[1] = proto;
+    etu = ETU_TERMINAL;
+    n = 3;
+  }
+  response[n - 1] = 0;
+  for(i = 0; i < n - 1; i++)
+    response[n - 1] ^= response[i];
+
+  // at least 16 ETUs between the start bits of PCK and of the response
+  LoopTerminalETU(6);
+  for(i = 0; i < n; i++)
+  {
+    result = SendByteTerminalParity(response[i], inverse_convention);
+    if(result != 0)
+      return result;
+    if(logger)
+      LogByte1(logger, LOG_BYTE_TO_TERMINAL, response[i]);
+  }
+
+  SetTerminalETU(etu);
+  if(logger)
+  {
+    LogCurrentTime(logger);
+    LogByte1(logger, LOG_TERMINAL_PPS,
+        (response[1] & 0x10) ? response[2] : 0x11);
+  }
+
+  return 0;
 }
 
 /**
@@ -276,9 +703,8 @@ uint8_t GetATRICC(
     // DI:  0x1 0x2 0x3 0x4 0x5 0x6 0x8 0x9 0xA 0xB 0xC 0xD  0xE  0xF
     // D:   1   2   4   8   16  32  12  20  1/2 1/4 1/8 1/16 1/32 1/64
     //
-    // For the moment the SCD only works with D = 1, F = 372
-    // which should be used even for different values of TA1 if the
-    // negotiable mode of operation is selected (abscence of TA2)
+    // The ICC starts with D = 1, F = 372. ResetICC may select a faster
+    // rate with PPS in the negotiable mode of operation (abscence of TA2)
     error = GetByteICCNoParity(*inverse_convention, &bytes[index]);
     if(error)
       goto enderror;
@@ -512,13 +938,13 @@ enderror:
  * @param p3 byte P3
  * @return the structure representing the command header. This function
  * allocates memory for the command header. The caller
- * is responsible for free-ing this memory after use. If the
+ * is responsible for free-ing this memory with ExchangeFree. If the
  * method is not successful it returns NULL
  */
 EMVCommandHeader* MakeCommandHeader(uint8_t cla, uint8_t ins, uint8_t p1, 
     uint8_t p2, uint8_t p3)
 {
-  EMVCommandHeader *cmd = (EMVCommandHeader*)malloc(sizeof(EMVCommandHeader));
+  EMVCommandHeader *cmd = (EMVCommandHeader*)ExchangeAlloc(sizeof(EMVCommandHeader));
   if(cmd == NULL) return NULL;
 
   cmd->cla = cla;
@@ -538,13 +964,13 @@ EMVCommandHeader* MakeCommandHeader(uint8_t cla, uint8_t ins, uint8_t p1,
  * @param command type of command requested (see EMV_CMD)
  * @return the structure representing the command header. This function
  * allocates memory for the command header. The caller
- * is responsible for free-ing this memory after use. If the
+ * is responsible for free-ing this memory with ExchangeFree. If the
  * method is not successful it returns NULL
  * @sa MakeCommandHeader
  */
 EMVCommandHeader* MakeCommandHeaderC(EMV_CMD command)
 {
-  EMVCommandHeader *cmd = (EMVCommandHeader*)malloc(sizeof(EMVCommandHeader));
+  EMVCommandHeader *cmd = (EMVCommandHeader*)ExchangeAlloc(sizeof(EMVCommandHeader));
   if(cmd == NULL) return NULL;
 
   // the default case, modified below where needed
@@ -629,19 +1055,19 @@ EMVCommandHeader* MakeCommandHeaderC(EMV_CMD command)
 CAPDU* MakeCommand(uint8_t cla, uint8_t ins, uint8_t p1,
     uint8_t p2, uint8_t p3, const uint8_t cmdData[], uint8_t lenData)
 {
-  CAPDU *cmd = (CAPDU*)malloc(sizeof(CAPDU));
+  CAPDU *cmd = (CAPDU*)ExchangeAlloc(sizeof(CAPDU));
   if(cmd == NULL) return NULL;
 
   cmd->cmdHeader = MakeCommandHeader(cla, ins, p1, p2, p3);
   if(cmd->cmdHeader == NULL)
   {
-    free(cmd);
+    ExchangeFree(cmd);
     return NULL;
   }
 
   if(cmdData != NULL && lenData != 0)
   {
-    cmd->cmdData = (uint8_t*)malloc(lenData * sizeof(uint8_t));
+    cmd->cmdData = (uint8_t*)ExchangeAlloc(lenData * sizeof(uint8_t));
     if(cmd->cmdData == NULL)
     {
       FreeCAPDU(cmd);
@@ -682,20 +1108,20 @@ CAPDU* MakeCommandP(const EMVCommandHeader *cmdHdr, const uint8_t cmdData[],
 {
   if(cmdHdr == NULL) return NULL;
 
-  CAPDU *cmd = (CAPDU*)malloc(sizeof(CAPDU));
+  CAPDU *cmd = (CAPDU*)ExchangeAlloc(sizeof(CAPDU));
   if(cmd == NULL) return NULL;
 
   cmd->cmdHeader = MakeCommandHeader(cmdHdr->cla, cmdHdr->ins,
       cmdHdr->p1, cmdHdr->p2, cmdHdr->p3);
   if(cmd->cmdHeader == NULL)
   {
-    free(cmd);
+    ExchangeFree(cmd);
     return NULL;
   }
 
   if(cmdData != NULL && lenData != 0)
   {
-    cmd->cmdData = (uint8_t*)malloc(lenData * sizeof(uint8_t));
+    cmd->cmdData = (uint8_t*)ExchangeAlloc(lenData * sizeof(uint8_t));
     if(cmd->cmdData == NULL)
     {
       FreeCAPDU(cmd);
@@ -734,19 +1160,19 @@ CAPDU* MakeCommandP(const EMVCommandHeader *cmdHdr, const uint8_t cmdData[],
 CAPDU* MakeCommandC(EMV_CMD command, const uint8_t cmdData[],
     uint8_t lenData)
 {
-  CAPDU *cmd = (CAPDU*)malloc(sizeof(CAPDU));
+  CAPDU *cmd = (CAPDU*)ExchangeAlloc(sizeof(CAPDU));
   if(cmd == NULL) return NULL;
 
   cmd->cmdHeader = MakeCommandHeaderC(command);
   if(cmd->cmdHeader == NULL)
   {
-    free(cmd);
+    ExchangeFree(cmd);
     return NULL;
   }
 
   if(cmdData != NULL && lenData != 0)
   {
-    cmd->cmdData = (uint8_t*)malloc(lenData * sizeof(uint8_t));
+    cmd->cmdData = (uint8_t*)ExchangeAlloc(lenData * sizeof(uint8_t));
     if(cmd->cmdData == NULL)
     {
       FreeCAPDU(cmd);
@@ -776,6 +1202,10 @@ uint8_t InitEMVTerminal(log_struct_t *logger)
 {
   uint8_t error;
 
+  // every reset starts at the default rate, without a PPS pending
+  SetTerminalETU(ETU_TERMINAL);
+  terminalPPSTA1 = 0;
+
   // start timer for terminal
   StartCounterTerminal();	
 
@@ -882,6 +1312,7 @@ uint8_t InitSCDTransaction(uint8_t t_inverse, uint8_t t_TC1,
   uint8_t error;
   uint8_t index;
   uint8_t history;
+  uint8_t oldTA1;
 
   // Initialize communication with Terminal
   error = InitEMVTerminal(logger);
@@ -942,6 +1373,30 @@ uint8_t InitSCDTransaction(uint8_t t_inverse, uint8_t t_TC1,
   *TA3 = atr_bytes[8];
   *TB3 = atr_bytes[9];
   history = icc_T0 & 0x0F;
+  iccProtocol = *proto;
+  InitT0ICC((atr_selection & (1 << 9)) ? atr_bytes[6] : 0x0A,
+      ICC_DEFAULT_RATE);
+  if(*proto == 1)
+    InitT1ICC(*TA3, *TB3);
+
+  // The TCK covers T0 and TA1, which may change below
+  atr_tck ^= icc_T0;
+  oldTA1 = (atr_selection & (1 << 15)) ? atr_bytes[0] : 0;
+
+  // Offer our own TA1 to the terminal, as the ICC stays at the default
+  // rate. This is not done if TA2 is present, as then the terminal
+  // would use TA1 without a PPS exchange
+  if(terminalTA1 != 0 && (atr_selection & (1 << 11)) == 0)
+  {
+    icc_T0 |= 0x10;
+    atr_selection |= (1 << 15);
+    atr_bytes[0] = terminalTA1;
+  }
+  if((atr_selection & (1 << 11)) == 0 && (atr_selection & (1 << 15)))
+    terminalPPSTA1 = atr_bytes[0];
+  atr_tck ^= icc_T0 ^ oldTA1;
+  if(atr_selection & (1 << 15))
+    atr_tck ^= atr_bytes[0];
 
   // Send the rest of the ATR to the terminal
   SendByteTerminalNoParity(icc_T0, t_inverse);
@@ -968,6 +1423,14 @@ uint8_t InitSCDTransaction(uint8_t t_inverse, uint8_t t_TC1,
     LoopTerminalETU(2);
   }
 
+  // TCK is only present if T=1 is indicated
+  if(*proto == 1)
+  {
+    SendByteTerminalNoParity(atr_tck, t_inverse);
+    if(logger)
+      LogByte1(logger, LOG_BYTE_ATR_TO_TERMINAL, atr_tck);
+  }
+
   error = 0;
 
 enderror:
@@ -1096,7 +1559,7 @@ uint8_t GetCommandCase(uint8_t cla, uint8_t ins)
  * @param logger a pointer to a log structure or NULL if no log is desired
  * @return command header to be received if successful. This function
  * allocates memory (5 bytes) for the command header. The caller
- * is responsible for free-ing this memory after use. If the
+ * is responsible for free-ing this memory with ExchangeFree. If the
  * method is not successful it returns NULL
  */
 EMVCommandHeader* ReceiveT0CmdHeader(
@@ -1107,7 +1570,7 @@ EMVCommandHeader* ReceiveT0CmdHeader(
   uint8_t tdelay, result;
   EMVCommandHeader *cmdHeader;
 
-  cmdHeader = (EMVCommandHeader*)malloc(sizeof(EMVCommandHeader));
+  cmdHeader = (EMVCommandHeader*)ExchangeAlloc(sizeof(EMVCommandHeader));
   if(cmdHeader == NULL)
   {
     if(logger)
@@ -1121,6 +1584,25 @@ EMVCommandHeader* ReceiveT0CmdHeader(
       inverse_convention, &(cmdHeader->cla), MAX_WAIT_TERMINAL_CMD);
   if(result != 0)
     goto enderror;
+
+  // PPSS (0xFF) is not a valid CLA, so it starts a PPS request if this
+  // is the first byte after an ATR that offered TA1
+  if(terminalPPSTA1 != 0 && cmdHeader->cla == 0xFF)
+  {
+    if(logger)
+      LogByte1(logger, LOG_BYTE_FROM_TERMINAL, cmdHeader->cla);
+    result = ReceivePPSTerminal(
+        inverse_convention, terminalPPSTA1, 0, logger);
+    terminalPPSTA1 = 0;
+    if(result != 0)
+      goto enderror;
+
+    result = GetByteTerminalParity(
+        inverse_convention, &(cmdHeader->cla), MAX_WAIT_TERMINAL_CMD);
+    if(result != 0)
+      goto enderror;
+  }
+  terminalPPSTA1 = 0;
   if(logger)
     LogByte1(logger, LOG_BYTE_FROM_TERMINAL, cmdHeader->cla);
   LoopTerminalETU(tdelay);	
@@ -1154,12 +1636,15 @@ EMVCommandHeader* ReceiveT0CmdHeader(
   if(result != 0)
     goto enderror;
   if(logger)
+  {
     LogByte1(logger, LOG_BYTE_FROM_TERMINAL, cmdHeader->p3);
+    LogTimestamp(logger);
+  }
 
   return cmdHeader;
 
 enderror:
-  free(cmdHeader);
+  ExchangeFree(cmdHeader);
   if(logger)
   {
     LogCurrentTime(logger);
@@ -1176,7 +1661,7 @@ enderror:
     {
       LogByte1(logger, LOG_TERMINAL_NO_CLOCK, 0);
     }
-    else if(result == RET_ERROR)
+    else if(result == RET_ERROR || result == RET_TERMINAL_PPS)
     {
       LogByte1(logger, LOG_TERMINAL_ERROR_RECEIVE, 0);
     }
@@ -1196,7 +1681,7 @@ enderror:
  * @param logger a pointer to a log structure or NULL if no log is desired
  * @return command data to be received if successful. This function
  * allocates memory for the command data. The caller
- * is responsible for free-ing this memory after use. If the
+ * is responsible for free-ing this memory with ExchangeFree. If the
  * method is not successful it returns NULL
  */
 uint8_t* ReceiveT0CmdData(
@@ -1208,7 +1693,7 @@ uint8_t* ReceiveT0CmdData(
   uint8_t tdelay, i, result;
   uint8_t *cmdData;
 
-  cmdData = (uint8_t*)malloc(len*sizeof(uint8_t));
+  cmdData = (uint8_t*)ExchangeAlloc(len*sizeof(uint8_t));
   if(cmdData == NULL)
   {
     if(logger)
@@ -1218,14 +1703,13 @@ uint8_t* ReceiveT0CmdData(
 
   tdelay = 1 + TC1;
 
+  // the data is logged once received, not between the bytes
   for(i = 0; i < len - 1; i++)
   {
     result = GetByteTerminalParity(
         inverse_convention, &(cmdData[i]), MAX_WAIT_TERMINAL_CMD);
     if(result != 0)
       goto enderror;
-    if(logger)
-      LogByte1(logger, LOG_BYTE_FROM_TERMINAL, cmdData[i]);
     LoopTerminalETU(tdelay);	
   }
 
@@ -1235,12 +1719,14 @@ uint8_t* ReceiveT0CmdData(
   if(result != 0)
     goto enderror;
   if(logger)
-    LogByte1(logger, LOG_BYTE_FROM_TERMINAL, cmdData[i]);
+    LogBytes(logger, LOG_BYTE_FROM_TERMINAL, cmdData, len);
 
   return cmdData;	
 
 enderror:
-  free(cmdData);
+  if(logger)
+    LogBytes(logger, LOG_BYTE_FROM_TERMINAL, cmdData, i);
+  ExchangeFree(cmdData);
   if(logger)
   {
     if(result == RET_TERMINAL_RESET_LOW)
@@ -1251,7 +1737,7 @@ enderror:
     {
       LogByte1(logger, LOG_TERMINAL_TIME_OUT, 0);
     }
-    else if(result == RET_ERROR)
+    else if(result == RET_ERROR || result == RET_TERMINAL_PPS)
     {
       LogByte1(logger, LOG_TERMINAL_ERROR_RECEIVE, 0);
     }
@@ -1283,7 +1769,7 @@ CAPDU* ReceiveT0Command(
 
   tdelay = 1 + TC1;
 
-  cmd = (CAPDU*)malloc(sizeof(CAPDU));
+  cmd = (CAPDU*)ExchangeAlloc(sizeof(CAPDU));
   if(cmd == NULL)
   {
     if(logger)
@@ -1297,7 +1783,7 @@ CAPDU* ReceiveT0Command(
   cmd->cmdHeader = ReceiveT0CmdHeader(inverse_convention, TC1, logger);
   if(cmd->cmdHeader == NULL)
   {
-    free(cmd);		
+    ExchangeFree(cmd);		
     return NULL;
   }	
   tmp = GetCommandCase(cmd->cmdHeader->cla, cmd->cmdHeader->ins);
@@ -1316,9 +1802,9 @@ CAPDU* ReceiveT0Command(
   LoopTerminalETU(6);
   if(SendByteTerminalParity(cmd->cmdHeader->ins, inverse_convention))
   {
-    free(cmd->cmdHeader);
+    ExchangeFree(cmd->cmdHeader);
     cmd->cmdHeader = NULL;
-    free(cmd);		
+    ExchangeFree(cmd);		
     if(logger)
       LogByte1(logger, LOG_TERMINAL_ERROR_SEND, 0);
     return NULL;
@@ -1332,9 +1818,9 @@ CAPDU* ReceiveT0Command(
       inverse_convention, TC1, cmd->lenData, logger);
   if(cmd->cmdData == NULL)
   {
-    free(cmd->cmdHeader);
+    ExchangeFree(cmd->cmdHeader);
     cmd->cmdHeader = NULL;
-    free(cmd);		
+    ExchangeFree(cmd);		
     return NULL;	
   }
 
@@ -1411,7 +1897,10 @@ uint8_t SendT0CmdHeader(
     return RET_ERROR;
   }
   if(logger)
+  {
     LogByte1(logger, LOG_BYTE_TO_ICC, cmdHeader->p3);
+    LogTimestamp(logger);
+  }
 
   return 0;
 }
@@ -1441,32 +1930,108 @@ uint8_t SendT0CmdData(
 
   tdelay = 1 + TC1;
 
+  // the data is logged once sent, not between the bytes
   for(i = 0; i < len - 1; i++)
   {
     if(SendByteICCParity(cmdData[i], inverse_convention))
-    {
-      if(logger)
-        LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
-      return RET_ERROR;	
-    }
-    if(logger)
-      LogByte1(logger, LOG_BYTE_TO_ICC, cmdData[i]);
+      goto enderror;
     LoopICCETU(tdelay);	
   }
 
   // Do not add a delay after the last byte
   if(SendByteICCParity(cmdData[i], inverse_convention))
-  {
-    if(logger)
-      LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
-    return RET_ERROR;	
-  }
+    goto enderror;
   if(logger)
-    LogByte1(logger, LOG_BYTE_TO_ICC, cmdData[i]);
+    LogBytes(logger, LOG_BYTE_TO_ICC, cmdData, len);
 
   return 0;
+
+enderror:
+  if(logger)
+  {
+    LogBytes(logger, LOG_BYTE_TO_ICC, cmdData, i);
+    LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
+  }
+  return RET_ERROR;
+}
+
+
+/**
+ * Receives a byte from the ICC for T = 0, waiting at most the work
+ * waiting time of the ICC (see InitT0ICC) for its start bit
+ *
+ * @param inverse_convention different than 0 if inverse
+ * convention is to be used
+ * @param byte contains the byte read on return
+ * @return zero if successful, RET_ICC_TIME_OUT if the ICC did not start
+ * to send the byte within WWT, or the error of GetByteICCParity
+ */
+static uint8_t GetT0Byte(uint8_t inverse_convention, uint8_t *byte)
+{
+  if(WaitForICCDataETU(iccWWT))
+    return RET_ICC_TIME_OUT;
+
+  return GetByteICCParity(inverse_convention, byte);
 }
 
+/**
+ * Receives a procedure byte from the ICC for T = 0, skipping the NULL
+ * bytes (0x60) that the ICC sends to ask for more time. Each NULL byte
+ * restarts the work waiting time, so a slow ICC may send any number of
+ * them, and each may be sent to the terminal as soon as it is received
+ * so that the waiting time of the terminal is restarted as well.
+ *
+ * A NULL byte is only sent to the terminal while the engine of the ICC
+ * line is running (see StartLine). When the ICC ETU is below
+ * ICC_MIN_ISR_ETU, e.g. after a PPS, the ICC line is polled and the
+ * next byte of the ICC may start while the NULL byte is being sent, so
+ * the NULL byte is dropped instead.
+ *
+ * @param inverse_convention different than 0 if inverse
+ * convention is to be used
+ * @param null_to_terminal T0_NULL_KEEP, T0_NULL_DIRECT or T0_NULL_INVERSE,
+ * see ReceiveT0Data
+ * @param stamp non-zero to log a timestamp when the first byte arrives
+ * @param byte contains the procedure byte on return
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return zero if successful, RET_TERMINAL_SEND_RESPONSE if a NULL byte
+ * could not be sent to the terminal, or the error of GetT0Byte
+ */
+static uint8_t GetT0ProcedureByte(
+    uint8_t inverse_convention,
+    uint8_t null_to_terminal,
+    uint8_t stamp,
+    uint8_t *byte,
+    log_struct_t *logger)
+{
+  uint8_t result;
+
+  while(1)
+  {
+    result = GetT0Byte(inverse_convention, byte);
+    if(result != 0)
+      return result;
+    if(logger)
+    {
+      if(stamp)
+        LogTimestamp(logger);
+      LogByte1(logger, LOG_BYTE_FROM_ICC, *byte);
+    }
+    stamp = 0;
+
+    if(*byte != SW1_MORE_TIME)
+      return 0;
+
+    if(null_to_terminal != T0_NULL_KEEP && IsLineRunning(LINE_ICC))
+    {
+      if(SendByteTerminalParity(SW1_MORE_TIME,
+            null_to_terminal == T0_NULL_INVERSE))
+        return RET_TERMINAL_SEND_RESPONSE;
+      if(logger)
+        LogByte1(logger, LOG_BYTE_TO_TERMINAL, SW1_MORE_TIME);
+    }
+  }
+}
 
 /**
  * Send a command (including data) to the ICC for protocol T = 0.
@@ -1486,7 +2051,7 @@ uint8_t SendT0Command(
     CAPDU *cmd,
     log_struct_t *logger)
 {
-  uint8_t tdelay, tmp, tmp2, i;	
+  uint8_t tdelay, tmp, tmp2, i, first;	
 
   if(cmd == NULL) return RET_ERROR;
   tdelay = 1 + TC1;
@@ -1505,28 +2070,14 @@ uint8_t SendT0Command(
   // for other cases (3, 4) get procedure byte and send command data
   LoopICCETU(6);
 
-  // Get firs byte (can be INS, ~INS, 60, 61, 6C or other in case of error)
-  if(GetByteICCParity(inverse_convention, &tmp))
+  // Get first byte (can be INS, ~INS, 61, 6C or other in case of error),
+  // after any NULL bytes (60)
+  if(GetT0ProcedureByte(inverse_convention, T0_NULL_KEEP, 1, &tmp, logger))
   {
     if(logger)
       LogByte1(logger, LOG_ICC_ERROR_RECEIVE, 0);
     return RET_ERROR;
   }
-  if(logger)
-    LogByte1(logger, LOG_BYTE_FROM_ICC, tmp);
-
-  while(tmp == SW1_MORE_TIME)
-  {
-    LoopICCETU(1);
-    if(GetByteICCParity(inverse_convention, &tmp))
-    {
-      if(logger)
-        LogByte1(logger, LOG_ICC_ERROR_RECEIVE, 0);
-      return RET_ERROR;
-    }
-    if(logger)
-      LogByte1(logger, LOG_BYTE_FROM_ICC, tmp);
-  }
 
   // if we don't get INS or ~INS then
   // get another byte and then exit, operation unexpected
@@ -1590,32 +2141,32 @@ uint8_t SendT0Command(
     }
   }
 
-  // send remaining of bytes, if any
+  // send remaining of bytes, if any, and log them once sent
+  first = i;
   for(; i < cmd->lenData - 1; i++)
   {
     if(SendByteICCParity(cmd->cmdData[i], inverse_convention))
-    {
-      if(logger)
-        LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
-      return RET_ERROR;
-    }
-    if(logger)
-      LogByte1(logger, LOG_BYTE_TO_ICC, cmd->cmdData[i]);
+      goto enderror;
     LoopICCETU(tdelay);
   }
   if(i == cmd->lenData - 1)
   {
     if(SendByteICCParity(cmd->cmdData[i], inverse_convention))
-    {
-      if(logger)
-        LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
-      return RET_ERROR;
-    }
-    if(logger)
-      LogByte1(logger, LOG_BYTE_TO_ICC, cmd->cmdData[i]);
+      goto enderror;
+    i++;
   }
+  if(logger)
+    LogBytes(logger, LOG_BYTE_TO_ICC, &cmd->cmdData[first], i - first);
 
   return 0;
+
+enderror:
+  if(logger)
+  {
+    LogBytes(logger, LOG_BYTE_TO_ICC, &cmd->cmdData[first], i - first);
+    LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
+  }
+  return RET_ERROR;
 }
 
 
@@ -1677,7 +2228,8 @@ CAPDU* ForwardCommand(
  */
 uint8_t* SerializeCommand(CAPDU *cmd, uint32_t *len)
 {
-  uint8_t *stream, i = 0;
+  uint8_t *stream;
+  uint16_t i = 0;
 
   if(cmd == NULL || len == NULL || cmd->cmdHeader == NULL) return NULL;
   if(cmd->lenData > 0 && cmd->cmdData == NULL) return NULL;
@@ -1696,9 +2248,9 @@ uint8_t* SerializeCommand(CAPDU *cmd, uint32_t *len)
   stream[i++] = cmd->cmdHeader->p2;
   stream[i++] = cmd->cmdHeader->p3;
 
-  while(i < cmd->lenData)
+  while(i < *len)
   {
-    stream[i] = cmd->cmdData[i];
+    stream[i] = cmd->cmdData[i - 5];
     i++;
   }
 
@@ -1707,7 +2259,9 @@ uint8_t* SerializeCommand(CAPDU *cmd, uint32_t *len)
 
 
 /**
- * This method receives a response from ICC for protocol T = 0.
+ * This method receives a response from ICC for protocol T = 0 into a
+ * buffer given by the caller, so that the response data of successive
+ * commands can be gathered in the same buffer (see TerminalSendT0Command).
  * If [SW1,SW2] != [0x90,0] then the response is not complete.
  * Either another command (e.g. get response) is expected, or
  * the previous command with different lc, or an error has occurred.
@@ -1716,144 +2270,161 @@ uint8_t* SerializeCommand(CAPDU *cmd, uint32_t *len)
  * Different codes for the return codes can be found in EMV Book 1
  * and Book 3.
  *
+ * The ICC must send each byte within its work waiting time (see
+ * InitT0ICC), which is restarted by each NULL byte.
+ *
  * @param inverse_convention different than 0 if inverse
  * convention is to be used
  * @param cmdHeader the header of the command for which response is expected
+ * @param data buffer for the response data
+ * @param maxlen the size of data. Any data bytes beyond this size are
+ * received from the ICC but not stored
+ * @param len stores the number of data bytes stored in data
+ * @param status stores the status bytes of the response
+ * @param null_to_terminal T0_NULL_KEEP to keep the NULL bytes of the ICC,
+ * or T0_NULL_DIRECT or T0_NULL_INVERSE to send each of them to the
+ * terminal, with the direct or inverse convention, as it is received
+ * (see T0_NULL_TO_TERMINAL)
  * @param logger a pointer to a log structure or NULL if no log is desired
- * @return response APDU if the method is successful. In the case this
- * method is unsuccessful (unrelated to SW1, SW2) then it will return NULL 
+ * @return zero if success, non-zero otherwise (unrelated to SW1, SW2)
  */
-RAPDU* ReceiveT0Response(
+uint8_t ReceiveT0Data(
     uint8_t inverse_convention,
     EMVCommandHeader *cmdHeader,
+    uint8_t *data,
+    uint8_t maxlen,
+    uint8_t *len,
+    EMVStatus *status,
+    uint8_t null_to_terminal,
     log_struct_t *logger)
 {
-  uint8_t tmp, i, result;
-  RAPDU* rapdu;
+  uint8_t tmp, i, n, result, ncase;
 
-  if(cmdHeader == NULL) return NULL;
+  if(cmdHeader == NULL || len == NULL || status == NULL ||
+    (data == NULL && maxlen > 0))
+    return RET_ERR_PARAM;
+  *len = 0;
 
-  rapdu = (RAPDU*)malloc(sizeof(RAPDU));
-  if(rapdu == NULL)
-  {
-    result = RET_ERR_MEMORY;
-    goto enderror;
-  }
-  rapdu->repStatus = NULL;
-  rapdu->repData = NULL;
-  rapdu->lenData = 0;
-  result = GetCommandCase(cmdHeader->cla, cmdHeader->ins);		
-  if(result == 0)
+  ncase = GetCommandCase(cmdHeader->cla, cmdHeader->ins);
+  if(ncase == 0)
   {
     result = RET_ERROR;
     goto enderror;
   }
 
+  result = GetT0ProcedureByte(inverse_convention, null_to_terminal, 1,
+      &tmp, logger);
+  if(result != 0)
+    goto enderror;
 
-  // for case 1 and case 3 there is no data expected, just status
-  if(tmp == 1 || tmp == 3)
+  // for case 2 and 4, we might get data based on first byte of response,
+  // while for case 1 and case 3 there is no data expected, just status
+  if((ncase == 2 || ncase == 4) &&
+      (tmp == cmdHeader->ins || tmp == ~cmdHeader->ins))	// get data
   {
-    rapdu->repStatus = (EMVStatus*)malloc(sizeof(EMVStatus));
-    if(rapdu->repStatus == NULL)
+    if(tmp == cmdHeader->ins)
+      n = cmdHeader->p3;
+    else
+      n = 1;
+
+    // the data is logged once received, not between the bytes
+    for(i = 0; i < n; i++)
     {
-      result = RET_ERR_MEMORY;
-      goto enderror;
+      result = GetT0Byte(inverse_convention,
+          (i < maxlen) ? &data[i] : &tmp);
+      if(result != 0)
+        break;
     }
-
-    result = GetByteICCParity(inverse_convention, &(rapdu->repStatus->sw1));
+    *len = (i < maxlen) ? i : maxlen;
+    if(logger)
+      LogBytes(logger, LOG_BYTE_FROM_ICC, data, *len);
     if(result != 0)
       goto enderror;
-    if(logger)
-      LogByte1(logger, LOG_BYTE_FROM_ICC, rapdu->repStatus->sw1);
-
-    if(rapdu->repStatus->sw1 == 0x60)
-    {
-      // requested more time, recall
-      FreeRAPDU(rapdu);
-      return ReceiveT0Response(inverse_convention, cmdHeader, logger);
-    }
 
-    result = GetByteICCParity(inverse_convention, &(rapdu->repStatus->sw2));
+    result = GetT0ProcedureByte(inverse_convention, null_to_terminal, 0,
+        &tmp, logger);
     if(result != 0)
       goto enderror;
-    if(logger)
-      LogByte1(logger, LOG_BYTE_FROM_ICC, rapdu->repStatus->sw2);
-
-    return rapdu;
   }
 
-  // for case 2 and 4, we might get data based on first byte of response	
-  result = GetByteICCParity(inverse_convention, &tmp);
+  // get second byte of status
+  status->sw1 = tmp;
+  result = GetT0Byte(inverse_convention, &(status->sw2));
   if(result != 0)
     goto enderror;
   if(logger)
-    LogByte1(logger, LOG_BYTE_FROM_ICC, tmp);
-
-  if(tmp == 0x60)
   {
-    // requested more time, recall
-    FreeRAPDU(rapdu);
-    return ReceiveT0Response(inverse_convention, cmdHeader, logger);
+    LogByte1(logger, LOG_BYTE_FROM_ICC, status->sw2);
+    LogTimestamp(logger);
   }
 
-  if(tmp == cmdHeader->ins || tmp == ~cmdHeader->ins)	// get data
+  return 0;
+
+enderror:
+  if(logger)
   {
-    if(tmp == cmdHeader->ins)
-      rapdu->lenData = cmdHeader->p3;
-    else
-      rapdu->lenData = 1;
+    LogCurrentTime(logger);
 
-    rapdu->repData = (uint8_t*)malloc(rapdu->lenData*sizeof(uint8_t));
-    if(rapdu->repData == NULL)
+    if(result == RET_TERMINAL_SEND_RESPONSE)
     {
-      result = RET_ERR_MEMORY;
-      goto enderror;
+      LogByte1(logger, LOG_TERMINAL_ERROR_SEND, SW1_MORE_TIME);
     }
-
-    for(i = 0; i < rapdu->lenData; i++)
-    {
-      result = GetByteICCParity(inverse_convention, &(rapdu->repData[i]));
-      if(result != 0)
-        goto enderror;
-      if(logger)
-        LogByte1(logger, LOG_BYTE_FROM_ICC, rapdu->repData[i]);
-    }		
-
-    rapdu->repStatus = (EMVStatus*)malloc(sizeof(EMVStatus));
-    if(rapdu->repStatus == NULL)
+    else if(result == RET_ERROR || result == RET_TERMINAL_PPS ||
+        result == RET_ICC_TIME_OUT)
     {
-      result = RET_ERR_MEMORY;
-      goto enderror;
+      LogByte1(logger, LOG_ICC_ERROR_RECEIVE, 0);
     }
+  }
+  return result;
+}
 
-    result = GetByteICCParity(inverse_convention, &(rapdu->repStatus->sw1));
-    if(result != 0)
-      goto enderror;
-    if(logger)
-      LogByte1(logger, LOG_BYTE_FROM_ICC, rapdu->repStatus->sw1);
+/**
+ * This method receives a response from ICC for protocol T = 0.
+ * See ReceiveT0Data for the meaning of the status bytes.
+ *
+ * @param inverse_convention different than 0 if inverse
+ * convention is to be used
+ * @param cmdHeader the header of the command for which response is expected
+ * @param null_to_terminal what to do with the NULL bytes of the ICC,
+ * see ReceiveT0Data
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return response APDU if the method is successful. In the case this
+ * method is unsuccessful (unrelated to SW1, SW2) then it will return NULL 
+ */
+RAPDU* ReceiveT0Response(
+    uint8_t inverse_convention,
+    EMVCommandHeader *cmdHeader,
+    uint8_t null_to_terminal,
+    log_struct_t *logger)
+{
+  uint8_t size;
+  RAPDU* rapdu;
 
-    result = GetByteICCParity(inverse_convention, &(rapdu->repStatus->sw2));
-    if(result != 0)
-      goto enderror;
-    if(logger)
-      LogByte1(logger, LOG_BYTE_FROM_ICC, rapdu->repStatus->sw2);
+  if(cmdHeader == NULL) return NULL;
 
-  }	
-  else	// get second byte of response (no data)
+  // the buffer is allocated before the response starts, as there is no
+  // time for it between the procedure byte and the data
+  size = (cmdHeader->p3 > 0) ? cmdHeader->p3 : 1;
+  rapdu = (RAPDU*)ExchangeAlloc(sizeof(RAPDU));
+  if(rapdu == NULL)
+    goto enderror;
+  rapdu->lenData = 0;
+  rapdu->repStatus = (EMVStatus*)ExchangeAlloc(sizeof(EMVStatus));
+  rapdu->repData = (uint8_t*)ExchangeAlloc(size);
+  if(rapdu->repStatus == NULL || rapdu->repData == NULL)
+    goto enderror;
+
+  if(ReceiveT0Data(inverse_convention, cmdHeader, rapdu->repData, size,
+      &(rapdu->lenData), rapdu->repStatus, null_to_terminal, logger))
   {
-    rapdu->repStatus = (EMVStatus*)malloc(sizeof(EMVStatus));
-    if(rapdu->repStatus == NULL)
-    {			
-      result = RET_ERR_MEMORY;
-      goto enderror;
-    }
+    FreeRAPDU(rapdu);
+    return NULL;
+  }
 
-    rapdu->repStatus->sw1 = tmp;
-    result = GetByteICCParity(inverse_convention, &(rapdu->repStatus->sw2));
-    if(result != 0)
-      goto enderror;
-    if(logger)
-      LogByte1(logger, LOG_BYTE_FROM_ICC, rapdu->repStatus->sw2);
+  if(rapdu->lenData == 0)
+  {
+    ExchangeFree(rapdu->repData);
+    rapdu->repData = NULL;
   }
 
   return rapdu;
@@ -1863,15 +2434,7 @@ enderror:
   if(logger)
   {
     LogCurrentTime(logger);
-
-    if(result == RET_ERR_MEMORY)
-    {
-      LogByte1(logger, LOG_ERROR_MEMORY, 0);
-    }
-    else if(result == RET_ERROR)
-    {
-      LogByte1(logger, LOG_ICC_ERROR_RECEIVE, 0);
-    }
+    LogByte1(logger, LOG_ERROR_MEMORY, 0);
   }
   return NULL;
 }
@@ -1900,6 +2463,7 @@ uint8_t SendT0Response(
   if(cmdHeader == NULL || response == NULL || response->repStatus == NULL)
     return RET_ERR_PARAM;	
 
+  LogTimestamp(logger);
   if(response->lenData > 0 && response->repData != NULL)
   {
     result = SendByteTerminalParity(cmdHeader->ins, inverse_convention);
@@ -1916,21 +2480,24 @@ uint8_t SendT0Response(
       LogByte1(logger, LOG_BYTE_TO_TERMINAL, cmdHeader->ins);
     LoopTerminalETU(2);
 
+    // the data is logged once sent, not between the bytes
     for(i = 0; i < response->lenData; i++)
     {			
       result = SendByteTerminalParity(response->repData[i], inverse_convention);
       if(result != 0)
+        break;
+      LoopTerminalETU(2);
+    }
+    if(logger)
+      LogBytes(logger, LOG_BYTE_TO_TERMINAL, response->repData, i);
+    if(result != 0)
+    {
+      if(logger)
       {
-        if(logger)
-        {
-          LogCurrentTime(logger);
-          LogByte1(logger, LOG_TERMINAL_ERROR_SEND, response->repData[i]);
-        }
-        goto enderror;
+        LogCurrentTime(logger);
+        LogByte1(logger, LOG_TERMINAL_ERROR_SEND, response->repData[i]);
       }
-      if(logger)
-        LogByte1(logger, LOG_BYTE_TO_TERMINAL, response->repData[i]);
-      LoopTerminalETU(2);
+      goto enderror;
     }
   }
 
@@ -1959,7 +2526,10 @@ uint8_t SendT0Response(
     goto enderror;
   }
   if(logger)
+  {
     LogByte1(logger, LOG_BYTE_TO_TERMINAL, response->repStatus->sw2);
+    LogTimestamp(logger);
+  }
   LoopTerminalETU(2);
 
   return 0;
@@ -1994,10 +2564,14 @@ RAPDU* ForwardResponse(
   if(cmdHeader == NULL)
     return NULL;
 
+  // the NULL bytes are passed on at once, as the terminal would time out
+  // if it only received them with the response
   if((log_dir & LOG_DIR_ICC) > 0)
-    response = ReceiveT0Response(cInverse, cmdHeader, logger);
+    response = ReceiveT0Response(cInverse, cmdHeader,
+        T0_NULL_TO_TERMINAL(tInverse), logger);
   else
-    response = ReceiveT0Response(cInverse, cmdHeader, NULL);
+    response = ReceiveT0Response(cInverse, cmdHeader,
+        T0_NULL_TO_TERMINAL(tInverse), NULL);
   if(response == NULL)
     return NULL;
 
@@ -2055,65 +2629,97 @@ uint8_t* SerializeResponse(RAPDU *response, uint8_t *len)
 
 
 /**
- * This method sends a command from the terminal to the ICC and also
- * returns to the terminal the answer from the ICC. Both the command
- * and the response are returned to the caller.
+ * Logs a relayed byte as seen by the sides selected in log_dir
  *
- * @param tInverse different than 0 if inverse convention is to be used
- * with the terminal
- * @param cInverse different than 0 if inverse convention is to be used
- * with the ICC
- * @param tTC1 byte TC1 of ATR used with terminal
- * @param cTC1 byte TC1 of ATR received from ICC
+ * @param direction RELAY_TERMINAL_TO_ICC or RELAY_ICC_TO_TERMINAL
+ * @param byte the byte relayed
  * @param log_dir specifies which part to log
- * @param logger a pointer to a log structure or NULL if no log is desired.
- * @return the command and response pair if successful. If this method
- * is not successful then it will return NULL
- * @sa ExchangeCompleteData
+ * @param logger a pointer to a log structure or NULL if no log is desired
  */
-CRP* ExchangeData(
-    uint8_t tInverse,
-    uint8_t cInverse,
-    uint8_t tTC1,
-    uint8_t cTC1,
+static void LogRelayByte(
+    uint8_t direction,
+    uint8_t byte,
     uint8_t log_dir,
     log_struct_t *logger)
 {
-  CRP* data;
+  if(logger == NULL)
+    return;
 
-  data = (CRP*)malloc(sizeof(CRP));
-  if(data == NULL)
+  if(direction == RELAY_TERMINAL_TO_ICC)
   {
-    if(logger)
-      LogByte1(logger, LOG_ERROR_MEMORY, 0);
-    return NULL;
+    if((log_dir & LOG_DIR_TERMINAL) > 0)
+      LogByte1Fast(logger, LOG_BYTE_FROM_TERMINAL, byte);
+    if((log_dir & LOG_DIR_ICC) > 0)
+      LogByte1Fast(logger, LOG_BYTE_TO_ICC, byte);
   }
-
-  data->cmd = ForwardCommand(tInverse, cInverse, tTC1, cTC1, log_dir, logger);
-  if(data->cmd == NULL)
+  else
   {
-    free(data);
-    return NULL;
+    if((log_dir & LOG_DIR_ICC) > 0)
+      LogByte1Fast(logger, LOG_BYTE_FROM_ICC, byte);
+    if((log_dir & LOG_DIR_TERMINAL) > 0)
+      LogByte1Fast(logger, LOG_BYTE_TO_TERMINAL, byte);
   }
+}
 
-  data->response = ForwardResponse(
-      tInverse, cInverse, data->cmd->cmdHeader, log_dir, logger);
-  if(data->response == NULL)
+/**
+ * Relays a fixed number of bytes in one direction and waits until
+ * they have all been sent
+ *
+ * @param direction RELAY_TERMINAL_TO_ICC or RELAY_ICC_TO_TERMINAL
+ * @param src_inverse different than 0 if the source uses inverse convention
+ * @param dst_inverse different than 0 if the destination uses inverse
+ * convention
+ * @param dst_guard ETUs added to the 12 ETUs between the bytes sent
+ * @param bytes contains the bytes relayed on return. The caller must
+ * ensure that at least len bytes are available
+ * @param len number of bytes to relay
+ * @param max_wait the maximum number of cycles to wait for each byte,
+ * 0 to wait indefinitely
+ * @param log_dir specifies which part to log
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return zero if successful, the error from RelayNextByte or EndRelay
+ * otherwise
+ */
+static uint8_t RelayBytes(
+    uint8_t direction,
+    uint8_t src_inverse,
+    uint8_t dst_inverse,
+    uint8_t dst_guard,
+    uint8_t *bytes,
+    uint8_t len,
+    uint32_t max_wait,
+    uint8_t log_dir,
+    log_struct_t *logger)
+{
+  uint8_t i, tmp, result;
+
+  StartRelay(direction, src_inverse, dst_inverse, dst_guard, bytes, len);
+
+  for(i = 0; i < len; i++)
   {
-    FreeCAPDU(data->cmd);
-    free(data);
-    return NULL;
+    result = RelayNextByte(&tmp, max_wait);
+    if(result != 0)
+    {
+      EndRelay();
+      return result;
+    }
+    bytes[i] = tmp;
+    LogRelayByte(direction, tmp, log_dir, logger);
   }
 
-  return data;
+  return EndRelay();
 }
 
 /**
- * This method exchange command-response pairs between terminal and ICC,
- * similar to ExchangeData. However this method forwards data repeatedly
- * until the response contains a success or error. The method returns
- * the initial command and the final response. Intermediate stages
- * are removed. If you need those stages use ExchangeData instead.
+ * This method relays a command from the terminal to the ICC and the
+ * answer from the ICC back to the terminal, like ExchangeData, but each
+ * byte (header, procedure bytes, data and status) is sent to the other
+ * side as soon as it has been received instead of after the complete
+ * command or response. The command and response structures are built
+ * while the bytes are relayed.
+ *
+ * Parity errors are not signalled to the sender and bytes refused by the
+ * receiver are not repeated: in both cases the exchange is aborted.
  *
  * @param tInverse different than 0 if inverse convention is to be used
  * with the terminal
@@ -2122,13 +2728,12 @@ CRP* ExchangeData(
  * @param tTC1 byte TC1 of ATR used with terminal
  * @param cTC1 byte TC1 of ATR received from ICC
  * @param log_dir specifies which part to log
- * @param logger a pointer to a log structure or NULL if no log is desired
+ * @param logger a pointer to a log structure or NULL if no log is desired.
  * @return the command and response pair if successful. If this method
- * is not successful then it will return NULL. The caller is responsible
- * for the allocated memory of the CRP structure.
+ * is not successful then it will return NULL
  * @sa ExchangeData
  */
-CRP* ExchangeCompleteData(
+CRP* RelayData(
     uint8_t tInverse,
     uint8_t cInverse,
     uint8_t tTC1,
@@ -2136,10 +2741,14 @@ CRP* ExchangeCompleteData(
     uint8_t log_dir,
     log_struct_t *logger)
 {
-  CRP *data, *tmp;
-  uint8_t cont;
+  uint8_t header[5];
+  uint8_t ring[RELAY_RING_SIZE];
+  uint8_t direction, cmdCase, le, len, expected, tmp, result;
+  CRP *data;
+  CAPDU *cmd;
+  RAPDU *response;
 
-  data = (CRP*)malloc(sizeof(CRP));
+  data = (CRP*)ExchangeAlloc(sizeof(CRP));
   if(data == NULL)
   {
     if(logger)
@@ -2149,51 +2758,1060 @@ CRP* ExchangeCompleteData(
   data->cmd = NULL;
   data->response = NULL;
 
-  // store command from first exchange
-  tmp = ExchangeData(tInverse, cInverse, tTC1, cTC1, log_dir, logger);
-  if(tmp == NULL)
+  // the header goes to the ICC while it is received
+  direction = RELAY_TERMINAL_TO_ICC;
+  result = RelayBytes(direction, tInverse, cInverse, 1 + cTC1,
+      header, 5, MAX_WAIT_TERMINAL_CMD, log_dir, logger);
+  if(result != 0)
+    goto enderror;
+  if((log_dir & LOG_DIR_ICC) > 0)
+    LogCurrentTime(logger);
+
+  // fine times of the header, the first answer of the ICC and the end of
+  // the response, the same for both sides as the bytes are relayed
+  LogTimestamp(logger);
+
+  result = RET_ERR_MEMORY;
+  cmd = (CAPDU*)ExchangeAlloc(sizeof(CAPDU));
+  if(cmd == NULL)
+    goto enderror;
+  cmd->cmdData = NULL;
+  cmd->lenData = 0;
+  data->cmd = cmd;
+  cmd->cmdHeader = MakeCommandHeader(
+      header[0], header[1], header[2], header[3], header[4]);
+  if(cmd->cmdHeader == NULL)
+    goto enderror;
+
+  response = (RAPDU*)ExchangeAlloc(sizeof(RAPDU));
+  if(response == NULL)
+    goto enderror;
+  response->repData = NULL;
+  response->lenData = 0;
+  data->response = response;
+  response->repStatus = (EMVStatus*)ExchangeAlloc(sizeof(EMVStatus));
+  if(response->repStatus == NULL)
+    goto enderror;
+
+  cmdCase = GetCommandCase(header[0], header[1]);
+  if(cmdCase == 0)
   {
-    FreeCRP(data);
-    return NULL;
+    result = RET_ERR_CHECK;
+    goto enderror;
   }
-  data->cmd = tmp->cmd;
-  tmp->cmd = NULL;	
-
-  cont = (tmp->response->repStatus->sw1 == 0x61 ||
-      tmp->response->repStatus->sw1 == 0x6C); 
-  if(cont) FreeCRP(tmp);
 
-  while(cont)
+  // for cases 3 and 4 the ICC requests the command data with procedure
+  // bytes, which are relayed to the terminal
+  if(cmdCase == 3 || cmdCase == 4)
   {
-    tmp = ExchangeData(tInverse, cInverse, tTC1, cTC1, log_dir, logger);
-    if(tmp == NULL)
+    cmd->cmdData = (uint8_t*)ExchangeAlloc(header[4]);
+    if(cmd->cmdData == NULL)
+      goto enderror;
+
+    while(cmd->lenData < header[4])
     {
-      FreeCRP(data);
-      return NULL;
-    }
+      direction = RELAY_ICC_TO_TERMINAL;
+      StartRelay(direction, cInverse, tInverse, 0, ring, RELAY_RING_SIZE);
+      do{
+        result = RelayNextByte(&tmp, 0);
+        if(result != 0)
+        {
+          EndRelay();
+          goto enderror;
+        }
+        LogTimestamp(logger);
+        LogRelayByte(direction, tmp, log_dir, logger);
+      }while(tmp == SW1_MORE_TIME);
 
-    cont = (tmp->response->repStatus->sw1 == 0x61 ||
-        tmp->response->repStatus->sw1 == 0x6C); 
+      // anything else than INS or ~INS is the status, the command
+      // ends without the remaining data
+      if(tmp != header[1] && tmp != (uint8_t)~header[1])
+      {
+        response->repStatus->sw1 = tmp;
+        result = RelayNextByte(&(response->repStatus->sw2), 0);
+        if(result == 0)
+        {
+          LogRelayByte(direction, response->repStatus->sw2, log_dir, logger);
+          LogTimestamp(logger);
+        }
+        tmp = EndRelay();
+        if(result == 0)
+          result = tmp;
+        if(result != 0)
+          goto enderror;
 
-    if(cont) FreeCRP(tmp);
-  }
+        return data;
+      }
 
-  data->response = tmp->response;
-  tmp->response = NULL;
-  FreeCRP(tmp);	
+      result = EndRelay();
+      if(result != 0)
+        goto enderror;
 
-  return data;
-}
+      // INS requests all the remaining bytes, ~INS just the next one
+      len = 1;
+      if(tmp == header[1])
+        len = header[4] - cmd->lenData;
 
-/**
- * Create a ByteArray structure. This method just links
- * the data to the ByteArray structure which means that
- * eliberating the data (calling free) of the ByteArray
- * will have an effect on the data passed to this method.
- *
- * @param data the bytes to be linked to the structure
- * @param len the length of the byte array
- * @return the created ByteArray or NULL if no memory is
+      direction = RELAY_TERMINAL_TO_ICC;
+      result = RelayBytes(direction, tInverse, cInverse, 1 + cTC1,
+          cmd->cmdData + cmd->lenData, len, MAX_WAIT_TERMINAL_CMD,
+          log_dir, logger);
+      if(result != 0)
+        goto enderror;
+      cmd->lenData += len;
+    }
+  }
+
+  // for cases 2 and 4 the response may contain data
+  le = 0;
+  if(cmdCase == 2 || cmdCase == 4)
+    le = header[4];
+  if(le > 0)
+  {
+    result = RET_ERR_MEMORY;
+    response->repData = (uint8_t*)ExchangeAlloc(le);
+    if(response->repData == NULL)
+      goto enderror;
+  }
+
+  // the response goes to the terminal while it is received, 12 ETUs
+  // apart like the ICC sends it, and the bytes are parsed on the way to
+  // separate the data from the procedure bytes
+  direction = RELAY_ICC_TO_TERMINAL;
+  StartRelay(direction, cInverse, tInverse, 0, ring, RELAY_RING_SIZE);
+  expected = 0;
+  while(1)
+  {
+    result = RelayNextByte(&tmp, 0);
+    if(result != 0)
+      break;
+    if(expected == 0 && response->lenData == 0)
+      LogTimestamp(logger);
+    LogRelayByte(direction, tmp, log_dir, logger);
+
+    if(expected > 0)
+    {
+      response->repData[response->lenData++] = tmp;
+      expected--;
+    }
+    else if(tmp == SW1_MORE_TIME)
+      continue;
+    else if(le > 0 && tmp == header[1])
+      expected = le - response->lenData;
+    else if(le > 0 && tmp == (uint8_t)~header[1])
+      expected = (response->lenData < le) ? 1 : 0;
+    else
+    {
+      response->repStatus->sw1 = tmp;
+      result = RelayNextByte(&(response->repStatus->sw2), 0);
+      if(result == 0)
+      {
+        LogRelayByte(direction, response->repStatus->sw2, log_dir, logger);
+        LogTimestamp(logger);
+      }
+      break;
+    }
+  }
+  tmp = EndRelay();
+  if(result == 0)
+    result = tmp;
+  if(result != 0)
+    goto enderror;
+
+  return data;
+
+enderror:
+  FreeCRP(data);
+  if(logger && result != RET_ERR_CHECK)
+  {
+    LogCurrentTime(logger);
+
+    if(result == RET_TERMINAL_RESET_LOW)
+    {
+      LogByte1(logger, LOG_TERMINAL_RST_LOW, 0);
+    }
+    else if(result == RET_TERMINAL_TIME_OUT)
+    {
+      LogByte1(logger, LOG_TERMINAL_TIME_OUT, 0);
+    }
+    else if(result == RET_TERMINAL_NO_CLOCK)
+    {
+      LogByte1(logger, LOG_TERMINAL_NO_CLOCK, 0);
+    }
+    else if(result == RET_TERMINAL_SEND_RESPONSE)
+    {
+      LogByte1(logger, LOG_TERMINAL_ERROR_SEND, 0);
+    }
+    else if(result == RET_ICC_SEND_CMD)
+    {
+      LogByte1(logger, LOG_ICC_ERROR_SEND, 0);
+    }
+    else if(result == RET_ERR_MEMORY)
+    {
+      LogByte1(logger, LOG_ERROR_MEMORY, 0);
+    }
+    else if(direction == RELAY_TERMINAL_TO_ICC)
+    {
+      LogByte1(logger, LOG_TERMINAL_ERROR_RECEIVE, 0);
+    }
+    else
+    {
+      LogByte1(logger, LOG_ICC_ERROR_RECEIVE, 0);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * This method sends a command from the terminal to the ICC and also
+ * returns to the terminal the answer from the ICC. Both the command
+ * and the response are returned to the caller. If forwardCutThrough
+ * is non-zero the bytes are relayed as they arrive, using RelayData.
+ * If the ICC uses T=1 the blocks are forwarded with ExchangeT1Data.
+ *
+ * @param tInverse different than 0 if inverse convention is to be used
+ * with the terminal
+ * @param cInverse different than 0 if inverse convention is to be used
+ * with the ICC
+ * @param tTC1 byte TC1 of ATR used with terminal
+ * @param cTC1 byte TC1 of ATR received from ICC
+ * @param log_dir specifies which part to log
+ * @param logger a pointer to a log structure or NULL if no log is desired.
+ * @return the command and response pair if successful. If this method
+ * is not successful then it will return NULL
+ * @sa ExchangeCompleteData
+ */
+CRP* ExchangeData(
+    uint8_t tInverse,
+    uint8_t cInverse,
+    uint8_t tTC1,
+    uint8_t cTC1,
+    uint8_t log_dir,
+    log_struct_t *logger)
+{
+  CRP* data;
+
+  if(iccProtocol == 1)
+    return ExchangeT1Data(tInverse, cInverse, tTC1, cTC1, log_dir, logger);
+
+  // a PPS request from the terminal is handled by ForwardCommand
+  if(forwardCutThrough && terminalPPSTA1 == 0)
+    return RelayData(tInverse, cInverse, tTC1, cTC1, log_dir, logger);
+
+  data = (CRP*)ExchangeAlloc(sizeof(CRP));
+  if(data == NULL)
+  {
+    if(logger)
+      LogByte1(logger, LOG_ERROR_MEMORY, 0);
+    return NULL;
+  }
+
+  data->cmd = ForwardCommand(tInverse, cInverse, tTC1, cTC1, log_dir, logger);
+  if(data->cmd == NULL)
+  {
+    ExchangeFree(data);
+    return NULL;
+  }
+
+  data->response = ForwardResponse(
+      tInverse, cInverse, data->cmd->cmdHeader, log_dir, logger);
+  if(data->response == NULL)
+  {
+    FreeCAPDU(data->cmd);
+    ExchangeFree(data);
+    return NULL;
+  }
+
+  return data;
+}
+
+/**
+ * This method exchange command-response pairs between terminal and ICC,
+ * similar to ExchangeData. However this method forwards data repeatedly
+ * until the response contains a success or error. The method returns
+ * the initial command and the final response. Intermediate stages
+ * are removed. If you need those stages use ExchangeData instead.
+ *
+ * @param tInverse different than 0 if inverse convention is to be used
+ * with the terminal
+ * @param cInverse different than 0 if inverse convention is to be used
+ * with the ICC
+ * @param tTC1 byte TC1 of ATR used with terminal
+ * @param cTC1 byte TC1 of ATR received from ICC
+ * @param log_dir specifies which part to log
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return the command and response pair if successful. If this method
+ * is not successful then it will return NULL. The caller is responsible
+ * for the allocated memory of the CRP structure.
+ * @sa ExchangeData
+ */
+CRP* ExchangeCompleteData(
+    uint8_t tInverse,
+    uint8_t cInverse,
+    uint8_t tTC1,
+    uint8_t cTC1,
+    uint8_t log_dir,
+    log_struct_t *logger)
+{
+  CRP *data, *tmp;
+  uint8_t cont;
+
+  data = (CRP*)ExchangeAlloc(sizeof(CRP));
+  if(data == NULL)
+  {
+    if(logger)
+      LogByte1(logger, LOG_ERROR_MEMORY, 0);
+    return NULL;
+  }
+  data->cmd = NULL;
+  data->response = NULL;
+
+  // store command from first exchange
+  tmp = ExchangeData(tInverse, cInverse, tTC1, cTC1, log_dir, logger);
+  if(tmp == NULL)
+  {
+    FreeCRP(data);
+    return NULL;
+  }
+  data->cmd = tmp->cmd;
+  tmp->cmd = NULL;	
+
+  cont = (tmp->response->repStatus->sw1 == 0x61 ||
+      tmp->response->repStatus->sw1 == 0x6C); 
+  if(cont) FreeCRP(tmp);
+
+  while(cont)
+  {
+    tmp = ExchangeData(tInverse, cInverse, tTC1, cTC1, log_dir, logger);
+    if(tmp == NULL)
+    {
+      FreeCRP(data);
+      return NULL;
+    }
+
+    cont = (tmp->response->repStatus->sw1 == 0x61 ||
+        tmp->response->repStatus->sw1 == 0x6C); 
+
+    if(cont) FreeCRP(tmp);
+  }
+
+  data->response = tmp->response;
+  tmp->response = NULL;
+  FreeCRP(tmp);	
+
+  return data;
+}
+
+/* T=1 protocol functions */
+/* The SCD exchanges blocks with the ICC as the interface device, or */
+/* forwards them unchanged between the terminal and the ICC */
+
+/**
+ * Sets the T=1 parameters of the ICC and resets the sequence numbers.
+ * This must be called after each reset of the ICC and after the rate
+ * of the ICC has been selected, as the waiting times are kept in ETUs.
+ *
+ * @param TA3 the IFSC from the ATR, 0x20 if absent
+ * @param TB3 the BWI (high nibble) and CWI (low nibble) from the ATR
+ */
+void InitT1ICC(uint8_t TA3, uint8_t TB3)
+{
+  iccT1.ifsc = TA3;
+  iccT1.ns = 0;
+  iccT1.nr = 0;
+
+  // EMV adds 4 ETUs to CWT and 960 ETUs (at D = 1) to BWT
+  iccT1.cwt = (1UL << (TB3 & 0x0F)) + 11 + 4;
+  iccT1.bwt = ((960UL << (TB3 >> 4)) + 960) * ETU_ICC / GetICCETU() + 11;
+}
+
+/**
+ * Sends one byte of a T=1 block
+ *
+ * @param side T1_ICC or T1_TERMINAL
+ * @param byte the byte to send
+ * @param inverse_convention different than 0 if inverse
+ * convention is to be used
+ * @param delay ETUs to wait before the byte, for the guard time
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ */
+static void SendT1Byte(
+    uint8_t side,
+    uint8_t byte,
+    uint8_t inverse_convention,
+    uint8_t delay,
+    log_struct_t *logger)
+{
+  if(side == T1_ICC)
+  {
+    if(delay)
+      LoopICCETU(delay);
+    SendByteICCNoParity(byte, inverse_convention);
+    if(logger)
+      LogByte1Fast(logger, LOG_BYTE_TO_ICC, byte);
+  }
+  else
+  {
+    if(delay)
+      LoopTerminalETU(delay);
+    SendByteTerminalNoParity(byte, inverse_convention);
+    if(logger)
+      LogByte1Fast(logger, LOG_BYTE_TO_TERMINAL, byte);
+  }
+}
+
+/**
+ * Receives one byte of a T=1 block. Parity errors are not signalled
+ * to the sender, as T=1 detects them with the LRC of the block.
+ *
+ * @param side T1_ICC or T1_TERMINAL
+ * @param inverse_convention different than 0 if inverse
+ * convention is to be used
+ * @param wait the maximum wait for the start bit, in ETUs for the ICC or
+ * as the max_wait of GetByteTerminalNoParity for the terminal
+ * @param byte contains the byte read on return
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return zero if successful, RET_ERROR if the byte has a parity error,
+ * or the time out and terminal errors of the byte functions
+ */
+static uint8_t GetT1Byte(
+    uint8_t side,
+    uint8_t inverse_convention,
+    uint32_t wait,
+    uint8_t *byte,
+    log_struct_t *logger)
+{
+  uint8_t result;
+
+  if(side == T1_ICC)
+  {
+    if(WaitForICCDataETU(wait))
+      return RET_ICC_TIME_OUT;
+    result = GetByteICCNoParity(inverse_convention, byte);
+    if(logger)
+      LogByte1Fast(logger, LOG_BYTE_FROM_ICC, *byte);
+  }
+  else
+  {
+    result = GetByteTerminalNoParity(inverse_convention, byte, wait);
+    if(result == RET_TERMINAL_RESET_LOW || result == RET_TERMINAL_TIME_OUT ||
+        result == RET_TERMINAL_NO_CLOCK)
+      return result;
+    if(logger)
+      LogByte1Fast(logger, LOG_BYTE_FROM_TERMINAL, *byte);
+  }
+
+  return result ? RET_ERROR : 0;
+}
+
+/**
+ * Sends a T=1 block to the ICC or to the terminal. The characters are
+ * sent with the character guard time of T=1, 11 ETUs if TC1 = 255 and
+ * 12 + TC1 ETUs otherwise.
+ *
+ * @param side T1_ICC or T1_TERMINAL
+ * @param inverse_convention different than 0 if inverse
+ * convention is to be used
+ * @param TC1 the N parameter from the ATR
+ * @param nad the node address byte
+ * @param pcb the protocol control byte
+ * @param inf the information field, may be NULL if len is 0
+ * @param len the length of the information field, at most T1_MAX_INF
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return zero if successful, RET_ICC_SEND_CMD if the ICC was removed or
+ * RET_TERMINAL_NO_CLOCK if the terminal stopped the clock
+ */
+uint8_t SendT1Block(
+    uint8_t side,
+    uint8_t inverse_convention,
+    uint8_t TC1,
+    uint8_t nad,
+    uint8_t pcb,
+    const uint8_t *inf,
+    uint8_t len,
+    log_struct_t *logger)
+{
+  uint8_t delay, lrc, i;
+
+  if(side == T1_ICC && !IsICCInserted())
+    return RET_ICC_SEND_CMD;
+  if(side == T1_TERMINAL && IsTerminalClock() == 0)
+    return RET_TERMINAL_NO_CLOCK;
+
+  delay = (TC1 == 0xFF) ? 0 : 1 + TC1;
+  lrc = nad ^ pcb ^ len;
+
+  SendT1Byte(side, nad, inverse_convention, 0, logger);
+  SendT1Byte(side, pcb, inverse_convention, delay, logger);
+  SendT1Byte(side, len, inverse_convention, delay, logger);
+  for(i = 0; i < len; i++)
+  {
+    lrc ^= inf[i];
+    SendT1Byte(side, inf[i], inverse_convention, delay, logger);
+  }
+  SendT1Byte(side, lrc, inverse_convention, delay, logger);
+
+  return 0;
+}
+
+/**
+ * Receives a T=1 block from the ICC or from the terminal. The whole block
+ * is always read, so that an invalid block can be answered with an
+ * R-block. On the terminal side a PPS request sent after an ATR that
+ * offered TA1 is handled here, as for ReceiveT0CmdHeader.
+ *
+ * @param side T1_ICC or T1_TERMINAL
+ * @param inverse_convention different than 0 if inverse
+ * convention is to be used
+ * @param wait the maximum wait for the first byte, in ETUs for the ICC
+ * (the block waiting time) or as the max_wait of GetByteTerminalNoParity
+ * for the terminal
+ * @param nad contains the node address byte on return
+ * @param pcb contains the protocol control byte on return
+ * @param inf buffer of at least T1_MAX_INF bytes for the information field
+ * @param len contains the length of the information field on return
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return zero if successful, RET_ERROR if the block is invalid (parity,
+ * length or LRC error), or the time out and terminal errors of the byte
+ * functions
+ */
+uint8_t ReceiveT1Block(
+    uint8_t side,
+    uint8_t inverse_convention,
+    uint32_t wait,
+    uint8_t *nad,
+    uint8_t *pcb,
+    uint8_t *inf,
+    uint8_t *len,
+    log_struct_t *logger)
+{
+  uint8_t result, error, lrc, tmp, i, n;
+
+  *len = 0;
+  result = GetT1Byte(side, inverse_convention, wait, nad, logger);
+
+  // PPSS (0xFF) is not a valid NAD
+  if(side == T1_TERMINAL && terminalPPSTA1 != 0 && result == 0 &&
+      *nad == 0xFF)
+  {
+    result = ReceivePPSTerminal(
+        inverse_convention, terminalPPSTA1, 1, logger);
+    terminalPPSTA1 = 0;
+    if(result != 0)
+      return result;
+    result = GetT1Byte(side, inverse_convention, wait, nad, logger);
+  }
+  if(side == T1_TERMINAL)
+    terminalPPSTA1 = 0;
+  if(result != 0 && result != RET_ERROR)
+    return result;
+  error = result;
+
+  // the remaining bytes must follow within the character waiting time
+  if(side == T1_ICC)
+    wait = iccT1.cwt;
+
+  result = GetT1Byte(side, inverse_convention, wait, pcb, logger);
+  if(result != 0 && result != RET_ERROR)
+    return result;
+  error |= result;
+
+  result = GetT1Byte(side, inverse_convention, wait, &tmp, logger);
+  if(result != 0 && result != RET_ERROR)
+    return result;
+  error |= result;
+  if(tmp == 0xFF)
+    error = RET_ERROR;
+
+  lrc = *nad ^ *pcb ^ tmp;
+  n = tmp;
+  for(i = 0; i < n; i++)
+  {
+    result = GetT1Byte(side, inverse_convention, wait, &tmp, logger);
+    if(result != 0 && result != RET_ERROR)
+      return result;
+    error |= result;
+    lrc ^= tmp;
+    if(i < T1_MAX_INF)
+    {
+      inf[i] = tmp;
+      *len = i + 1;
+    }
+  }
+
+  result = GetT1Byte(side, inverse_convention, wait, &tmp, logger);
+  if(result != 0 && result != RET_ERROR)
+    return result;
+  error |= result;
+  if(tmp != lrc)
+    error = RET_ERROR;
+
+  return error ? RET_ERROR : 0;
+}
+
+/**
+ * Announces the IFSD of the SCD to the ICC with S(IFS request), as
+ * required by EMV after the ATR of a T=1 ICC
+ *
+ * @param inverse_convention different than 0 if inverse
+ * convention is to be used
+ * @param TC1 the N parameter from the ATR
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return zero if successful, RET_ICC_T1_BLOCK if the ICC did not
+ * confirm the IFSD
+ */
+uint8_t SendT1IFSD(
+    uint8_t inverse_convention,
+    uint8_t TC1,
+    log_struct_t *logger)
+{
+  uint8_t ifsd, nad, pcb, len, result, i;
+
+  ifsd = T1_IFSD;
+  for(i = 0; i < T1_MAX_RETRIES; i++)
+  {
+    LoopICCETU(T1_BGT_WAIT);
+    result = SendT1Block(T1_ICC, inverse_convention, TC1, 0,
+        T1_PCB_S | T1_S_IFS, &ifsd, 1, logger);
+    if(result != 0)
+      return result;
+
+    result = ReceiveT1Block(T1_ICC, inverse_convention, iccT1.bwt,
+        &nad, &pcb, t1Block, &len, logger);
+    if(result == 0 && pcb == (T1_PCB_S | T1_PCB_RESPONSE | T1_S_IFS) &&
+        len == 1 && t1Block[0] == ifsd)
+      return 0;
+  }
+
+  if(logger)
+    LogByte1(logger, LOG_ICC_ERROR_RECEIVE, 0);
+
+  return RET_ICC_T1_BLOCK;
+}
+
+/**
+ * Writes a command APDU in the format used by T=1: the header is
+ * followed by Lc and the command data if there is any data and by Le
+ * for commands that return data (case 2 and case 4).
+ *
+ * @param cmd the command
+ * @param apdu buffer of at least T1_APDU_SIZE bytes
+ * @return the length of the APDU
+ */
+static uint16_t SerializeT1Command(CAPDU *cmd, uint8_t *apdu)
+{
+  uint16_t n;
+  uint8_t cmdCase;
+
+  apdu[0] = cmd->cmdHeader->cla;
+  apdu[1] = cmd->cmdHeader->ins;
+  apdu[2] = cmd->cmdHeader->p1;
+  apdu[3] = cmd->cmdHeader->p2;
+  n = 4;
+
+  cmdCase = GetCommandCase(cmd->cmdHeader->cla, cmd->cmdHeader->ins);
+  if(cmd->lenData > 0 && cmd->cmdData != NULL)
+  {
+    apdu[n++] = cmd->lenData;
+    memcpy(&apdu[n], cmd->cmdData, cmd->lenData);
+    n += cmd->lenData;
+    if(cmdCase == 4)
+      apdu[n++] = 0;
+  }
+  else if(cmdCase != 1)
+    apdu[n++] = cmd->cmdHeader->p3;
+
+  return n;
+}
+
+/**
+ * Makes a CAPDU from a command APDU received with T=1. P3 holds Lc if
+ * there is command data and Le otherwise, as for T=0.
+ *
+ * @param apdu the command APDU
+ * @param len the length of the APDU
+ * @return the command or NULL if the APDU is not valid or there is not
+ * enough memory
+ */
+static CAPDU* ParseT1Command(const uint8_t *apdu, uint16_t len)
+{
+  uint8_t p3;
+
+  if(len < 4)
+    return NULL;
+
+  p3 = (len > 4) ? apdu[4] : 0;
+  if(len <= 5)
+    return MakeCommand(apdu[0], apdu[1], apdu[2], apdu[3], p3, NULL, 0);
+
+  if(p3 == 0 || len < 5 + (uint16_t)p3)
+    return NULL;
+
+  return MakeCommand(apdu[0], apdu[1], apdu[2], apdu[3], p3, &apdu[5], p3);
+}
+
+/**
+ * Makes a RAPDU from a response APDU received with T=1
+ *
+ * @param apdu the response data followed by SW1 and SW2
+ * @param len the length of the APDU
+ * @return the response or NULL if the APDU is not valid or there is not
+ * enough memory
+ */
+static RAPDU* ParseT1Response(const uint8_t *apdu, uint16_t len)
+{
+  RAPDU *response;
+
+  if(len < 2 || len > 257)
+    return NULL;
+
+  response = (RAPDU*)ExchangeAlloc(sizeof(RAPDU));
+  if(response == NULL)
+    return NULL;
+  response->repData = NULL;
+  response->lenData = len - 2;
+  response->repStatus = (EMVStatus*)ExchangeAlloc(sizeof(EMVStatus));
+  if(response->repStatus == NULL)
+    goto enderror;
+  response->repStatus->sw1 = apdu[len - 2];
+  response->repStatus->sw2 = apdu[len - 1];
+
+  if(response->lenData > 0)
+  {
+    response->repData = (uint8_t*)ExchangeAlloc(response->lenData);
+    if(response->repData == NULL)
+      goto enderror;
+    memcpy(response->repData, apdu, response->lenData);
+  }
+
+  return response;
+
+enderror:
+  FreeRAPDU(response);
+  return NULL;
+}
+
+/**
+ * Sends a command to the ICC and returns its response, using T=1.
+ * The command is chained over several I-blocks if it is longer than the
+ * IFSC and chained responses are acknowledged with R-blocks. Invalid
+ * blocks and time outs are answered with R-blocks, WTX and IFS requests
+ * from the ICC are accepted and any other S-block ends the exchange.
+ *
+ * @param inverse_convention different than 0 if inverse
+ * convention is to be used
+ * @param TC1 the N parameter from the ATR
+ * @param cmd the command to send
+ * @param logger a pointer to a log structure or NULL if no log is desired
+ * @return the response from the ICC or NULL if the exchange failed. The
+ * caller is responsible for the response, which is allocated with
+ * ExchangeAlloc
+ */
+RAPDU* TransmitT1Command(
+    uint8_t inverse_convention,
+    uint8_t TC1,
+    CAPDU *cmd,
+    log_struct_t *logger)
+{
+  uint16_t n, offset, rlen;
+  uint8_t ipcb, ilen, spcb, slen, sbyte, nad, pcb, len;
+  uint8_t result, retries, wtx, receiving;
+  const uint8_t *sinf;
+
+  if(cmd == NULL || cmd->cmdHeader == NULL)
+    return NULL;
+
+  n = SerializeT1Command(cmd, t1Apdu);
+  offset = 0;
+  rlen = 0;
+  retries = 0;
+  wtx = 1;
+  receiving = 0;
+  sbyte = 0;
+
+  // first I-block of the command
+  ilen = (n > iccT1.ifsc) ? iccT1.ifsc : n;
+  ipcb = (iccT1.ns ? T1_PCB_NS : 0) | ((ilen < n) ? T1_PCB_MORE : 0);
+  spcb = ipcb;
+  sinf = t1Apdu;
+  slen = ilen;
+
+  while(1)
+  {
+    LoopICCETU(T1_BGT_WAIT);
+    result = SendT1Block(T1_ICC, inverse_convention, TC1, 0,
+        spcb, sinf, slen, logger);
+    if(result != 0)
+      goto enderror;
+
+    result = ReceiveT1Block(T1_ICC, inverse_convention,
+        iccT1.bwt * wtx, &nad, &pcb, t1Block, &len, logger);
+    wtx = 1;
+
+    // an I-block must have the expected sequence number and, while the
+    // command is sent, it is only valid after the last block
+    if(result == 0 && (pcb & 0x80) == 0 &&
+        (((pcb & T1_PCB_NS) ? 1 : 0) != iccT1.nr ||
+         (receiving == 0 && (ipcb & T1_PCB_MORE))))
+      result = RET_ERROR;
+
+    if(result != 0)
+    {
+      if(++retries > T1_MAX_RETRIES)
+        goto enderror;
+
+      // ask the ICC for its last block again
+      spcb = T1_PCB_R | (iccT1.nr ? T1_PCB_NR : 0) |
+        ((result == RET_ERROR) ? 0x01 : 0x02);
+      sinf = NULL;
+      slen = 0;
+      continue;
+    }
+    retries = 0;
+
+    if((pcb & 0x80) == 0)
+    {
+      // I-block: the response, or part of it
+      if(receiving == 0)
+      {
+        iccT1.ns ^= 1;
+        receiving = 1;
+      }
+      iccT1.nr ^= 1;
+
+      if(rlen + len > T1_APDU_SIZE)
+        goto enderror;
+      memcpy(&t1Apdu[rlen], t1Block, len);
+      rlen += len;
+      if((pcb & T1_PCB_MORE) == 0)
+        break;
+
+      spcb = T1_PCB_R | (iccT1.nr ? T1_PCB_NR : 0);
+      sinf = NULL;
+      slen = 0;
+    }
+    else if((pcb & T1_PCB_S) == T1_PCB_R)
+    {
+      // R-block: next part of the command, or send the last block again
+      if(receiving == 0)
+      {
+        if(((pcb & T1_PCB_NR) ? 1 : 0) != iccT1.ns &&
+            (ipcb & T1_PCB_MORE))
+        {
+          iccT1.ns ^= 1;
+          offset += ilen;
+          ilen = (n - offset > iccT1.ifsc) ? iccT1.ifsc : n - offset;
+          ipcb = (iccT1.ns ? T1_PCB_NS : 0) |
+            ((offset + ilen < n) ? T1_PCB_MORE : 0);
+        }
+        spcb = ipcb;
+        sinf = &t1Apdu[offset];
+        slen = ilen;
+      }
+    }
+    else if(pcb == (T1_PCB_S | T1_S_WTX) && len == 1)
+    {
+      sbyte = t1Block[0];
+      wtx = sbyte ? sbyte : 1;
+      spcb = pcb | T1_PCB_RESPONSE;
+      sinf = &sbyte;
+      slen = 1;
+    }
+    else if(pcb == (T1_PCB_S | T1_S_IFS) && len == 1)
+    {
+      sbyte = t1Block[0];
+      iccT1.ifsc = sbyte;
+      spcb = pcb | T1_PCB_RESPONSE;
+      sinf = &sbyte;
+      slen = 1;
+    }
+    else
+      goto enderror;
+  }
+
+  return ParseT1Response(t1Apdu, rlen);
+
+enderror:
+  if(logger)
+    LogByte1(logger, LOG_ICC_ERROR_RECEIVE, 0);
+
+  return NULL;
+}
+
+/**
+ * This method forwards T=1 blocks between the terminal and the ICC until
+ * a complete command (which may be chained) and its complete response
+ * have been exchanged. The blocks are forwarded unchanged, so the
+ * terminal and the ICC negotiate the IFSC, IFSD and waiting time
+ * extensions between themselves. Only an invalid block from either side
+ * is answered by the SCD with an R-block, as the block cannot be
+ * forwarded.
+ *
+ * @param tInverse different than 0 if inverse convention is to be used
+ * with the terminal
+ * @param cInverse different than 0 if inverse convention is to be used
+ * with the ICC
+ * @param tTC1 byte TC1 of ATR used with terminal
+ * @param cTC1 byte TC1 of ATR received from ICC
+ * @param log_dir specifies which part to log
+ * @param logger a pointer to a log structure or NULL if no log is desired.
+ * @return the command and response pair if successful. If this method
+ * is not successful then it will return NULL
+ * @sa ExchangeData
+ */
+CRP* ExchangeT1Data(
+    uint8_t tInverse,
+    uint8_t cInverse,
+    uint8_t tTC1,
+    uint8_t cTC1,
+    uint8_t log_dir,
+    log_struct_t *logger)
+{
+  uint16_t alen;
+  uint8_t nad, pcb, len, result, retries, wtx, done;
+  log_struct_t *tlogger, *clogger;
+  CRP *data;
+
+  data = (CRP*)ExchangeAlloc(sizeof(CRP));
+  if(data == NULL)
+  {
+    if(logger)
+      LogByte1(logger, LOG_ERROR_MEMORY, 0);
+    return NULL;
+  }
+  data->cmd = NULL;
+  data->response = NULL;
+  tlogger = ((log_dir & LOG_DIR_TERMINAL) > 0) ? logger : NULL;
+  clogger = ((log_dir & LOG_DIR_ICC) > 0) ? logger : NULL;
+  alen = 0;
+  wtx = 1;
+  done = 0;
+
+  while(done == 0)
+  {
+    // block from the terminal
+    result = ReceiveT1Block(T1_TERMINAL, tInverse, MAX_WAIT_TERMINAL_CMD,
+        &nad, &pcb, t1Block, &len, tlogger);
+    if(result == RET_ERROR)
+    {
+      result = SendT1Block(T1_TERMINAL, tInverse, tTC1, 0,
+          T1_PCB_R | (iccT1.nr ? T1_PCB_NR : 0) | 0x01, NULL, 0, tlogger);
+      if(result != 0)
+        goto enderror;
+      continue;
+    }
+    if(result != 0)
+      goto enderror;
+
+    // a new I-block from the terminal is part of the command
+    if((pcb & 0x80) == 0 && ((pcb & T1_PCB_NS) ? 1 : 0) == iccT1.ns)
+    {
+      iccT1.ns ^= 1;
+      if(data->cmd != NULL || alen + len > T1_APDU_SIZE)
+      {
+        result = RET_ERROR;
+        goto enderror;
+      }
+      memcpy(&t1Apdu[alen], t1Block, len);
+      alen += len;
+      if((pcb & T1_PCB_MORE) == 0)
+      {
+        data->cmd = ParseT1Command(t1Apdu, alen);
+        if(data->cmd == NULL)
+        {
+          result = RET_ERR_MEMORY;
+          goto enderror;
+        }
+        alen = 0;
+      }
+    }
+    else if(pcb == (T1_PCB_S | T1_PCB_RESPONSE | T1_S_WTX) && len == 1)
+      wtx = t1Block[0] ? t1Block[0] : 1;
+
+    if((log_dir & LOG_DIR_ICC) > 0)
+      LogCurrentTime(logger);
+    result = SendT1Block(T1_ICC, cInverse, cTC1, nad, pcb,
+        t1Block, len, clogger);
+    if(result != 0)
+      goto enderror;
+
+    // block from the ICC, asked again while it is not valid
+    retries = 0;
+    while(1)
+    {
+      result = ReceiveT1Block(T1_ICC, cInverse, iccT1.bwt * wtx,
+          &nad, &pcb, t1Block, &len, clogger);
+      if(result != RET_ERROR || ++retries > T1_MAX_RETRIES)
+        break;
+      LoopICCETU(T1_BGT_WAIT);
+      SendT1Block(T1_ICC, cInverse, cTC1, 0,
+          T1_PCB_R | (iccT1.nr ? T1_PCB_NR : 0) | 0x01, NULL, 0, clogger);
+    }
+    wtx = 1;
+    if(result != 0)
+      goto enderror;
+
+    // a new I-block from the ICC is part of the response
+    if((pcb & 0x80) == 0 && ((pcb & T1_PCB_NS) ? 1 : 0) == iccT1.nr)
+    {
+      iccT1.nr ^= 1;
+      if(data->cmd == NULL || alen + len > T1_APDU_SIZE)
+      {
+        result = RET_ERROR;
+        goto enderror;
+      }
+      memcpy(&t1Apdu[alen], t1Block, len);
+      alen += len;
+      if((pcb & T1_PCB_MORE) == 0)
+        done = 1;
+    }
+
+    if((log_dir & LOG_DIR_TERMINAL) > 0)
+      LogCurrentTime(logger);
+    result = SendT1Block(T1_TERMINAL, tInverse, tTC1, nad, pcb,
+        t1Block, len, tlogger);
+    if(result != 0)
+      goto enderror;
+  }
+
+  data->response = ParseT1Response(t1Apdu, alen);
+  if(data->response == NULL)
+  {
+    result = RET_ERR_MEMORY;
+    goto enderror;
+  }
+
+  return data;
+
+enderror:
+  FreeCRP(data);
+  if(logger)
+  {
+    LogCurrentTime(logger);
+    if(result == RET_TERMINAL_RESET_LOW)
+      LogByte1(logger, LOG_TERMINAL_RST_LOW, 0);
+    else if(result == RET_TERMINAL_TIME_OUT)
+      LogByte1(logger, LOG_TERMINAL_TIME_OUT, 0);
+    else if(result == RET_TERMINAL_NO_CLOCK)
+      LogByte1(logger, LOG_TERMINAL_NO_CLOCK, 0);
+    else if(result == RET_ERR_MEMORY)
+      LogByte1(logger, LOG_ERROR_MEMORY, 0);
+    else
+      LogByte1(logger, LOG_ICC_ERROR_RECEIVE, 0);
+  }
+
+  return NULL;
+}
+
+/**
+ * Create a ByteArray structure. This method just links
+ * the data to the ByteArray structure which means that
+ * eliberating the data (calling free) of the ByteArray
+ * will have an effect on the data passed to this method.
+ *
+ * @param data the bytes to be linked to the structure
+ * @param len the length of the byte array
+ * @return the created ByteArray or NULL if no memory is
  * available
  */
 ByteArray* MakeByteArray(uint8_t *data, uint8_t len)
@@ -2302,16 +3920,16 @@ void FreeCAPDU(CAPDU* cmd)
 
   if(cmd->cmdHeader != NULL)
   {
-    free(cmd->cmdHeader);
+    ExchangeFree(cmd->cmdHeader);
     cmd->cmdHeader = NULL;		
   }
 
   if(cmd->cmdData != NULL)
   {		
-    free(cmd->cmdData);
+    ExchangeFree(cmd->cmdData);
     cmd->cmdData = NULL;
   }
-  free(cmd);
+  ExchangeFree(cmd);
 }
 
 /**
@@ -2326,18 +3944,18 @@ CAPDU* CopyCAPDU(CAPDU* cmd)
 
   if(cmd == NULL || cmd->cmdHeader == NULL) return NULL;
 
-  command = (CAPDU*)malloc(sizeof(CAPDU));
+  command = (CAPDU*)ExchangeAlloc(sizeof(CAPDU));
   if(command == NULL) return NULL;
-  command->cmdHeader = (EMVCommandHeader*)malloc(sizeof(EMVCommandHeader));
+  command->cmdHeader = (EMVCommandHeader*)ExchangeAlloc(sizeof(EMVCommandHeader));
   if(command->cmdHeader == NULL)
   {
-    free(command);
+    ExchangeFree(command);
     return NULL;
   }
   memcpy(command->cmdHeader, cmd->cmdHeader, sizeof(EMVCommandHeader));
   if(cmd->cmdData != NULL && cmd->lenData != 0)
   {
-    command->cmdData = (uint8_t*)malloc(cmd->lenData * sizeof(uint8_t));
+    command->cmdData = (uint8_t*)ExchangeAlloc(cmd->lenData * sizeof(uint8_t));
     if(command->cmdData == NULL)
     {
       FreeCAPDU(command);
@@ -2366,16 +3984,16 @@ void FreeRAPDU(RAPDU* response)
 
   if(response->repStatus != NULL)
   {
-    free(response->repStatus);
+    ExchangeFree(response->repStatus);
     response->repStatus = NULL;		
   }
 
   if(response->repData != NULL)
   {		
-    free(response->repData);
+    ExchangeFree(response->repData);
     response->repData = NULL;
   }
-  free(response);
+  ExchangeFree(response);
 }
 
 /**
@@ -2390,18 +4008,18 @@ RAPDU* CopyRAPDU(RAPDU* resp)
 
   if(resp == NULL || resp->repStatus == NULL) return NULL;
 
-  response = (RAPDU*)malloc(sizeof(RAPDU));
+  response = (RAPDU*)ExchangeAlloc(sizeof(RAPDU));
   if(response == NULL) return NULL;
-  response->repStatus = (EMVStatus*)malloc(sizeof(EMVStatus));
+  response->repStatus = (EMVStatus*)ExchangeAlloc(sizeof(EMVStatus));
   if(response->repStatus == NULL)
   {
-    free(response);
+    ExchangeFree(response);
     return NULL;
   }
   memcpy(response->repStatus, resp->repStatus, sizeof(EMVStatus));
   if(resp->repData != NULL && resp->lenData != 0)
   {
-    response->repData = (uint8_t*)malloc(resp->lenData * sizeof(uint8_t));
+    response->repData = (uint8_t*)ExchangeAlloc(resp->lenData * sizeof(uint8_t));
     if(response->repData == NULL)
     {
       FreeRAPDU(response);
@@ -2439,7 +4057,62 @@ void FreeCRP(CRP* data)
     FreeRAPDU(data->response);
     data->response = NULL;
   }
-  free(data);
+  ExchangeFree(data);
+}
+
+
+
+/**
+ * Allocates memory for an object of the current command-response
+ * exchange (CRP, CAPDU, RAPDU and their parts).
+ *
+ * The memory is taken from a static arena by moving a pointer, so
+ * allocating between two bytes of a transmission takes constant time and
+ * does not fragment the heap. The arena is rewound once every block has
+ * been released with ExchangeFree, which for ForwardData happens after
+ * each FreeCRP. When the arena is full the memory is taken from the heap.
+ *
+ * @param size the number of bytes requested
+ * @return a pointer to the memory or NULL if there is no memory available
+ * @sa ExchangeFree
+ */
+void* ExchangeAlloc(size_t size)
+{
+  void *p;
+
+  // keep every block aligned for the structures stored in it
+  if(size == 0)
+    size = 1;
+  size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+  if(size > EXCHANGE_ARENA_SIZE - exchangeArenaUsed)
+    return malloc(size);
+
+  p = &exchangeArena[exchangeArenaUsed];
+  exchangeArenaUsed += size;
+  exchangeArenaBlocks++;
+
+  return p;
 }
 
+/**
+ * Releases memory obtained from ExchangeAlloc
+ *
+ * @param p the memory to be released, which may be NULL
+ * @sa ExchangeAlloc
+ */
+void ExchangeFree(void *p)
+{
+  if(p == NULL) return;
 
+  if((uint8_t*)p < exchangeArena ||
+      (uint8_t*)p >= exchangeArena + EXCHANGE_ARENA_SIZE)
+  {
+    free(p);
+    return;
+  }
+
+  exchangeArenaBlocks--;
+  if(exchangeArenaBlocks == 0)
+    exchangeArenaUsed = 0;
+}
@@ -33,6 +33,8 @@
 #ifndef _EMV_H_
 #define _EMV_H_
 
+#include <stddef.h>
+
 #include "scd_logger.h"
 
 //------------------------------------------------------------------------
@@ -40,6 +42,75 @@
 #define EMV_MORE_TAGS_MASK 0x1F
 #define EMV_EXTRA_LENGTH_BYTE 0x81
 
+/// Size of the arena used for the objects of one exchange
+#ifndef EXCHANGE_ARENA_SIZE
+#define EXCHANGE_ARENA_SIZE 512
+#endif
+
+/// Set to 1 to forward each byte as soon as it is received (see RelayData)
+#ifndef FORWARD_CUT_THROUGH
+#define FORWARD_CUT_THROUGH 0
+#endif
+
+/// Bytes of a response from the ICC that may wait to be sent to the terminal
+#define RELAY_RING_SIZE 32
+
+/// TA1 and PPS1 value for the default rate, F = 372 and D = 1
+#define ICC_DEFAULT_RATE 0x11
+
+/// ETUs (at D = 1) allowed beyond the work waiting time of the ICC before
+/// a T=0 receive times out. EMV requires at least 480
+#ifndef ICC_WWT_EXTRA
+#define ICC_WWT_EXTRA 480
+#endif
+
+/// NULL bytes of the ICC are not passed on, see ReceiveT0Data
+#define T0_NULL_KEEP 0
+/// NULL bytes of the ICC are sent to the terminal with direct convention
+#define T0_NULL_DIRECT 1
+/// NULL bytes of the ICC are sent to the terminal with inverse convention
+#define T0_NULL_INVERSE 2
+/// NULL bytes of the ICC are sent to a terminal using the given convention
+#define T0_NULL_TO_TERMINAL(inverse) \
+  ((inverse) ? T0_NULL_INVERSE : T0_NULL_DIRECT)
+
+/// TA1 offered to the terminal in the ATR (F = 372, D = 4 by default).
+/// Set to 0 to forward the TA1 of the ICC unchanged
+#ifndef TERMINAL_TA1
+#define TERMINAL_TA1 0x13
+#endif
+
+/// Maximum size of the information field (INF) of a T=1 block
+#define T1_MAX_INF 254
+
+/// IFSD announced to the ICC after the ATR
+#define T1_IFSD 254
+
+/// Size of the buffer holding a T=1 command or response APDU
+#define T1_APDU_SIZE 261
+
+/// ETUs waited before sending a block to the ICC, so that the block
+/// guard time (22 ETUs between start bits) is kept
+#define T1_BGT_WAIT 12
+
+/// Times a T=1 block is sent again or requested again after an error
+#define T1_MAX_RETRIES 3
+
+/// Devices that exchange T=1 blocks with the SCD
+#define T1_ICC 0
+#define T1_TERMINAL 1
+
+/// PCB bits of T=1 blocks (ISO/IEC 7816-3, section 11.3.2)
+#define T1_PCB_R 0x80                   // R-block, with bits 8-7 = 10
+#define T1_PCB_S 0xC0                   // S-block, with bits 8-7 = 11
+#define T1_PCB_NS 0x40                  // N(S) of an I-block
+#define T1_PCB_MORE 0x20                // M bit of an I-block
+#define T1_PCB_NR 0x10                  // N(R) of an R-block
+#define T1_PCB_RESPONSE 0x20            // S-block response
+#define T1_S_IFS 0x01                   // S-block types
+#define T1_S_ABORT 0x02
+#define T1_S_WTX 0x03
+
 //------------------------------------------------------------------------
 // EMV data structures
 
@@ -124,9 +195,24 @@ uint8_t ResetICC(
         uint8_t *TB3,
         log_struct_t *logger);
 
+//------------------------------------------------------------------------
+// Global variables
+
+/// Non-zero if ExchangeData relays the bytes with RelayData
+extern uint8_t forwardCutThrough;
+
+/// TA1 offered to the terminal in the ATR, see TERMINAL_TA1
+extern uint8_t terminalTA1;
+
+/// Protocol used with the ICC since the last reset, 0 for T=0, 1 for T=1
+extern uint8_t iccProtocol;
+
 //------------------------------------------------------------------------
 // T=0 protocol functions
 
+/// Sets the work waiting time of the ICC for T=0 from its ATR and rate
+void InitT0ICC(uint8_t TC2, uint8_t pps1);
+
 /// Sends default ATR for T=0 to terminal
 void SendT0ATRTerminal(
         uint8_t inverse_convention,
@@ -144,6 +230,14 @@ uint8_t GetATRICC(
         uint8_t *tck,
         log_struct_t *logger);
 
+/// Negotiates the transmission rate of the ICC with a PPS exchange
+uint8_t SendPPSICC(
+        uint8_t inverse_convention,
+        uint8_t proto,
+        uint8_t TC1,
+        uint8_t *pps1,
+        log_struct_t *logger);
+
 /// This function will return a command header structure
 EMVCommandHeader* MakeCommandHeader(uint8_t cla, uint8_t ins, uint8_t p1, 
         uint8_t p2, uint8_t p3);
@@ -227,10 +321,22 @@ CAPDU* ForwardCommand(
 /// Serialize a CAPDU structure
 uint8_t* SerializeCommand(CAPDU *cmd, uint32_t *len);
 
+/// Receive response from ICC for T=0 into a given buffer
+uint8_t ReceiveT0Data(
+        uint8_t inverse_convention,
+        EMVCommandHeader *cmdHeader,
+        uint8_t *data,
+        uint8_t maxlen,
+        uint8_t *len,
+        EMVStatus *status,
+        uint8_t null_to_terminal,
+        log_struct_t *logger);
+
 /// Receive response from ICC for T=0
 RAPDU* ReceiveT0Response(
         uint8_t inverse_convention,
         EMVCommandHeader *cmdHeader,
+        uint8_t null_to_terminal,
         log_struct_t *logger);
 
 /// Send a response to the terminal
@@ -251,6 +357,15 @@ RAPDU* ForwardResponse(
 /// Serialize a RAPDU structure
 uint8_t* SerializeResponse(RAPDU *response, uint8_t *len);
 
+/// Relays a command-response exchange between terminal and ICC byte by byte
+CRP* RelayData(
+        uint8_t tInverse,
+        uint8_t cInverse,
+        uint8_t tTC1,
+        uint8_t cTC1,
+        uint8_t log_dir,
+        log_struct_t *logger);
+
 /// Makes a command-response exchange between terminal and ICC
 CRP* ExchangeData(
         uint8_t tInverse,
@@ -269,6 +384,56 @@ CRP* ExchangeCompleteData(
         uint8_t log_dir,
         log_struct_t *logger);
 
+//------------------------------------------------------------------------
+// T=1 protocol functions
+
+/// Sets the T=1 parameters of the ICC from its ATR
+void InitT1ICC(uint8_t TA3, uint8_t TB3);
+
+/// Sends a T=1 block to the ICC or to the terminal
+uint8_t SendT1Block(
+        uint8_t side,
+        uint8_t inverse_convention,
+        uint8_t TC1,
+        uint8_t nad,
+        uint8_t pcb,
+        const uint8_t *inf,
+        uint8_t len,
+        log_struct_t *logger);
+
+/// Receives a T=1 block from the ICC or from the terminal
+uint8_t ReceiveT1Block(
+        uint8_t side,
+        uint8_t inverse_convention,
+        uint32_t wait,
+        uint8_t *nad,
+        uint8_t *pcb,
+        uint8_t *inf,
+        uint8_t *len,
+        log_struct_t *logger);
+
+/// Announces the IFSD of the SCD to the ICC with S(IFS request)
+uint8_t SendT1IFSD(
+        uint8_t inverse_convention,
+        uint8_t TC1,
+        log_struct_t *logger);
+
+/// Sends a command to the ICC and returns its response, using T=1
+RAPDU* TransmitT1Command(
+        uint8_t inverse_convention,
+        uint8_t TC1,
+        CAPDU *cmd,
+        log_struct_t *logger);
+
+/// Makes a command-response exchange between terminal and ICC for T=1
+CRP* ExchangeT1Data(
+        uint8_t tInverse,
+        uint8_t cInverse,
+        uint8_t tTC1,
+        uint8_t cTC1,
+        uint8_t log_dir,
+        log_struct_t *logger);
+
 /// Encapsulates data in a ByteArray structure
 ByteArray* MakeByteArray(uint8_t *data, uint8_t len);
 
@@ -296,5 +461,11 @@ RAPDU* CopyRAPDU(RAPDU* resp);
 /// Eliberates the memory used by a CRP
 void FreeCRP(CRP* data);
 
+/// Allocates memory for an object of the current exchange
+void* ExchangeAlloc(size_t size);
+
+/// Eliberates memory allocated with ExchangeAlloc
+void ExchangeFree(void *p);
+
 #endif // _EMV_H_
 
@@ -0,0 +1,58 @@
+/**
+ * \file
+ * \brief	VirtualSerial.h stub for the host build
+ *
+ * Replaces the LUFA based header in lufa_usb_virtual_serial/ when building
+ * natively. The functions are implemented in sim_io.c on top of in-memory
+ * host buffers.
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VIRTUALSERIAL_H_
+#define _VIRTUALSERIAL_H_
+
+#include <avr/io.h>
+#include <avr/wdt.h>
+#include <avr/power.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>                // included by the LUFA headers
+#include <string.h>
+
+/// Size of the receive buffer, which limits the length of a line from the host
+#define HOST_RX_SIZE 512
+
+void SetupUSBHardware(void);
+void StopUSBHardware(void);
+void CDC_Task(void);
+const char* GetHostLine(uint16_t *len);
+const char* PollHostLine(uint16_t *len);
+uint8_t SendHostData(const char *data);
+uint8_t SendHostBytes(const uint8_t *data, uint16_t len, uint8_t flush);
+uint8_t GetHostFrame(uint8_t *type, uint8_t *data, uint16_t *len,
+    uint16_t maxlen);
+uint8_t SendHostFrame(uint8_t type, const uint8_t *data, uint16_t len);
+
+#endif // _VIRTUALSERIAL_H_
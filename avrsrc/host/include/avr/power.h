@@ -0,0 +1,57 @@
+/**
+ * \file
+ * \brief	avr/power.h stub for the host build
+ *
+ * Host replacement for the avr-libc header of the same name, used when
+ * building the SCD sources natively against the simulated HAL.
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _AVR_POWER_H_
+#define _AVR_POWER_H_
+
+#define power_all_enable() do { } while (0)
+#define power_all_disable() do { } while (0)
+#define power_usb_enable() do { } while (0)
+#define power_usb_disable() do { } while (0)
+#define power_usart1_enable() do { } while (0)
+#define power_usart1_disable() do { } while (0)
+#define power_adc_enable() do { } while (0)
+#define power_adc_disable() do { } while (0)
+#define power_spi_enable() do { } while (0)
+#define power_spi_disable() do { } while (0)
+#define power_twi_enable() do { } while (0)
+#define power_twi_disable() do { } while (0)
+#define power_timer0_enable() do { } while (0)
+#define power_timer0_disable() do { } while (0)
+#define power_timer1_enable() do { } while (0)
+#define power_timer1_disable() do { } while (0)
+#define power_timer2_enable() do { } while (0)
+#define power_timer2_disable() do { } while (0)
+#define power_timer3_enable() do { } while (0)
+#define power_timer3_disable() do { } while (0)
+
+#endif // _AVR_POWER_H_
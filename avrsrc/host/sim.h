@@ -0,0 +1,345 @@
+/**
+ * \file
+ * \brief	sim.h header file
+ *
+ * Interface of the host simulator used to run the SCD code natively. It
+ * provides a virtual clock, a virtual card and a virtual terminal that
+ * are driven by the simulated HAL (sim_hal.c).
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "scd_hal.h"
+
+/// Frequency of the clock provided by the virtual terminal
+#define SIM_F_TERMINAL 4000000UL
+
+/// CPU cycles taken by one iteration of a simple HAL polling loop
+#define SIM_POLL_CYCLES 15
+
+/// CPU cycles taken by one iteration of the terminal byte polling loop
+#define SIM_BYTE_POLL_CYCLES 30
+
+/// CPU cycles taken by one terminal clock check (IsTerminalClock)
+#define SIM_CLOCK_POLL_CYCLES 80
+
+/// Simulated time value meaning "never"
+#define SIM_NEVER UINT64_MAX
+
+/// Maximum length of a simulated APDU (header, data and status)
+#define SIM_MAX_APDU 300
+
+/// Maximum number of bytes buffered on a simulated line
+#define SIM_MAX_LINE 512
+
+/// Maximum number of exchanges recorded during one simulation run
+#define SIM_MAX_EXCHANGES 128
+
+/// Default work waiting time (960 * WI with WI = 10), in ETUs
+#define SIM_WWT_ETUS 9600
+
+/// Simulated time, in CPU cycles since the start of the simulation
+typedef uint64_t sim_time_t;
+
+/// A byte on one of the simulated I/O lines
+typedef struct {
+  uint8_t value;
+  sim_time_t start;     // leading edge of the start bit
+} SimByte;
+
+/// Bytes sent by a device and not yet consumed by the SCD
+typedef struct {
+  SimByte bytes[SIM_MAX_LINE];
+  uint16_t head;
+  uint16_t tail;
+} SimLine;
+
+/// Entry in the command table of a virtual card
+typedef struct {
+  const char *command;  // hex CLA INS P1 P2 [data prefix] to match
+  const char *response; // hex response data, without status
+  uint16_t sw;          // status word returned with the response
+  uint16_t delay_etus;  // processing time before the response
+} SimCardEntry;
+
+/// Behaviour of a virtual card
+typedef struct {
+  const char *name;
+  const char *atr;                  // hex ATR, including TS
+  uint16_t atr_delay_etus;          // delay between reset high and TS
+  uint16_t ack_delay_etus;          // delay before the procedure byte
+  const SimCardEntry *entries;      // terminated by a NULL command
+  uint8_t chunk;                    // most bytes per GET RESPONSE, 0 if any
+  uint8_t slow;                     // processing times multiplier, 0 if 1
+  uint16_t null_etus;               // interval of the NULL bytes sent while
+                                    // processing, 0 to send none
+} SimCardProfile;
+
+/// Script of a virtual terminal
+typedef struct {
+  const char *name;
+  const char **commands;            // hex C-TPDUs, NULL terminated
+  uint16_t reset_etus;              // time the reset line is held low
+  uint16_t think_etus;              // processing time between commands
+  uint8_t pps;                      // non-zero to request the TA1 of the ATR
+} SimTerminalScript;
+
+/// Timing of one command-response pair as seen by each device
+typedef struct {
+  uint8_t cla, ins, p1, p2, p3;
+  uint16_t sw;
+  sim_time_t terminal_start;        // first byte sent by the terminal
+  sim_time_t terminal_end;          // last byte received by the terminal
+  sim_time_t card_start;            // first byte received by the card
+  sim_time_t card_end;              // last byte sent by the card
+  sim_time_t card_wait;             // time the card waited for data bytes
+} SimExchange;
+
+/// Counters of anomalies detected during a simulation run
+typedef struct {
+  uint32_t overruns;        // bytes whose start bit was missed by the SCD
+  uint32_t stalls;          // reads from a device that never sent a byte
+  uint32_t collisions;      // bytes sent to a device while it was sending
+  uint32_t wwt_violations;  // gaps longer than the work waiting time
+  uint32_t wdt_expired;     // watchdog periods that elapsed without reset
+  uint32_t mismatches;      // responses altered between card and terminal
+  uint32_t protocol_errors; // unexpected bytes seen by the virtual devices
+} SimStats;
+
+/* Simulation clock */
+
+/// Current simulated time
+extern sim_time_t sim_now;
+
+/// Anomalies detected in the current run
+extern SimStats sim_stats;
+
+/// Moves the simulated time forward
+void SimAdvance(sim_time_t cycles);
+
+/// Returns the length of a terminal ETU in CPU cycles
+sim_time_t SimTerminalETU(void);
+
+/// Returns the length of an ICC ETU in CPU cycles
+sim_time_t SimICCETU(void);
+
+/// Converts CPU cycles to microseconds
+double SimCyclesToUs(sim_time_t cycles);
+
+/// Resets the clock, devices, statistics and SCD peripherals (power-on)
+void SimReset(void);
+
+/* Simulated lines */
+
+/// Appends a byte to a line
+void SimLinePush(SimLine *line, uint8_t value, sim_time_t start);
+
+/// Returns the next byte of a line or NULL if the line is empty
+SimByte* SimLinePeek(SimLine *line);
+
+/// Removes the next byte of a line
+void SimLinePop(SimLine *line);
+
+/* Virtual card (sim_card.c) */
+
+/// Inserts a virtual card with the given profile, or removes it if NULL
+void SimCardInsert(const SimCardProfile *profile);
+
+/// Returns non-zero if a virtual card is inserted
+uint8_t SimCardPresent(void);
+
+/// Applies power and clock to the virtual card or removes them
+void SimCardPower(uint8_t on);
+
+/// Updates the state of the reset line of the virtual card
+void SimCardReset(uint8_t high);
+
+/// Delivers a byte sent by the SCD to the virtual card
+void SimCardReceive(uint8_t value, sim_time_t start);
+
+/// Returns the last response sent by the virtual card (data and status)
+const uint8_t* SimCardLastResponse(uint16_t *len);
+
+/// Returns when the virtual card last received a byte and lost power
+sim_time_t SimCardLastReceived(sim_time_t *off);
+
+/// Bytes sent by the virtual card to the SCD
+extern SimLine sim_card_line;
+
+/// Returns the F or D value coded in TA1 or PPS1
+uint16_t SimRateValue(uint8_t code, uint8_t d);
+
+/* Virtual terminal (sim_terminal.c) */
+
+/// Prepares a virtual terminal running the given script
+void SimTerminalStart(const SimTerminalScript *script);
+
+/// Returns the first time >= sim_now when the terminal clock has the state
+sim_time_t SimTerminalClockAt(uint8_t on);
+
+/// Returns the first time >= sim_now when the terminal reset has the level
+sim_time_t SimTerminalResetAt(uint8_t high);
+
+/// Delivers a byte sent by the SCD to the virtual terminal
+void SimTerminalReceive(uint8_t value, sim_time_t start);
+
+/// Returns the time the terminal was connected to the SCD
+sim_time_t SimTerminalConnectTime(void);
+
+/// Returns the number of script commands completed by the terminal
+uint16_t SimTerminalCompleted(void);
+
+/// Returns non-zero if the terminal ran its whole script
+uint8_t SimTerminalFinished(void);
+
+/// Bytes sent by the virtual terminal to the SCD
+extern SimLine sim_terminal_line;
+
+/// Exchanges seen by the virtual terminal
+extern SimExchange sim_exchanges[SIM_MAX_EXCHANGES];
+
+/// Number of valid entries in sim_exchanges
+extern uint16_t sim_num_exchanges;
+
+/// Records the timing of the next command-response pair seen by the card
+void SimRecordCardExchange(const uint8_t *header, uint16_t sw,
+    sim_time_t start, sim_time_t end, sim_time_t wait);
+
+/* Simulated peripherals (sim_io.c) */
+
+/// Size of the simulated EEPROM
+#define SIM_EEPROM_SIZE 4096
+
+/// Contents of the simulated EEPROM
+extern uint8_t sim_eeprom[SIM_EEPROM_SIZE];
+
+/// Number of EEPROM bytes read, counted by eeprom_read_byte (also for the
+/// check done by eeprom_update_byte)
+extern uint32_t sim_eeprom_reads;
+
+/// Number of EEPROM bytes written, counted by eeprom_write_byte
+extern uint32_t sim_eeprom_writes;
+
+/// If non-zero, the EEPROM write with this number is not done and a
+/// watchdog reset is injected instead (WDRF is set in MCUSR), returning
+/// to sim_reset_jmp
+extern uint32_t sim_eeprom_reset_at;
+
+/// Where an injected reset returns to (see sim_eeprom_reset_at)
+extern jmp_buf sim_reset_jmp;
+
+/// Button state returned by GetButton
+extern uint8_t sim_button;
+
+/// Queues a line to be returned by GetHostLine
+void SimHostWrite(const char *line);
+
+/// Queues a binary frame to be returned by GetHostFrame
+void SimHostWriteFrame(uint8_t type, const uint8_t *data, uint16_t len);
+
+/// Returns the data sent by the SCD over the virtual serial port
+const char* SimHostOutput(void);
+
+/// Returns the number of bytes sent by the SCD over the virtual serial port
+size_t SimHostOutputLength(void);
+
+/// Returns the payload of the next valid frame in the host output
+const uint8_t* SimHostReadFrame(size_t *offset, uint8_t *type, uint16_t *len);
+
+/// Clears the host output and the queued host lines
+void SimHostReset(void);
+
+/* Heap accounting (sim_heap.c) */
+
+/// Allocators used by the SCD sources in the host build
+void* SimMalloc(size_t size);
+void* SimCalloc(size_t n, size_t size);
+void* SimRealloc(void *p, size_t size);
+void SimFree(void *p);
+
+/// Restarts the peak heap measurement from the current usage
+void SimHeapReset(void);
+
+/// Returns the heap currently used by the SCD code, in bytes
+uint32_t SimHeapUsed(void);
+
+/// Returns the maximum heap used since the last SimHeapReset, in bytes
+uint32_t SimHeapPeak(void);
+
+/// Returns the number of blocks currently allocated by the SCD code
+uint32_t SimHeapBlocks(void);
+
+/// Returns the number of blocks allocated or resized by the SCD code
+uint32_t SimHeapAllocs(void);
+
+/* Helpers */
+
+/// Parses a hex string into bytes, returning the number of bytes
+uint16_t SimParseHex(const char *hex, uint8_t *out, uint16_t max);
+
+/* Canned profiles (sim_profiles.c) */
+
+/// Card answering an EMV purchase with offline data authentication
+extern const SimCardProfile sim_card_emv;
+
+/// Card like sim_card_emv that can run at a faster rate after PPS
+extern const SimCardProfile sim_card_emv_fast;
+
+/// Card like sim_card_emv that uses the T=1 protocol
+extern const SimCardProfile sim_card_emv_t1;
+
+/// Card like sim_card_emv that returns the data of GET RESPONSE in chunks
+extern const SimCardProfile sim_card_emv_chunked;
+
+/// Card like sim_card_emv that takes longer than WWT to process the
+/// cryptographic commands and sends NULL bytes meanwhile
+extern const SimCardProfile sim_card_emv_slow;
+
+/// Card like sim_card_emv_fast that sends NULL bytes shortly one after
+/// the other while processing
+extern const SimCardProfile sim_card_emv_fast_null;
+
+/// Card like sim_card_emv_slow that sends no NULL bytes, so it breaks WWT
+extern const SimCardProfile sim_card_emv_silent;
+
+/// Card like sim_card_emv_silent that can run at the rate of
+/// sim_card_emv_fast after PPS
+extern const SimCardProfile sim_card_emv_silent_fast;
+
+/// Terminal running a purchase with plaintext PIN verification
+extern const SimTerminalScript sim_terminal_purchase;
+
+/// Purchase from a terminal that requests the TA1 of the ATR with PPS
+extern const SimTerminalScript sim_terminal_purchase_pps;
+
+#endif // _SIM_H_
@@ -0,0 +1,800 @@
+/**
+ * \file
+ * \brief	sim_card.c source file
+ *
+ * Virtual T=0 card used by the host simulator. The card answers to reset
+ * with the ATR of its profile and then serves commands from the profile
+ * table, with the timing of a real card: 12 ETUs per character, 16 ETUs
+ * when the direction changes, plus the processing time of each entry.
+ * If the ATR indicates T=1 in TD1 the card exchanges T=1 blocks instead,
+ * with chaining in both directions and the IFSD set with S(IFS).
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+/// Character duration including guard time, in ETUs
+#define CARD_CHAR_ETUS 12
+
+/// Minimum delay between characters in opposite directions, in ETUs
+#define CARD_TURN_ETUS 16
+
+/// Block guard time of T=1, between the start bits of two blocks
+#define CARD_BGT_ETUS 22
+
+/// States of the virtual card
+typedef enum {
+  CARD_MUTE,      // not powered or in reset
+  CARD_IDLE,      // waiting for a command header
+  CARD_HEADER,    // receiving a command header
+  CARD_DATA,      // receiving command data
+  CARD_PPS,       // receiving a PPS request
+  CARD_BLOCK,     // receiving a T=1 block
+} SimCardState;
+
+SimLine sim_card_line;
+
+// static vars
+static const SimCardProfile *profile;
+static uint8_t powered;
+static uint8_t reset_high;
+static SimCardState state;
+static uint8_t header[5];
+static uint8_t nheader;
+static uint8_t data[256];
+static uint16_t ndata, lc;
+static uint8_t pending[SIM_MAX_APDU];   // response kept for GET RESPONSE
+static uint16_t npending;
+static uint16_t pending_sw;
+static uint8_t last[SIM_MAX_APDU];      // last response sent
+static uint16_t nlast;
+static sim_time_t last_rx;              // start of the last byte received
+static sim_time_t power_off;            // time power was last removed
+static sim_time_t next_tx;              // earliest start of the next byte sent
+static sim_time_t cmd_start;
+static sim_time_t cmd_wait;
+static sim_time_t etu;                  // ETU used by the card
+static sim_time_t etu_default;          // ETU before PPS, for processing times
+static uint8_t ta1;                     // TA1 of the ATR, the fastest rate
+static uint8_t pps_allowed;             // non-zero until the first command
+static uint8_t pps[7];                  // PPS request
+static uint8_t npps;
+static uint8_t t1;                      // non-zero if the ATR indicates T=1
+static uint8_t ifsc;                    // IFSC from TA3
+static uint8_t ifsd;                    // IFSD set by the SCD
+static uint8_t ns;                      // N(S) of the next I-block sent
+static uint8_t nr;                      // N(S) expected from the SCD
+static uint8_t block[259];              // T=1 block being received
+static uint16_t nblock;
+static uint8_t sent[259];               // last T=1 block sent
+static uint16_t nsent;
+static sim_time_t block_start;          // start of the first byte of block
+static uint8_t apdu[SIM_MAX_APDU];      // command APDU received with T=1
+static uint16_t napdu;
+static uint16_t nacked;                 // bytes of last already acknowledged
+static uint8_t chunk;                   // length of the last response chunk
+static uint8_t responding;              // non-zero while sending a response
+
+
+/**
+ * @param ins the INS byte of a command
+ * @return non-zero if the command carries data to the card
+ */
+static uint8_t HasCommandData(uint8_t ins)
+{
+  switch(ins)
+  {
+    case 0xA4: // SELECT
+    case 0x88: // INTERNAL AUTHENTICATE
+    case 0x82: // EXTERNAL AUTHENTICATE
+    case 0xAE: // GENERATE AC
+    case 0xA8: // GET PROCESSING OPTIONS
+    case 0x20: // VERIFY
+    case 0x24: // PIN CHANGE/UNBLOCK
+    case 0x1E: // APPLICATION BLOCK
+    case 0x18: // APPLICATION UNBLOCK
+    case 0x16: // CARD BLOCK
+      return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Schedules a byte to be sent by the card
+ *
+ * @param value the byte
+ * @param earliest the earliest time for the start bit
+ * @return the time of the start bit
+ */
+static sim_time_t Send(uint8_t value, sim_time_t earliest)
+{
+  sim_time_t start;
+
+  start = earliest > next_tx ? earliest : next_tx;
+  SimLinePush(&sim_card_line, value, start);
+  next_tx = start + CARD_CHAR_ETUS * etu;
+
+  return start;
+}
+
+/**
+ * Sends the response to the current command: the procedure byte and the
+ * data if any, followed by the status word. The response ends the command.
+ * If the profile asks for it, NULL bytes are sent during the processing.
+ *
+ * @param resp the response data
+ * @param len the length of the response data
+ * @param sw the status word
+ * @param delay processing time in ETUs of the default rate
+ */
+static void Respond(const uint8_t *resp, uint16_t len, uint16_t sw,
+    uint16_t delay)
+{
+  sim_time_t t;
+  uint32_t work, w;
+  uint16_t i;
+
+  work = delay;
+  if(profile->slow > 1)
+    work *= profile->slow;
+
+  t = last_rx + CARD_TURN_ETUS * etu;
+  if(profile->null_etus > 0)
+    for(w = profile->null_etus; w < work; w += profile->null_etus)
+      Send(0x60, t + w * etu_default);
+  t += work * etu_default;
+  nlast = 0;
+
+  if(len > 0)
+  {
+    Send(header[1], t);
+    t = 0;
+    for(i = 0; i < len; i++)
+    {
+      Send(resp[i], t);
+      last[nlast++] = resp[i];
+    }
+  }
+
+  Send((sw >> 8) & 0xFF, t);
+  t = Send(sw & 0xFF, 0);
+  last[nlast++] = (sw >> 8) & 0xFF;
+  last[nlast++] = sw & 0xFF;
+
+  SimRecordCardExchange(header, sw, cmd_start,
+      t + (CARD_CHAR_ETUS - 2) * etu, cmd_wait);
+  state = CARD_IDLE;
+}
+
+/**
+ * Returns data to the terminal following the T=0 rules for commands
+ * without command data: the data is sent only if P3 matches its length,
+ * otherwise the card asks for the right length with 6Cxx.
+ */
+static void RespondCase2(const uint8_t *resp, uint16_t len, uint16_t sw,
+    uint16_t delay)
+{
+  uint16_t le;
+
+  le = header[4] ? header[4] : 256;
+  if(len == 0)
+    Respond(NULL, 0, sw, delay);
+  else if(le != len)
+    Respond(NULL, 0, 0x6C00 | (len & 0xFF), delay);
+  else
+    Respond(resp, len, sw, delay);
+}
+
+/**
+ * Finds the entry of the profile that matches the current command
+ *
+ * @return the entry or NULL if none matches
+ */
+static const SimCardEntry* FindEntry(void)
+{
+  const SimCardEntry *entry;
+  uint8_t cmd[SIM_MAX_APDU];
+  uint16_t n;
+
+  for(entry = profile->entries; entry->command != NULL; entry++)
+  {
+    n = SimParseHex(entry->command, cmd, sizeof(cmd));
+    if(n < 4 || memcmp(cmd, header, 4) != 0)
+      continue;
+    if(n - 4 > ndata || memcmp(cmd + 4, data, n - 4) != 0)
+      continue;
+    return entry;
+  }
+
+  return NULL;
+}
+
+/**
+ * Returns the number of pending bytes given by the next GET RESPONSE
+ */
+static uint16_t NextChunk(void)
+{
+  if(profile->chunk > 0 && npending > profile->chunk)
+    return profile->chunk;
+  return npending;
+}
+
+/**
+ * Executes the current command once all its bytes were received
+ */
+static void Process(void)
+{
+  const SimCardEntry *entry;
+  uint8_t resp[SIM_MAX_APDU];
+  uint16_t len, sw, le;
+
+  if(header[1] == 0xC0)
+  {
+    if(npending == 0)
+      Respond(NULL, 0, 0x6985, 0);
+    else
+    {
+      // the rest of the data is announced with 61xx after each chunk
+      len = NextChunk();
+      sw = pending_sw;
+      if(len < npending)
+      {
+        sw = npending - len;
+        if(profile->chunk > 0 && sw > profile->chunk)
+          sw = profile->chunk;
+        sw = 0x6100 | (sw & 0xFF);
+      }
+      RespondCase2(pending, len, sw, 0);
+
+      le = header[4] ? header[4] : 256;
+      if(le == len)
+      {
+        memmove(pending, pending + len, npending - len);
+        npending -= len;
+      }
+    }
+    return;
+  }
+
+  npending = 0;
+  entry = FindEntry();
+  if(entry == NULL)
+  {
+    if(header[1] == 0xA4)
+      sw = 0x6A82;
+    else if(header[1] == 0xB2)
+      sw = 0x6A83;
+    else
+      sw = 0x6D00;
+    Respond(NULL, 0, sw, 0);
+    return;
+  }
+
+  len = entry->response ? SimParseHex(entry->response, resp, sizeof(resp)) : 0;
+  if(HasCommandData(header[1]) && len > 0)
+  {
+    // case 4, the data is retrieved with GET RESPONSE
+    memcpy(pending, resp, len);
+    npending = len;
+    pending_sw = entry->sw;
+    Respond(NULL, 0, 0x6100 | (NextChunk() & 0xFF), entry->delay_etus);
+  }
+  else if(HasCommandData(header[1]))
+    Respond(NULL, 0, entry->sw, entry->delay_etus);
+  else
+    RespondCase2(resp, len, entry->sw, entry->delay_etus);
+}
+
+/**
+ * Sends a T=1 block, keeping a copy in case the SCD asks for it again
+ *
+ * @param pcb the protocol control byte
+ * @param inf the information field
+ * @param len the length of the information field
+ * @param earliest the earliest time for the first byte
+ * @return the time of the start bit of the last byte
+ */
+static sim_time_t SendBlock(uint8_t pcb, const uint8_t *inf, uint8_t len,
+    sim_time_t earliest)
+{
+  sim_time_t t;
+  uint16_t i;
+
+  nsent = 0;
+  sent[nsent++] = 0;
+  sent[nsent++] = pcb;
+  sent[nsent++] = len;
+  memmove(&sent[nsent], inf, len);
+  nsent += len;
+  sent[nsent] = 0;
+  for(i = 0; i < nsent; i++)
+    sent[nsent] ^= sent[i];
+  nsent++;
+
+  t = Send(sent[0], earliest);
+  for(i = 1; i < nsent; i++)
+    t = Send(sent[i], 0);
+
+  return t;
+}
+
+/**
+ * Sends an R-block asking for the next I-block of the SCD
+ *
+ * @param error non-zero if the last block of the SCD was not valid
+ */
+static void SendR(uint8_t error)
+{
+  SendBlock(0x80 | (nr ? 0x10 : 0) | (error ? 0x01 : 0), NULL, 0,
+      last_rx + CARD_BGT_ETUS * etu);
+}
+
+/**
+ * Sends the next part of the response in last as an I-block
+ *
+ * @param earliest the earliest time for the first byte
+ */
+static void SendResponseChunk(sim_time_t earliest)
+{
+  uint8_t pcb;
+  sim_time_t t;
+
+  chunk = (nlast - nacked > ifsd) ? ifsd : nlast - nacked;
+  pcb = (ns ? 0x40 : 0) | ((nacked + chunk < nlast) ? 0x20 : 0);
+  t = SendBlock(pcb, &last[nacked], chunk, earliest);
+  ns ^= 1;
+
+  if((pcb & 0x20) == 0)
+  {
+    responding = 0;
+    SimRecordCardExchange(header, (last[nlast - 2] << 8) | last[nlast - 1],
+        cmd_start, t + (CARD_CHAR_ETUS - 2) * etu, cmd_wait);
+  }
+}
+
+/**
+ * Executes the command APDU received with T=1 and starts sending the
+ * response. T=1 returns the response data directly, so there is no
+ * GET RESPONSE.
+ */
+static void ProcessT1(void)
+{
+  const SimCardEntry *entry;
+  uint16_t sw, delay;
+
+  memcpy(header, apdu, 4);
+  header[4] = (napdu > 4) ? apdu[4] : 0;
+  ndata = 0;
+  if(napdu > 5 && napdu >= 5 + apdu[4])
+  {
+    ndata = apdu[4];
+    memcpy(data, &apdu[5], ndata);
+  }
+
+  nlast = 0;
+  delay = 0;
+  entry = FindEntry();
+  if(entry == NULL)
+  {
+    if(header[1] == 0xA4)
+      sw = 0x6A82;
+    else if(header[1] == 0xB2)
+      sw = 0x6A83;
+    else
+      sw = 0x6D00;
+  }
+  else
+  {
+    if(entry->response)
+      nlast = SimParseHex(entry->response, last, sizeof(last) - 2);
+    sw = entry->sw;
+    delay = entry->delay_etus;
+  }
+  last[nlast++] = (sw >> 8) & 0xFF;
+  last[nlast++] = sw & 0xFF;
+
+  nacked = 0;
+  responding = 1;
+  SendResponseChunk(last_rx + CARD_BGT_ETUS * etu + delay * etu_default);
+}
+
+/**
+ * Handles a complete T=1 block sent by the SCD
+ */
+static void ProcessBlock(void)
+{
+  uint8_t pcb, len, check, resp;
+  uint16_t i;
+
+  check = 0;
+  for(i = 0; i < nblock; i++)
+    check ^= block[i];
+  pcb = block[1];
+  len = block[2];
+  state = CARD_IDLE;
+
+  if(check != 0 || block[0] != 0)
+  {
+    // ask for the block again
+    sim_stats.protocol_errors++;
+    SendR(1);
+    return;
+  }
+
+  if((pcb & 0xC0) == 0xC0)
+  {
+    // only S(IFS request) and S(WTX response) are expected from the SCD
+    if(pcb == 0xC1 && len == 1 && block[3] >= 0x10 && block[3] < 0xFF)
+    {
+      ifsd = block[3];
+      resp = block[3];
+      SendBlock(0xE1, &resp, 1, last_rx + CARD_BGT_ETUS * etu);
+    }
+    else
+      sim_stats.protocol_errors++;
+    return;
+  }
+
+  if(pcb & 0x80)
+  {
+    // R-block: next part of the response or the last block again
+    if(responding && ((pcb & 0x10) ? 1 : 0) == ns && (pcb & 0x0F) == 0)
+    {
+      nacked += chunk;
+      SendResponseChunk(last_rx + CARD_BGT_ETUS * etu);
+    }
+    else
+      SendBlock(sent[1], &sent[3], sent[2], last_rx + CARD_BGT_ETUS * etu);
+    return;
+  }
+
+  // I-block
+  if(((pcb & 0x40) ? 1 : 0) != nr || len > ifsc)
+  {
+    sim_stats.protocol_errors++;
+    SendR(1);
+    return;
+  }
+  nr ^= 1;
+  if(responding)
+  {
+    // a new command acknowledges the end of the previous response
+    sim_stats.protocol_errors++;
+    responding = 0;
+  }
+  if(napdu == 0)
+  {
+    cmd_start = block_start;
+    cmd_wait = 0;
+  }
+  if(napdu + len > sizeof(apdu))
+  {
+    sim_stats.protocol_errors++;
+    napdu = 0;
+  }
+  memcpy(&apdu[napdu], &block[3], len);
+  napdu += len;
+
+  if(pcb & 0x20)
+    SendR(0);
+  else
+  {
+    ProcessT1();
+    napdu = 0;
+  }
+}
+
+/**
+ * @param code FI or DI value from TA1 or PPS1
+ * @param d non-zero for DI, zero for FI
+ * @return the F or D value coded, 0 if not supported by the virtual
+ * devices
+ */
+uint16_t SimRateValue(uint8_t code, uint8_t d)
+{
+  static const uint16_t F[16] = {372, 372, 558, 744, 1116, 1488, 1860, 0,
+    0, 512, 768, 1024, 1536, 2048, 0, 0};
+  static const uint16_t D[16] = {0, 1, 2, 4, 8, 16, 32, 64,
+    12, 20, 0, 0, 0, 0, 0, 0};
+
+  return d ? D[code & 0x0F] : F[code & 0x0F];
+}
+
+/**
+ * Answers a complete PPS request. PPS1 is accepted if it keeps the F
+ * value of TA1 and does not exceed its D value, otherwise the card
+ * answers without PPS1 and keeps the default rate.
+ */
+static void ProcessPPS(void)
+{
+  uint8_t resp[4], check, i, n;
+  uint16_t f, d;
+  sim_time_t t;
+
+  check = 0;
+  for(i = 0; i < npps; i++)
+    check ^= pps[i];
+  if(check != 0)
+  {
+    // a card does not answer an invalid request
+    sim_stats.protocol_errors++;
+    state = CARD_MUTE;
+    return;
+  }
+
+  n = 0;
+  resp[n++] = 0xFF;
+  resp[n++] = pps[1] & 0x0F;
+  f = d = 0;
+  if(pps[1] & 0x10)
+  {
+    f = SimRateValue(pps[2] >> 4, 0);
+    d = SimRateValue(pps[2], 1);
+    if((pps[2] >> 4) == (ta1 >> 4) && f != 0 && d != 0 &&
+        d <= SimRateValue(ta1, 1))
+    {
+      resp[1] |= 0x10;
+      resp[n++] = pps[2];
+    }
+  }
+  resp[n] = 0;
+  for(i = 0; i < n; i++)
+    resp[n] ^= resp[i];
+  n++;
+
+  t = last_rx + CARD_TURN_ETUS * etu;
+  for(i = 0; i < n; i++)
+  {
+    Send(resp[i], t);
+    t = 0;
+  }
+
+  // the new rate applies after the response
+  if(resp[1] & 0x10)
+    etu = etu * f / (372 * d);
+  state = CARD_IDLE;
+}
+
+/**
+ * Inserts a virtual card or removes it
+ *
+ * @param card_profile the behaviour of the card, NULL to remove the card
+ */
+void SimCardInsert(const SimCardProfile *card_profile)
+{
+  profile = card_profile;
+  SimCardPower(0);
+}
+
+/**
+ * @return non-zero if a card is inserted
+ */
+uint8_t SimCardPresent(void)
+{
+  return profile != NULL;
+}
+
+/**
+ * Applies or removes power and clock. Removing power discards anything
+ * the card was about to send.
+ *
+ * @param on non-zero to power the card
+ */
+void SimCardPower(uint8_t on)
+{
+  if(powered && !on)
+    power_off = sim_now;
+  powered = (on && profile != NULL);
+  reset_high = 0;
+  etu = etu_default = SimICCETU();
+  state = CARD_MUTE;
+  npending = 0;
+  nlast = 0;
+  sim_card_line.head = sim_card_line.tail = 0;
+}
+
+/**
+ * Updates the reset line. On the rising edge the card sends its ATR.
+ *
+ * @param high the new level of the reset line
+ */
+void SimCardReset(uint8_t high)
+{
+  uint8_t atr[33];
+  uint16_t i, n, pos;
+  sim_time_t t;
+
+  if(!powered)
+    return;
+
+  sim_card_line.head = sim_card_line.tail = 0;
+  reset_high = high;
+  state = CARD_MUTE;
+  if(!high)
+    return;
+
+  // the card starts at the default rate, the one set by ActivateICC
+  etu = etu_default = SimICCETU();
+  ta1 = 0x11;
+  pps_allowed = 1;
+
+  n = SimParseHex(profile->atr, atr, sizeof(atr));
+  if(n > 2 && (atr[1] & 0x10))
+    ta1 = atr[2];
+
+  // T=1 is indicated in TD1, with the IFSC in TA3 if TD2 is present
+  t1 = 0;
+  ifsc = 0x20;
+  ifsd = 0x20;
+  ns = nr = 0;
+  napdu = 0;
+  responding = 0;
+  pos = 2 + ((atr[1] >> 4) & 1) + ((atr[1] >> 5) & 1) + ((atr[1] >> 6) & 1);
+  if((atr[1] & 0x80) && pos < n && (atr[pos] & 0x0F) == 1)
+  {
+    t1 = 1;
+    i = pos + 1 + ((atr[pos] >> 4) & 1) + ((atr[pos] >> 5) & 1) +
+      ((atr[pos] >> 6) & 1);
+    if((atr[pos] & 0x80) && i + 1 < n && (atr[i] & 0x10))
+      ifsc = atr[i + 1];
+  }
+  t = sim_now + profile->atr_delay_etus * etu;
+  next_tx = 0;
+  for(i = 0; i < n; i++)
+  {
+    Send(atr[i], t);
+    t = 0;
+  }
+  state = CARD_IDLE;
+}
+
+/**
+ * Receives a byte sent by the SCD
+ *
+ * @param value the byte
+ * @param start the time of the start bit
+ */
+void SimCardReceive(uint8_t value, sim_time_t start)
+{
+  SimByte *b;
+
+  if(!powered || !reset_high || state == CARD_MUTE)
+  {
+    sim_stats.protocol_errors++;
+    return;
+  }
+
+  b = SimLinePeek(&sim_card_line);
+  if(b != NULL || start + 2 * etu < next_tx)
+    sim_stats.collisions++;
+  if(SimICCETU() != etu)
+    sim_stats.protocol_errors++;
+
+  switch(state)
+  {
+    case CARD_IDLE:
+      if(pps_allowed && value == 0xFF)
+      {
+        pps[0] = value;
+        npps = 1;
+        state = CARD_PPS;
+        break;
+      }
+      pps_allowed = 0;
+      if(t1)
+      {
+        block_start = start;
+        block[0] = value;
+        nblock = 1;
+        state = CARD_BLOCK;
+        break;
+      }
+      cmd_start = start;
+      cmd_wait = 0;
+      nheader = 0;
+      ndata = 0;
+      header[nheader++] = value;
+      state = CARD_HEADER;
+    break;
+
+    case CARD_HEADER:
+      header[nheader++] = value;
+      if(nheader < 5)
+        break;
+
+      lc = header[4];
+      if(HasCommandData(header[1]) && lc > 0)
+      {
+        // ask for all the command data
+        state = CARD_DATA;
+        last_rx = Send(header[1],
+            start + CARD_TURN_ETUS * etu +
+            profile->ack_delay_etus * etu_default);
+        return;
+      }
+      last_rx = start;
+      Process();
+      return;
+
+    case CARD_PPS:
+      pps[npps++] = value;
+      last_rx = start;
+      if(npps < 2 || npps < 3 + ((pps[1] >> 4) & 1) +
+          ((pps[1] >> 5) & 1) + ((pps[1] >> 6) & 1))
+        return;
+      pps_allowed = 0;
+      ProcessPPS();
+      return;
+
+    case CARD_BLOCK:
+      block[nblock++] = value;
+      last_rx = start;
+      if(nblock < 3 || nblock < 4 + block[2])
+        return;
+      ProcessBlock();
+      return;
+
+    case CARD_DATA:
+      if(ndata == 0 && start > last_rx + CARD_TURN_ETUS * etu)
+        cmd_wait += start - (last_rx + CARD_TURN_ETUS * etu);
+      else if(ndata > 0 && start > last_rx + CARD_CHAR_ETUS * etu)
+        cmd_wait += start - (last_rx + CARD_CHAR_ETUS * etu);
+      data[ndata++] = value;
+      last_rx = start;
+      if(ndata == lc)
+        Process();
+      return;
+
+    default:
+    break;
+  }
+
+  last_rx = start;
+}
+
+/**
+ * @param len the length of the response, including the status word
+ * @return the last response sent by the card
+ */
+const uint8_t* SimCardLastResponse(uint16_t *len)
+{
+  *len = nlast;
+  return last;
+}
+
+/**
+ * @param off contains on return the time power was last removed
+ * @return the start of the last byte received by the card
+ */
+sim_time_t SimCardLastReceived(sim_time_t *off)
+{
+  *off = power_off;
+  return last_rx;
+}
@@ -0,0 +1,1320 @@
+/**
+ * \file
+ * \brief	sim_hal.c source file
+ *
+ * Software implementation of the functions in scd_hal.h, used to run the
+ * SCD code natively on a host. Instead of driving the AVR peripherals,
+ * each function moves the simulated clock forward and exchanges bytes
+ * with the virtual card (sim_card.c) and terminal (sim_terminal.c).
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <avr/io.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <string.h>
+
+#include "counter.h"
+#include "scd_hal.h"
+#include "scd_values.h"
+#include "sim.h"
+
+/// CPU cycles of one period of the sync counter (timer T2)
+#define SIM_T2_PERIOD ((sim_time_t)(F_CPU / 1000000UL) * counter_res_us)
+
+/// Duration of the start bit up to the sampling point of the first bit
+#define SIM_TERMINAL_RX_ETUS 9.9
+
+/// Duration of the start bit up to the sampling point of the last bit
+#define SIM_ICC_RX_ETUS 10
+
+sim_time_t sim_now;
+SimStats sim_stats;
+volatile uint32_t counter_t2;
+
+// static vars
+static sim_time_t wdt_period;     // 0 if the watchdog is disabled
+static sim_time_t wdt_deadline;
+static uint8_t t2_running;
+static sim_time_t t2_epoch;       // time of the last sync counter update
+static sim_time_t t3_start;       // time the terminal counter was started
+static uint8_t icc_powered;
+static uint8_t icc_reset;         // last level of PD4 seen by the card
+static uint16_t icc_etu;          // ETU set with SetICCETU, timer 1 clocks
+static uint16_t terminal_etu;     // ETU set with SetTerminalETU, terminal clocks
+static uint8_t line_enabled[2];   // set by StartLine, cleared by StopLine
+static uint8_t line_relay;        // set between StartRelay and EndRelay
+static sim_time_t line_armed[2];  // time the line engine started, or SIM_NEVER
+static void (*line_hook)(void);   // set with SetLineIdleHook
+
+
+/* Simulation clock */
+
+/**
+ * Moves the simulated time forward, checking the watchdog on the way
+ *
+ * @param cycles number of CPU cycles to advance
+ */
+void SimAdvance(sim_time_t cycles)
+{
+  sim_now += cycles;
+
+  while(wdt_period != 0 && sim_now > wdt_deadline)
+  {
+    sim_stats.wdt_expired++;
+    wdt_deadline += wdt_period;
+  }
+}
+
+/**
+ * @return the length of a terminal ETU in CPU cycles
+ */
+sim_time_t SimTerminalETU(void)
+{
+  return (sim_time_t)terminal_etu * (F_CPU / SIM_F_TERMINAL);
+}
+
+/**
+ * @return the length of an ICC ETU in CPU cycles, based on the
+ * prescaler of timer 1 given by ICC_CLK_TCCR1B
+ */
+sim_time_t SimICCETU(void)
+{
+  if((ICC_CLK_TCCR1B & 0x07) == 0x02)
+    return (sim_time_t)icc_etu * 8;
+
+  return icc_etu;
+}
+
+/**
+ * @param cycles number of CPU cycles
+ * @return the given number of cycles in micro-seconds
+ */
+double SimCyclesToUs(sim_time_t cycles)
+{
+  return (double)cycles * 1000000.0 / F_CPU;
+}
+
+/**
+ * Resets the simulated time, the state of the HAL and the statistics,
+ * as a power-on reset does (PORF is set in MCUSR). The virtual card
+ * and terminal are disconnected.
+ */
+void SimReset(void)
+{
+  sim_now = 0;
+  memset(&sim_stats, 0, sizeof(sim_stats));
+  wdt_period = 0;
+  wdt_deadline = 0;
+  t2_running = 0;
+  t2_epoch = 0;
+  t3_start = 0;
+  icc_powered = 0;
+  icc_reset = 0;
+  icc_etu = ETU_ICC;
+  terminal_etu = ETU_TERMINAL;
+  line_enabled[LINE_TERMINAL] = 0;
+  line_enabled[LINE_ICC] = 0;
+  line_relay = 0;
+  line_armed[LINE_TERMINAL] = SIM_NEVER;
+  line_armed[LINE_ICC] = SIM_NEVER;
+  line_hook = NULL;
+  counter_t2 = 0;
+  PORTD = 0;
+  MCUSR = _BV(PORF);
+
+  SimCardInsert(NULL);
+  SimTerminalStart(NULL);
+  SimHostReset();
+}
+
+/**
+ * Used by sleep_cpu(). Sleeps until the terminal provides clock or, if
+ * there is no such event, for one millisecond.
+ */
+void SimSleep(void)
+{
+  sim_time_t t;
+
+  t = SimTerminalClockAt(1);
+  if(t != SIM_NEVER && t > sim_now)
+    SimAdvance(t - sim_now);
+  else
+    SimAdvance(F_CPU / 1000);
+}
+
+/**
+ * Arms the watchdog, replacing wdt_enable()
+ *
+ * @param timeout one of the WDTO_ values
+ */
+void SimWdtEnable(uint8_t timeout)
+{
+  static const uint16_t ms[] = {15, 30, 60, 120, 250, 500, 1000, 2000, 4000, 8000};
+
+  if(timeout > WDTO_8S)
+    timeout = WDTO_8S;
+  wdt_period = (sim_time_t)ms[timeout] * (F_CPU / 1000);
+  wdt_deadline = sim_now + wdt_period;
+}
+
+/**
+ * Disarms the watchdog, replacing wdt_disable()
+ */
+void SimWdtDisable(void)
+{
+  wdt_period = 0;
+}
+
+/**
+ * Restarts the watchdog period, replacing wdt_reset()
+ */
+void SimWdtReset(void)
+{
+  wdt_deadline = sim_now + wdt_period;
+}
+
+
+/* Simulated lines */
+
+/**
+ * Appends a byte to a simulated line
+ *
+ * @param line the line
+ * @param value the byte
+ * @param start time of the start bit
+ */
+void SimLinePush(SimLine *line, uint8_t value, sim_time_t start)
+{
+  uint16_t next;
+
+  next = (line->tail + 1) % SIM_MAX_LINE;
+  if(next == line->head)
+  {
+    sim_stats.protocol_errors++;
+    return;
+  }
+
+  line->bytes[line->tail].value = value;
+  line->bytes[line->tail].start = start;
+  line->tail = next;
+}
+
+/**
+ * @param line the line
+ * @return the next byte on the line or NULL if the line is empty
+ */
+SimByte* SimLinePeek(SimLine *line)
+{
+  if(line->head == line->tail)
+    return NULL;
+
+  return &(line->bytes[line->head]);
+}
+
+/**
+ * Removes the next byte from a simulated line
+ *
+ * @param line the line
+ */
+void SimLinePop(SimLine *line)
+{
+  if(line->head != line->tail)
+    line->head = (line->head + 1) % SIM_MAX_LINE;
+}
+
+/**
+ * Mirrors LineActive of the HAL: starts the engine of a line if it is
+ * enabled, the relay is not running and the ETU is long enough
+ *
+ * @param line LINE_TERMINAL or LINE_ICC
+ * @return non-zero if the engine of the line is running
+ */
+static uint8_t SimLineActive(uint8_t line)
+{
+  uint8_t slow;
+
+  if(line == LINE_ICC)
+    slow = (icc_etu >= ICC_MIN_ISR_ETU);
+  else
+    slow = (terminal_etu >= TERMINAL_MIN_ISR_ETU);
+
+  if(!LINE_ISR || !line_enabled[line] || line_relay || !slow)
+  {
+    line_armed[line] = SIM_NEVER;
+    return 0;
+  }
+
+  if(line_armed[line] == SIM_NEVER)
+    line_armed[line] = sim_now;
+
+  return 1;
+}
+
+/**
+ * Checks if the SCD has missed the start bit of a byte. Without a line
+ * engine the SCD must be waiting when the start bit comes. With the
+ * engine the byte is missed if it came before the engine started or if
+ * the queue of the engine was full.
+ *
+ * @param line LINE_TERMINAL or LINE_ICC
+ * @param sline the simulated line
+ * @param b the next byte of the line
+ * @param engine non-zero if the line engine was running
+ * @param etu the ETU of the line, in CPU cycles
+ * @return non-zero if the byte was missed
+ */
+static uint8_t SimLineMissed(uint8_t line, SimLine *sline, SimByte *b,
+    uint8_t engine, sim_time_t etu)
+{
+  uint16_t i, n;
+
+  if(!engine)
+    return b->start + etu / 4 < sim_now;
+
+  if(b->start + etu / 4 < line_armed[line])
+    return 1;
+
+  n = 0;
+  for(i = sline->head; i != sline->tail; i = (i + 1) % SIM_MAX_LINE)
+  {
+    if(sline->bytes[i].start + 10 * etu > sim_now)
+      break;
+    n++;
+  }
+
+  return n >= LINE_QUEUE_SIZE;
+}
+
+/**
+ * Calls the idle hook while a line engine waits for the next byte, as
+ * the HAL does between the checks of the queue
+ *
+ * @param line LINE_TERMINAL or LINE_ICC
+ * @param sline the simulated line
+ * @param deadline the end of the wait, SIM_NEVER for no limit
+ */
+static void SimLineIdle(uint8_t line, SimLine *sline, sim_time_t deadline)
+{
+  SimByte *b;
+  sim_time_t before;
+
+  if(line_hook == NULL || !SimLineActive(line))
+    return;
+
+  while(sim_now < deadline)
+  {
+    b = SimLinePeek(sline);
+    if(b == NULL || b->start <= sim_now)
+      return;
+    if(line == LINE_TERMINAL && (SimTerminalResetAt(0) <= sim_now ||
+          SimTerminalClockAt(0) <= sim_now))
+      return;
+
+    before = sim_now;
+    line_hook();
+    if(sim_now == before)
+      return;
+  }
+}
+
+/**
+ * Propagates the ICC reset line (PD4) to the virtual card. The line is also
+ * written directly through PORTD, so this is called by every ICC function.
+ */
+static void SyncICCReset(void)
+{
+  uint8_t level;
+
+  level = bit_is_set(PORTD, PD4) ? 1 : 0;
+  if(level != icc_reset)
+  {
+    icc_reset = level;
+    SimCardReset(level);
+  }
+}
+
+/**
+ * Brings the sync counter up to date with the simulated time
+ */
+static void SyncTimerT2(void)
+{
+  sim_time_t periods;
+
+  if(t2_running == 0)
+    return;
+
+  periods = (sim_now - t2_epoch) / SIM_T2_PERIOD;
+  counter_t2 += (uint32_t)periods;
+  t2_epoch += periods * SIM_T2_PERIOD;
+}
+
+/**
+ * Waits until the given time, or the deadline if it comes first
+ *
+ * @param t time of the event
+ * @param deadline the maximum time to wait, SIM_NEVER for no limit
+ * @return non-zero if the event happened before the deadline
+ */
+static uint8_t WaitUntil(sim_time_t t, sim_time_t deadline)
+{
+  if(t == SIM_NEVER && deadline == SIM_NEVER)
+  {
+    // the real device would hang here
+    sim_stats.stalls++;
+    return 0;
+  }
+
+  if(t > deadline)
+  {
+    SimAdvance(deadline - sim_now);
+    return 0;
+  }
+
+  if(t > sim_now)
+    SimAdvance(t - sim_now);
+
+  return 1;
+}
+
+
+/* General SCD functions */
+
+/**
+ * @return the value of the sync counter
+ */
+uint32_t GetCounter()
+{
+  SyncTimerT2();
+  return counter_t2;
+}
+
+/**
+ * @return the sync counter and the value of the timer T2, in units of
+ * timestamp_res_us
+ */
+uint32_t GetTimestamp()
+{
+  return (GetCounter() << 8) | ReadTimerT2();
+}
+
+/**
+ * Sets the value of the sync counter
+ *
+ * @param value the new value of the counter
+ */
+void SetCounter(uint32_t value)
+{
+  SyncTimerT2();
+  counter_t2 = value;
+}
+
+/**
+ * Resets to 0 the value of the sync counter
+ */
+void ResetCounter()
+{
+  SyncTimerT2();
+  counter_t2 = 0;
+}
+
+/**
+ * Enables the Watch Dog Timer
+ *
+ * @param ms number of milli-seconds for the watchdog
+ */
+void EnableWDT(uint16_t ms)
+{
+  if(ms <= 15)
+    wdt_enable(WDTO_15MS);
+  else if(ms <= 30)
+    wdt_enable(WDTO_30MS);
+  else if(ms <= 60)
+    wdt_enable(WDTO_60MS);
+  else if(ms <= 120)
+    wdt_enable(WDTO_120MS);
+  else if(ms <= 250)
+    wdt_enable(WDTO_250MS);
+  else if(ms <= 500)
+    wdt_enable(WDTO_500MS);
+  else if(ms <= 1000)
+    wdt_enable(WDTO_1S);
+  else if(ms <= 2000)
+    wdt_enable(WDTO_2S);
+  else if(ms <= 4000)
+    wdt_enable(WDTO_4S);
+  else
+    wdt_enable(WDTO_8S);
+}
+
+/**
+ * Disables the Watch Dog Timer
+ */
+void DisableWDT()
+{
+  wdt_disable();
+}
+
+/**
+ * Resets the Watch Dog Timer
+ */
+void ResetWDT()
+{
+  wdt_reset();
+}
+
+
+/* SCD to Terminal functions */
+
+/**
+ * Enables the terminal reset interrupt. The simulator never raises it.
+ */
+void EnableTerminalResetInterrupt()
+{
+}
+
+/**
+ * Disables the terminal reset interrupt
+ */
+void DisableTerminalResetInterrupt()
+{
+}
+
+/**
+ * @return non-zero if we have some terminal clock, zero otherwise
+ */
+uint16_t IsTerminalClock()
+{
+  SimAdvance(SIM_CLOCK_POLL_CYCLES);
+
+  return SimTerminalClockAt(1) == sim_now;
+}
+
+/**
+ * @return the status of the terminal I/O line, low during a start bit
+ */
+uint8_t GetTerminalIOLine()
+{
+  SimByte *b;
+
+  SimAdvance(SIM_POLL_CYCLES);
+  b = SimLinePeek(&sim_terminal_line);
+  if(b != NULL && b->start <= sim_now && sim_now < b->start + SimTerminalETU())
+    return 0;
+
+  return 1;
+}
+
+/**
+ * @return the state of the reset line from the terminal
+ */
+uint8_t GetTerminalResetLine()
+{
+  SimAdvance(SIM_POLL_CYCLES);
+
+  return SimTerminalResetAt(1) == sim_now;
+}
+
+/**
+ * Loops until the IO or reset line from the terminal become low.
+ *
+ * @param max_wait the maximum number of cycles to wait, 0 to wait
+ * indefinitely.
+ * @return 1 if reset is low, 2 if the I/O is low, or 3 if both lines are low.
+ * In case the maximum number of wait cycles has elapsed then this function
+ * returns 0.
+ */
+uint8_t WaitTerminalResetIOLow(uint32_t max_wait)
+{
+  sim_time_t t_reset, t_io, deadline;
+  SimByte *b;
+  uint8_t result;
+
+  deadline = SIM_NEVER;
+  if(max_wait != 0)
+    deadline = sim_now + (sim_time_t)max_wait * SIM_POLL_CYCLES;
+
+  t_reset = SimTerminalResetAt(0);
+  b = SimLinePeek(&sim_terminal_line);
+  t_io = (b != NULL) ? b->start : SIM_NEVER;
+  if(t_io != SIM_NEVER && t_io < sim_now)
+    t_io = sim_now;
+
+  if(!WaitUntil(t_reset < t_io ? t_reset : t_io, deadline))
+    return 0;
+
+  result = (SimTerminalResetAt(0) == sim_now) ? 1 : 0;
+  if(t_io == sim_now)
+    result |= 2;
+
+  return result;
+}
+
+/**
+ * Loops until the reset line from the terminal becomes high
+ *
+ * @param max_wait the maximum number of cycles to wait, 0 to wait
+ * indefinitely.
+ * @return 0 if success, RET_TERMINAL_TIME_OUT otherwise
+ */
+uint8_t WaitTerminalResetHigh(uint32_t max_wait)
+{
+  sim_time_t deadline = SIM_NEVER;
+
+  if(max_wait != 0)
+    deadline = sim_now + (sim_time_t)max_wait * SIM_POLL_CYCLES;
+
+  if(!WaitUntil(SimTerminalResetAt(1), deadline))
+    return RET_TERMINAL_TIME_OUT;
+
+  return 0;
+}
+
+/**
+ * Loops until receives clock from terminal
+ *
+ * @param max_wait the maximum number of clock checks, 0 to wait
+ * indefinitely.
+ * @return 0 if success, RET_TERMINAL_NO_CLOCK otherwise
+ */
+uint8_t WaitTerminalClock(uint32_t max_wait)
+{
+  sim_time_t deadline = SIM_NEVER;
+
+  if(max_wait != 0)
+    deadline = sim_now + (sim_time_t)max_wait * SIM_CLOCK_POLL_CYCLES;
+
+  if(!WaitUntil(SimTerminalClockAt(1), deadline))
+    return RET_TERMINAL_NO_CLOCK;
+
+  return 0;
+}
+
+/**
+ * @return the value of the timer T2
+ */
+uint8_t ReadTimerT2()
+{
+  SyncTimerT2();
+  if(t2_running == 0)
+    return 0;
+
+  return (uint8_t)(((sim_now - t2_epoch) * 256) / SIM_T2_PERIOD);
+}
+
+/**
+ * Starts the T2 timer, which updates the sync counter
+ */
+void StartTimerT2()
+{
+  if(t2_running)
+    return;
+
+  t2_running = 1;
+  t2_epoch = sim_now;
+}
+
+/**
+ * Stops the T2 timer
+ */
+void StopTimerT2()
+{
+  SyncTimerT2();
+  t2_running = 0;
+}
+
+/**
+ * Increments the sync counter
+ */
+void IncrementCounter()
+{
+  SyncTimerT2();
+  counter_t2++;
+}
+
+/**
+ * @return the number of terminal clocks since the terminal counter started
+ */
+uint16_t ReadCounterTerminal()
+{
+  return (uint16_t)((sim_now - t3_start) / (F_CPU / SIM_F_TERMINAL));
+}
+
+/**
+ * Starts the counter for the external clock given by the terminal
+ */
+void StartCounterTerminal()
+{
+  TCCR3A = 0x0C;
+  TCCR3B = 0x0F;
+  t3_start = sim_now;
+  StartLine(LINE_TERMINAL);
+}
+
+/**
+ * Stops the terminal clock counter
+ */
+void StopCounterTerminal()
+{
+  StopLine(LINE_TERMINAL);
+  TCCR3B = 0;
+}
+
+/**
+ * Pauses the terminal clock counter
+ */
+void PauseCounterTerminal()
+{
+  StopLine(LINE_TERMINAL);
+  TCCR3B = 0;
+}
+
+/**
+ * Sends a byte to the terminal with parity check. The virtual terminal
+ * never signals parity errors.
+ *
+ * @param byte the byte to send
+ * @param inverse_convention unused
+ * @return 0 if success, non-zero otherwise
+ */
+uint8_t SendByteTerminalParity(uint8_t byte, uint8_t inverse_convention)
+{
+  SendByteTerminalNoParity(byte, inverse_convention);
+  LoopTerminalETU(1);
+
+  return 0;
+}
+
+/**
+ * Sends a byte to the terminal without parity check. The start bit is
+ * sent one ETU after the call and the function returns after the
+ * stop bit (11 ETUs).
+ *
+ * @param byte the byte to send
+ * @param inverse_convention unused
+ */
+void SendByteTerminalNoParity(uint8_t byte, uint8_t inverse_convention)
+{
+  SimTerminalReceive(byte, sim_now + SimTerminalETU());
+  SimAdvance(11 * SimTerminalETU());
+}
+
+/**
+ * Receives a byte from the terminal with parity check
+ *
+ * @param inverse_convention unused
+ * @param r_byte the received byte
+ * @param max_wait the maximum number of polling cycles, 0 to wait
+ * indefinitely
+ * @return 0 if success, error code otherwise
+ */
+uint8_t GetByteTerminalParity(
+        uint8_t inverse_convention,
+        uint8_t *r_byte,
+        uint32_t max_wait)
+{
+  return GetByteTerminalNoParity(inverse_convention, r_byte, max_wait);
+}
+
+/**
+ * Receives a byte from the terminal without parity check. The function
+ * returns about 9.9 ETUs after the start bit. If the start bit was sent
+ * before the call the byte still gets delivered but the event is counted
+ * as an overrun.
+ *
+ * @param inverse_convention unused
+ * @param r_byte the received byte
+ * @param max_wait the maximum number of polling cycles, 0 to wait
+ * indefinitely
+ * @return 0 if success, RET_TERMINAL_RESET_LOW, RET_TERMINAL_NO_CLOCK or
+ * RET_TERMINAL_TIME_OUT otherwise
+ */
+uint8_t GetByteTerminalNoParity(
+        uint8_t inverse_convention,
+        uint8_t *r_byte,
+        uint32_t max_wait)
+{
+  sim_time_t t_reset, t_clock, t_byte, t_end, deadline;
+  SimByte *b;
+  uint8_t engine;
+
+  deadline = SIM_NEVER;
+  if(max_wait != 0)
+    deadline = sim_now + (sim_time_t)max_wait * SIM_BYTE_POLL_CYCLES;
+
+  engine = SimLineActive(LINE_TERMINAL);
+  SimLineIdle(LINE_TERMINAL, &sim_terminal_line, deadline);
+
+  t_reset = SimTerminalResetAt(0);
+  t_clock = SimTerminalClockAt(0);
+  b = SimLinePeek(&sim_terminal_line);
+  t_byte = SIM_NEVER;
+  if(b != NULL)
+  {
+    t_byte = b->start;
+    if(t_byte < sim_now)
+      t_byte = sim_now;
+  }
+
+  if(t_reset <= t_clock && t_reset <= t_byte)
+  {
+    if(!WaitUntil(t_reset, deadline))
+      return RET_TERMINAL_TIME_OUT;
+    return RET_TERMINAL_RESET_LOW;
+  }
+
+  if(t_clock <= t_byte)
+  {
+    if(!WaitUntil(t_clock, deadline))
+      return RET_TERMINAL_TIME_OUT;
+    return RET_TERMINAL_NO_CLOCK;
+  }
+
+  if(!WaitUntil(t_byte, deadline))
+    return RET_TERMINAL_TIME_OUT;
+
+  if(SimLineMissed(LINE_TERMINAL, &sim_terminal_line, b, engine,
+        SimTerminalETU()))
+    sim_stats.overruns++;
+  *r_byte = b->value;
+  t_end = b->start + (sim_time_t)(SIM_TERMINAL_RX_ETUS * SimTerminalETU());
+  SimLinePop(&sim_terminal_line);
+  if(!engine)
+    SimAdvance((sim_time_t)(SIM_TERMINAL_RX_ETUS * SimTerminalETU()));
+  else if(t_end > sim_now)
+    SimAdvance(t_end - sim_now);
+
+  return 0;
+}
+
+/**
+ * Waits (loops) for a number of ETUs based on the terminal clock
+ *
+ * @param nEtus the number of ETUs to wait
+ * @return 0 if success, RET_TERMINAL_TIME_OUT if the clock stopped
+ */
+uint8_t LoopTerminalETU(uint32_t nEtus)
+{
+  sim_time_t t_end, t_clock;
+
+  t_end = sim_now + nEtus * SimTerminalETU();
+  t_clock = SimTerminalClockAt(0);
+  if(t_clock < t_end)
+  {
+    WaitUntil(t_clock, SIM_NEVER);
+    SimAdvance((sim_time_t)MAX_WAIT_TERMINAL_CLK * SIM_POLL_CYCLES);
+    return RET_TERMINAL_TIME_OUT;
+  }
+
+  SimAdvance(t_end - sim_now);
+
+  return 0;
+}
+
+
+/* SCD to ICC functions */
+
+/**
+ * @return non-zero if ICC is inserted, zero otherwise
+ */
+uint8_t IsICCInserted()
+{
+  SimAdvance(SIM_POLL_CYCLES);
+
+  return SimCardPresent();
+}
+
+/**
+ * @return non-zero if the ICC is powered
+ */
+uint8_t IsICCPowered()
+{
+  return icc_powered;
+}
+
+/**
+ * Powers up the card, if possible
+ *
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t PowerUpICC()
+{
+  if(!IsICCInserted())
+    return 1;
+
+  icc_powered = 1;
+
+  return 0;
+}
+
+/**
+ * Powers down the ICC
+ */
+void PowerDownICC()
+{
+  icc_powered = 0;
+  SimCardPower(0);
+}
+
+/**
+ * Waits (loops) for a number of ETUs based on the ICC clock
+ *
+ * @param nEtus the number of ETUs to wait
+ */
+void LoopICCETU(uint8_t nEtus)
+{
+  SyncICCReset();
+  SimAdvance(nEtus * SimICCETU());
+}
+
+/**
+ * Loops for max_cycles or until the I/O line from ICC becomes low
+ *
+ * @param max_cycles the maximum number of polling cycles, 0 to wait
+ * indefinitely
+ * @return 0 if the I/O line went low, non-zero otherwise
+ */
+uint8_t WaitForICCData(uint32_t max_cycles)
+{
+  sim_time_t deadline = SIM_NEVER;
+  SimByte *b;
+
+  SyncICCReset();
+  if(max_cycles != 0)
+    deadline = sim_now + (sim_time_t)max_cycles * SIM_POLL_CYCLES;
+
+  SimLineIdle(LINE_ICC, &sim_card_line, deadline);
+  b = SimLinePeek(&sim_card_line);
+  if(!WaitUntil(b != NULL ? b->start : SIM_NEVER, deadline))
+    return 1;
+
+  return 0;
+}
+
+/**
+ * Loops until the I/O line from ICC becomes low or nEtus elapse
+ *
+ * @param nEtus the maximum number of ICC ETUs, 0 to wait indefinitely
+ * @return 0 if the I/O line went low, non-zero otherwise
+ */
+uint8_t WaitForICCDataETU(uint32_t nEtus)
+{
+  sim_time_t deadline = SIM_NEVER;
+  SimByte *b;
+
+  SyncICCReset();
+  if(nEtus != 0)
+    deadline = sim_now + (sim_time_t)nEtus * SimICCETU();
+
+  SimLineIdle(LINE_ICC, &sim_card_line, deadline);
+  b = SimLinePeek(&sim_card_line);
+  if(!WaitUntil(b != NULL ? b->start : SIM_NEVER, deadline))
+    return 1;
+
+  return 0;
+}
+
+/**
+ * Receives a byte from the ICC without parity checking. The function
+ * returns about 10 ETUs after the start bit. The real device waits
+ * indefinitely for the start bit; here a silent card is reported as a
+ * stall and RET_ERROR is returned.
+ *
+ * @param inverse_convention unused
+ * @param r_byte the received byte
+ * @return 0 if success, RET_ERROR otherwise
+ */
+uint8_t GetByteICCNoParity(uint8_t inverse_convention, uint8_t *r_byte)
+{
+  SimByte *b;
+  sim_time_t t_end;
+  uint8_t engine;
+
+  SyncICCReset();
+  engine = SimLineActive(LINE_ICC);
+  SimLineIdle(LINE_ICC, &sim_card_line, SIM_NEVER);
+  b = SimLinePeek(&sim_card_line);
+  if(b == NULL)
+  {
+    sim_stats.stalls++;
+    SimAdvance(SIM_WWT_ETUS * SimICCETU());
+    return RET_ERROR;
+  }
+
+  if(SimLineMissed(LINE_ICC, &sim_card_line, b, engine, SimICCETU()))
+    sim_stats.overruns++;
+  if(b->start > sim_now)
+    SimAdvance(b->start - sim_now);
+
+  *r_byte = b->value;
+  t_end = b->start + SIM_ICC_RX_ETUS * SimICCETU();
+  SimLinePop(&sim_card_line);
+  if(!engine)
+    SimAdvance(SIM_ICC_RX_ETUS * SimICCETU());
+  else if(t_end > sim_now)
+    SimAdvance(t_end - sim_now);
+
+  return 0;
+}
+
+/**
+ * Receives a byte from the ICC with parity checking
+ *
+ * @param inverse_convention unused
+ * @param r_byte the received byte
+ * @return 0 if success, RET_ERROR otherwise
+ */
+uint8_t GetByteICCParity(uint8_t inverse_convention, uint8_t *r_byte)
+{
+  return GetByteICCNoParity(inverse_convention, r_byte);
+}
+
+/**
+ * Sends a byte to the ICC without parity check. The start bit is
+ * sent one ETU after the call and the function returns after the
+ * stop bit (11 ETUs).
+ *
+ * @param byte the byte to send
+ * @param inverse_convention unused
+ */
+void SendByteICCNoParity(uint8_t byte, uint8_t inverse_convention)
+{
+  SyncICCReset();
+  SimCardReceive(byte, sim_now + SimICCETU());
+  SimAdvance(11 * SimICCETU());
+}
+
+/**
+ * Sends a byte to the ICC with parity check. The virtual card never
+ * signals parity errors.
+ *
+ * @param byte the byte to send
+ * @param inverse_convention unused
+ * @return 0 if success, non-zero otherwise
+ */
+uint8_t SendByteICCParity(uint8_t byte, uint8_t inverse_convention)
+{
+  SendByteICCNoParity(byte, inverse_convention);
+  LoopICCETU(1);
+
+  return 0;
+}
+
+/**
+ * Sets the ETU used by the terminal functions
+ *
+ * @param etu the length of one ETU in terminal clocks
+ */
+void SetTerminalETU(uint16_t etu)
+{
+  terminal_etu = etu;
+  line_armed[LINE_TERMINAL] = SIM_NEVER;
+  if(line_enabled[LINE_TERMINAL])
+    SimLineActive(LINE_TERMINAL);
+}
+
+/**
+ * @return the length of one terminal ETU in terminal clocks
+ */
+uint16_t GetTerminalETU()
+{
+  return terminal_etu;
+}
+
+/**
+ * Sets the ETU used by the ICC functions
+ *
+ * @param etu the length of one ETU in timer 1 clocks
+ */
+void SetICCETU(uint16_t etu)
+{
+  icc_etu = etu;
+  line_armed[LINE_ICC] = SIM_NEVER;
+  if(line_enabled[LINE_ICC])
+    SimLineActive(LINE_ICC);
+}
+
+/**
+ * @return the length of one ICC ETU in timer 1 clocks
+ */
+uint16_t GetICCETU()
+{
+  return icc_etu;
+}
+
+/**
+ * Sets the reset line of the ICC to the desired value
+ *
+ * @param high zero for low, non-zero for high
+ */
+void SetICCResetLine(uint8_t high)
+{
+  if(high)
+    PORTD |= _BV(PD4);
+  else
+    PORTD &= ~(_BV(PD4));
+  SyncICCReset();
+}
+
+/**
+ * Starts the activation sequence for the ICC
+ *
+ * @param warm zero for a cold reset, non-zero for a warm reset
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t ActivateICC(uint8_t warm)
+{
+  StopLine(LINE_ICC);
+  icc_etu = ETU_ICC;
+  PORTD &= ~(_BV(PD4));
+  SyncICCReset();
+
+  if(warm == 0)
+  {
+    SimAdvance((sim_time_t)ICC_VCC_DELAY_US * (F_CPU / 1000000UL));
+    if(PowerUpICC())
+    {
+      DeactivateICC();
+      return 1;
+    }
+    SimAdvance((sim_time_t)ICC_VCC_DELAY_US * (F_CPU / 1000000UL));
+    SimCardPower(1);
+  }
+
+  StartLine(LINE_ICC);
+
+  return 0;
+}
+
+/**
+ * Starts the deactivation sequence for the ICC
+ */
+void DeactivateICC()
+{
+  StopLine(LINE_ICC);
+  PORTD &= ~(_BV(PD4));
+  SyncICCReset();
+  PowerDownICC();
+}
+
+/**
+ * Enables the ICC insert interrupt. The simulator never raises it.
+ */
+void EnableICCInsertInterrupt()
+{
+}
+
+/**
+ * Disables the ICC insert interrupt
+ */
+void DisableICCInsertInterrupt()
+{
+}
+
+
+/* Relay functions */
+
+static uint8_t relay_direction;
+static uint8_t relay_guard;
+static uint16_t relay_size;
+static sim_time_t relay_tx_free;  // time the destination can start a byte
+
+/**
+ * Prepares a relay. The simulated relay does not need the ring, each byte
+ * is delivered to the destination as soon as it is received, with the time
+ * it would be sent by the pipelined transmitter of the SCD.
+ *
+ * @param direction RELAY_TERMINAL_TO_ICC or RELAY_ICC_TO_TERMINAL
+ * @param src_inverse unused, the simulated lines carry logical bytes
+ * @param dst_inverse unused, the simulated lines carry logical bytes
+ * @param dst_guard number of ETUs added to the 12 ETUs between bytes sent
+ * @param bytes unused
+ * @param size size of the ring, used to detect overflows
+ */
+void StartRelay(
+        uint8_t direction,
+        uint8_t src_inverse,
+        uint8_t dst_inverse,
+        uint8_t dst_guard,
+        uint8_t *bytes,
+        uint16_t size)
+{
+  line_relay = 1;
+  line_armed[LINE_TERMINAL] = SIM_NEVER;
+  line_armed[LINE_ICC] = SIM_NEVER;
+  relay_direction = direction;
+  relay_guard = dst_guard;
+  relay_size = size;
+  relay_tx_free = sim_now;
+}
+
+/**
+ * Receives the next byte of the relay and schedules it on the destination
+ *
+ * @param r_byte contains the byte read on return
+ * @param max_wait the maximum number of cycles to wait for the start bit.
+ * Give 0 to wait indefinitely.
+ * @return zero if the byte was received and queued, non-zero otherwise
+ */
+uint8_t RelayNextByte(uint8_t *r_byte, uint32_t max_wait)
+{
+  sim_time_t etu, period, start;
+  uint8_t result;
+
+  *r_byte = 0;
+  if(relay_direction == RELAY_TERMINAL_TO_ICC)
+  {
+    etu = SimICCETU();
+    result = GetByteTerminalNoParity(0, r_byte, max_wait);
+    if(result != 0)
+      return result;
+  }
+  else
+  {
+    etu = SimTerminalETU();
+    SyncICCReset();
+    if(SimLinePeek(&sim_card_line) == NULL)
+    {
+      if(max_wait == 0)
+        sim_stats.stalls++;
+      else
+        SimAdvance((sim_time_t)max_wait * SIM_POLL_CYCLES);
+      return RET_ICC_TIME_OUT;
+    }
+    GetByteICCNoParity(0, r_byte);
+  }
+
+  // bytes waiting in the ring, including the one being sent
+  period = (12 + relay_guard) * etu;
+  if(relay_tx_free > sim_now &&
+      (relay_tx_free - sim_now + period - 1) / period >= relay_size)
+    return RET_ERR_MEMORY;
+
+  start = (relay_tx_free > sim_now ? relay_tx_free : sim_now) + etu;
+  relay_tx_free = start - etu + period;
+
+  if(relay_direction == RELAY_TERMINAL_TO_ICC)
+  {
+    SimCardReceive(*r_byte, start);
+  }
+  else
+  {
+    if(SimTerminalClockAt(0) <= start)
+      return RET_TERMINAL_NO_CLOCK;
+    SimTerminalReceive(*r_byte, start);
+  }
+
+  return 0;
+}
+
+/**
+ * Waits until the last byte of the relay has been sent
+ *
+ * @return zero
+ */
+uint8_t EndRelay()
+{
+  if(relay_tx_free > sim_now)
+    SimAdvance(relay_tx_free - sim_now);
+  line_relay = 0;
+
+  return 0;
+}
+
+
+/* Interrupt-driven line functions */
+
+/**
+ * Starts the byte engine of a line
+ *
+ * @param line LINE_TERMINAL or LINE_ICC
+ * @return zero if the engine is running, RET_ERROR otherwise
+ */
+uint8_t StartLine(uint8_t line)
+{
+  line_enabled[line] = 1;
+  line_armed[line] = SIM_NEVER;
+
+  return SimLineActive(line) ? 0 : RET_ERROR;
+}
+
+/**
+ * Stops the byte engine of a line
+ *
+ * @param line LINE_TERMINAL or LINE_ICC
+ */
+void StopLine(uint8_t line)
+{
+  line_enabled[line] = 0;
+  line_armed[line] = SIM_NEVER;
+}
+
+/**
+ * @param line LINE_TERMINAL or LINE_ICC
+ * @return non-zero if the byte engine of the line is running
+ */
+uint8_t IsLineRunning(uint8_t line)
+{
+  return line_armed[line] != SIM_NEVER;
+}
+
+/**
+ * @param line LINE_TERMINAL or LINE_ICC
+ * @return the number of bytes received by the engine of a line and not
+ * read yet
+ */
+uint8_t LineBytesReceived(uint8_t line)
+{
+  SimLine *sline;
+  sim_time_t etu;
+  uint16_t i;
+  uint8_t n = 0;
+
+  if(line_armed[line] == SIM_NEVER)
+    return 0;
+
+  sline = (line == LINE_ICC) ? &sim_card_line : &sim_terminal_line;
+  etu = (line == LINE_ICC) ? SimICCETU() : SimTerminalETU();
+  for(i = sline->head; i != sline->tail && n < LINE_QUEUE_SIZE - 1;
+      i = (i + 1) % SIM_MAX_LINE)
+  {
+    if(sline->bytes[i].start + 10 * etu > sim_now)
+      break;
+    n++;
+  }
+
+  return n;
+}
+
+/**
+ * Sets the function called while the byte functions wait for a line
+ *
+ * @param hook the function to call, or NULL
+ */
+void SetLineIdleHook(void (*hook)(void))
+{
+  line_hook = hook;
+}
@@ -0,0 +1,168 @@
+/**
+ * \file
+ * \brief	sim_heap.c source file
+ *
+ * Heap accounting for the host simulator. The SCD sources are compiled with
+ * malloc, calloc, realloc and free redirected to the functions below, which
+ * keep track of the heap used by the firmware as it would be on the AVR.
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+
+/// Bytes used by avr-libc malloc to track each chunk
+#define SIM_HEAP_CHUNK_OVERHEAD 2
+
+/// Header kept in front of every block handed to the SCD code
+typedef union {
+  size_t size;
+  long double align;
+} SimHeapBlock;
+
+// static vars
+static uint32_t heap_used, heap_peak, heap_blocks, heap_allocs;
+
+
+/**
+ * Accounts for a new block of the given size
+ */
+static void HeapAdd(size_t size)
+{
+  heap_used += size + SIM_HEAP_CHUNK_OVERHEAD;
+  heap_blocks++;
+  heap_allocs++;
+  if(heap_used > heap_peak)
+    heap_peak = heap_used;
+}
+
+/**
+ * Accounts for a block of the given size being released
+ */
+static void HeapRemove(size_t size)
+{
+  heap_used -= size + SIM_HEAP_CHUNK_OVERHEAD;
+  heap_blocks--;
+}
+
+void* SimMalloc(size_t size)
+{
+  SimHeapBlock *block;
+
+  block = (SimHeapBlock*)malloc(sizeof(SimHeapBlock) + size);
+  if(block == NULL)
+    return NULL;
+
+  block->size = size;
+  HeapAdd(size);
+
+  return block + 1;
+}
+
+void* SimCalloc(size_t n, size_t size)
+{
+  void *p;
+
+  p = SimMalloc(n * size);
+  if(p != NULL)
+    memset(p, 0, n * size);
+
+  return p;
+}
+
+void* SimRealloc(void *p, size_t size)
+{
+  SimHeapBlock *block, *tmp;
+
+  if(p == NULL)
+    return SimMalloc(size);
+
+  block = (SimHeapBlock*)p - 1;
+  tmp = (SimHeapBlock*)realloc(block, sizeof(SimHeapBlock) + size);
+  if(tmp == NULL)
+    return NULL;
+
+  HeapRemove(tmp->size);
+  tmp->size = size;
+  HeapAdd(size);
+
+  return tmp + 1;
+}
+
+void SimFree(void *p)
+{
+  SimHeapBlock *block;
+
+  if(p == NULL)
+    return;
+
+  block = (SimHeapBlock*)p - 1;
+  HeapRemove(block->size);
+  free(block);
+}
+
+/**
+ * Restarts the peak heap measurement from the current usage
+ */
+void SimHeapReset(void)
+{
+  heap_peak = heap_used;
+}
+
+/**
+ * @return the heap currently used by the SCD code, in bytes
+ */
+uint32_t SimHeapUsed(void)
+{
+  return heap_used;
+}
+
+/**
+ * @return the maximum heap used since the last SimHeapReset, in bytes
+ */
+uint32_t SimHeapPeak(void)
+{
+  return heap_peak;
+}
+
+/**
+ * @return the number of blocks currently allocated by the SCD code
+ */
+uint32_t SimHeapBlocks(void)
+{
+  return heap_blocks;
+}
+
+/**
+ * @return the number of blocks allocated or resized by the SCD code
+ * since the simulator started
+ */
+uint32_t SimHeapAllocs(void)
+{
+  return heap_allocs;
+}
@@ -0,0 +1,638 @@
+/**
+ * \file
+ * \brief	sim_io.c source file
+ *
+ * Host implementation of the SCD peripherals used by the portable
+ * sources: I/O registers, LEDs, buttons, LCD, USART, EEPROM, delays and
+ * the USB virtual serial port.
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <avr/eeprom.h>
+#include <avr/io.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util/crc16.h>
+#include <util/delay.h>
+
+#include "scd_io.h"
+#include "sim.h"
+#include "VirtualSerial.h"
+
+/// CPU cycles to program one EEPROM byte (3.4 ms)
+#define SIM_EEPROM_WRITE_CYCLES ((sim_time_t)F_CPU * 34 / 10000)
+
+/// Size of the bulk endpoints of the virtual serial port
+#define SIM_USB_PACKET_SIZE 64
+
+/// CPU cycles to transfer one USB packet (one full speed frame)
+#define SIM_USB_PACKET_CYCLES ((sim_time_t)F_CPU / 1000)
+
+/// Maximum number of queued host lines
+#define SIM_HOST_LINES 32
+
+/* I/O registers */
+volatile uint8_t SREG;
+volatile uint8_t MCUSR;
+volatile uint8_t PORTB, PINB, DDRB;
+volatile uint8_t PORTC, PINC, DDRC;
+volatile uint8_t PORTD, PIND, DDRD;
+volatile uint8_t PORTE, PINE, DDRE;
+volatile uint8_t PORTF, PINF, DDRF;
+volatile uint8_t TCCR3A, TCCR3B, TCCR3C, TIMSK3, TIFR3;
+volatile uint16_t OCR3A, TCNT3;
+
+uint8_t sim_eeprom[SIM_EEPROM_SIZE];
+uint32_t sim_eeprom_reads;
+uint32_t sim_eeprom_writes;
+uint32_t sim_eeprom_reset_at;
+jmp_buf sim_reset_jmp;
+uint8_t sim_button = BUTTON_A;
+
+// static vars
+static uint8_t lcd_state;
+static char *host_lines[SIM_HOST_LINES];
+static uint16_t host_lens[SIM_HOST_LINES];
+static uint8_t host_head, host_count;
+static char host_line[HOST_RX_SIZE];
+static char *host_output;
+static size_t host_output_len;
+static uint16_t host_pending;           // bytes of the unsent packet
+
+
+/* Delays */
+
+void _delay_ms(double ms)
+{
+  SimAdvance((sim_time_t)(ms * (F_CPU / 1000)));
+}
+
+void _delay_us(double us)
+{
+  SimAdvance((sim_time_t)(us * (F_CPU / 1000000)));
+}
+
+
+/* Led functions */
+
+void Led1On() { PORTE |= _BV(PE7); }
+void Led2On() { PORTE |= _BV(PE6); }
+void Led3On() { PORTE |= _BV(PE5); }
+void Led4On() { PORTE |= _BV(PE4); }
+void Led1Off() { PORTE &= ~(_BV(PE7)); }
+void Led2Off() { PORTE &= ~(_BV(PE6)); }
+void Led3Off() { PORTE &= ~(_BV(PE5)); }
+void Led4Off() { PORTE &= ~(_BV(PE4)); }
+
+// Other signals
+
+void T_C4On() { PORTB |= _BV(PB4); }
+void T_C8On() { PORTB |= _BV(PB5); }
+void T_C4Off() { PORTB &= ~(_BV(PB4)); }
+void T_C8Off() { PORTB &= ~(_BV(PB5)); }
+void JTAG_P1_High() { PORTF |= _BV(PF4); }
+void JTAG_P1_Low() { PORTF &= ~(_BV(PF4)); }
+void JTAG_P3_High() { PORTF |= _BV(PF6); }
+void JTAG_P3_Low() { PORTF &= ~(_BV(PF6)); }
+
+
+/* Button functions, returning the state set in sim_button. As the pins
+ * of the device, GetButtonX is zero while the button is pressed. */
+
+uint8_t GetButtonA() { return (sim_button & BUTTON_A) == 0; }
+uint8_t GetButtonB() { return (sim_button & BUTTON_B) == 0; }
+uint8_t GetButtonC() { return (sim_button & BUTTON_C) == 0; }
+uint8_t GetButtonD() { return (sim_button & BUTTON_D) == 0; }
+
+uint8_t GetButton()
+{
+  _delay_ms(10);
+
+  return sim_button;
+}
+
+
+/* LCD functions. The text goes to stderr, as with the real device. */
+
+uint8_t GetLCDState() { return lcd_state; }
+void SetLCDState(uint8_t state) { lcd_state = state; }
+void InitLCD() { lcd_state = 1; }
+uint8_t CheckLCD() { return 0; }
+void LCDOff() { lcd_state = 0; }
+void LCDOn() { lcd_state = 1; }
+
+void WriteStringLCD(char *string, uint8_t len)
+{
+  fwrite(string, 1, len, stderr);
+}
+
+int LcdPutchar(char c, FILE *unused)
+{
+  return fputc(c, stderr);
+}
+
+
+/* EEPROM functions */
+
+uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+  sim_eeprom_reads++;
+  return sim_eeprom[(uintptr_t)addr % SIM_EEPROM_SIZE];
+}
+
+uint16_t eeprom_read_word(const uint16_t *addr)
+{
+  uint16_t value;
+
+  eeprom_read_block(&value, addr, sizeof(value));
+  return value;
+}
+
+uint32_t eeprom_read_dword(const uint32_t *addr)
+{
+  uint32_t value;
+
+  eeprom_read_block(&value, addr, sizeof(value));
+  return value;
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+  size_t i;
+
+  for(i = 0; i < n; i++)
+    ((uint8_t*)dst)[i] = eeprom_read_byte((const uint8_t*)src + i);
+}
+
+void eeprom_write_byte(uint8_t *addr, uint8_t value)
+{
+  // a reset lets the write in progress finish, so it stops before one
+  if(sim_eeprom_reset_at != 0 && sim_eeprom_writes + 1 == sim_eeprom_reset_at)
+  {
+    // the SCD restarts through the watchdog after INT0_vect or WDT_vect
+    sim_eeprom_reset_at = 0;
+    MCUSR |= _BV(WDRF);
+    longjmp(sim_reset_jmp, 1);
+  }
+  sim_eeprom_writes++;
+  sim_eeprom[(uintptr_t)addr % SIM_EEPROM_SIZE] = value;
+  SimAdvance(SIM_EEPROM_WRITE_CYCLES);
+}
+
+void eeprom_write_word(uint16_t *addr, uint16_t value)
+{
+  eeprom_write_block(&value, addr, sizeof(value));
+}
+
+void eeprom_write_dword(uint32_t *addr, uint32_t value)
+{
+  eeprom_write_block(&value, addr, sizeof(value));
+}
+
+void eeprom_write_block(const void *src, void *dst, size_t n)
+{
+  size_t i;
+
+  for(i = 0; i < n; i++)
+    eeprom_write_byte((uint8_t*)dst + i, ((const uint8_t*)src)[i]);
+}
+
+void eeprom_update_byte(uint8_t *addr, uint8_t value)
+{
+  if(eeprom_read_byte(addr) != value)
+    eeprom_write_byte(addr, value);
+}
+
+void eeprom_update_word(uint16_t *addr, uint16_t value)
+{
+  eeprom_update_block(&value, addr, sizeof(value));
+}
+
+void eeprom_update_dword(uint32_t *addr, uint32_t value)
+{
+  eeprom_update_block(&value, addr, sizeof(value));
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n)
+{
+  size_t i;
+
+  for(i = 0; i < n; i++)
+    eeprom_update_byte((uint8_t*)dst + i, ((const uint8_t*)src)[i]);
+}
+
+void WriteSingleByteEEPROM(uint16_t addr, uint8_t data)
+{
+  eeprom_write_byte((uint8_t*)(uintptr_t)addr, data);
+}
+
+uint8_t ReadSingleByteEEPROM(uint16_t addr)
+{
+  return eeprom_read_byte((const uint8_t*)(uintptr_t)addr);
+}
+
+void WriteBytesEEPROM(uint16_t addr, uint8_t *data, uint16_t len)
+{
+  if(data == NULL || len > 4000) return;
+
+  eeprom_write_block(data, (void*)(uintptr_t)addr, len);
+}
+
+uint8_t* ReadBytesEEPROM(uint16_t addr, uint16_t len)
+{
+  uint8_t *data;
+
+  if(len > 4000) return NULL;
+  data = (uint8_t*)SimMalloc(len*sizeof(uint8_t));
+  if(data == NULL) return NULL;
+
+  eeprom_read_block(data, (const void*)(uintptr_t)addr, len);
+
+  return data;
+}
+
+
+/* USART functions. There is nothing connected to the serial port. */
+
+void InitUSART(uint16_t baudUBRR) { }
+void DisableUSART() { }
+void SendCharUSART(char data) { }
+char GetCharUSART(void) { return 0; }
+void FlushUSART(void) { }
+char* GetLineUSART() { return NULL; }
+void SendLineUSART(const char *data) { }
+
+
+/* Virtual serial port */
+
+void SetupUSBHardware(void)
+{
+}
+
+void StopUSBHardware(void)
+{
+}
+
+void CDC_Task(void)
+{
+}
+
+/**
+ * Queues a line to be returned by GetHostLine
+ *
+ * @param line the string sent by the host, without CR or LF
+ */
+void SimHostWrite(const char *line)
+{
+  if(host_count == SIM_HOST_LINES)
+    return;
+
+  host_lines[(host_head + host_count) % SIM_HOST_LINES] = strdup(line);
+  host_lens[(host_head + host_count) % SIM_HOST_LINES] = strlen(line);
+  host_count++;
+}
+
+/**
+ * Computes the CRC of a frame, in the format given in GetHostFrame
+ *
+ * @param type the type of the frame
+ * @param data the payload
+ * @param len the length of the payload
+ * @return the CRC-16 of the frame
+ */
+static uint16_t FrameCRC(uint8_t type, const uint8_t *data, uint16_t len)
+{
+  uint16_t crc, i;
+
+  crc = _crc_xmodem_update(0, type);
+  crc = _crc_xmodem_update(crc, len & 0xFF);
+  crc = _crc_xmodem_update(crc, (len >> 8) & 0xFF);
+  for(i = 0; i < len; i++)
+    crc = _crc_xmodem_update(crc, data[i]);
+
+  return crc;
+}
+
+/**
+ * Queues a binary frame to be returned by GetHostFrame
+ *
+ * @param type the type of the frame
+ * @param data the payload
+ * @param len the length of the payload
+ */
+void SimHostWriteFrame(uint8_t type, const uint8_t *data, uint16_t len)
+{
+  uint8_t *frame;
+  uint16_t crc;
+
+  if(host_count == SIM_HOST_LINES)
+    return;
+
+  frame = (uint8_t*)malloc(len + 5);
+  if(frame == NULL)
+    return;
+  crc = FrameCRC(type, data, len);
+  frame[0] = type;
+  frame[1] = len & 0xFF;
+  frame[2] = (len >> 8) & 0xFF;
+  memcpy(frame + 3, data, len);
+  frame[len + 3] = crc & 0xFF;
+  frame[len + 4] = (crc >> 8) & 0xFF;
+
+  host_lines[(host_head + host_count) % SIM_HOST_LINES] = (char*)frame;
+  host_lens[(host_head + host_count) % SIM_HOST_LINES] = len + 5;
+  host_count++;
+}
+
+/**
+ * Returns the next frame in the data sent by the SCD to the host
+ *
+ * @param offset the position of the frame in the output, updated to the
+ * position of the next frame
+ * @param type stores the type of the frame
+ * @param len stores the length of the payload
+ * @return the payload, or NULL if there is no valid frame at offset
+ */
+const uint8_t* SimHostReadFrame(size_t *offset, uint8_t *type, uint16_t *len)
+{
+  const uint8_t *frame;
+  uint16_t crc;
+
+  if(*offset + 5 > host_output_len)
+    return NULL;
+
+  frame = (const uint8_t*)host_output + *offset;
+  *type = frame[0];
+  *len = frame[1] | (frame[2] << 8);
+  if(*offset + *len + 5 > host_output_len)
+    return NULL;
+  crc = FrameCRC(*type, frame + 3, *len);
+  if(frame[*len + 3] != (crc & 0xFF) || frame[*len + 4] != (crc >> 8))
+    return NULL;
+  *offset += *len + 5;
+
+  return frame + 3;
+}
+
+/**
+ * @return all the data sent by the SCD to the host since the last reset
+ * of the simulator, as a NUL terminated string
+ */
+const char* SimHostOutput(void)
+{
+  return host_output != NULL ? host_output : "";
+}
+
+/**
+ * @return the number of bytes sent by the SCD to the host since the last
+ * reset of the simulator, including binary frames
+ */
+size_t SimHostOutputLength(void)
+{
+  return host_output_len;
+}
+
+/**
+ * Appends data sent by the SCD to the host output
+ *
+ * @param data the data sent
+ * @param len the length of the data
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t AppendHostOutput(const void *data, size_t len)
+{
+  char *tmp;
+
+  tmp = (char*)realloc(host_output, host_output_len + len + 1);
+  if(tmp == NULL)
+    return 1;
+  host_output = tmp;
+  memcpy(host_output + host_output_len, data, len);
+  host_output_len += len;
+  host_output[host_output_len] = 0;
+
+  return 0;
+}
+
+/**
+ * Appends data sent by the SCD to the host output, taking one USB frame
+ * per packet
+ *
+ * @param data the data sent
+ * @param len the length of the data
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t HostOutput(const void *data, size_t len)
+{
+  if(AppendHostOutput(data, len))
+    return 1;
+
+  len += host_pending;
+  host_pending = 0;
+  SimAdvance((len / SIM_USB_PACKET_SIZE + 1) * SIM_USB_PACKET_CYCLES);
+
+  return 0;
+}
+
+/**
+ * Returns the next line queued with SimHostWrite. The real device blocks
+ * until the host sends a line; here NULL is returned when there is none.
+ * As on the device, the line is returned in a static receive buffer and
+ * lines that do not fit are dropped.
+ *
+ * @param len stores the length of the line
+ * @return the NUL terminated line or NULL, valid until the next call
+ */
+const char* GetHostLine(uint16_t *len)
+{
+  char *line;
+  uint16_t n;
+
+  if(host_count == 0)
+    return NULL;
+
+  line = host_lines[host_head];
+  n = host_lens[host_head];
+  host_head = (host_head + 1) % SIM_HOST_LINES;
+  host_count--;
+  SimAdvance((n / SIM_USB_PACKET_SIZE + 1) * SIM_USB_PACKET_CYCLES);
+
+  if(n >= HOST_RX_SIZE)
+  {
+    free(line);
+    return NULL;
+  }
+  memcpy(host_line, line, n + 1);
+  *len = n;
+  free(line);
+
+  return host_line;
+}
+
+/**
+ * Returns the next line queued with SimHostWrite. This is the same as
+ * GetHostLine, which does not block in the simulator either.
+ *
+ * @param len stores the length of the line
+ * @return the NUL terminated line or NULL, valid until the next call
+ */
+const char* PollHostLine(uint16_t *len)
+{
+  return GetHostLine(len);
+}
+
+/**
+ * Returns the next frame queued with SimHostWriteFrame. As GetHostLine,
+ * this returns an error when there is nothing queued.
+ *
+ * @param type stores the type of the frame
+ * @param data the buffer for the payload
+ * @param len stores the length of the payload
+ * @param maxlen the size of the data buffer
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t GetHostFrame(uint8_t *type, uint8_t *data, uint16_t *len,
+    uint16_t maxlen)
+{
+  uint8_t *frame;
+  uint16_t n, crc;
+
+  if(host_count == 0)
+    return 1;
+
+  frame = (uint8_t*)host_lines[host_head];
+  n = host_lens[host_head];
+  host_head = (host_head + 1) % SIM_HOST_LINES;
+  host_count--;
+  SimAdvance((n / SIM_USB_PACKET_SIZE + 1) * SIM_USB_PACKET_CYCLES);
+
+  if(n < 5)
+    goto enderror;
+  *type = frame[0];
+  *len = frame[1] | (frame[2] << 8);
+  crc = FrameCRC(*type, frame + 3, *len);
+  if(*len + 5 != n || *len > maxlen ||
+      frame[n - 2] != (crc & 0xFF) || frame[n - 1] != (crc >> 8))
+    goto enderror;
+  memcpy(data, frame + 3, *len);
+  free(frame);
+
+  return 0;
+
+enderror:
+  free(frame);
+  return 1;
+}
+
+/**
+ * Sends a string to the host, taking one USB frame per packet
+ *
+ * @param data a NUL terminated string
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t SendHostData(const char *data)
+{
+  if(data == NULL)
+    return 1;
+
+  return HostOutput(data, strlen(data));
+}
+
+/**
+ * Sends raw bytes to the host, taking one USB frame for each full packet
+ * and, if flush is set, one for the last packet
+ *
+ * @param data the bytes to send
+ * @param len the number of bytes
+ * @param flush set to send the last packet
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t SendHostBytes(const uint8_t *data, uint16_t len, uint8_t flush)
+{
+  if(data == NULL)
+    return 1;
+  if(flush)
+    return HostOutput(data, len);
+  if(AppendHostOutput(data, len))
+    return 1;
+
+  host_pending += len;
+  SimAdvance((host_pending / SIM_USB_PACKET_SIZE) * SIM_USB_PACKET_CYCLES);
+  host_pending = host_pending % SIM_USB_PACKET_SIZE;
+
+  return 0;
+}
+
+/**
+ * Sends a binary frame to the host, in the format given in GetHostFrame
+ *
+ * @param type the type of the frame
+ * @param data the payload
+ * @param len the length of the payload
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t SendHostFrame(uint8_t type, const uint8_t *data, uint16_t len)
+{
+  uint8_t *frame;
+  uint16_t crc;
+  uint8_t result;
+
+  frame = (uint8_t*)malloc(len + 5);
+  if(frame == NULL)
+    return 1;
+  crc = FrameCRC(type, data, len);
+  frame[0] = type;
+  frame[1] = len & 0xFF;
+  frame[2] = (len >> 8) & 0xFF;
+  if(len > 0)
+    memcpy(frame + 3, data, len);
+  frame[len + 3] = crc & 0xFF;
+  frame[len + 4] = (crc >> 8) & 0xFF;
+
+  result = HostOutput(frame, len + 5);
+  free(frame);
+
+  return result;
+}
+
+/**
+ * Clears the data sent to the host and the queued host lines
+ */
+void SimHostReset(void)
+{
+  while(host_count > 0)
+  {
+    free(host_lines[host_head]);
+    host_head = (host_head + 1) % SIM_HOST_LINES;
+    host_count--;
+  }
+
+  free(host_output);
+  host_output = NULL;
+  host_output_len = 0;
+  host_pending = 0;
+}
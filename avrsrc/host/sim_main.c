@@ -0,0 +1,2561 @@
+/**
+ * \file
+ * \brief	sim_main.c source file
+ *
+ * Entry point of the host simulator. It runs the SCD applications against
+ * the virtual card and terminal and reports the timing of the exchanges,
+ * returning non-zero if any scenario fails its checks.
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/eeprom.h>
+
+#include "apps.h"
+#include "counter.h"
+// scd.h declares the firmware main(void); keep it out of the way
+#define main scd_main
+#include "scd.h"
+#undef main
+#include "scd_logger.h"
+#include "scd_tasks.h"
+#include "scd_values.h"
+#include "serial.h"
+#include "sim.h"
+#include "terminal.h"
+#include "utils.h"
+
+/* Globals normally defined in scd.c */
+log_struct_t scd_logger;
+uint8_t warmResetByte;
+uint8_t lcdAvailable = 1;
+uint8_t nCounter;
+uint8_t selected;
+uint8_t bootkey;
+uint16_t revision = 0x24;
+
+/// A simulation scenario
+typedef struct {
+  const char *name;
+  uint8_t (*run)(const char *name);
+} SimScenario;
+
+/// Timing of one exchange, as reported by the benchmark
+typedef struct {
+  double terminal_us;   // time seen by the terminal, if any
+  double card_us;       // time the card spent on the exchange
+  double added_us;      // time added by the SCD
+  double added_etus;    // time added by the SCD, in ETUs
+} SimTiming;
+
+// static vars
+static uint8_t verbose;
+static FILE *bench;
+static uint8_t nbench;
+static uint32_t hook_calls;
+static uint8_t probe_sent;
+static uint8_t sim_encoded[2 * LOG_BUFFER_SIZE];  // see WriteEncoded
+static uint16_t sim_nencoded;
+static uint32_t sim_encode_calls;       // see __wrap_LogEncode
+
+/// Longest time allowed between two runs of a task while forwarding.
+/// The tasks do not run while a response is sent to the terminal, and
+/// 256 bytes and the status take about 320 ms at the default rate.
+#define TASK_MAX_GAP_MS 350
+
+/// Fewest GET RESPONSE commands expected in the terminal-chunks scenario,
+/// the INTERNAL AUTHENTICATE response alone takes 17 chunks of 8 bytes
+#define TERMINAL_MIN_CHUNKS 17
+
+/// Position of the Authorized Amount in the CDOL1 of the virtual card
+#define TLV_CDOL1_AMOUNT 1
+
+/// Record with a CDOL1 that has the Authorized Amount after other objects
+#define TLV_CDOL1_LATE "700F8C0D9A039C019F1A029F02069F0306"
+#define TLV_CDOL1_LATE_AMOUNT 8
+
+
+/**
+ * Parses a hex string into bytes
+ *
+ * @param hex the string, ignoring any spaces
+ * @param out the buffer for the bytes
+ * @param max the size of the buffer
+ * @return the number of bytes written
+ */
+uint16_t SimParseHex(const char *hex, uint8_t *out, uint16_t max)
+{
+  uint16_t n = 0;
+  unsigned int value;
+
+  while(*hex && n < max)
+  {
+    if(*hex == ' ')
+    {
+      hex++;
+      continue;
+    }
+    if(sscanf(hex, "%2x", &value) != 1)
+      break;
+    out[n++] = (uint8_t)value;
+    hex += 2;
+  }
+
+  return n;
+}
+
+/**
+ * Restarts the SCD after a reset as main and InitSCD do: the reset
+ * flags are read and cleared, then the log committed before the reset
+ * is copied to EEPROM unless SRAM was lost with power
+ *
+ * @return the reset flags of this reset
+ */
+static uint8_t BootSCD(void)
+{
+  uint8_t flags;
+
+  flags = MCUSR;
+  MCUSR = 0;
+  RecoverLogEEPROM(&scd_logger, flags);
+
+  return flags;
+}
+
+/**
+ * Starts a scenario from a freshly reset device and EEPROM
+ */
+static void Prepare(void)
+{
+  memset(sim_eeprom, 0xFF, sizeof(sim_eeprom));
+  ResetEEPROM();
+  SimReset();
+  BootSCD();
+  ResetLogger(&scd_logger);
+  scd_logger.mask = eeprom_read_byte((uint8_t*)EEPROM_LOG_MASK);
+  SimHeapReset();
+  nCounter = 0;
+}
+
+/**
+ * Reassembles the EEPROM log ring: the entries of its records, from the
+ * oldest to the newest, skipping the records whose log was not copied
+ *
+ * @param out the buffer for the entries, EEPROM_TLOG_SIZE bytes, or NULL
+ * @return the number of log bytes written to EEPROM
+ */
+static uint16_t ReadLogEEPROM(uint8_t *out)
+{
+  log_ring_t ring;
+  uint8_t header[EEPROM_LOG_RECORD_HEADER];
+  uint16_t addr, len, size = 0;
+
+  ReadLogRingState(&ring);
+  for(addr = ring.tail; addr != ring.head; )
+  {
+    addr = ReadLogRing(addr, header, sizeof(header));
+    len = header[2] | (header[3] << 8);
+    if(len & EEPROM_LOG_RECORD_PENDING)
+    {
+      addr = LogRingAddress(addr, len & ~EEPROM_LOG_RECORD_PENDING);
+      continue;
+    }
+    if(size + len > EEPROM_TLOG_SIZE)
+      break;
+    if(out != NULL)
+      ReadLogRing(addr, out + size, len);
+    addr = LogRingAddress(addr, len);
+    size += len;
+  }
+
+  return size;
+}
+
+/**
+ * @return the number of log bytes written to EEPROM
+ */
+static uint16_t LogSizeEEPROM(void)
+{
+  return ReadLogEEPROM(NULL);
+}
+
+/**
+ * Reads a varint of a log, see LogTime
+ *
+ * @param log the log bytes
+ * @param pos the position of the varint, moved after it
+ * @param len the number of log bytes
+ * @return the value of the varint
+ */
+static uint32_t GetVarint(const uint8_t *log, uint16_t *pos, uint16_t len)
+{
+  uint32_t value = 0;
+  uint8_t shift = 0;
+
+  while(*pos < len && shift < 35)
+  {
+    value |= (uint32_t)(log[*pos] & 0x7F) << shift;
+    shift += 7;
+    if((log[(*pos)++] & 0x80) == 0)
+      break;
+  }
+
+  return value;
+}
+
+/**
+ * Ends the last entry of a chain decoded by DecodeLog, which becomes a
+ * 1-byte entry if it has only one byte
+ *
+ * @param out the decoded entries
+ * @param o the position after the last entry
+ * @param entry the position of the last entry, or LOG_NO_ENTRY
+ * @return the position after the last entry
+ */
+static uint16_t DecodeChainEnd(uint8_t *out, uint16_t o, uint16_t entry)
+{
+  if(entry != LOG_NO_ENTRY && out[entry + 1] == 1)
+  {
+    out[entry] &= 0xFC;
+    out[entry + 1] = out[entry + 2];
+    o--;
+  }
+
+  return o;
+}
+
+/**
+ * Adds a byte of a chain to the entries decoded by DecodeLog, as part of
+ * the last entry if it has the same type
+ *
+ * @param out the decoded entries
+ * @param o the position after the last entry
+ * @param entry the position of the last entry, or LOG_NO_ENTRY
+ * @param type the type of the byte
+ * @param byte the byte
+ * @return the position after the last entry
+ */
+static uint16_t DecodeChainByte(uint8_t *out, uint16_t o, uint16_t *entry,
+    uint8_t type, uint8_t byte)
+{
+  if(*entry == LOG_NO_ENTRY || (out[*entry] & 0xFC) != type)
+  {
+    o = DecodeChainEnd(out, o, *entry);
+    *entry = o;
+    out[o++] = type | LOG_RUN;
+    out[o++] = 0;
+  }
+  out[*entry + 1]++;
+  out[o++] = byte;
+
+  return o;
+}
+
+/**
+ * Decodes a log read from EEPROM (version 3, see SCD_LOG_BYTE) to the
+ * version 2 entries it was encoded from by LogEncode
+ *
+ * @param in the encoded log
+ * @param len the number of bytes of the encoded log
+ * @param out the buffer for the entries
+ * @param max the size of out
+ * @return the number of bytes of the entries, which stop at the first
+ * invalid token
+ */
+static uint16_t DecodeLog(const uint8_t *in, uint16_t len, uint8_t *out,
+    uint16_t max)
+{
+  static uint8_t chain[2 * EEPROM_TLOG_SIZE];
+  uint32_t recent[LOG_CHAIN_RECENT], delta;
+  uint16_t i = 0, o = 0, n, k, nchain, entry;
+  uint8_t header, token, type, nrecent;
+
+  while(i < len && o + 8 <= max)
+  {
+    header = in[i++];
+    if((header & 0x03) != LOG_CHAIN ||
+        (header & 0xFC) < LOG_BYTE_TO_TERMINAL ||
+        (header & 0xFC) > LOG_BYTE_FROM_ICC)
+    {
+      // the other entries are kept as they are
+      if((header & 0x03) == LOG_RUN)
+        n = (i < len) ? in[i] + 1 : 0;
+      else if((header & 0x03) == 0 && LogTypeMask(header) == LOG_MASK_TIME)
+        for(n = 0; i + n < len && (in[i + n++] & 0x80); );
+      else
+        n = (header & 0x03) + 1;
+      if(n > len - i)
+        n = len - i;
+      if(o + 1 + n > max)
+        break;
+      out[o++] = header;
+      memcpy(out + o, in + i, n);
+      o += n;
+      i += n;
+      continue;
+    }
+
+    nchain = 0;
+    nrecent = 0;
+    entry = LOG_NO_ENTRY;
+    while(i < len && o + 8 <= max && (token = in[i++]) != LOG_CHAIN_END)
+    {
+      if(token < LOG_CHAIN_FINE && token != LOG_CHAIN_TIME)
+      {
+        type = header & 0xFC;
+        if(token & LOG_CHAIN_PAIRED)
+          type ^= 0x04;
+        for(n = token & 0x3F; n > 0 && i < len && o + 8 <= max; n--)
+        {
+          chain[nchain++] = in[i];
+          o = DecodeChainByte(out, o, &entry, type, in[i++]);
+        }
+        continue;
+      }
+
+      if(token >= LOG_CHAIN_COPY && token < LOG_CHAIN_TIME_SHORT)
+      {
+        type = header & 0xFC;
+        if(token & LOG_CHAIN_COPY_PAIRED)
+          type ^= 0x04;
+        k = (i < len) ? in[i++] + 1 : 0xFFFF;
+        if(k > nchain)
+          return DecodeChainEnd(out, o, entry);
+        n = (token & 0x0F) + LOG_CHAIN_MIN_COPY;
+        for(; n > 0 && o + 8 <= max; n--, nchain++)
+        {
+          chain[nchain] = chain[nchain - k];
+          o = DecodeChainByte(out, o, &entry, type, chain[nchain]);
+        }
+        continue;
+      }
+
+      // the time differences are entries of their own
+      o = DecodeChainEnd(out, o, entry);
+      entry = LOG_NO_ENTRY;
+      type = LOG_TIME_FINE & 0xFC;
+      if(token >= LOG_CHAIN_TIME_SHORT)
+      {
+        type = LOG_TIME_GENERAL & 0xFC;
+        delta = token & 0x1F;
+      }
+      else if(token == LOG_CHAIN_TIME)
+      {
+        type = LOG_TIME_GENERAL & 0xFC;
+        delta = GetVarint(in, &i, len);
+      }
+      else if(token >= LOG_CHAIN_FINE_RECENT)
+      {
+        k = (token >> 2) & 0x07;
+        if(k >= nrecent)
+          return o;
+        delta = recent[k] + (token & 0x03) - 2;
+      }
+      else
+      {
+        delta = (token & 0x1F) | (GetVarint(in, &i, len) << 5);
+        k = (nrecent < LOG_CHAIN_RECENT) ? nrecent++ : LOG_CHAIN_RECENT - 1;
+      }
+      if(type == (LOG_TIME_FINE & 0xFC))
+      {
+        for(; k > 0; k--)
+          recent[k] = recent[k - 1];
+        recent[0] = delta;
+      }
+
+      out[o++] = type;
+      for(; delta > 0x7F; delta >>= 7)
+        out[o++] = (delta & 0x7F) | 0x80;
+      out[o++] = delta;
+    }
+    o = DecodeChainEnd(out, o, entry);
+  }
+
+  return o;
+}
+
+/**
+ * Reads the EEPROM log as ReadLogEEPROM and decodes it to the version 2
+ * entries of the SCD_LOG_BYTE types, see DecodeLog
+ *
+ * @param out the buffer for the entries, 2 * EEPROM_TLOG_SIZE bytes
+ * @return the number of bytes of the entries
+ */
+static uint16_t ReadLogEntries(uint8_t *out)
+{
+  static uint8_t log[EEPROM_TLOG_SIZE];
+
+  return DecodeLog(log, ReadLogEEPROM(log), out, 2 * EEPROM_TLOG_SIZE);
+}
+
+/**
+ * Computes the time added by the SCD to one exchange
+ *
+ * When the virtual terminal is used the SCD time is the part of the exchange
+ * seen by the terminal that was not spent in the card. Otherwise the SCD is
+ * the terminal and its time is the gap since the previous response plus any
+ * time the card waited for command data.
+ *
+ * @param i the index of the exchange in sim_exchanges
+ * @param forward non-zero if the virtual terminal was used
+ * @param timing the structure where the results are stored
+ */
+static void ExchangeTiming(uint16_t i, uint8_t forward, SimTiming *timing)
+{
+  SimExchange *e = &sim_exchanges[i];
+  sim_time_t card, added;
+
+  card = e->card_end - e->card_start - e->card_wait;
+  if(forward)
+  {
+    added = 0;
+    timing->terminal_us = 0;
+    if(e->terminal_end)
+    {
+      added = e->terminal_end - e->terminal_start - card;
+      timing->terminal_us = SimCyclesToUs(e->terminal_end - e->terminal_start);
+    }
+    timing->added_etus = (double)added / SimTerminalETU();
+  }
+  else
+  {
+    added = e->card_wait;
+    if(i > 0)
+      added += e->card_start - sim_exchanges[i - 1].card_end;
+    timing->terminal_us = 0;
+    timing->added_etus = (double)added / SimICCETU();
+  }
+  timing->card_us = SimCyclesToUs(card);
+  timing->added_us = SimCyclesToUs(added);
+}
+
+/**
+ * Prints the exchanges recorded during the last run
+ *
+ * @param forward non-zero if the virtual terminal was used
+ */
+static void PrintExchanges(uint8_t forward)
+{
+  uint16_t i;
+  SimExchange *e;
+  SimTiming t;
+
+  printf("  cmd         sw    terminal(ms)  card(ms)  added(ms)  added(etu)\n");
+  for(i = 0; i < sim_num_exchanges; i++)
+  {
+    e = &sim_exchanges[i];
+    ExchangeTiming(i, forward, &t);
+    printf("  %02X%02X%02X%02X%02X  %04X  %12.3f  %8.3f  %9.3f  %10.1f\n",
+        e->cla, e->ins, e->p1, e->p2, e->p3, e->sw,
+        t.terminal_us / 1000.0, t.card_us / 1000.0, t.added_us / 1000.0,
+        t.added_etus);
+  }
+}
+
+/**
+ * Appends the results of a scenario to the benchmark file
+ *
+ * @param name the name of the scenario
+ * @param forward non-zero if the virtual terminal was used
+ * @param failed non-zero if the scenario failed
+ * @param error the value returned by the application
+ * @param duration the duration of the transaction
+ */
+static void WriteBench(const char *name, uint8_t forward, uint8_t failed,
+    uint8_t error, sim_time_t duration)
+{
+  uint16_t i;
+  SimExchange *e;
+  SimTiming t;
+  double added = 0;
+
+  for(i = 0; i < sim_num_exchanges; i++)
+  {
+    ExchangeTiming(i, forward, &t);
+    added += t.added_us;
+  }
+
+  fprintf(bench, "%s    {\n", nbench ? ",\n" : "");
+  fprintf(bench, "      \"name\": \"%s\",\n", name);
+  fprintf(bench, "      \"ok\": %s,\n", failed ? "false" : "true");
+  fprintf(bench, "      \"error\": %u,\n", error);
+  fprintf(bench, "      \"time_us\": %.1f,\n", SimCyclesToUs(duration));
+  fprintf(bench, "      \"added_us\": %.1f,\n", added);
+  fprintf(bench, "      \"exchanges\": %u,\n", sim_num_exchanges);
+  fprintf(bench, "      \"peak_heap\": %u,\n", SimHeapPeak());
+  fprintf(bench, "      \"log_bytes\": %u,\n", LogSizeEEPROM());
+  fprintf(bench, "      \"commands\": [");
+  for(i = 0; i < sim_num_exchanges; i++)
+  {
+    e = &sim_exchanges[i];
+    ExchangeTiming(i, forward, &t);
+    fprintf(bench, "%s\n        {\"cmd\": \"%02X%02X%02X%02X%02X\", "
+        "\"sw\": \"%04X\", \"terminal_us\": %.1f, \"card_us\": %.1f, "
+        "\"added_us\": %.1f, \"added_etus\": %.1f}",
+        i ? "," : "", e->cla, e->ins, e->p1, e->p2, e->p3, e->sw,
+        t.terminal_us, t.card_us, t.added_us, t.added_etus);
+  }
+  fprintf(bench, "\n      ]\n    }");
+  nbench++;
+}
+
+/**
+ * Prints the result of a scenario and checks the anomaly counters
+ *
+ * @param name the name of the scenario
+ * @param forward non-zero if the virtual terminal was used
+ * @param error the value returned by the application
+ * @param duration the duration of the transaction
+ * @return zero if the scenario passed, non-zero otherwise
+ */
+static uint8_t Report(const char *name, uint8_t forward, uint8_t error,
+    sim_time_t duration)
+{
+  uint8_t failed;
+
+  failed = (error != 0 ||
+      sim_stats.overruns != 0 ||
+      sim_stats.stalls != 0 ||
+      sim_stats.collisions != 0 ||
+      sim_stats.wwt_violations != 0 ||
+      sim_stats.mismatches != 0 ||
+      sim_stats.protocol_errors != 0);
+
+  printf("%-10s %s  time %.3f ms  exchanges %u  heap %u bytes  "
+      "log %u bytes\n",
+      name, failed ? "FAIL" : "OK", SimCyclesToUs(duration) / 1000.0,
+      sim_num_exchanges, SimHeapPeak(), LogSizeEEPROM());
+  if(failed || verbose)
+    printf("  error %u  overruns %u  stalls %u  collisions %u  wwt %u  "
+        "mismatches %u  protocol %u  watchdog %u\n",
+        error, sim_stats.overruns, sim_stats.stalls, sim_stats.collisions,
+        sim_stats.wwt_violations, sim_stats.mismatches,
+        sim_stats.protocol_errors, sim_stats.wdt_expired);
+  if(verbose)
+    PrintExchanges(forward);
+  if(bench)
+    WriteBench(name, forward, failed, error, duration);
+
+  return failed;
+}
+
+/**
+ * Runs an application that sits between the virtual terminal and card
+ *
+ * @param name the name of the scenario
+ * @param app the application to run
+ * @param card the profile of the virtual card
+ * @param terminal the script of the virtual terminal
+ * @return zero if the scenario passed, non-zero otherwise
+ */
+static uint8_t RunBetween(const char *name, uint8_t (*app)(log_struct_t*),
+    const SimCardProfile *card, const SimTerminalScript *terminal)
+{
+  uint8_t error;
+  sim_time_t duration;
+
+  Prepare();
+  SimCardInsert(card);
+  SimTerminalStart(terminal);
+  StartTimerT2();
+
+  error = app(&scd_logger);
+  if(!SimTerminalFinished())
+    error = RET_ERROR;
+
+  duration = 0;
+  if(sim_num_exchanges > 0)
+    duration = sim_exchanges[sim_num_exchanges - 1].terminal_end -
+      SimTerminalConnectTime();
+
+  return Report(name, 1, error, duration);
+}
+
+/**
+ * Forwards a purchase between the virtual terminal and card
+ */
+static uint8_t RunForward(const char *name)
+{
+  return RunBetween(name, ForwardData, &sim_card_emv, &sim_terminal_purchase);
+}
+
+/**
+ * Forwards a purchase between the virtual terminal and card, relaying
+ * each byte as soon as it is received (cut-through)
+ */
+static uint8_t RunRelay(const char *name)
+{
+  uint8_t result;
+
+  forwardCutThrough = 1;
+  result = RunBetween(name, ForwardData, &sim_card_emv, &sim_terminal_purchase);
+  forwardCutThrough = FORWARD_CUT_THROUGH;
+
+  return result;
+}
+
+/**
+ * Forwards a purchase from a card that sends NULL bytes while it takes
+ * longer than WWT to process a command. The NULL bytes must reach the
+ * terminal as they arrive, or the terminal sees the WWT exceeded.
+ */
+static uint8_t RunForwardNull(const char *name)
+{
+  return RunBetween(name, ForwardData, &sim_card_emv_slow,
+      &sim_terminal_purchase);
+}
+
+/**
+ * Same as forward-null, relaying each byte as soon as it is received
+ */
+static uint8_t RunRelayNull(const char *name)
+{
+  uint8_t result;
+
+  forwardCutThrough = 1;
+  result = RunBetween(name, ForwardData, &sim_card_emv_slow,
+      &sim_terminal_purchase);
+  forwardCutThrough = FORWARD_CUT_THROUGH;
+
+  return result;
+}
+
+/**
+ * Relays the NULL bytes of a card that runs at a faster rate after PPS,
+ * as ReceiveT0Response does for ForwardData. The ICC ETU is then below
+ * ICC_MIN_ISR_ETU, so the SCD polls the ICC line, and the NULL bytes of
+ * the card follow each other closer than a byte sent to the terminal.
+ * Sending one would miss the start of the next byte of the card, so
+ * none must reach the terminal, which is not connected here, and the
+ * status of the card must be received.
+ */
+static uint8_t RunRelayNullPPS(const char *name)
+{
+  const uint8_t data[] = {0x01, 0x02, 0x03, 0x04};
+  uint8_t inverse, proto, TC1, TA3, TB3, error;
+  CAPDU *cmd;
+  RAPDU *response = NULL;
+
+  Prepare();
+  SimCardInsert(&sim_card_emv_fast_null);
+  StartTimerT2();
+
+  error = ResetICC(0, &inverse, &proto, &TC1, &TA3, &TB3, &scd_logger);
+  if(error == 0 && GetICCETU() >= ICC_MIN_ISR_ETU)
+    error = RET_ICC_PPS;
+
+  // INTERNAL AUTHENTICATE, which the card takes 3000 ETUs to process
+  cmd = MakeCommand(0x00, 0x88, 0x00, 0x00, sizeof(data), data, sizeof(data));
+  if(error == 0 && SendT0Command(inverse, TC1, cmd, &scd_logger))
+    error = RET_ICC_SEND_CMD;
+  if(error == 0)
+  {
+    response = ReceiveT0Response(inverse, cmd->cmdHeader,
+        T0_NULL_TO_TERMINAL(0), &scd_logger);
+    if(response == NULL || response->repStatus->sw1 != 0x61)
+      error = RET_ICC_GET_RESPONSE;
+  }
+  if(verbose)
+    printf("  ICC ETU %u  error %u\n", GetICCETU(), error);
+  FreeRAPDU(response);
+  FreeCAPDU(cmd);
+  DeactivateICC();
+
+  return Report(name, 0, error, sim_now);
+}
+
+/**
+ * Forwards a purchase from a virtual terminal that negotiates the rate
+ * offered by the SCD in the ATR
+ */
+static uint8_t RunForwardPPS(const char *name)
+{
+  return RunBetween(name, ForwardData, &sim_card_emv,
+      &sim_terminal_purchase_pps);
+}
+
+/**
+ * Same as RunForwardPPS, relaying each byte as soon as it is received
+ */
+static uint8_t RunRelayPPS(const char *name)
+{
+  uint8_t result;
+
+  forwardCutThrough = 1;
+  result = RunBetween(name, ForwardData, &sim_card_emv,
+      &sim_terminal_purchase_pps);
+  forwardCutThrough = FORWARD_CUT_THROUGH;
+
+  return result;
+}
+
+/**
+ * Forwards the blocks of a purchase between the virtual terminal and a
+ * card that use T=1
+ */
+static uint8_t RunForwardT1(const char *name)
+{
+  return RunBetween(name, ForwardData, &sim_card_emv_t1,
+      &sim_terminal_purchase);
+}
+
+/**
+ * Runs AT+CLIVE and checks that the log was streamed to the host in
+ * FRAME_TRACE frames instead of being written to EEPROM
+ *
+ * @param logger the log structure
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t ForwardLive(log_struct_t *logger)
+{
+  const char *reply;
+  size_t offset = 0;
+  uint16_t len, frames = 0;
+  uint32_t streamed = 0;
+  uint8_t type;
+
+  reply = ProcessSerialData("AT+CLIVE", logger);
+  if(reply == NULL || strcmp(reply, "AT OK\r\n") != 0)
+    return RET_ERROR;
+
+  while(SimHostReadFrame(&offset, &type, &len) != NULL)
+  {
+    if(type != FRAME_TRACE)
+      return RET_ERROR;
+    streamed += len;
+    frames++;
+  }
+  if(verbose)
+    printf("  streamed %lu log bytes in %u frames\n",
+        (unsigned long)streamed, frames);
+
+  if(offset != SimHostOutputLength() || streamed == 0 || LogSizeEEPROM() != 0)
+    return RET_ERROR;
+
+  return 0;
+}
+
+/**
+ * Forwards a purchase streaming the log to the host (AT+CLIVE)
+ */
+static uint8_t RunForwardLive(const char *name)
+{
+  return RunBetween(name, ForwardLive, &sim_card_emv, &sim_terminal_purchase);
+}
+
+/**
+ * Sets the event mask with AT+CLOGM, then logs a transaction and checks
+ * that the EEPROM log only has events of the classes in the mask
+ *
+ * @param logger the log structure
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t ForwardMasked(log_struct_t *logger)
+{
+  const uint8_t mask = LOG_MASK_TERMINAL | LOG_MASK_ICC | LOG_MASK_TIME |
+    LOG_MASK_GENERAL;
+  static uint8_t log[2 * EEPROM_TLOG_SIZE];
+  const char *reply;
+  uint16_t addr, end;
+  uint8_t header, result;
+
+  reply = ProcessSerialData("AT+CLOGM=F0", logger);
+  if(reply == NULL || strcmp(reply, "AT OK\r\n") != 0 ||
+      sim_eeprom[EEPROM_LOG_MASK] != mask)
+    return RET_ERROR;
+  reply = ProcessSerialData("AT+CLOGM", logger);
+  if(reply == NULL || strcmp(reply, "AT LOGM=F0\r\n") != 0)
+    return RET_ERROR;
+
+  result = ForwardData(logger);
+  if(result != 0)
+    return result;
+
+  // walk the entries of the log, see SCD_LOG_BYTE
+  addr = 0;
+  end = ReadLogEntries(log);
+  while(addr < end)
+  {
+    header = log[addr++];
+    if((LogTypeMask(header) & mask) == 0)
+      return RET_ERROR;
+    if((header & 0x03) == LOG_RUN)
+      addr += log[addr] + 1;
+    else if((header & 0x03) == 0 && LogTypeMask(header) == LOG_MASK_TIME)
+      while(log[addr++] & 0x80);
+    else
+      addr += (header & 0x03) + 1;
+  }
+  if(addr != end || end == 0)
+    return RET_ERROR;
+
+  return 0;
+}
+
+/**
+ * Forwards a purchase logging only the events and times, without the
+ * bytes exchanged (AT+CLOGM)
+ */
+static uint8_t RunForwardMask(const char *name)
+{
+  return RunBetween(name, ForwardMasked, &sim_card_emv,
+      &sim_terminal_purchase);
+}
+
+/**
+ * Relays a purchase and checks the fine times logged after the last byte
+ * of each response (LOG_TIME_FINE) against the times the card sent it
+ */
+static uint8_t RelayTimed(log_struct_t *logger)
+{
+  static uint8_t log[2 * EEPROM_TLOG_SIZE];
+  uint32_t ends[SIM_MAX_EXCHANGES];
+  uint32_t fine = 0, delta;
+  uint16_t addr, end, n = 0, k;
+  uint8_t header, result, shift, pending = 0;
+  double error;
+
+  result = ForwardData(logger);
+  if(result != 0)
+    return result;
+
+  // walk the entries of the log, see SCD_LOG_BYTE. The fine time after
+  // a response is the one followed by other bytes than those relayed
+  // from the ICC
+  addr = 0;
+  end = ReadLogEntries(log);
+  while(addr < end)
+  {
+    header = log[addr++];
+    if((header & 0xFC) == (LOG_TIME_FINE & 0xFC))
+    {
+      if((header & 0x03) == 0x03)
+      {
+        fine = log[addr] | ((uint32_t)log[addr + 1] << 8) |
+          ((uint32_t)log[addr + 2] << 16) | ((uint32_t)log[addr + 3] << 24);
+        addr += 4;
+      }
+      else
+      {
+        delta = 0;
+        shift = 0;
+        do{
+          delta |= (uint32_t)(log[addr] & 0x7F) << shift;
+          shift += 7;
+        }while(log[addr++] & 0x80);
+        fine += delta;
+      }
+      pending = 1;
+      continue;
+    }
+
+    if(LogTypeMask(header) != LOG_MASK_TIME && pending)
+    {
+      if((header & 0xFC) != LOG_BYTE_FROM_ICC &&
+          (header & 0xFC) != LOG_BYTE_TO_TERMINAL && n < SIM_MAX_EXCHANGES)
+        ends[n++] = fine;
+      pending = 0;
+    }
+    if((header & 0x03) == LOG_RUN)
+      addr += log[addr] + 1;
+    else if((header & 0x03) == 0 && LogTypeMask(header) == LOG_MASK_TIME)
+      while(log[addr++] & 0x80);
+    else
+      addr += (header & 0x03) + 1;
+  }
+  if(pending && n < SIM_MAX_EXCHANGES)
+    ends[n++] = fine;
+
+  // the times between responses must match within a few us, well below
+  // one ETU and the 1024 us of the sync counter. The first exchange is
+  // stored and forwarded (it may be a PPS), so it ends later
+  if(n != sim_num_exchanges || n < 3)
+    return RET_ERROR;
+  for(k = 2; k < n; k++)
+  {
+    error = (double)(ends[k] - ends[1]) * timestamp_res_us -
+      SimCyclesToUs(sim_exchanges[k].card_end - sim_exchanges[1].card_end);
+    if(error < -2.0 * timestamp_res_us || error > 2.0 * timestamp_res_us)
+      return RET_ERROR;
+  }
+
+  return 0;
+}
+
+/**
+ * Relays a purchase, checking the fine times logged (LOG_TIME_FINE)
+ */
+static uint8_t RunRelayTiming(const char *name)
+{
+  uint8_t result;
+
+  forwardCutThrough = 1;
+  result = RunBetween(name, RelayTimed, &sim_card_emv, &sim_terminal_purchase);
+  forwardCutThrough = FORWARD_CUT_THROUGH;
+
+  return result;
+}
+
+/**
+ * Task run while the lines wait that keeps the CPU busy for 2 ms, as a
+ * USB transfer or an EEPROM write would
+ */
+static void BusyHook(void)
+{
+  hook_calls++;
+  SimAdvance(2000 * (F_CPU / 1000000UL));
+}
+
+/**
+ * Forwards a transaction while the line engines run BusyHook, as a task
+ * of the scheduler, whenever they wait. The bytes sent during the hook
+ * must be received by the engines, so the scenario fails with overruns
+ * otherwise.
+ *
+ * @param logger the log structure
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t ForwardBusy(log_struct_t *logger)
+{
+  uint8_t result;
+
+  hook_calls = 0;
+  AddTask(BusyHook, TASK_GROUP_TEST, TASK_RUN);
+  result = ForwardData(logger);
+  RemoveTask(BusyHook);
+  if(result == 0 && hook_calls == 0)
+    return RET_ERROR;
+
+  return result;
+}
+
+/**
+ * Forwards a purchase with a busy idle hook (SetLineIdleHook)
+ */
+static uint8_t RunLineHook(const char *name)
+{
+  return RunBetween(name, ForwardBusy, &sim_card_emv, &sim_terminal_purchase);
+}
+
+/**
+ * Task that sends two control commands from the host in the middle of
+ * the transaction: one accepted while an application runs and one that
+ * is not
+ */
+static void ProbeTask(void)
+{
+  if(!probe_sent && sim_num_exchanges >= 12)
+  {
+    SimHostWrite("AT+CLOGM");
+    SimHostWrite("AT+CTERM");
+    probe_sent = 1;
+  }
+}
+
+/**
+ * Runs AT+CLIVE while the host sends control commands, and checks that
+ * they are answered during the transaction, between the trace frames,
+ * and that no task waits longer than TASK_MAX_GAP_MS between two runs
+ *
+ * @param logger the log structure
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t ForwardTasks(log_struct_t *logger)
+{
+  const char *reply;
+  const uint8_t *data;
+  const task_entry_t *probe;
+  size_t offset = 0;
+  uint16_t len, before = 0, after = 0, replies = 0;
+  uint32_t maxgap, runs;
+  uint8_t type;
+
+  probe_sent = 0;
+  AddTask(ProbeTask, TASK_GROUP_TEST, TASK_RUN);
+  reply = ProcessSerialData("AT+CLIVE", logger);
+  probe = GetTask(ProbeTask);
+  maxgap = probe->maxgap;
+  runs = probe->runs;
+  RemoveTask(ProbeTask);
+  if(reply == NULL || strcmp(reply, "AT OK\r\n") != 0 || !probe_sent)
+    return RET_ERROR;
+
+  while((data = SimHostReadFrame(&offset, &type, &len)) != NULL)
+  {
+    if(type == FRAME_TRACE && replies == 0)
+      before++;
+    else if(type == FRAME_TRACE)
+      after++;
+    else if(type == FRAME_REPLY && replies == 0 &&
+        len == 12 && memcmp(data, "AT LOGM=", 8) == 0)
+      replies++;
+    else if(type == FRAME_REPLY && replies == 1 &&
+        len == 8 && memcmp(data, "AT BAD\r\n", 8) == 0)
+      replies++;
+    else
+      return RET_ERROR;
+  }
+  if(verbose)
+    printf("  %lu task runs, longest gap %lu us, trace frames %u + %u\n",
+        (unsigned long)runs, (unsigned long)(maxgap * counter_res_us),
+        before, after);
+
+  if(offset != SimHostOutputLength() || replies != 2 ||
+      before == 0 || after == 0)
+    return RET_ERROR;
+  if(maxgap * counter_res_us > TASK_MAX_GAP_MS * 1000UL)
+    return RET_ERROR;
+
+  return 0;
+}
+
+/**
+ * Forwards a purchase streaming the log, with control commands from the
+ * host, checking the latency of the tasks (see scd_tasks.h)
+ */
+static uint8_t RunTaskLatency(const char *name)
+{
+  return RunBetween(name, ForwardTasks, &sim_card_emv, &sim_terminal_purchase);
+}
+
+/**
+ * Computes the CRC32 of the binary EEPROM dump, as zlib.crc32 in Python
+ *
+ * @param data the bytes
+ * @param len the number of bytes
+ * @return the CRC32
+ */
+static uint32_t DumpCRC32(const uint8_t *data, size_t len)
+{
+  static uint32_t table[256];
+  uint32_t crc, c;
+  size_t i;
+  int k;
+
+  if(table[1] == 0)
+    for(i = 0; i < 256; i++)
+    {
+      c = i;
+      for(k = 0; k < 8; k++)
+        c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+      table[i] = c;
+    }
+
+  crc = 0xFFFFFFFF;
+  for(i = 0; i < len; i++)
+    crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+  return crc ^ 0xFFFFFFFF;
+}
+
+/**
+ * Logs a transaction and then reads the EEPROM with AT+CGEE and with
+ * AT+CGEEB, checking the length, contents and CRC32 of the binary dump
+ *
+ * @param logger the log structure
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t ForwardDump(log_struct_t *logger)
+{
+  const uint8_t *out;
+  const char *reply;
+  size_t hex_len, bin_len;
+  sim_time_t start, hex_time, bin_time;
+  uint32_t crc;
+  uint8_t result;
+
+  result = ForwardData(logger);
+  if(result != 0)
+    return result;
+
+  SimHostReset();
+  start = sim_now;
+  reply = ProcessSerialData("AT+CGEE", logger);
+  hex_time = sim_now - start;
+  hex_len = SimHostOutputLength();
+  if(reply == NULL || strcmp(reply, "AT OK\r\n") != 0)
+    return RET_ERROR;
+
+  SimHostReset();
+  start = sim_now;
+  reply = ProcessSerialData("AT+CGEEB", logger);
+  bin_time = sim_now - start;
+  bin_len = SimHostOutputLength();
+  if(reply == NULL || strcmp(reply, "AT OK\r\n") != 0)
+    return RET_ERROR;
+  if(verbose)
+    printf("  hex dump %lu bytes %.3f ms, binary dump %lu bytes %.3f ms\n",
+        (unsigned long)hex_len, SimCyclesToUs(hex_time) / 1000.0,
+        (unsigned long)bin_len, SimCyclesToUs(bin_time) / 1000.0);
+
+  out = (const uint8_t*)SimHostOutput();
+  if(bin_len != SIM_EEPROM_SIZE + 6 ||
+      (out[0] | (out[1] << 8)) != SIM_EEPROM_SIZE ||
+      memcmp(out + 2, sim_eeprom, SIM_EEPROM_SIZE) != 0)
+    return RET_ERROR;
+  crc = DumpCRC32(sim_eeprom, SIM_EEPROM_SIZE);
+  out += SIM_EEPROM_SIZE + 2;
+  if(((uint32_t)out[0] | ((uint32_t)out[1] << 8) |
+      ((uint32_t)out[2] << 16) | ((uint32_t)out[3] << 24)) != crc)
+    return RET_ERROR;
+  if(bin_time >= hex_time)
+    return RET_ERROR;
+
+  return 0;
+}
+
+/**
+ * Forwards a purchase and then dumps the EEPROM to the host
+ */
+static uint8_t RunForwardDump(const char *name)
+{
+  return RunBetween(name, ForwardDump, &sim_card_emv, &sim_terminal_purchase);
+}
+
+/**
+ * Sends AT+CGLOG to pull the EEPROM log and checks the reply against the
+ * log reassembled from the simulated EEPROM
+ *
+ * @param cmd the AT+CGLOG command, with the session and sequence number
+ * the host needs
+ * @param first the sequence number expected for the first record sent
+ * @param logger the log structure
+ * @return the number of log bytes received, or -1 if the reply is wrong
+ */
+static int32_t PullLog(const char *cmd, uint16_t first, log_struct_t *logger)
+{
+  static uint8_t log[EEPROM_TLOG_SIZE];
+  const uint8_t *out;
+  const char *reply;
+  log_ring_t ring;
+  uint16_t size, len;
+  uint32_t crc;
+
+  SimHostReset();
+  reply = ProcessSerialData(cmd, logger);
+  if(reply == NULL || strcmp(reply, "AT OK\r\n") != 0)
+    return -1;
+
+  // the records sent are the newest ones, so the end of the log
+  ReadLogRingState(&ring);
+  size = ReadLogEEPROM(log);
+  out = (const uint8_t*)SimHostOutput();
+  len = out[5] | (out[6] << 8);
+  if(out[0] != sim_eeprom[EEPROM_LOG_SESSION] ||
+      (out[1] | (out[2] << 8)) != first ||
+      (out[3] | (out[4] << 8)) != ring.seq ||
+      SimHostOutputLength() != len + 11u || len > size ||
+      memcmp(out + 7, log + size - len, len) != 0)
+    return -1;
+  crc = DumpCRC32(out + 7, len);
+  out += len + 7;
+  if(((uint32_t)out[0] | ((uint32_t)out[1] << 8) |
+      ((uint32_t)out[2] << 16) | ((uint32_t)out[3] << 24)) != crc)
+    return -1;
+
+  return len;
+}
+
+/**
+ * Logs a transaction and a second record, then pulls the log with
+ * AT+CGLOG: all of it, only the second record, nothing once the host
+ * has it all, and all of it again for a sequence number in the future
+ * or another session, as after an erase
+ *
+ * @param logger the log structure
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t ForwardPull(log_struct_t *logger)
+{
+  const uint8_t data[] = {0x90, 0x00};
+  char cmd[20];
+  uint16_t size;
+  uint8_t result, session;
+
+  result = ForwardData(logger);
+  if(result != 0)
+    return result;
+
+  ResetLogger(logger);
+  LogBytes(logger, LOG_BYTE_TO_TERMINAL, data, sizeof(data));
+  WriteLogEEPROM(logger);
+
+  size = LogSizeEEPROM();
+  session = sim_eeprom[EEPROM_LOG_SESSION];
+  if(size < 0x100 || PullLog("AT+CGLOG", 0, logger) != size)
+    return RET_ERROR;
+  sprintf(cmd, "AT+CGLOG=%02X0001", session);
+  if(PullLog(cmd, 1, logger) != 4)
+    return RET_ERROR;
+  sprintf(cmd, "AT+CGLOG=%02X0002", session);
+  if(PullLog(cmd, 2, logger) != 0)
+    return RET_ERROR;
+  sprintf(cmd, "AT+CGLOG=%02X0003", session);
+  if(PullLog(cmd, 0, logger) != size)
+    return RET_ERROR;
+  sprintf(cmd, "AT+CGLOG=%02X0001", (uint8_t)(session - 1));
+  if(PullLog(cmd, 0, logger) != size)
+    return RET_ERROR;
+
+  return 0;
+}
+
+/**
+ * Forwards a purchase and then pulls the log incrementally
+ */
+static uint8_t RunForwardPull(const char *name)
+{
+  return RunBetween(name, ForwardPull, &sim_card_emv, &sim_terminal_purchase);
+}
+
+/**
+ * Sends AT+CGTRN to get one transaction of the EEPROM log and checks the
+ * reply against the log reassembled from the simulated EEPROM
+ *
+ * @param number the transaction number
+ * @param log the log reassembled from the simulated EEPROM
+ * @param offset the expected offset of the transaction in the log
+ * @param logger the log structure
+ * @return the length of the transaction, or -1 if the reply is wrong
+ */
+static int32_t GetTransaction(uint8_t number, const uint8_t *log,
+    uint16_t offset, log_struct_t *logger)
+{
+  const uint8_t *out;
+  const char *reply;
+  char cmd[16];
+  uint16_t len;
+  uint32_t crc;
+
+  SimHostReset();
+  sprintf(cmd, "AT+CGTRN=%02X", number);
+  reply = ProcessSerialData(cmd, logger);
+  if(reply == NULL || strcmp(reply, "AT OK\r\n") != 0)
+    return -1;
+
+  out = (const uint8_t*)SimHostOutput();
+  len = out[1] | (out[2] << 8);
+  if(out[0] != number || SimHostOutputLength() != len + 7u ||
+      memcmp(out + 3, log + offset, len) != 0)
+    return -1;
+  crc = DumpCRC32(out + 3, len);
+  out += len + 3;
+  if(((uint32_t)out[0] | ((uint32_t)out[1] << 8) |
+      ((uint32_t)out[2] << 16) | ((uint32_t)out[3] << 24)) != crc)
+    return -1;
+
+  return len;
+}
+
+/**
+ * @param data the bytes, LSB first
+ * @return the 32-bit value
+ */
+static uint32_t GetLE32(const uint8_t *data)
+{
+  return (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+    ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+/**
+ * Logs a transaction and a record with two more, then checks the
+ * transaction index (AT+CGIDX) and gets each transaction by number
+ * (AT+CGTRN), also once the first record was overwritten
+ *
+ * @param logger the log structure
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t ForwardIndex(log_struct_t *logger)
+{
+  static uint8_t log[EEPROM_TLOG_SIZE];
+  const uint8_t atr[] = {0x3B, 0x00};
+  const uint8_t data[] = {0x00, 0xA4, 0x04, 0x00};
+  uint8_t card_atr[33];
+  const uint8_t *out;
+  const char *reply;
+  uint16_t size, first, offset;
+  uint8_t result, n;
+
+  result = ForwardData(logger);
+  if(result != 0 || nCounter != 1)
+    return RET_ERROR;
+  first = LogSizeEEPROM();
+
+  // a record with transactions 2 and 3, the second without ATR
+  ResetLogger(logger);
+  LogBytes(logger, LOG_BYTE_ATR_FROM_ICC, atr, sizeof(atr));
+  LogTransaction(logger, 0, 1000, 2);
+  LogBytes(logger, LOG_BYTE_FROM_TERMINAL, data, sizeof(data));
+  LogTransaction(logger, LogMark(logger), 2000, 3);
+  LogBytes(logger, LOG_BYTE_FROM_TERMINAL, data, sizeof(data));
+  WriteLogEEPROM(logger);
+  size = ReadLogEEPROM(log);
+
+  // three entries of 15 bytes: number, seq, offset, length, time, ATR
+  SimHostReset();
+  reply = ProcessSerialData("AT+CGIDX", logger);
+  out = (const uint8_t*)SimHostOutput();
+  if(reply == NULL || strcmp(reply, "AT OK\r\n") != 0 || out[0] != 3 ||
+      SimHostOutputLength() != 1 + 3 * 15 + 4 ||
+      DumpCRC32(out + 1, 3 * 15) != GetLE32(out + 46))
+    return RET_ERROR;
+
+  // transaction 1 runs to the end of the first record
+  n = SimParseHex(sim_card_emv.atr, card_atr, sizeof(card_atr));
+  offset = out[4] | (out[5] << 8);
+  if(out[1] != 1 || out[2] != 0 || out[3] != 0 ||
+      offset + (out[6] | (out[7] << 8)) != first ||
+      GetLE32(out + 12) != DumpCRC32(card_atr, n))
+    return RET_ERROR;
+  if(out[16] != 2 || out[17] != 1 || GetLE32(out + 23) != 1000 ||
+      GetLE32(out + 27) != DumpCRC32(atr, sizeof(atr)) ||
+      out[31] != 3 || GetLE32(out + 38) != 2000 ||
+      GetLE32(out + 42) != DumpCRC32(NULL, 0))
+    return RET_ERROR;
+
+  if(GetTransaction(1, log, offset, logger) != first - offset ||
+      GetTransaction(2, log, first, logger) != 4 + 6 ||
+      GetTransaction(3, log, first + 10, logger) != 6 ||
+      GetTransaction(9, log, 0, logger) != -1 ||
+      GetTransaction(4, log, 0, logger) != -1)
+    return RET_ERROR;
+
+  // repeat the second record until the first one is overwritten
+  while(LogSizeEEPROM() >= size)
+  {
+    size = LogSizeEEPROM();
+    WriteLogEEPROM(logger);
+  }
+  size = ReadLogEEPROM(log);
+  if(GetTransaction(1, log, 0, logger) != -1 ||
+      GetTransaction(2, log, size - 16, logger) != 4 + 6)
+    return RET_ERROR;
+
+  return 0;
+}
+
+/**
+ * Forwards a purchase and then uses the transaction index
+ */
+static uint8_t RunForwardIndex(const char *name)
+{
+  return RunBetween(name, ForwardIndex, &sim_card_emv, &sim_terminal_purchase);
+}
+
+/**
+ * Writes more records than the EEPROM log ring holds and checks that the
+ * newest ones are kept in order, that the metadata slots are used in turn
+ * and that AT+CGLOG reports the records lost
+ */
+static uint8_t RunLogRing(const char *name)
+{
+  static uint8_t data[700];
+  uint8_t header[EEPROM_LOG_RECORD_HEADER];
+  log_ring_t ring;
+  uint16_t addr, seq, len, i, n, valid;
+  uint8_t error = 0;
+  char cmd[20];
+
+  Prepare();
+  for(n = 0; n < 12; n++)
+  {
+    ResetLogger(&scd_logger);
+    memset(data, n, sizeof(data));
+    LogBytes(&scd_logger, LOG_BYTE_FROM_ICC, data, sizeof(data));
+    WriteLogEEPROM(&scd_logger);
+  }
+
+  // each record has 706 bytes of entries, so the ring holds 5 of them
+  ReadLogRingState(&ring);
+  seq = 7;
+  for(addr = ring.tail; addr != ring.head && error == 0; seq++)
+  {
+    addr = ReadLogRing(addr, header, sizeof(header));
+    len = header[2] | (header[3] << 8);
+    if((header[0] | (header[1] << 8)) != seq || len != 706)
+      error = RET_ERROR;
+    // runs of 255 bytes, as the last record but with its own data
+    for(i = 0; i < len && error == 0; i++)
+      if(eeprom_read_byte((uint8_t*)LogRingAddress(addr, i)) !=
+          (i % 257 > 1 ? seq : scd_logger.log_buffer[i]))
+        error = RET_ERROR;
+    addr = LogRingAddress(addr, len);
+  }
+  if(seq != 12 || ring.seq != 12 || LogRingUsed(&ring) != 5 * 710)
+    error = RET_ERROR;
+
+  // all slots hold a state, the newest one in slot 12 % 6
+  valid = 0;
+  for(i = 0; i < EEPROM_LOG_NSLOTS; i++)
+  {
+    addr = EEPROM_LOG_SLOTS + i * EEPROM_LOG_SLOT_SIZE;
+    seq = sim_eeprom[addr] | (sim_eeprom[addr + 1] << 8);
+    if(seq % EEPROM_LOG_NSLOTS == i && seq > 12 - EEPROM_LOG_NSLOTS)
+      valid++;
+  }
+  if(valid != EEPROM_LOG_NSLOTS)
+    error = RET_ERROR;
+
+  // a host that read up to record 3 missed records 3 to 6
+  sprintf(cmd, "AT+CGLOG=%02X0003", sim_eeprom[EEPROM_LOG_SESSION]);
+  if(PullLog(cmd, 7, &scd_logger) != 5 * 706)
+    error = RET_ERROR;
+
+  return Report(name, 0, error, sim_now);
+}
+
+/**
+ * Writes a log to EEPROM from the given EEPROM contents, injecting a
+ * reset before EEPROM write number at. After the reset the SCD copies
+ * the committed log as InitSCD does, and another reset is injected
+ * before write number again of that copy
+ *
+ * @param base the EEPROM contents before the log is written
+ * @param data the bytes logged
+ * @param len the number of bytes logged
+ * @param at the EEPROM write to reset at, 0 for none
+ * @param again the EEPROM write to reset at after the first reset
+ */
+static void FlushWithResets(const uint8_t *base, const uint8_t *data,
+    uint16_t len, uint32_t at, uint32_t again)
+{
+  volatile uint8_t boots = 0;
+
+  memcpy(sim_eeprom, base, SIM_EEPROM_SIZE);
+  ResetLogger(&scd_logger);
+  LogBytes(&scd_logger, LOG_BYTE_FROM_ICC, data, len);
+  sim_eeprom_writes = 0;
+  sim_eeprom_reset_at = at;
+
+  if(setjmp(sim_reset_jmp) == 0)
+    WriteLogEEPROM(&scd_logger);
+  else
+  {
+    // the logger is kept in SRAM over the reset
+    if(++boots == 1)
+    {
+      sim_eeprom_writes = 0;
+      sim_eeprom_reset_at = again;
+    }
+    BootSCD();
+  }
+  sim_eeprom_reset_at = 0;
+}
+
+/**
+ * Injects resets at random points while a log is written to a full
+ * EEPROM ring, and checks that after the restart the EEPROM is the same
+ * as without the reset: the new record complete and the older ones not
+ * torn. Also checks the worst-case time of the commit done by INT0_vect
+ * and WDT_vect before they restart the SCD
+ */
+static uint8_t RunLogReset(const char *name)
+{
+  static uint8_t base[SIM_EEPROM_SIZE], expected[SIM_EEPROM_SIZE];
+  static uint8_t data[1000];
+  sim_time_t start, commit = 0, flush;
+  uint32_t writes, at, seed = 1;
+  uint16_t i, n, len;
+  uint8_t error = 0;
+
+  Prepare();
+  for(i = 0; i < sizeof(data); i++)
+    data[i] = i * 7;
+
+  // fill the ring, so that each new record drops older ones
+  for(n = 0; n < 5; n++)
+  {
+    ResetLogger(&scd_logger);
+    LogBytes(&scd_logger, LOG_BYTE_FROM_ICC, data + n, 300 + n * 100);
+    WriteLogEEPROM(&scd_logger);
+  }
+
+  for(n = 0; n < 8 && error == 0; n++)
+  {
+    memcpy(base, sim_eeprom, SIM_EEPROM_SIZE);
+    len = 100 + n * 120;
+
+    // reference run, without resets
+    ResetLogger(&scd_logger);
+    LogBytes(&scd_logger, LOG_BYTE_FROM_ICC, data + n, len);
+    sim_eeprom_writes = 0;
+    start = sim_now;
+    CommitLogEEPROM(&scd_logger);
+    if(sim_now - start > commit)
+      commit = sim_now - start;
+    FlushLogEEPROM(&scd_logger);
+    flush = sim_now - start;
+    writes = sim_eeprom_writes;
+    memcpy(expected, sim_eeprom, SIM_EEPROM_SIZE);
+
+    // every write of the commit, then random ones with a second reset
+    for(at = 1; at <= writes + 1 && error == 0; at++)
+    {
+      if(at > 16)
+      {
+        seed = seed * 1103515245 + 12345;
+        at += (seed >> 16) % 40;
+        if(at > writes)
+          break;
+      }
+      FlushWithResets(base, data + n, len, at, at > 16 ? (seed >> 8) % 20 : 0);
+      if(memcmp(sim_eeprom, expected, SIM_EEPROM_SIZE) != 0)
+        error = RET_ERROR;
+    }
+    if(verbose)
+      printf("  record %u: %lu writes, commit %.1f ms, flush %.1f ms\n",
+          n, (unsigned long)writes, SimCyclesToUs(commit) / 1000.0,
+          SimCyclesToUs(flush) / 1000.0);
+
+    memcpy(sim_eeprom, expected, SIM_EEPROM_SIZE);
+  }
+
+  // the commit writes at most the counter, version, slot and header
+  if(commit > (sim_time_t)F_CPU * 34 / 10000 *
+      (2 + EEPROM_LOG_SLOT_SIZE + EEPROM_LOG_RECORD_HEADER))
+    error = RET_ERROR;
+
+  return Report(name, 0, error, commit);
+}
+
+/**
+ * Forwards a purchase replacing the PIN sent by the virtual terminal
+ */
+static uint8_t RunDummyPIN(const char *name)
+{
+  return RunBetween(name, DummyPIN, &sim_card_emv, &sim_terminal_purchase);
+}
+
+/**
+ * Runs the terminal application against a virtual card
+ */
+static uint8_t RunTerminalWith(const char *name, const SimCardProfile *card)
+{
+  uint8_t error;
+  sim_time_t duration;
+
+  Prepare();
+  SimCardInsert(card);
+  StartTimerT2();
+
+  error = Terminal(&scd_logger);
+
+  duration = 0;
+  if(sim_num_exchanges > 0)
+    duration = sim_exchanges[sim_num_exchanges - 1].card_end;
+
+  return Report(name, 0, error, duration);
+}
+
+/**
+ * Runs the terminal application against the virtual card
+ */
+static uint8_t RunTerminal(const char *name)
+{
+  return RunTerminalWith(name, &sim_card_emv);
+}
+
+/**
+ * Runs the terminal application against a card that accepts PPS
+ */
+static uint8_t RunTerminalPPS(const char *name)
+{
+  return RunTerminalWith(name, &sim_card_emv_fast);
+}
+
+/**
+ * Runs the terminal application against a card that uses T=1
+ */
+static uint8_t RunTerminalT1(const char *name)
+{
+  return RunTerminalWith(name, &sim_card_emv_t1);
+}
+
+/**
+ * Runs the terminal application twice and checks that each session gets
+ * its own transaction number, so the index entry of the first one is not
+ * replaced by the second one
+ */
+static uint8_t RunTerminalIndex(const char *name)
+{
+  log_trans_t first, second;
+  const char *reply;
+  uint8_t error;
+  sim_time_t duration;
+
+  Prepare();
+  SimCardInsert(&sim_card_emv);
+  StartTimerT2();
+
+  error = Terminal(&scd_logger);
+  if(error == 0)
+  {
+    SimCardInsert(&sim_card_emv);
+    error = Terminal(&scd_logger);
+  }
+
+  if(error == 0 && (nCounter != 2 ||
+      eeprom_read_byte((uint8_t*)EEPROM_COUNTER) != 2 ||
+      ReadLogIndex(1, &first) != 0 || ReadLogIndex(2, &second) != 0 ||
+      first.number != 1 || second.number != 2 ||
+      first.record == second.record || first.length == 0 ||
+      second.length == 0))
+    error = RET_ERROR;
+
+  SimHostReset();
+  reply = ProcessSerialData("AT+CGIDX", &scd_logger);
+  if(error == 0 && (reply == NULL || strcmp(reply, "AT OK\r\n") != 0 ||
+      ((const uint8_t*)SimHostOutput())[0] != 2))
+    error = RET_ERROR;
+  if(verbose)
+    printf("  transactions %u\n", nCounter);
+
+  duration = 0;
+  if(sim_num_exchanges > 0)
+    duration = sim_exchanges[sim_num_exchanges - 1].card_end;
+
+  return Report(name, 0, error, duration);
+}
+
+/**
+ * Runs the terminal application against a card that returns the data of
+ * each case 4 command in chunks of 8 bytes, so TerminalSendT0Command has
+ * to gather each response from many GET RESPONSE commands
+ */
+static uint8_t RunTerminalChunks(const char *name)
+{
+  uint8_t error;
+  uint16_t i, chunks;
+  sim_time_t duration;
+
+  Prepare();
+  SimCardInsert(&sim_card_emv_chunked);
+  StartTimerT2();
+
+  error = Terminal(&scd_logger);
+
+  chunks = 0;
+  for(i = 0; i < sim_num_exchanges; i++)
+  {
+    if(sim_exchanges[i].ins != 0xC0)
+      continue;
+    chunks++;
+    if(sim_exchanges[i].p3 > sim_card_emv_chunked.chunk)
+      error = RET_ERROR;
+  }
+  if(chunks < TERMINAL_MIN_CHUNKS)
+    error = RET_ERROR;
+  if(verbose)
+    printf("  GET RESPONSE commands %u\n", chunks);
+
+  duration = 0;
+  if(sim_num_exchanges > 0)
+    duration = sim_exchanges[sim_num_exchanges - 1].card_end;
+
+  return Report(name, 0, error, duration);
+}
+
+/**
+ * Runs the terminal application against a card that sends NULL bytes
+ * while it takes longer than WWT to process a command
+ */
+static uint8_t RunTerminalNull(const char *name)
+{
+  return RunTerminalWith(name, &sim_card_emv_slow);
+}
+
+/**
+ * Runs the terminal application against a card that takes longer than
+ * WWT to process a command without sending NULL bytes. The terminal
+ * application must give up once WWT has elapsed, and not before: the
+ * card must lose power between WWT and WWT plus ICC_WWT_EXTRA after the
+ * last byte it received, allowing one more character for that byte.
+ * WWT is 960 * WI * F ICC clocks, or 960 * WI * D ETUs at the rate
+ * selected with PPS, whatever D the SCD selects.
+ *
+ * @param card the silent card
+ * @param F the F value of the rate used with the card
+ */
+static uint8_t RunTerminalWWTWith(
+    const char *name, const SimCardProfile *card, uint16_t F)
+{
+  uint8_t error;
+  sim_time_t etu, wwt, margin, rx, off, duration;
+
+  Prepare();
+  SimCardInsert(card);
+  StartTimerT2();
+  etu = SimICCETU();
+
+  error = Terminal(&scd_logger);
+  rx = SimCardLastReceived(&off);
+  duration = off - rx;
+  wwt = 960UL * 10 * F * etu / 372;
+  margin = (ICC_WWT_EXTRA * F / 372 + 12) * etu;
+  if(verbose)
+    printf("  terminal error %u  silence %.0f us  WWT %.0f us\n",
+        error, SimCyclesToUs(duration), SimCyclesToUs(wwt));
+  error = (error == 0) ? RET_ERROR : 0;
+  if(off < rx || duration < wwt || duration > wwt + margin)
+    error = RET_ERROR;
+
+  return Report(name, 0, error, duration);
+}
+
+/**
+ * Runs the terminal application against a silent card at the default
+ * rate
+ */
+static uint8_t RunTerminalWWT(const char *name)
+{
+  return RunTerminalWWTWith(name, &sim_card_emv_silent, 372);
+}
+
+/**
+ * Runs the terminal application against a silent card at the F = 512
+ * rate selected with PPS, where WWT is longer than 960 * WI default
+ * ETUs
+ */
+static uint8_t RunTerminalWWTFast(const char *name)
+{
+  return RunTerminalWWTWith(name, &sim_card_emv_silent_fast, 512);
+}
+
+/**
+ * Walks the READ RECORD responses of the virtual card as the terminal
+ * application does in a READ RECORD sweep. Walking each record with a
+ * TLV cursor, descending into the templates inside it and searching
+ * its CDOL1 must not allocate anything, and ParseRECORD must make one
+ * copy of each record whatever the number of objects in it.
+ */
+static uint8_t RunTLVRecords(const char *name)
+{
+  const SimCardEntry *entry;
+  uint8_t data[256];
+  uint8_t error = 0;
+  uint16_t len, records, objects;
+  uint32_t allocs, blocks;
+  RECORD *rec;
+  TLVCursor tlv, obj, inner;
+
+  Prepare();
+  blocks = SimHeapBlocks();
+
+  records = 0;
+  objects = 0;
+  for(entry = sim_card_emv.entries; entry->command != NULL; entry++)
+  {
+    if(strncmp(entry->command, "00B2", 4) != 0)
+      continue;
+    len = SimParseHex(entry->response, data, sizeof(data));
+    records++;
+
+    // walk the record in place, with any template inside it
+    allocs = SimHeapAllocs();
+    InitTLVCursor(&tlv, data, len, 1);
+    if(NextTLV(&tlv) || tlv.tag1 != 0x70 || EnterTLV(&tlv, &obj))
+      error = RET_ERROR;
+    while(NextTLV(&obj) == RET_SUCCESS)
+    {
+      objects++;
+      if(EnterTLV(&obj, &inner) != RET_SUCCESS)
+        continue;
+      while(NextTLV(&inner) == RET_SUCCESS)
+        objects++;
+      if(inner.left != 0)
+        error = RET_ERROR;
+    }
+    if(obj.left != 0 || tlv.left != 0 || SimHeapAllocs() != allocs)
+      error = RET_ERROR;
+
+    // a truncated record is rejected
+    if(ParseRECORD(data, len - 1) != NULL)
+      error = RET_ERROR;
+
+    allocs = SimHeapAllocs();
+    rec = ParseRECORD(data, len);
+    if(rec == NULL || SimHeapAllocs() != allocs + 2)
+    {
+      error = RET_ERROR;
+      FreeRECORD(rec);
+      continue;
+    }
+
+    allocs = SimHeapAllocs();
+    if(GetTLVFromRECORD(rec, 0x8C, 0, &tlv) == RET_SUCCESS &&
+        AmountPositionInCDOLRecord(rec) != TLV_CDOL1_AMOUNT)
+      error = RET_ERROR;
+    if(SimHeapAllocs() != allocs)
+      error = RET_ERROR;
+    FreeRECORD(rec);
+  }
+
+  len = SimParseHex(TLV_CDOL1_LATE, data, sizeof(data));
+  rec = ParseRECORD(data, len);
+  if(AmountPositionInCDOLRecord(rec) != TLV_CDOL1_LATE_AMOUNT)
+    error = RET_ERROR;
+  FreeRECORD(rec);
+
+  if(records == 0 || SimHeapBlocks() != blocks)
+    error = RET_ERROR;
+  if(verbose)
+    printf("  records %u  objects %u\n", records, objects);
+
+  return Report(name, 0, error, 0);
+}
+
+/**
+ * Commits logs and resets the SCD before they are copied, as INT0_vect
+ * and WDT_vect do, long after the power-on reset. Each restart must
+ * copy the committed log, giving the same EEPROM as without the reset,
+ * while a restart after a power-on reset must not use the logger.
+ */
+static uint8_t RunLogBoot(const char *name)
+{
+  static uint8_t base[SIM_EEPROM_SIZE], expected[SIM_EEPROM_SIZE];
+  static uint8_t data[600];
+  volatile uint8_t flags = 0;
+  uint8_t error = 0;
+  uint16_t i, n, len;
+
+  Prepare();
+  for(i = 0; i < sizeof(data); i++)
+    data[i] = i * 5;
+
+  for(n = 0; n < 3; n++)
+  {
+    memcpy(base, sim_eeprom, SIM_EEPROM_SIZE);
+    len = 200 + n * 150;
+
+    // reference run, without the reset
+    ResetLogger(&scd_logger);
+    LogBytes(&scd_logger, LOG_BYTE_FROM_ICC, data + n, len);
+    WriteLogEEPROM(&scd_logger);
+    memcpy(expected, sim_eeprom, SIM_EEPROM_SIZE);
+    memcpy(sim_eeprom, base, SIM_EEPROM_SIZE);
+
+    // the reset comes before the first byte of the copy
+    ResetLogger(&scd_logger);
+    LogBytes(&scd_logger, LOG_BYTE_FROM_ICC, data + n, len);
+    CommitLogEEPROM(&scd_logger);
+    sim_eeprom_writes = 0;
+    sim_eeprom_reset_at = 1;
+    if(setjmp(sim_reset_jmp) == 0)
+    {
+      FlushLogEEPROM(&scd_logger);
+      error = RET_ERROR;
+    }
+    else
+      flags = BootSCD();
+    sim_eeprom_reset_at = 0;
+
+    if(flags != _BV(WDRF) || memcmp(sim_eeprom, expected, SIM_EEPROM_SIZE))
+      error = RET_ERROR;
+    if(verbose)
+      printf("  reset %u: flags %02X\n", n, flags);
+  }
+
+  // after a power-on reset the pending copy is not done
+  ResetLogger(&scd_logger);
+  LogBytes(&scd_logger, LOG_BYTE_FROM_ICC, data, 100);
+  CommitLogEEPROM(&scd_logger);
+  memcpy(expected, sim_eeprom, SIM_EEPROM_SIZE);
+  MCUSR |= _BV(PORF);
+  flags = BootSCD();
+  if(!(flags & _BV(PORF)) || MCUSR != 0 ||
+      memcmp(sim_eeprom, expected, SIM_EEPROM_SIZE))
+    error = RET_ERROR;
+
+  return Report(name, 0, error, sim_now);
+}
+
+/**
+ * Commits a record whose log is never copied, as when power is lost
+ * before FlushLogEEPROM, between two complete records. The log read
+ * from EEPROM and pulled with AT+CGLOG must only have the complete
+ * records, not the old bytes of the ring under the torn one.
+ */
+static uint8_t RunLogTorn(const char *name)
+{
+  const uint8_t data[] = {0x00, 0xB2, 0x01, 0x0C, 0x00};
+  uint16_t first, size;
+  uint8_t error = 0;
+
+  Prepare();
+
+  ResetLogger(&scd_logger);
+  LogBytes(&scd_logger, LOG_BYTE_FROM_TERMINAL, data, sizeof(data));
+  WriteLogEEPROM(&scd_logger);
+  first = LogSizeEEPROM();
+
+  // the copy of the second record is lost with the logger
+  ResetLogger(&scd_logger);
+  LogBytes(&scd_logger, LOG_BYTE_TO_ICC, data, sizeof(data));
+  CommitLogEEPROM(&scd_logger);
+  ResetLogger(&scd_logger);
+  if(LogSizeEEPROM() != first ||
+      PullLog("AT+CGLOG", 0, &scd_logger) != first)
+    error = RET_ERROR;
+
+  ResetLogger(&scd_logger);
+  LogBytes(&scd_logger, LOG_BYTE_FROM_ICC, data, 2);
+  WriteLogEEPROM(&scd_logger);
+  size = LogSizeEEPROM();
+  if(size != first + 4 || PullLog("AT+CGLOG", 0, &scd_logger) != size)
+    error = RET_ERROR;
+  if(verbose)
+    printf("  log %u bytes, first record %u bytes\n", size, first);
+
+  return Report(name, 0, error, sim_now);
+}
+
+uint16_t __real_LogEncode(log_struct_t *logger, uint16_t end,
+    log_write_t write);
+
+/**
+ * Counts the calls to LogEncode, which the host build links here (see
+ * HOST_LDFLAGS in the Makefile)
+ */
+uint16_t __wrap_LogEncode(log_struct_t *logger, uint16_t end,
+    log_write_t write)
+{
+  sim_encode_calls++;
+  return __real_LogEncode(logger, end, write);
+}
+
+/**
+ * Commits the largest log to a ring full of the smallest records, the
+ * worst case of CommitLogEEPROM as all of them are dropped. Checks that
+ * the commit does not encode the log, writes at most the transaction
+ * counter, a slot and the record header and reads one header for each
+ * record dropped besides the state of the ring. The copy done by
+ * FlushLogEEPROM encodes the log instead.
+ */
+static uint8_t RunLogCommit(const char *name)
+{
+  uint8_t data[60];
+  log_ring_t ring;
+  sim_time_t start, commit;
+  uint32_t reads, writes, dropped, encodes;
+  uint16_t i;
+  uint8_t error = 0;
+
+  Prepare();
+  for(i = 0; i < EEPROM_TLOG_SIZE / (EEPROM_LOG_RECORD_HEADER + 2); i++)
+  {
+    ResetLogger(&scd_logger);
+    LogByte1(&scd_logger, LOG_BYTE_FROM_ICC, i);
+    WriteLogEEPROM(&scd_logger);
+  }
+  ReadLogRingState(&ring);
+  dropped = LogRingUsed(&ring) / (EEPROM_LOG_RECORD_HEADER + 2);
+
+  // exchanges in both ways, as their chains take the most encoder work
+  for(i = 0; i < sizeof(data); i++)
+    data[i] = i * 11;
+  ResetLogger(&scd_logger);
+  while(scd_logger.position < LOG_BUFFER_SIZE - 120)
+  {
+    LogBytes(&scd_logger, LOG_BYTE_TO_ICC, data, sizeof(data));
+    LogTime(&scd_logger, LOG_TIME_FINE, scd_logger.position);
+    LogBytes(&scd_logger, LOG_BYTE_FROM_ICC, data + 1, 40);
+    LogTime(&scd_logger, LOG_TIME_GENERAL, scd_logger.position);
+  }
+
+  sim_encode_calls = 0;
+  sim_eeprom_reads = 0;
+  sim_eeprom_writes = 0;
+  start = sim_now;
+  CommitLogEEPROM(&scd_logger);
+  commit = sim_now - start;
+  reads = sim_eeprom_reads;
+  writes = sim_eeprom_writes;
+  encodes = sim_encode_calls;
+  ReadLogRingState(&ring);
+  if(verbose)
+    printf("  commit: %lu records dropped, %lu bytes read, %lu written, "
+        "%lu encodes, %.1f ms\n", (unsigned long)dropped,
+        (unsigned long)reads, (unsigned long)writes, (unsigned long)encodes,
+        SimCyclesToUs(commit) / 1000.0);
+
+  // all records are dropped, the state is read, then checked before
+  // each byte is updated
+  if(encodes != 0 || ring.tail != scd_logger.flush_addr ||
+      writes > 1 + EEPROM_LOG_SLOT_SIZE + EEPROM_LOG_RECORD_HEADER ||
+      reads > 1 + EEPROM_LOG_NSLOTS * EEPROM_LOG_SLOT_SIZE +
+      dropped * EEPROM_LOG_RECORD_HEADER +
+      2 + EEPROM_LOG_SLOT_SIZE + EEPROM_LOG_RECORD_HEADER)
+    error = RET_ERROR;
+
+  sim_encode_calls = 0;
+  if(FlushLogEEPROM(&scd_logger) != 0 || sim_encode_calls != 2)
+    error = RET_ERROR;
+
+  return Report(name, 0, error, commit);
+}
+
+/**
+ * Stores the bytes encoded by LogEncode after those of sim_encoded
+ */
+static void WriteEncoded(const uint8_t *data, uint8_t len)
+{
+  memcpy(sim_encoded + sim_nencoded, data, len);
+  sim_nencoded += len;
+}
+
+/**
+ * Returns the number of bytes that version 1 of the log takes for the
+ * given version 2 entries, as each byte of a run is an entry of 2 bytes
+ * and each time difference an absolute time of 5 bytes
+ *
+ * @param log the entries
+ * @param len the number of bytes of the entries
+ * @return the number of bytes in version 1
+ */
+static uint16_t LogSizeV1(const uint8_t *log, uint16_t len)
+{
+  uint16_t addr = 0, size = 0;
+  uint8_t header;
+
+  while(addr < len)
+  {
+    header = log[addr++];
+    if((header & 0x03) == LOG_RUN)
+    {
+      size += 2 * log[addr];
+      addr += log[addr] + 1;
+    }
+    else if((header & 0x03) == 0 && LogTypeMask(header) == LOG_MASK_TIME)
+    {
+      size += 5;
+      while(log[addr++] & 0x80);
+    }
+    else
+    {
+      size += (header & 0x03) + 2;
+      addr += (header & 0x03) + 1;
+    }
+  }
+
+  return size;
+}
+
+/**
+ * Logs exchanges with long data, recent and other fine times, short and
+ * long general times and entries of the same type one after the other,
+ * so that LogEncode gives chains with all kinds of tokens
+ *
+ * @param logger the log structure
+ */
+static void LogChains(log_struct_t *logger)
+{
+  uint8_t data[300];
+  uint32_t fine = 0, time = 1000;
+  uint16_t i;
+
+  for(i = 0; i < sizeof(data); i++)
+    data[i] = i * 3;
+  ResetLogger(logger);
+  LogBytes(logger, LOG_BYTE_ATR_FROM_ICC, data, 4);
+  LogTime(logger, LOG_TIME_GENERAL, time);
+  LogTime(logger, LOG_TIME_FINE, fine);
+  for(i = 0; i < 6; i++)
+  {
+    if(i == 3)
+      LogTransaction(logger, LogMark(logger), time, 2);
+    LogBytes(logger, LOG_BYTE_TO_ICC, data + i, 5);
+    fine += 1860 + 2 * (i & 1);
+    LogTime(logger, LOG_TIME_FINE, fine);
+    LogByte1(logger, LOG_BYTE_FROM_ICC, data[i + 1]);
+    LogBytes(logger, LOG_BYTE_TO_ICC, data, 40 + 50 * i);
+    fine += 20000 * i + 3;
+    LogTime(logger, LOG_TIME_FINE, fine);
+    LogBytes(logger, LOG_BYTE_FROM_ICC, data + 2, 2);
+    if(i == 4)
+    {
+      LogMark(logger);
+      LogBytes(logger, LOG_BYTE_FROM_ICC, data + 2, 2);
+    }
+    time += (i % 3 == 2) ? 300 : 12 + 20 * (i % 3);
+    LogTime(logger, LOG_TIME_GENERAL, time);
+  }
+  LogByte1(logger, LOG_ICC_DEACTIVATED, 0);
+}
+
+/**
+ * Forwards a purchase and checks that its EEPROM log decodes to entries
+ * that LogEncode gives back as they were, and that it takes at most half
+ * of the size of the version 1 log. Then checks that a log with chains of
+ * all kinds of tokens decodes to the entries it was encoded from, and so
+ * does the log of its second transaction alone. Last, checks that the
+ * record of that log only takes the encoded length in a full ring,
+ * keeping the older record that its committed length would drop
+ *
+ * @param logger the log structure
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t ForwardCompact(log_struct_t *logger)
+{
+  static uint8_t log[EEPROM_TLOG_SIZE], entries[2 * EEPROM_TLOG_SIZE];
+  uint8_t data[298];
+  log_ring_t ring;
+  uint16_t size, len, i;
+  uint8_t result;
+
+  result = ForwardData(logger);
+  if(result != 0)
+    return result;
+
+  size = ReadLogEEPROM(log);
+  ReadLogRingState(&ring);
+  if(LogRingUsed(&ring) != EEPROM_LOG_RECORD_HEADER + size)
+    return RET_ERROR;
+  len = DecodeLog(log, size, entries, sizeof(entries));
+  if(verbose)
+    printf("  log %u bytes, %u in version 2 and %u in version 1\n",
+        size, len, LogSizeV1(entries, len));
+  if(size == 0 || len > LOG_BUFFER_SIZE || 2 * size > LogSizeV1(entries, len))
+    return RET_ERROR;
+  ResetLogger(logger);
+  memcpy(logger->log_buffer, entries, len);
+  sim_nencoded = 0;
+  if(LogEncode(logger, len, WriteEncoded) != size ||
+      sim_nencoded != size || memcmp(sim_encoded, log, size) != 0)
+    return RET_ERROR;
+
+  LogChains(logger);
+  sim_nencoded = 0;
+  size = LogEncode(logger, logger->position, WriteEncoded);
+  if(sim_nencoded != size || size >= logger->position ||
+      DecodeLog(sim_encoded, size, entries, sizeof(entries)) !=
+      logger->position ||
+      memcmp(entries, logger->log_buffer, logger->position) != 0)
+    return RET_ERROR;
+  i = logger->index[0].encoded;
+  if(DecodeLog(sim_encoded + i, size - i, entries, sizeof(entries)) !=
+      logger->position - logger->index[0].offset ||
+      memcmp(entries, logger->log_buffer + logger->index[0].offset,
+        logger->position - logger->index[0].offset) != 0)
+    return RET_ERROR;
+
+  // 1-byte entries or runs of 255 bytes (without bytes to copy) one
+  // after the other would be longer as chains, so they are not chained
+  ResetLogger(logger);
+  for(i = 0; i < 20; i++)
+    LogByte1(logger, (i & 1) ? LOG_BYTE_FROM_ICC : LOG_BYTE_TO_ICC, i);
+  if(LogEncode(logger, logger->position, NULL) != logger->position)
+    return RET_ERROR;
+  for(i = 0; i < 255; i++)
+  {
+    log[i] = i;
+    log[255 + i] = 255 - i;
+  }
+  ResetLogger(logger);
+  LogBytes(logger, LOG_BYTE_TO_ICC, log, 255);
+  LogBytes(logger, LOG_BYTE_FROM_ICC, log + 255, 255);
+  if(LogEncode(logger, logger->position, NULL) != logger->position)
+    return RET_ERROR;
+
+  // records of 902 bytes leave less space than the entries of the log
+  // take, but enough for the encoded log
+  ResetEEPROM();
+  memset(data, 0x5A, sizeof(data));
+  for(i = 0; i < 3; i++)
+  {
+    ResetLogger(logger);
+    LogBytes(logger, LOG_BYTE_FROM_ICC, data, sizeof(data));
+    LogBytes(logger, LOG_BYTE_FROM_ICC, data, sizeof(data));
+    LogBytes(logger, LOG_BYTE_FROM_ICC, data, sizeof(data));
+    WriteLogEEPROM(logger);
+  }
+  LogChains(logger);
+  CommitLogEEPROM(logger);
+  ReadLogRingState(&ring);
+  len = LogRingUsed(&ring);
+  FlushLogEEPROM(logger);
+  ReadLogRingState(&ring);
+  if(verbose)
+    printf("  ring %u bytes used after the commit, %u after the copy\n",
+        len, LogRingUsed(&ring));
+  if(len != 2 * 906 + EEPROM_LOG_RECORD_HEADER + logger->position ||
+      LogRingUsed(&ring) != 3 * 906 + EEPROM_LOG_RECORD_HEADER + size ||
+      ReadLogEEPROM(log) != 3 * 902 + size ||
+      memcmp(log + 3 * 902, sim_encoded, size) != 0)
+    return RET_ERROR;
+
+  return 0;
+}
+
+/**
+ * Forwards a purchase and checks the encoding of the EEPROM log
+ */
+static uint8_t RunLogCompact(const char *name)
+{
+  return RunBetween(name, ForwardCompact, &sim_card_emv,
+      &sim_terminal_purchase);
+}
+
+/**
+ * Checks the replies sent by TerminalVSerial to the host
+ *
+ * @param binary non-zero if the replies are binary frames
+ * @param count the number of RAPDUs expected
+ * @param last the status expected after the RAPDUs (FRAME_OK or FRAME_STOP
+ * for a batch), or zero if none
+ * @return zero if there is one OK followed by the expected replies
+ */
+static uint8_t CheckHostReplies(uint8_t binary, uint16_t count, uint8_t last)
+{
+  const char *status = NULL;
+
+  const char *text, *end;
+  const uint8_t *payload;
+  size_t offset = 0;
+  uint16_t n = 0, len;
+  uint8_t type;
+
+  if(binary)
+  {
+    payload = SimHostReadFrame(&offset, &type, &len);
+    if(payload == NULL || type != FRAME_OK)
+      return 1;
+    while((payload = SimHostReadFrame(&offset, &type, &len)) != NULL)
+    {
+      if(last != 0 && n == count && type == last)
+        break;
+      if(type != FRAME_RAPDU || len < 2)
+        return 1;
+      n++;
+    }
+    if(last != 0 && (payload == NULL || type != last))
+      return 1;
+
+    return (offset != SimHostOutputLength() || n != count);
+  }
+
+  if(last == FRAME_OK)
+    status = "AT OK\r\n";
+  else if(last == FRAME_STOP)
+    status = "AT STOP\r\n";
+
+  text = SimHostOutput();
+  if(strstr(text, "AT OK\r\n") != text)
+    return 1;
+  text += strlen("AT OK\r\n");
+  while((end = strstr(text, "\r\n")) != NULL)
+  {
+    if(status != NULL && n == count && strcmp(text, status) == 0)
+      return 0;
+    if(end - text < 4 || strncmp(text, "AT", 2) == 0)
+      return 1;
+    text = end + 2;
+    n++;
+  }
+
+  return (status != NULL || *text != 0 || n != count);
+}
+
+/**
+ * Runs the virtual serial terminal (AT+CCINIT) against the virtual card,
+ * with the purchase CAPDUs queued by the USB host
+ *
+ * @param name the name of the scenario
+ * @param binary non-zero to exchange binary frames (AT+CBIN) instead of hex
+ * encoded AT commands
+ * @return zero if the scenario passed, non-zero otherwise
+ */
+static uint8_t RunHostTerminalWith(const char *name, uint8_t binary)
+{
+  const char **cmd;
+  const char *reply;
+  char line[16 + 2 * HOST_APDU_SIZE];
+  uint8_t data[HOST_APDU_SIZE];
+  uint16_t len, count = 0;
+  uint8_t error = 0;
+
+  Prepare();
+  SimCardInsert(&sim_card_emv);
+  StartTimerT2();
+
+  if(binary)
+  {
+    reply = ProcessSerialData("AT+CBIN", NULL);
+    if(reply == NULL || strcmp(reply, "AT OK\r\n") != 0)
+      error = RET_ERROR;
+  }
+  for(cmd = sim_terminal_purchase.commands; *cmd != NULL; cmd++, count++)
+  {
+    if(binary)
+    {
+      len = SimParseHex(*cmd, data, sizeof(data));
+      SimHostWriteFrame(FRAME_CAPDU, data, len);
+    }
+    else
+    {
+      snprintf(line, sizeof(line), "AT+CCAPDU=%s", *cmd);
+      SimHostWrite(line);
+    }
+  }
+  if(binary)
+    SimHostWriteFrame(FRAME_END, NULL, 0);
+  else
+    SimHostWrite("AT+CCEND");
+
+  reply = ProcessSerialData("AT+CCINIT", &scd_logger);
+  if(error == 0 && (reply == NULL || strcmp(reply, "AT OK\r\n") != 0))
+    error = RET_ERROR;
+  else if(CheckHostReplies(binary, count, 0))
+    error = RET_ERROR;
+  if(verbose)
+    printf("  host bytes %lu\n", (unsigned long)SimHostOutputLength());
+
+  if(binary)
+    ProcessSerialData("AT+CBIN=0", NULL);
+
+  return Report(name, 0, error, sim_now);
+}
+
+/**
+ * Runs the virtual serial terminal with hex encoded AT commands
+ */
+static uint8_t RunHostTerminal(const char *name)
+{
+  return RunHostTerminalWith(name, 0);
+}
+
+/**
+ * Runs the virtual serial terminal with binary frames
+ */
+static uint8_t RunHostTerminalBinary(const char *name)
+{
+  return RunHostTerminalWith(name, 1);
+}
+
+/**
+ * Runs the virtual serial terminal with the purchase sent as one AT+CCBATCH
+ * script. Every step must return 9000, and the script ends with a READ
+ * RECORD that fails and stops the batch before its last step.
+ *
+ * @param name the name of the scenario
+ * @param binary non-zero to exchange binary frames (AT+CBIN) instead of hex
+ * encoded AT commands
+ * @return zero if the scenario passed, non-zero otherwise
+ */
+static uint8_t RunHostBatchWith(const char *name, uint8_t binary)
+{
+  static const char *extra[] = {"00B2051400", "00B2011400", NULL};
+  const char **cmd;
+  const char *reply;
+  char line[16 + 2 * HOST_BATCH_SIZE];
+  uint8_t batch[HOST_BATCH_SIZE];
+  uint16_t i, len = 0, count = 0;
+  uint8_t error = 0;
+
+  Prepare();
+  SimCardInsert(&sim_card_emv);
+  StartTimerT2();
+
+  for(cmd = sim_terminal_purchase.commands; *cmd != NULL; cmd++, count++)
+  {
+    batch[len] = BATCH_SW_EQ;
+    batch[len + 1] = 0x90;
+    batch[len + 2] = 0x00;
+    batch[len + 3] = SimParseHex(*cmd, &batch[len + 4], HOST_APDU_SIZE);
+    len += 4 + batch[len + 3];
+  }
+  for(cmd = extra; *cmd != NULL; cmd++)
+  {
+    batch[len] = (cmd == extra) ? BATCH_SW_EQ : BATCH_ANY;
+    batch[len + 1] = 0x90;
+    batch[len + 2] = 0x00;
+    batch[len + 3] = SimParseHex(*cmd, &batch[len + 4], HOST_APDU_SIZE);
+    len += 4 + batch[len + 3];
+  }
+  // the failing READ RECORD is answered, the step after it is not run
+  count++;
+
+  if(binary)
+  {
+    reply = ProcessSerialData("AT+CBIN", NULL);
+    if(reply == NULL || strcmp(reply, "AT OK\r\n") != 0)
+      error = RET_ERROR;
+    SimHostWriteFrame(FRAME_BATCH, batch, len);
+    SimHostWriteFrame(FRAME_END, NULL, 0);
+  }
+  else
+  {
+    strcpy(line, "AT+CCBATCH=");
+    for(i = 0; i < len; i++)
+      sprintf(line + 11 + 2 * i, "%02X", batch[i]);
+    SimHostWrite(line);
+    SimHostWrite("AT+CCEND");
+  }
+
+  reply = ProcessSerialData("AT+CCINIT", &scd_logger);
+  if(error == 0 && (reply == NULL || strcmp(reply, "AT OK\r\n") != 0))
+    error = RET_ERROR;
+  else if(CheckHostReplies(binary, count, FRAME_STOP))
+    error = RET_ERROR;
+  if(verbose)
+    printf("  host bytes %lu\n", (unsigned long)SimHostOutputLength());
+
+  if(binary)
+    ProcessSerialData("AT+CBIN=0", NULL);
+
+  return Report(name, 0, error, sim_now);
+}
+
+/**
+ * Runs a batch of CAPDUs with hex encoded AT commands
+ */
+static uint8_t RunHostBatch(const char *name)
+{
+  return RunHostBatchWith(name, 0);
+}
+
+/**
+ * Runs a batch of CAPDUs with binary frames
+ */
+static uint8_t RunHostBatchBinary(const char *name)
+{
+  return RunHostBatchWith(name, 1);
+}
+
+/// Available scenarios
+static const SimScenario scenarios[] = {
+  {"forward", RunForward},
+  {"relay", RunRelay},
+  {"forward-pps", RunForwardPPS},
+  {"relay-pps", RunRelayPPS},
+  {"forward-t1", RunForwardT1},
+  {"forward-live", RunForwardLive},
+  {"forward-mask", RunForwardMask},
+  {"relay-timing", RunRelayTiming},
+  {"forward-null", RunForwardNull},
+  {"relay-null", RunRelayNull},
+  {"relay-null-pps", RunRelayNullPPS},
+  {"line-hook", RunLineHook},
+  {"task-latency", RunTaskLatency},
+  {"eeprom-dump", RunForwardDump},
+  {"log-pull", RunForwardPull},
+  {"log-ring", RunLogRing},
+  {"log-reset", RunLogReset},
+  {"log-boot", RunLogBoot},
+  {"log-torn", RunLogTorn},
+  {"log-commit", RunLogCommit},
+  {"log-compact", RunLogCompact},
+  {"log-index", RunForwardIndex},
+  {"terminal", RunTerminal},
+  {"terminal-pps", RunTerminalPPS},
+  {"terminal-t1", RunTerminalT1},
+  {"terminal-index", RunTerminalIndex},
+  {"terminal-chunks", RunTerminalChunks},
+  {"terminal-null", RunTerminalNull},
+  {"terminal-wwt", RunTerminalWWT},
+  {"terminal-wwt-fast", RunTerminalWWTFast},
+  {"tlv-records", RunTLVRecords},
+  {"dummypin", RunDummyPIN},
+  {"usb-terminal", RunHostTerminal},
+  {"usb-terminal-bin", RunHostTerminalBinary},
+  {"usb-batch", RunHostBatch},
+  {"usb-batch-bin", RunHostBatchBinary},
+  {NULL, NULL},
+};
+
+/**
+ * Runs the scenarios given as arguments, or all of them
+ *
+ * Use -v to print the exchanges and the LCD output and -o FILE to write
+ * the results as JSON, so they can be compared between builds.
+ */
+int main(int argc, char **argv)
+{
+  const SimScenario *s;
+  const char *names[16];
+  const char *output = NULL;
+  int i, failed = 0, count = 0;
+
+  for(i = 1; i < argc; i++)
+  {
+    if(strcmp(argv[i], "-v") == 0)
+      verbose = 1;
+    else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      output = argv[++i];
+    else if(argv[i][0] == '-' || count == 16)
+    {
+      fprintf(stderr, "usage: %s [-v] [-o FILE] [scenario...]\n", argv[0]);
+      return 2;
+    }
+    else
+    {
+      for(s = scenarios; s->name != NULL; s++)
+        if(strcmp(argv[i], s->name) == 0)
+          break;
+      if(s->name == NULL)
+      {
+        printf("unknown scenario: %s\n", argv[i]);
+        return 2;
+      }
+      names[count++] = s->name;
+    }
+  }
+
+  if(output != NULL)
+  {
+    bench = fopen(output, "w");
+    if(bench == NULL)
+    {
+      perror(output);
+      return 2;
+    }
+    fprintf(bench, "{\n  \"scenarios\": [\n");
+  }
+
+  // the LCD output of the applications is only shown in verbose mode
+  if(!verbose)
+    freopen("/dev/null", "w", stderr);
+
+  for(s = scenarios; s->name != NULL; s++)
+  {
+    for(i = 0; i < count; i++)
+      if(names[i] == s->name)
+        break;
+    if(count == 0 || i < count)
+      failed |= s->run(s->name);
+  }
+
+  if(bench != NULL)
+  {
+    fprintf(bench, "\n  ]\n}\n");
+    fclose(bench);
+  }
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,256 @@
+/**
+ * \file
+ * \brief	sim_profiles.c source file
+ *
+ * Canned cards and terminal scripts used by the host simulator. The card
+ * data follows the structure of a real EMV debit card, with records of
+ * realistic sizes so that the timing of the exchanges is representative.
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+
+#include "sim.h"
+
+/// Commands served by sim_card_emv
+static const SimCardEntry emv_entries[] = {
+  // SELECT PSE
+  {"00A40400315041592E5359532E4444463031",
+    "6F1A840E315041592E5359532E4444463031A5088801015F2D02656E",
+    0x9000, 10},
+  // Payment system directory
+  {"00B2010C",
+    "701A61184F07A0000000031010500A56495341204445424954870101",
+    0x9000, 20},
+  // SELECT application
+  {"00A40400A0000000031010",
+    "6F1F8407A0000000031010A514500A564953412044454249548701015F2D0265"
+      "6E",
+    0x9000, 10},
+  // GET PROCESSING OPTIONS
+  {"80A80000",
+    "800E7C00100103001801010120010200",
+    0x9000, 100},
+  // READ RECORD SFI 2
+  {"00B20114",
+    "703457134761739001010119D28122011234567890000F5F200F43415244484F"
+      "4C4445522F564953419F1F0A31323334353637383930",
+    0x9000, 20},
+  {"00B20214",
+    "704C5F25032301015F24032812315A0847617390010101195F3401019F0702FF"
+      "008E0E000000000000000042031E031F039F0D05F0400088009F0E0500100000"
+      "009F0F05F0400098005F28020826",
+    0x9000, 20},
+  {"00B20314",
+    "70358C159F02069F03069F1A0295055F2A029A039C019F37048D178A029F0206"
+      "9F03069F1A0295055F2A029A039C019F37049F08020096",
+    0x9000, 20},
+  // READ RECORD SFI 3, issuer public key certificate
+  {"00B2011C",
+    "7081B39081B0145719DD3B40707918D2A72ACFE2ADEF5D9058DCE18E98D108DB"
+      "A641F4D538AD16DA853FAA58BB5C7364FC6B2DC1FF7EDA4002EFC45B35270823"
+      "BADD84A57935ED3A0FF8592251FA68F8F9FBC748093B543A8B60C636A984BFDB"
+      "93E3561240F8EE66A6A2798E3708D470BEFDC0250AAA144EF636911373CEC0F7"
+      "6DAF526054BC1BBAE67EB285B8691E5C2184D99F1519DEE2992D82079DDB61F7"
+      "82B20DC51418405ABA8F9FCE107911040F8853771A13",
+    0x9000, 30},
+  // READ RECORD SFI 4, ICC public key certificate
+  {"00B20124",
+    "7081B49F4681B053DD4043924AC2E83BD8D49BC5F92A9C7115427B08B81D602E"
+      "2AF3B2FDBA24804CA278E7B631DB27163242C411D0A35A2BCD5FC2274CFE1492"
+      "BB691EA70018A68D569DB6FC165E5F183F05D23B4EACDE725E0C66C2DCA3D373"
+      "84B0005BF0E409CFB94BE9B500C96D76F3DACC5F1E23B7781038CA8B3F622DAD"
+      "3475505504B00C68197DA9338B858726249BD1BAA374E057ED66405A44A29C7D"
+      "2F9C2C7E58E6D5D27ABE90EFF6ACFB2ACA8C9CAA159292",
+    0x9000, 30},
+  {"00B20224",
+    "70378F01929F3201039224B140E42B9F56553CD47FC0C4DD42D4C467FEC2F025"
+      "F5F2A0B3C3A12DFD24FF0E7A8F09309F4701039F49039F3704",
+    0x9000, 20},
+  // GET DATA
+  {"80CA9F36",
+    "9F3602001C",
+    0x9000, 10},
+  {"80CA9F13",
+    "9F13020010",
+    0x9000, 10},
+  {"80CA9F17",
+    "9F170103",
+    0x9000, 10},
+  // VERIFY, plaintext PIN
+  {"00200080",
+    NULL,
+    0x9000, 150},
+  // INTERNAL AUTHENTICATE, takes an RSA signature
+  {"00880000",
+    "80818067B5BEE843C919B33D9955D49D73DD15E76E787B0654CC465EBEDDF2A9"
+      "9C67E106408A6913D3B1983DBB31B84025D41EF9CA6035CF0B648C5DA3748559"
+      "3C3966E938AF20E5D5344C1C2271472CE7B6BBE0A273A110654E06AD6438153F"
+      "68E826EBE83C9FC0DEF628B0AEFB40D54EDDBFDDD57E59E3D872DEA8FE0D881B"
+      "4CCC6C",
+    0x9000, 3000},
+  // GENERATE AC
+  {"80AE8000",
+    "801280001C5776CA33BEE50DA706010A03A00000",
+    0x9000, 1200},
+  {"80AE4000",
+    "801280001C5776CA33BEE50DA706010A03A00000",
+    0x9000, 1200},
+  {"80AE0000",
+    "801280001C5776CA33BEE50DA706010A03A00000",
+    0x9000, 1200},
+  {NULL, NULL, 0, 0},
+};
+
+/// Card answering an EMV purchase with offline data authentication
+const SimCardProfile sim_card_emv = {
+  "emv",
+  "3B6500002063CB6A00",
+  20,
+  2,
+  emv_entries,
+};
+
+/// Same card, allowing F = 512 and D = 32 in TA1
+const SimCardProfile sim_card_emv_fast = {
+  "emv-fast",
+  "3B759600002063CB6A00",
+  20,
+  2,
+  emv_entries,
+};
+
+/// Same card using T=1, with IFSC = 32 (TA3), BWI = 4 and CWI = 5 (TB3)
+const SimCardProfile sim_card_emv_t1 = {
+  "emv-t1",
+  "3BE000FF81312045CA",
+  20,
+  2,
+  emv_entries,
+};
+
+/// Same card, returning at most 8 bytes for each GET RESPONSE
+const SimCardProfile sim_card_emv_chunked = {
+  "emv-chunked",
+  "3B6500002063CB6A00",
+  20,
+  2,
+  emv_entries,
+  8,
+};
+
+/// Same card, 20 times slower and sending a NULL byte every 4000 ETUs
+const SimCardProfile sim_card_emv_slow = {
+  "emv-slow",
+  "3B6500002063CB6A00",
+  20,
+  2,
+  emv_entries,
+  0,
+  20,
+  4000,
+};
+
+/// Same card, 20 times slower and sending no NULL bytes
+const SimCardProfile sim_card_emv_silent = {
+  "emv-silent",
+  "3B6500002063CB6A00",
+  20,
+  2,
+  emv_entries,
+  0,
+  20,
+  0,
+};
+
+/// Same card, allowing F = 512 and D = 32 in TA1 and sending a NULL byte
+/// every 8 ETUs of the default rate while processing
+const SimCardProfile sim_card_emv_fast_null = {
+  "emv-fast-null",
+  "3B759600002063CB6A00",
+  20,
+  2,
+  emv_entries,
+  0,
+  0,
+  8,
+};
+
+/// Same silent card, allowing F = 512 and D = 32 in TA1
+const SimCardProfile sim_card_emv_silent_fast = {
+  "emv-silent-fast",
+  "3B759600002063CB6A00",
+  20,
+  2,
+  emv_entries,
+  0,
+  20,
+  0,
+};
+
+/// Commands sent by sim_terminal_purchase
+static const char *purchase_commands[] = {
+  // SELECT PSE
+  "00A404000E315041592E5359532E4444463031",
+  // READ RECORD with the wrong length, answered by 6Cxx
+  "00B2010C00",
+  // SELECT application
+  "00A4040007A0000000031010",
+  // GET PROCESSING OPTIONS, empty PDOL
+  "80A80000028300",
+  // READ RECORD for each entry in the AFL
+  "00B2011400",
+  "00B2021400",
+  "00B2031400",
+  "00B2011C00",
+  "00B2012400",
+  "00B2022400",
+  // GET DATA, PIN try counter
+  "80CA9F1700",
+  // VERIFY with PIN 1234
+  "0020008008241234FFFFFFFFFF",
+  // GENERATE AC (ARQC) with the CDOL1 data
+  "80AE80001D000000001000000000000000082600000000000826261015001234"
+  "5678",
+  NULL,
+};
+
+/// Terminal running a purchase with plaintext PIN verification
+const SimTerminalScript sim_terminal_purchase = {
+  "purchase",
+  purchase_commands,
+  120,
+  40,
+};
+
+/// Same purchase, requesting the rate offered in the ATR with PPS
+const SimTerminalScript sim_terminal_purchase_pps = {
+  "purchase-pps",
+  purchase_commands,
+  120,
+  40,
+  1,
+};
@@ -0,0 +1,823 @@
+/**
+ * \file
+ * \brief	sim_terminal.c source file
+ *
+ * Virtual T=0 terminal used by the host simulator. The terminal provides
+ * clock and reset to the SCD, reads the ATR and then sends the commands
+ * of its script, following procedure bytes and issuing GET RESPONSE or
+ * repeating a command as requested by 61xx and 6Cxx status words. If the
+ * script asks for it the terminal first requests the TA1 of the ATR
+ * with PPS.
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "sim.h"
+
+/// Character duration including guard time, in ETUs
+#define TERMINAL_CHAR_ETUS 12
+
+/// Minimum delay between characters in opposite directions, in ETUs
+#define TERMINAL_TURN_ETUS 16
+
+/// Block guard time of T=1, between the start bits of two blocks
+#define TERMINAL_BGT_ETUS 22
+
+/// IFSD announced by the terminal with T=1, small to force chaining
+#define TERMINAL_IFSD 32
+
+/// States of the virtual terminal
+typedef enum {
+  TERMINAL_OFF,       // no terminal connected
+  TERMINAL_ATR,       // receiving the ATR
+  TERMINAL_PPS,       // receiving the PPS response
+  TERMINAL_PROC,      // waiting for a procedure byte or SW1
+  TERMINAL_DATA,      // receiving response data
+  TERMINAL_SW2,       // waiting for SW2
+  TERMINAL_BLOCK,     // receiving a T=1 block
+  TERMINAL_DONE,      // script finished, terminal deactivated
+} SimTerminalState;
+
+SimLine sim_terminal_line;
+SimExchange sim_exchanges[SIM_MAX_EXCHANGES];
+uint16_t sim_num_exchanges;
+
+// static vars
+static const SimTerminalScript *script;
+static SimTerminalState state;
+static uint8_t connected;
+static sim_time_t clock_on, clock_off;    // clock runs in [clock_on, clock_off)
+static sim_time_t reset_high, reset_low;  // reset is high in [reset_high, reset_low)
+static uint8_t atr[33];
+static uint8_t natr;
+static uint8_t guard;                     // extra guard time (TC1)
+static sim_time_t etu;                    // ETU used by the terminal
+static uint8_t pps[4];                    // PPS request, then response
+static uint8_t npps;
+static uint16_t next_cmd;                 // index of the next script command
+static uint16_t completed;
+static uint8_t cmd[SIM_MAX_APDU];
+static uint16_t ncmd;
+static uint16_t nsent;                    // command data bytes already sent
+static uint8_t resp[SIM_MAX_APDU];
+static uint16_t nresp;
+static uint16_t nexpected;                // response data bytes still expected
+static uint8_t sw1;
+static sim_time_t last_rx;                // start of the last byte received
+static sim_time_t next_tx;                // earliest start of the next byte sent
+static uint16_t nterminal;                // exchanges recorded by the terminal
+static uint8_t t1;                        // non-zero if the ATR indicates T=1
+static uint8_t ifsc;                      // IFSC from TA3
+static uint8_t ns;                        // N(S) of the next I-block sent
+static uint8_t nr;                        // N(S) expected from the card
+static uint8_t block[259];                // T=1 block being received
+static uint16_t nblock;
+static uint8_t sent[259];                 // last T=1 block sent
+static uint16_t nblocksent;
+static uint8_t chunk;                     // length of the last command chunk
+static uint16_t ncard;                    // exchanges recorded by the card
+
+
+/**
+ * Computes the length of an ATR from its first bytes
+ *
+ * @param data the bytes received so far
+ * @param len the number of bytes received so far
+ * @return the total length of the ATR, or 0 if more bytes are needed
+ */
+static uint8_t AtrLength(const uint8_t *data, uint8_t len)
+{
+  uint8_t pos, y, k, tck, n, td;
+
+  if(len < 2)
+    return 0;
+
+  y = data[1] >> 4;
+  k = data[1] & 0x0F;
+  pos = 2;
+  tck = 0;
+  while(1)
+  {
+    n = ((y >> 3) & 1) + ((y >> 2) & 1) + ((y >> 1) & 1) + (y & 1);
+    pos += n;
+    if((y & 0x08) == 0)
+      break;
+    if(len < pos)
+      return 0;
+    td = data[pos - 1];
+    if((td & 0x0F) != 0)
+      tck = 1;
+    y = td >> 4;
+  }
+
+  return pos + k + tck;
+}
+
+/**
+ * Finds the protocol indicated in TD1 of the ATR and, for T=1, the IFSC
+ * in TA3
+ */
+static void ParseProtocol(void)
+{
+  uint8_t pos, td2;
+
+  pos = 2 + ((atr[1] >> 4) & 1) + ((atr[1] >> 5) & 1) + ((atr[1] >> 6) & 1);
+  if((atr[1] & 0x80) == 0 || (atr[pos] & 0x0F) != 1)
+    return;
+
+  t1 = 1;
+  td2 = pos + 1 + ((atr[pos] >> 4) & 1) + ((atr[pos] >> 5) & 1) +
+    ((atr[pos] >> 6) & 1);
+  if((atr[pos] & 0x80) && (atr[td2] & 0x10))
+    ifsc = atr[td2 + 1];
+}
+
+/**
+ * Schedules a byte to be sent by the terminal
+ *
+ * @param value the byte
+ * @param earliest the earliest time for the start bit
+ * @return the time of the start bit
+ */
+static sim_time_t Send(uint8_t value, sim_time_t earliest)
+{
+  sim_time_t start;
+
+  start = earliest > next_tx ? earliest : next_tx;
+  SimLinePush(&sim_terminal_line, value, start);
+  next_tx = start + (TERMINAL_CHAR_ETUS + guard) * etu;
+
+  return start;
+}
+
+/**
+ * Sends command data bytes
+ *
+ * @param count the number of bytes to send
+ * @param earliest the earliest time for the first byte
+ */
+static void SendData(uint16_t count, sim_time_t earliest)
+{
+  while(count-- > 0 && nsent + 5 < ncmd)
+  {
+    Send(cmd[5 + nsent++], earliest);
+    earliest = 0;
+  }
+}
+
+/**
+ * Deactivates the terminal: reset goes low, then the clock stops
+ *
+ * @param t the time of the deactivation
+ */
+static void Finish(sim_time_t t)
+{
+  state = TERMINAL_DONE;
+  reset_low = t;
+  clock_off = t + etu;
+}
+
+/**
+ * Records the start of the exchange for the command in cmd
+ *
+ * @param t the earliest time for the first byte
+ */
+static void StartExchange(sim_time_t t)
+{
+  SimExchange *e;
+
+  nsent = 0;
+  nresp = 0;
+
+  if(nterminal < SIM_MAX_EXCHANGES)
+  {
+    e = &sim_exchanges[nterminal];
+    e->cla = cmd[0];
+    e->ins = cmd[1];
+    e->p1 = cmd[2];
+    e->p2 = cmd[3];
+    e->p3 = cmd[4];
+    e->terminal_start = t > next_tx ? t : next_tx;
+  }
+}
+
+/**
+ * Sends the header of the command in cmd
+ *
+ * @param t the earliest time for the first byte
+ */
+static void SendHeader(sim_time_t t)
+{
+  uint8_t i;
+
+  StartExchange(t);
+  state = TERMINAL_PROC;
+
+  for(i = 0; i < 5; i++)
+  {
+    Send(cmd[i], t);
+    t = 0;
+  }
+}
+
+/**
+ * Sends a T=1 block, keeping a copy in case the card asks for it again
+ *
+ * @param pcb the protocol control byte
+ * @param inf the information field
+ * @param len the length of the information field
+ * @param earliest the earliest time for the first byte
+ */
+static void SendBlock(uint8_t pcb, const uint8_t *inf, uint8_t len,
+    sim_time_t earliest)
+{
+  uint16_t i;
+
+  nblocksent = 0;
+  sent[nblocksent++] = 0;
+  sent[nblocksent++] = pcb;
+  sent[nblocksent++] = len;
+  memmove(&sent[nblocksent], inf, len);
+  nblocksent += len;
+  sent[nblocksent] = 0;
+  for(i = 0; i < nblocksent; i++)
+    sent[nblocksent] ^= sent[i];
+  nblocksent++;
+
+  for(i = 0; i < nblocksent; i++)
+  {
+    Send(sent[i], earliest);
+    earliest = 0;
+  }
+
+  nblock = 0;
+  state = TERMINAL_BLOCK;
+}
+
+/**
+ * Sends the next part of the command in cmd as an I-block
+ *
+ * @param t the earliest time for the first byte
+ */
+static void SendChunk(sim_time_t t)
+{
+  uint8_t pcb;
+
+  chunk = (ncmd - nsent > ifsc) ? ifsc : ncmd - nsent;
+  pcb = (ns ? 0x40 : 0) | ((nsent + chunk < ncmd) ? 0x20 : 0);
+  SendBlock(pcb, &cmd[nsent], chunk, t);
+  ns ^= 1;
+}
+
+/**
+ * Sends the command in cmd with T=1. The C-TPDUs of the script are
+ * turned into command APDUs by adding Le to the commands of case 4.
+ *
+ * @param t the earliest time for the first byte
+ */
+static void SendCommandT1(sim_time_t t)
+{
+  if(ncmd > 5 && (cmd[1] == 0xA4 || cmd[1] == 0xA8 || cmd[1] == 0xAE ||
+        cmd[1] == 0x88))
+    cmd[ncmd++] = 0;
+
+  StartExchange(t);
+  SendChunk(t);
+}
+
+/**
+ * Starts the next command of the script, or deactivates the terminal at
+ * the end of the script
+ *
+ * @param t the earliest time for the first byte
+ */
+static void NextCommand(sim_time_t t)
+{
+  t += script->think_etus * etu;
+  if(script->commands[next_cmd] == NULL)
+  {
+    Finish(t);
+    return;
+  }
+
+  ncmd = SimParseHex(script->commands[next_cmd], cmd, sizeof(cmd));
+  if(ncmd == 4)
+    cmd[ncmd++] = 0;
+  if(ncmd < 5)
+  {
+    sim_stats.protocol_errors++;
+    Finish(t);
+    return;
+  }
+
+  if(t1)
+    SendCommandT1(t);
+  else
+    SendHeader(t);
+}
+
+/**
+ * Starts the exchanges after the ATR or the PPS exchange. With T=1 the
+ * terminal first announces its IFSD.
+ *
+ * @param t the earliest time for the first byte
+ */
+static void Begin(sim_time_t t)
+{
+  uint8_t ifsd;
+
+  if(t1)
+  {
+    ifsd = TERMINAL_IFSD;
+    SendBlock(0xC1, &ifsd, 1, t);
+  }
+  else
+    NextCommand(t);
+}
+
+/**
+ * Sends a PPS request for the TA1 byte of the ATR
+ *
+ * @param t the earliest time for the first byte
+ */
+static void SendPPS(sim_time_t t)
+{
+  uint8_t i;
+
+  pps[0] = 0xFF;
+  pps[1] = 0x10 | t1;
+  pps[2] = atr[2];
+  pps[3] = pps[0] ^ pps[1] ^ pps[2];
+  for(i = 0; i < 4; i++)
+  {
+    Send(pps[i], t);
+    t = 0;
+  }
+
+  npps = 0;
+  state = TERMINAL_PPS;
+}
+
+/**
+ * Handles one byte of the PPS response. Once the response is complete the
+ * terminal switches to the confirmed rate and starts the script.
+ *
+ * @param value the byte
+ * @param start the time of the start bit
+ */
+static void ReceivePPS(uint8_t value, sim_time_t start)
+{
+  uint8_t ta1, len, check, i;
+
+  ta1 = atr[2];
+  pps[npps++] = value;
+  if(npps < 2)
+    return;
+  len = (pps[1] & 0x10) ? 4 : 3;
+  if(npps < len)
+    return;
+
+  check = 0;
+  for(i = 0; i < len; i++)
+    check ^= pps[i];
+  if(check != 0 || pps[0] != 0xFF || (pps[1] & 0x0F) != t1 ||
+      (len == 4 && pps[2] != ta1))
+  {
+    sim_stats.protocol_errors++;
+    Finish(start + TERMINAL_TURN_ETUS * etu);
+    return;
+  }
+
+  // the new rate applies after the response
+  if(len == 4)
+    etu = (sim_time_t)(SimRateValue(ta1 >> 4, 0) / SimRateValue(ta1, 1)) *
+      (F_CPU / SIM_F_TERMINAL);
+  Begin(start + TERMINAL_TURN_ETUS * etu);
+}
+
+/**
+ * Handles the end of a command-response pair
+ *
+ * @param sw2 the last byte of the status word
+ * @param start the time of the start bit of sw2
+ */
+static void Complete(uint8_t sw2, sim_time_t start)
+{
+  const uint8_t *card_resp;
+  uint16_t card_len;
+  sim_time_t t;
+
+  resp[nresp++] = sw1;
+  resp[nresp++] = sw2;
+  if(nterminal < SIM_MAX_EXCHANGES)
+  {
+    sim_exchanges[nterminal].sw = (sw1 << 8) | sw2;
+    sim_exchanges[nterminal].terminal_end =
+      start + (TERMINAL_CHAR_ETUS - 2) * etu;
+    nterminal++;
+    if(nterminal > sim_num_exchanges)
+      sim_num_exchanges = nterminal;
+  }
+
+  // the response must be the one sent by the card
+  card_resp = SimCardLastResponse(&card_len);
+  if(card_len != nresp || memcmp(card_resp, resp, nresp) != 0)
+    sim_stats.mismatches++;
+
+  t = start + TERMINAL_TURN_ETUS * etu;
+  if(sw1 == 0x61)
+  {
+    cmd[0] = 0x00;
+    cmd[1] = 0xC0;
+    cmd[2] = 0x00;
+    cmd[3] = 0x00;
+    cmd[4] = sw2;
+    ncmd = 5;
+    SendHeader(t);
+  }
+  else if(sw1 == 0x6C)
+  {
+    cmd[4] = sw2;
+    SendHeader(t);
+  }
+  else
+  {
+    completed++;
+    next_cmd++;
+    NextCommand(t);
+  }
+}
+
+/**
+ * Handles a complete T=1 block sent by the card
+ *
+ * @param start the time of the start bit of the last byte
+ */
+static void ReceiveBlock(sim_time_t start)
+{
+  uint8_t pcb, len, check, wtx;
+  uint16_t i;
+  sim_time_t t;
+
+  check = 0;
+  for(i = 0; i < nblock; i++)
+    check ^= block[i];
+  pcb = block[1];
+  len = block[2];
+  t = start + TERMINAL_BGT_ETUS * etu;
+
+  if(check != 0 || block[0] != 0)
+  {
+    sim_stats.protocol_errors++;
+    Finish(t);
+    return;
+  }
+
+  if(pcb == 0xE1 && len == 1 && block[3] == TERMINAL_IFSD)
+    NextCommand(t);
+  else if(pcb == 0xC3 && len == 1)
+  {
+    wtx = block[3];
+    SendBlock(0xE3, &wtx, 1, t);
+  }
+  else if((pcb & 0xC0) == 0x80)
+  {
+    // R-block: next part of the command or the last block again
+    if(((pcb & 0x10) ? 1 : 0) == ns && (pcb & 0x0F) == 0 &&
+        nsent + chunk < ncmd)
+    {
+      nsent += chunk;
+      SendChunk(t);
+    }
+    else
+    {
+      sim_stats.protocol_errors++;
+      SendBlock(sent[1], &sent[3], sent[2], t);
+    }
+  }
+  else if((pcb & 0x80) == 0 && ((pcb & 0x40) ? 1 : 0) == nr &&
+      nsent + chunk == ncmd && len <= TERMINAL_IFSD)
+  {
+    // I-block: the response, or part of it
+    nr ^= 1;
+    for(i = 0; i < len && nresp < SIM_MAX_APDU - 2; i++)
+      resp[nresp++] = block[3 + i];
+    if(pcb & 0x20)
+      SendBlock(0x80 | (nr ? 0x10 : 0), NULL, 0, t);
+    else if(nresp < 2)
+    {
+      sim_stats.protocol_errors++;
+      Finish(t);
+    }
+    else
+    {
+      nresp -= 2;
+      sw1 = resp[nresp];
+      Complete(resp[nresp + 1], start);
+    }
+  }
+  else
+  {
+    sim_stats.protocol_errors++;
+    Finish(t);
+  }
+}
+
+/**
+ * Prepares a virtual terminal to be connected to the SCD
+ *
+ * @param terminal_script the commands to send, NULL to disconnect the
+ * terminal
+ */
+void SimTerminalStart(const SimTerminalScript *terminal_script)
+{
+  script = terminal_script;
+  sim_terminal_line.head = sim_terminal_line.tail = 0;
+  sim_num_exchanges = 0;
+  nterminal = 0;
+  ncard = 0;
+  natr = 0;
+  guard = 0;
+  etu = (sim_time_t)ETU_TERMINAL * (F_CPU / SIM_F_TERMINAL);
+  npps = 0;
+  t1 = 0;
+  ifsc = 0x20;
+  ns = nr = 0;
+  next_cmd = 0;
+  completed = 0;
+  next_tx = 0;
+  last_rx = 0;
+  memset(sim_exchanges, 0, sizeof(sim_exchanges));
+
+  if(script == NULL)
+  {
+    state = TERMINAL_OFF;
+    clock_on = clock_off = SIM_NEVER;
+    reset_high = reset_low = SIM_NEVER;
+    return;
+  }
+
+  // connected once the SCD looks for the clock, see Connect
+  state = TERMINAL_ATR;
+  clock_on = clock_off = SIM_NEVER;
+  reset_high = reset_low = SIM_NEVER;
+  connected = 0;
+}
+
+/**
+ * Connects the terminal to the SCD the first time the SCD checks the
+ * terminal clock, as a user would do once the SCD is ready. The clock
+ * starts immediately and the reset line is released after the time given
+ * in the script.
+ */
+static void Connect(void)
+{
+  if(script == NULL || connected)
+    return;
+
+  connected = 1;
+  clock_on = sim_now;
+  reset_high = sim_now + script->reset_etus * etu;
+}
+
+/**
+ * @param on the desired state of the clock
+ * @return the first time, not earlier than now, when the clock is in the
+ * given state or SIM_NEVER
+ */
+sim_time_t SimTerminalClockAt(uint8_t on)
+{
+  uint8_t running;
+
+  Connect();
+  running = (clock_on <= sim_now && sim_now < clock_off);
+  if(running == (on != 0))
+    return sim_now;
+  if(on)
+    return clock_on > sim_now ? clock_on : SIM_NEVER;
+
+  return clock_off;
+}
+
+/**
+ * @param high the desired level of the reset line
+ * @return the first time, not earlier than now, when the reset line has
+ * the given level or SIM_NEVER
+ */
+sim_time_t SimTerminalResetAt(uint8_t high)
+{
+  uint8_t level;
+
+  level = (reset_high <= sim_now && sim_now < reset_low);
+  if(level == (high != 0))
+    return sim_now;
+  if(high)
+    return reset_high > sim_now ? reset_high : SIM_NEVER;
+
+  return reset_low;
+}
+
+/**
+ * Receives a byte sent by the SCD
+ *
+ * @param value the byte
+ * @param start the time of the start bit
+ */
+void SimTerminalReceive(uint8_t value, sim_time_t start)
+{
+  sim_time_t last;
+  uint8_t len;
+
+  if(state == TERMINAL_OFF || state == TERMINAL_DONE || start < reset_high)
+  {
+    sim_stats.protocol_errors++;
+    return;
+  }
+
+  if(start + 2 * etu < next_tx)
+    sim_stats.collisions++;
+  if(SimTerminalETU() != etu)
+    sim_stats.protocol_errors++;
+
+  // the card must keep the work waiting time since the last character
+  last = last_rx;
+  if(next_tx > last + (TERMINAL_CHAR_ETUS + guard) * etu)
+    last = next_tx - (TERMINAL_CHAR_ETUS + guard) * etu;
+  if(state != TERMINAL_ATR && start > last + SIM_WWT_ETUS * etu)
+    sim_stats.wwt_violations++;
+  last_rx = start;
+
+  switch(state)
+  {
+    case TERMINAL_ATR:
+      atr[natr++] = value;
+      len = AtrLength(atr, natr);
+      if(len == 0 || natr < len)
+      {
+        if(natr == sizeof(atr))
+        {
+          sim_stats.protocol_errors++;
+          Finish(start);
+        }
+        break;
+      }
+      if(atr[1] & 0x40)
+      {
+        guard = atr[2 + ((atr[1] >> 4) & 1) + ((atr[1] >> 5) & 1)];
+        if(guard == 0xFF)
+          guard = 0;
+      }
+      ParseProtocol();
+      if(script->pps && (atr[1] & 0x10) &&
+          SimRateValue(atr[2] >> 4, 0) != 0 && SimRateValue(atr[2], 1) != 0)
+        SendPPS(start + TERMINAL_TURN_ETUS * etu);
+      else
+        Begin(start + TERMINAL_TURN_ETUS * etu);
+    break;
+
+    case TERMINAL_PPS:
+      ReceivePPS(value, start);
+    break;
+
+    case TERMINAL_PROC:
+      if(value == 0x60)
+        break;
+      if(value == cmd[1])
+      {
+        if(ncmd > 5)
+          SendData(ncmd - 5, start + TERMINAL_TURN_ETUS * etu);
+        else
+        {
+          nexpected = cmd[4] ? cmd[4] : 256;
+          state = TERMINAL_DATA;
+        }
+      }
+      else if(value == (uint8_t)~cmd[1])
+      {
+        if(ncmd > 5)
+          SendData(1, start + TERMINAL_TURN_ETUS * etu);
+        else
+        {
+          nexpected = 1;
+          state = TERMINAL_DATA;
+        }
+      }
+      else if((value & 0xF0) == 0x60 || (value & 0xF0) == 0x90)
+      {
+        sw1 = value;
+        state = TERMINAL_SW2;
+      }
+      else
+      {
+        sim_stats.protocol_errors++;
+        Finish(start + TERMINAL_TURN_ETUS * etu);
+      }
+    break;
+
+    case TERMINAL_DATA:
+      if(nresp < SIM_MAX_APDU - 2)
+        resp[nresp++] = value;
+      if(--nexpected == 0)
+        state = TERMINAL_PROC;
+    break;
+
+    case TERMINAL_SW2:
+      Complete(value, start);
+    break;
+
+    case TERMINAL_BLOCK:
+      if(nblock < sizeof(block))
+        block[nblock++] = value;
+      if(nblock >= 3 && nblock == 4 + block[2])
+        ReceiveBlock(start);
+    break;
+
+    default:
+    break;
+  }
+}
+
+/**
+ * Records the timing of a command-response pair seen by the card. Pairs
+ * are matched in order with the ones seen by the terminal.
+ *
+ * @param header the command header received by the card
+ * @param sw the status word sent by the card
+ * @param start the start bit of the first byte received by the card
+ * @param end the end of the last byte sent by the card
+ * @param wait the time the card spent waiting for command data
+ */
+void SimRecordCardExchange(const uint8_t *header, uint16_t sw,
+    sim_time_t start, sim_time_t end, sim_time_t wait)
+{
+  SimExchange *e;
+
+  if(ncard >= SIM_MAX_EXCHANGES)
+    return;
+
+  e = &sim_exchanges[ncard++];
+  if(script == NULL)
+  {
+    // no terminal, keep the details from the card
+    e->cla = header[0];
+    e->ins = header[1];
+    e->p1 = header[2];
+    e->p2 = header[3];
+    e->p3 = header[4];
+    e->sw = sw;
+  }
+  e->card_start = start;
+  e->card_end = end;
+  e->card_wait = wait;
+  if(ncard > sim_num_exchanges)
+    sim_num_exchanges = ncard;
+}
+
+/**
+ * @return the time the terminal was connected to the SCD
+ */
+sim_time_t SimTerminalConnectTime(void)
+{
+  return clock_on;
+}
+
+/**
+ * @return the number of script commands completed by the terminal
+ */
+uint16_t SimTerminalCompleted(void)
+{
+  return completed;
+}
+
+/**
+ * @return non-zero if the terminal completed its whole script
+ */
+uint8_t SimTerminalFinished(void)
+{
+  return script != NULL && state == TERMINAL_DONE &&
+    script->commands[next_cmd] == NULL;
+}
@@ -39,6 +39,7 @@
  */
 
 #include <util/delay.h>
+#include <util/crc16.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -58,6 +59,15 @@ CDC_LineEncoding_t LineEncoding = { .BaudRateBPS = 0,
     .ParityType  = CDC_PARITY_None,
     .DataBits    = 8                            };
 
+/** Receive buffer fed by the CDC OUT endpoint. Bytes between rxStart and rxEnd
+ *  have been received but not consumed, bytes up to rxScan have already been
+ *  searched for the end of a line and rxLine is the end of the line last
+ *  returned by GetHostLine, which stays in place until the next read.
+ */
+static uint8_t hostRx[HOST_RX_SIZE];
+static uint16_t rxStart, rxScan, rxLine, rxEnd;
+static uint8_t rxOverflow;
+
 /** 
  * Main program entry point implemented in VirtualSerial() in scd.c
  */
@@ -266,95 +276,243 @@ void CDC_Task(void)
 }
 
 /**
- * Receive a string data from the USB host
- *
- * This function will block until a string data (ended with CR, LF or CRLF)
- * is received from the USB host (the SCD is the USB device). This method
- * removes any trailing characters (CR, LF or CRLF) and appends the NUL
- * character '\0'.
- *
- * @param len the maximum length of the string to be received
- * @return the NUL('\0') terminated string if success, NULL if error. The
- * caller is responsible for eliberating the returned memory.
+ * Drops the line returned by the last call to GetHostLine
  */
-char* GetHostData(uint16_t len)
+static void ReleaseHostLine(void)
 {
-    uint8_t pos = 0;
-    uint8_t retval;
-    char* buf;
+    if(rxLine > rxStart)
+    {
+        rxStart = rxLine;
+        if(rxScan < rxStart)
+            rxScan = rxStart;
+    }
+}
 
+/**
+ * Moves the received data from the Rx endpoint into the receive buffer,
+ * making room at the end of the buffer for it if needed. This does not
+ * block if there is no data from the USB host.
+ *
+ * @return zero if success, non-zero if the USB device is not configured
+ */
+static uint8_t FillHostRx(void)
+{
     if (USB_DeviceState != DEVICE_STATE_Configured)
-        return NULL;
-
-    buf = (char*)malloc(len * sizeof(char));
-    if (buf == NULL)
-      return NULL;
+        return 1;
 
-    memset(buf, 0, len);
+    /* The unconsumed data is only moved when the end of the buffer is
+     * reached, so each byte is copied at most once more */
+    if(rxEnd == HOST_RX_SIZE && rxStart > 0)
+    {
+        memmove(hostRx, &hostRx[rxStart], rxEnd - rxStart);
+        rxEnd -= rxStart;
+        rxScan -= rxStart;
+        rxLine = 0;
+        rxStart = 0;
+    }
 
     /* Select the Serial Rx Endpoint */
     Endpoint_SelectEndpoint(CDC_RX_EPNUM);
-    while(!Endpoint_IsOUTReceived());
+    if(!Endpoint_IsOUTReceived())
+        return 0;
 
-    /* Print received data from the host */
-    while(1){
+    while(Endpoint_BytesInEndpoint() > 0 && rxEnd < HOST_RX_SIZE)
+        hostRx[rxEnd++] = Endpoint_Read_Byte();
+
+    /* Release the packet once all its bytes are in the buffer */
+    if(Endpoint_BytesInEndpoint() == 0)
+        Endpoint_ClearOUT();
 
-        while(Endpoint_WaitUntilReady() != ENDPOINT_READYWAIT_NoError);
+    return 0;
+}
 
-        retval = Endpoint_Read_Stream_LE(&buf[pos], len - pos);
-        if(retval != ENDPOINT_RWSTREAM_NoError && retval != ENDPOINT_RWSTREAM_Timeout)
+/**
+ * Returns the next line in the receive buffer, reading the packets from
+ * the USB host as needed
+ *
+ * @param len stores the length of the line, without the NUL character
+ * @param wait non-zero to wait for a line, zero to return NULL as soon as
+ * the packets received so far do not complete a line
+ * @return the NUL('\0') terminated line or NULL, see GetHostLine
+ */
+static const char* NextHostLine(uint16_t *len, uint8_t wait)
+{
+    char *line;
+    uint8_t c;
+
+    ReleaseHostLine();
+
+    while(1)
+    {
+        /* Only the bytes received since the last call are searched */
+        while(rxScan < rxEnd)
         {
-            free(buf);
-            return NULL;
+            c = hostRx[rxScan];
+            if(c == '\r' || c == '\n')
+                break;
+            rxScan++;
         }
 
-        pos = strlen(buf);
-
-        if(strchr(buf, '\n') != NULL || strchr(buf, '\r') != NULL)
+        if(rxScan < rxEnd)
         {
-            // remove any possible trailing chars
-            if(buf[pos-1] == '\r' || buf[pos-1] == '\n')
+            hostRx[rxScan] = 0;
+            line = (char*)&hostRx[rxStart];
+            *len = rxScan - rxStart;
+            rxScan++;
+            rxLine = rxScan;
+
+            if(rxOverflow)
             {
-                buf[pos-1] = 0;
-                pos = pos - 1;
+                /* End of a line that did not fit */
+                rxOverflow = 0;
+                return NULL;
             }
-            if(buf[pos-1] == '\r' || buf[pos-1] == '\n')
+            if(*len == 0)
             {
-                buf[pos-1] = 0;
-                pos = pos - 1;
+                ReleaseHostLine();
+                continue;
             }
 
-            break;
+            return line;
         }
 
-        Endpoint_ClearOUT();
+        /* Drop the start of a line longer than the buffer */
+        if(rxStart == 0 && rxEnd == HOST_RX_SIZE)
+        {
+            rxOverflow = 1;
+            rxStart = rxScan = rxLine = rxEnd = 0;
+        }
+
+        if(FillHostRx())
+            return NULL;
+        if(!wait && rxScan == rxEnd)
+            return NULL;
     }
+}
 
-    return buf;
+/**
+ * Receive a line from the USB host
+ *
+ * This function will block until a line (ended with CR, LF or CRLF) is
+ * received from the USB host (the SCD is the USB device). The line is
+ * returned in place in the receive buffer, without the trailing
+ * characters and with the NUL character '\0' appended. Empty lines are
+ * ignored.
+ *
+ * @param len stores the length of the line, without the NUL character
+ * @return the NUL('\0') terminated line if success, NULL if error or if the
+ * line did not fit in the receive buffer, in which case it is dropped. The
+ * line is only valid until the next call to GetHostLine, PollHostLine or
+ * GetHostFrame and must not be freed.
+ */
+const char* GetHostLine(uint16_t *len)
+{
+    return NextHostLine(len, 1);
 }
 
 /**
- * Send a string data to the USB host
+ * Receive a line from the USB host if one is available
  *
- * This function will transmit a string data (without adding CR or LF) to
- * the USB host (the SCD is the USB device)
+ * This is the same as GetHostLine but it does not block: NULL is also
+ * returned when the host has not sent a complete line yet, and the bytes
+ * received are kept for the next call.
  *
- * @param data a NUL ('\0') terminated string to be transmitted
+ * @param len stores the length of the line, without the NUL character
+ * @return the NUL('\0') terminated line or NULL, see GetHostLine
+ */
+const char* PollHostLine(uint16_t *len)
+{
+    return NextHostLine(len, 0);
+}
+
+/**
+ * Reads bytes from the receive buffer, waiting for new packets from the USB
+ * host as needed.
  *
- * @return zero if success, non-zero otherwise
+ * @param data the buffer for the bytes
+ * @param len the number of bytes to read
+ * @return zero if success, non-zero if the USB device is not configured
  */
-uint8_t SendHostData(const char *data)
+static uint8_t ReadHostBytes(uint8_t *data, uint16_t len)
 {
-    uint8_t full;
+    ReleaseHostLine();
 
-    if (data == NULL || USB_DeviceState != DEVICE_STATE_Configured)
+    while(len-- > 0)
+    {
+        while(rxStart == rxEnd)
+        {
+            if(FillHostRx())
+                return 1;
+        }
+        *data++ = hostRx[rxStart++];
+    }
+
+    rxLine = rxStart;
+    if(rxScan < rxStart)
+        rxScan = rxStart;
+
+    return 0;
+}
+
+/**
+ * Receive a binary frame from the USB host
+ *
+ * A frame has a type byte, a 16-bit payload length (little endian), the
+ * payload and a CRC-16 (XMODEM, little endian) of all the previous bytes.
+ * This function blocks until a complete frame is received. Frames and
+ * lines (see GetHostLine) can be mixed as they share the receive buffer.
+ *
+ * @param type stores the type of the frame
+ * @param data the buffer for the payload
+ * @param len stores the length of the payload
+ * @param maxlen the size of the data buffer
+ * @return zero if success, non-zero if the frame cannot be received, is
+ * longer than maxlen or has a bad CRC
+ */
+uint8_t GetHostFrame(uint8_t *type, uint8_t *data, uint16_t *len,
+        uint16_t maxlen)
+{
+    uint8_t header[3], crc[2], byte;
+    uint16_t i, n, check;
+
+    if (USB_DeviceState != DEVICE_STATE_Configured)
         return 1;
 
-    /* Select the Serial Tx Endpoint */
-    Endpoint_SelectEndpoint(CDC_TX_EPNUM);
+    if(ReadHostBytes(header, 3))
+        return 1;
+    *type = header[0];
+    *len = header[1] | (header[2] << 8);
 
-    /* Write the String to the Endpoint */
-    Endpoint_Write_Stream_LE(data, strlen(data));
+    check = 0;
+    for(i = 0; i < 3; i++)
+        check = _crc_xmodem_update(check, header[i]);
+
+    /* Consume all the frame, even if it does not fit */
+    n = 0;
+    for(i = 0; i < *len; i++)
+    {
+        if(ReadHostBytes(&byte, 1))
+            return 1;
+        check = _crc_xmodem_update(check, byte);
+        if(n < maxlen)
+            data[n++] = byte;
+    }
+
+    if(ReadHostBytes(crc, 2))
+        return 1;
+    if(n < *len || check != (crc[0] | (crc[1] << 8)))
+        return 1;
+
+    return 0;
+}
+
+/**
+ * Sends the last packet written to the Tx endpoint, followed by an empty
+ * packet if the last one was full
+ */
+static void FlushHostData(void)
+{
+    uint8_t full;
 
     /* Remember if the packet to send completely fills the endpoint */
     full = (Endpoint_BytesInEndpoint() == CDC_TXRX_EPSIZE);
@@ -372,6 +530,91 @@ uint8_t SendHostData(const char *data)
         /* Send an empty packet to ensure that the host does not buffer data sent to it */
         Endpoint_ClearIN();
     }
+}
+
+/**
+ * Send a string data to the USB host
+ *
+ * This function will transmit a string data (without adding CR or LF) to
+ * the USB host (the SCD is the USB device)
+ *
+ * @param data a NUL ('\0') terminated string to be transmitted
+ *
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t SendHostData(const char *data)
+{
+    if (data == NULL || USB_DeviceState != DEVICE_STATE_Configured)
+        return 1;
+
+    /* Select the Serial Tx Endpoint */
+    Endpoint_SelectEndpoint(CDC_TX_EPNUM);
+
+    /* Write the String to the Endpoint */
+    Endpoint_Write_Stream_LE(data, strlen(data));
+    FlushHostData();
+
+    return 0;
+}
+
+/**
+ * Send raw bytes to the USB host
+ *
+ * Full packets are sent as they are filled. The last packet is only sent
+ * if flush is set, so that a long transfer can be split in several calls
+ * without sending short packets.
+ *
+ * @param data the bytes to be transmitted
+ * @param len the number of bytes
+ * @param flush set to send the last packet
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t SendHostBytes(const uint8_t *data, uint16_t len, uint8_t flush)
+{
+    if (data == NULL || USB_DeviceState != DEVICE_STATE_Configured)
+        return 1;
+
+    Endpoint_SelectEndpoint(CDC_TX_EPNUM);
+    Endpoint_Write_Stream_LE(data, len);
+    if(flush)
+        FlushHostData();
+
+    return 0;
+}
+
+/**
+ * Send a binary frame to the USB host, in the format given in GetHostFrame
+ *
+ * @param type the type of the frame
+ * @param data the payload, may be NULL if len is 0
+ * @param len the length of the payload
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t SendHostFrame(uint8_t type, const uint8_t *data, uint16_t len)
+{
+    uint8_t header[3], crc[2];
+    uint16_t i, check;
+
+    if (USB_DeviceState != DEVICE_STATE_Configured)
+        return 1;
+
+    header[0] = type;
+    header[1] = len & 0xFF;
+    header[2] = (len >> 8) & 0xFF;
+    check = 0;
+    for(i = 0; i < 3; i++)
+        check = _crc_xmodem_update(check, header[i]);
+    for(i = 0; i < len; i++)
+        check = _crc_xmodem_update(check, data[i]);
+    crc[0] = check & 0xFF;
+    crc[1] = (check >> 8) & 0xFF;
+
+    Endpoint_SelectEndpoint(CDC_TX_EPNUM);
+    Endpoint_Write_Stream_LE(header, 3);
+    if(len > 0)
+        Endpoint_Write_Stream_LE(data, len);
+    Endpoint_Write_Stream_LE(crc, 2);
+    FlushHostData();
 
     return 0;
 }
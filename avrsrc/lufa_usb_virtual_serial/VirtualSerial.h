@@ -67,12 +67,19 @@
 		/** LED mask for the library LED driver, to indicate that an error has occurred in the USB interface. */
 		#define LEDMASK_USB_ERROR           (LEDS_LED1 | LEDS_LED3)
 
+		/** Size of the receive buffer, which limits the length of a line from the host. */
+		#define HOST_RX_SIZE                 512
+
 	/* Function Prototypes: */
 		void SetupUSBHardware(void);
 		void StopUSBHardware(void);
 		void CDC_Task(void);
-        char* GetHostData(uint16_t len);
+        const char* GetHostLine(uint16_t *len);
+        const char* PollHostLine(uint16_t *len);
         uint8_t SendHostData(const char *data);
+        uint8_t SendHostBytes(const uint8_t *data, uint16_t len, uint8_t flush);
+        uint8_t GetHostFrame(uint8_t *type, uint8_t *data, uint16_t *len, uint16_t maxlen);
+        uint8_t SendHostFrame(uint8_t type, const uint8_t *data, uint16_t len);
 
 		void EVENT_USB_Device_Connect(void);
 		void EVENT_USB_Device_Disconnect(void);
@@ -89,7 +89,9 @@ static char* strScroll = "BC to   scroll";
 static char* strSelect = "BD to   select";
 static char* strAvailable = "Avail.  apps:";
 #endif
-log_struct_t scd_logger;                // logger structure
+// logger structure, kept over a reset so that a log committed to EEPROM
+// just before a reset can be copied there after it (see InitSCD)
+log_struct_t scd_logger __attribute__((section(".noinit")));
 
 /* Global variables */
 uint8_t warmResetByte;
@@ -97,6 +99,7 @@ uint8_t lcdAvailable;			        // non-zero if LCD is working
 uint8_t nCounter;			            // number of transactions
 uint8_t selected;			            // ID of application selected
 uint8_t bootkey;                        // used for bootloader jump
+uint8_t resetFlags;                     // MCUSR at the last reset (see main)
 uint16_t revision = 0x24;               // current revision number, saved as BCD
 
 // Use the LCD as stderr (see main)
@@ -110,6 +113,11 @@ int main(void)
 {
   uint8_t sreg;
 
+  // Keep the reset flags and clear them, as only software clears them:
+  // a power-on flag left set would hide the cause of every later reset
+  resetFlags = MCUSR;
+  MCUSR = 0;
+
   // Init SCD
   InitSCD();
 
@@ -265,8 +273,12 @@ void InitSCD()
   // Disable WDT to keep safe operation
   DisableWDT();
 
+  // Copy to EEPROM any log committed before the reset (e.g. by INT0_vect)
+  RecoverLogEEPROM(&scd_logger, resetFlags);
+
   // Reset log structure (the one in SRAM)
   ResetLogger(&scd_logger);
+  scd_logger.mask = eeprom_read_byte((uint8_t*)EEPROM_LOG_MASK);
 
   // Read ms counter in order to continue from last value
   // We add the estimated startup time of 4 ms
@@ -353,9 +365,9 @@ ISR(INT0_vect)
   // Log the event
   LogByte1(&scd_logger, LOG_TERMINAL_RST_LOW, 0);
 
-  // Write the log to EEPROM and clear its contents
-  WriteLogEEPROM(&scd_logger);
-  ResetLogger(&scd_logger);
+  // Commit the log to EEPROM, it is copied there by InitSCD after the
+  // reset, as a large log would take seconds to write
+  CommitLogEEPROM(&scd_logger);
 
   // check for warm vs cold reset
   if(IsTerminalClock())
@@ -412,25 +424,20 @@ ISR(INT1_vect)
  */
 ISR(WDT_vect)
 {
+  // stop the pending reset until the log record is committed
+  DisableWDT();
+
   // Log the event
   LogByte1(&scd_logger, LOG_WDT_RESET, 0);
 
-  // Write the log to EEPROM and clear its contents
-  WriteLogEEPROM(&scd_logger);
-  ResetLogger(&scd_logger);
-}
-
+  // Commit the log to EEPROM, it is copied there by InitSCD after the reset
+  CommitLogEEPROM(&scd_logger);
 
-/**
- * Interrupt routine for Timer3 Compare Match A overflow. This interrupt
- * can fire when the Timer3 matches the OCR3A value and the corresponding
- * interrupt is enabled
- */
-ISR(TIMER3_COMPA_vect, ISR_NAKED)
-{	
-  reti();	// Do nothing, used just to wake up the CPU
+  // restart the device as the watchdog would have done
+  wdt_enable(WDTO_15MS);
 }
 
+
 /**
  * Interrupt routine for Timer2 Compare Match A overflow. This interrupt
  * can fire when the Timer2 matches the OCR2A value and the corresponding
@@ -552,7 +559,7 @@ void TestSCDTerminal()
   StartCounterTerminal();
 
   // wait for Terminal CLK and send ATR
-  while(ReadCounterTerminal() < 100);
+  WaitTerminalClock(0);
   Led1On();	
   while(GetTerminalResetLine() == 0);
   Led2On();
@@ -59,17 +59,62 @@
 /// EEPROM address for transaction counter
 #define EEPROM_COUNTER 0x40	
 
-/// EEPROM address for log high address pointer 
+/// EEPROM address for log high address pointer (linear logs, version 1 and 2)
 #define EEPROM_TLOG_POINTER_HI 0x48
 
-/// EEPROM address for log low address pointer 
+/// EEPROM address for log low address pointer (linear logs, version 1 and 2)
 #define EEPROM_TLOG_POINTER_LO 0x49
 
+/// EEPROM address for the version of the log in EEPROM (EEPROM_LOG_FORMAT)
+#define EEPROM_LOG_VERSION 0x4A
+
+/**
+ * Version of the log in EEPROM. Versions 1 and 2 were a linear log of
+ * LOG_FORMAT_VERSION 1 and 2 entries ending at the TLOG pointer. Version 3
+ * is a ring of records holding version 2 entries, see WriteLogEEPROM.
+ * Version 4 adds the transaction index after a shorter ring. Version 5
+ * has the same layout with version 3 entries, see LogEncode.
+ */
+#define EEPROM_LOG_FORMAT 5
+
+/// EEPROM address for the event mask of the logger (LOG_MASK_*)
+#define EEPROM_LOG_MASK 0x4B
+
+/// EEPROM address for the log session, changed each time the log is erased
+#define EEPROM_LOG_SESSION 0x4C
+
+/// EEPROM address for the metadata slots of the log ring
+#define EEPROM_LOG_SLOTS 0x50
+
+/// Number of metadata slots of the log ring, used in turn
+#define EEPROM_LOG_NSLOTS 6
+
+/// Size of a metadata slot: next sequence, head, tail and check (LE16 each)
+#define EEPROM_LOG_SLOT_SIZE 8
+
 /// EEPROM address for transaction log data
 #define EEPROM_TLOG_DATA 0x80
 
 /// EEPROM maximum allowed address
-#define EEPROM_MAX_ADDRESS 0xFE0
+#define EEPROM_MAX_ADDRESS 0xF50
+
+/// EEPROM address for the index of the transactions in the log ring
+#define EEPROM_LOG_INDEX 0xF50
+
+/// Number of index entries, used in turn by transaction number
+#define EEPROM_LOG_NINDEX 8
+
+/// Size of an index entry, see ReadLogIndex
+#define EEPROM_LOG_INDEX_SIZE 18
+
+/// Size of the log ring, from EEPROM_TLOG_DATA to EEPROM_MAX_ADDRESS
+#define EEPROM_TLOG_SIZE (EEPROM_MAX_ADDRESS - EEPROM_TLOG_DATA)
+
+/// Size of the header of a log record: sequence number and length (LE16 each)
+#define EEPROM_LOG_RECORD_HEADER 4
+
+/// Flag set in the length of a log record until its log is copied
+#define EEPROM_LOG_RECORD_PENDING 0x8000
 
 // External definitions
 extern char* appStrings[];
@@ -39,6 +39,7 @@
 #include <avr/wdt.h>
 #include <util/delay.h>
 
+#include "counter.h"
 #include "scd_hal.h"
 #include "scd_io.h"
 #include "scd_values.h"
@@ -48,9 +49,69 @@
 
 /* Global Variables */
 volatile uint32_t syncCounter;      // counter updated regularly, e.g. by timer 2
+volatile uint32_t counter_t2;       // sync counter of timer 2, see counter.h
+
+/* Static variables */
+static uint16_t iccETU = ETU_ICC;                         // current ICC ETU
+static uint16_t iccETUHalf = ETU_HALF(ETU_ICC);
+static uint16_t iccETULessThanHalf = ETU_LESS_THAN_HALF(ETU_ICC);
+static uint16_t iccETUExtended = ETU_EXTENDED(ETU_ICC);
+static uint16_t terminalETU = ETU_TERMINAL;               // current terminal ETU
+static uint16_t terminalETUHalf = ETU_HALF(ETU_TERMINAL);
+static uint16_t terminalETUSample = (uint16_t)(ETU_TERMINAL * 0.4);
+static uint16_t terminalETULessThanHalf = ETU_LESS_THAN_HALF(ETU_TERMINAL);
+static uint16_t terminalETUExtended = ETU_EXTENDED(ETU_TERMINAL);
+
+/* Interrupt-driven line functions, see StartLine */
+static void LineUpdate(uint8_t line);
+static void LineSuspend(uint8_t suspend);
+static uint8_t LineActive(uint8_t line);
+static uint8_t LineTerminalClock();
+static uint8_t LineReceive(
+    uint8_t line,
+    uint8_t inverse_convention,
+    uint8_t signal,
+    uint8_t *r_byte,
+    uint32_t max_wait);
+static uint8_t LineSend(
+    uint8_t line,
+    uint8_t byte,
+    uint8_t inverse_convention,
+    uint8_t signal);
+static uint8_t LineLoop(uint8_t line, uint32_t nEtus);
+static uint8_t LineWaitData(
+    uint8_t line,
+    uint32_t max_cycles,
+    uint32_t nEtus);
 
 /* SCD to Terminal functions */
 
+/**
+ * Sets the ETU used by the terminal functions, e.g. after a PPS exchange
+ * requested by the terminal. As for the ICC, the values derived from the
+ * ETU are computed here.
+ *
+ * @param etu the length of one ETU in terminal clocks. The default value
+ * is ETU_TERMINAL
+ */
+void SetTerminalETU(uint16_t etu)
+{
+  terminalETU = etu;
+  terminalETUHalf = ETU_HALF(etu);
+  terminalETUSample = (uint16_t)(((uint32_t)etu * 4) / 10);
+  terminalETULessThanHalf = (uint16_t)(((uint32_t)etu * 46) / 100);
+  terminalETUExtended = (uint16_t)(((uint32_t)etu * 1075) / 1000);
+  LineUpdate(LINE_TERMINAL);
+}
+
+/**
+ * @return the length of one terminal ETU in terminal clocks
+ */
+uint16_t GetTerminalETU()
+{
+  return terminalETU;
+}
+
 
 /**
  * Enable the terminal reset interrupt. This interrupt should fire
@@ -239,6 +300,10 @@ uint16_t IsTerminalClock()
   uint8_t sreg;
   uint16_t time, result;
 
+  // the engine of the terminal line must not lose its timing
+  if(IsLineRunning(LINE_TERMINAL))
+    return LineTerminalClock();
+
   sreg = SREG;
   cli();	
   TCNT3 = 1;		// We need to be sure it will not restart in the process	
@@ -303,22 +368,55 @@ uint8_t ReadTimerT2()
 }
 
 
+/**
+ * Returns a timestamp with a finer resolution than the sync counter,
+ * made of the sync counter and the value of the timer T2. Each unit is
+ * 1/256 of a sync counter unit, i.e. 4 us (see timestamp_res_us), well
+ * below one ETU. The value wraps around after about 4.7 hours.
+ *
+ * @return the timestamp, in units of timestamp_res_us
+ * @sa StartTimerT2
+ */
+uint32_t GetTimestamp()
+{
+  uint32_t counter;
+  uint8_t timer, sreg;
+
+  sreg = SREG;
+  cli();
+  counter = counter_t2;
+  timer = TCNT2;
+  if(TIFR2 & _BV(OCF2A))
+  {
+    // the interrupt is pending, so the counter is one period behind
+    // unless the timer is still at the compare match
+    timer = TCNT2;
+    if(timer != OCR2A)
+      counter++;
+  }
+  SREG = sreg;
+
+  return (counter << 8) | timer;
+}
+
+
 /**
  * Starts the timer T2 using the internal clock CLK_IO.
  * The current setup is for an interrupt frequency f_t2_int = 976.5625 Hz.
- * That means that each value of the udpated counter represents 1.024 ms.
+ * That means that each value of the udpated counter represents 1.024 ms,
+ * and each value of the timer T2 (0 to 255) 4 us.
  * 
  * @sa ReadTimerT2
  */
 void StartTimerT2()
 {
   // We use this to generate an interrupt with the given frequency
-  OCR2A = 16;                     // interrupt every 16 timer clocks
+  OCR2A = 255;                    // interrupt every 256 timer clocks
   TIMSK2 |= _BV(OCIE2A);
 
   TCNT2 = 0;
   TCCR2A = _BV(WGM21);			// CTC mode, No toggle on OC2X pins, no PWM
-  TCCR2B = _BV(CS22) | _BV(CS21) | _BV(CS20);  // F_CLK_T2 = F_CLK_IO / 1024
+  TCCR2B = _BV(CS22);             // F_CLK_T2 = F_CLK_IO / 64
 }
 
 /**
@@ -400,8 +498,9 @@ void StartCounterTerminal()
   // as in the specs) the OC3C line (I/O for terminal) is changed
   // even if TCCR3A = 0
 
-  Write16bitRegister(&OCR3A, ETU_TERMINAL);
+  Write16bitRegister(&OCR3A, terminalETU);
   TCCR3B = 0x0F;						// CTC, timer external source
+  StartLine(LINE_TERMINAL);
 }
 
 /**
@@ -409,6 +508,7 @@ void StartCounterTerminal()
  */
 void StopCounterTerminal()
 {
+  StopLine(LINE_TERMINAL);
   TCCR3B = 0;
   Write16bitRegister(&TCNT3, 0); 		//TCNT3 = 0;	
 }
@@ -418,6 +518,7 @@ void StopCounterTerminal()
  */
 void PauseCounterTerminal()
 {
+  StopLine(LINE_TERMINAL);
   TCCR3B = 0;
 }
 
@@ -434,7 +535,10 @@ uint8_t LoopTerminalETU(uint32_t nEtus)
   uint32_t i, k;
   uint8_t done;
 
-  Write16bitRegister(&OCR3A, ETU_TERMINAL);	// set ETU
+  if(LineActive(LINE_TERMINAL))
+    return LineLoop(LINE_TERMINAL, nEtus);
+
+  Write16bitRegister(&OCR3A, terminalETU);	// set ETU
   TCCR3A = 0x0C;								// set OC3C to 1
   Write16bitRegister(&TCNT3, 1);				// TCNT3 = 1	
   TIFR3 |= _BV(OCF3A);						// Reset OCR3A compare flag		
@@ -478,13 +582,19 @@ void SendByteTerminalNoParity(uint8_t byte, uint8_t inverse_convention)
   if(IsTerminalClock() == 0)
     return;	
 
+  if(LineActive(LINE_TERMINAL))
+  {
+    LineSend(LINE_TERMINAL, byte, inverse_convention, 0);
+    return;
+  }
+
   // this code is needed to be sure that the I/O line will not
   // toggle to low when we set DDRC4 as output
   TCCR3A = 0x0C;								// Set OC3C on compare
 
   PORTC |= _BV(PC4);							// Put to high	
   DDRC |= _BV(PC4);							// Set PC4 (OC3C) as output	
-  Write16bitRegister(&OCR3A, ETU_TERMINAL);	// set ETU
+  Write16bitRegister(&OCR3A, terminalETU);	// set ETU
   Write16bitRegister(&TCNT3, 1);				// TCNT3 = 1	
   TIFR3 |= _BV(OCF3A);						// Reset OCR3A compare flag		
 
@@ -540,7 +650,7 @@ void SendByteTerminalNoParity(uint8_t byte, uint8_t inverse_convention)
     TCCR3A = 0x08;
 
   // wait for the last bit to be sent (need to toggle and
-  // keep for ETU_TERMINAL clocks)
+  // keep for one terminal ETU)
   while(bit_is_clear(TIFR3, OCF3A));
   TIFR3 |= _BV(OCF3A);	
   while(bit_is_clear(TIFR3, OCF3A));
@@ -567,6 +677,9 @@ uint8_t SendByteTerminalParity(uint8_t byte, uint8_t inverse_convention)
   uint8_t i;
   volatile uint8_t tmp;
 
+  if(LineActive(LINE_TERMINAL))
+    return LineSend(LINE_TERMINAL, byte, inverse_convention, 1);
+
   SendByteTerminalNoParity(byte, inverse_convention);
 
   // wait for one ETU to read I/O line
@@ -575,7 +688,7 @@ uint8_t SendByteTerminalParity(uint8_t byte, uint8_t inverse_convention)
   // if there is a parity error try 4 times to resend
   if(bit_is_clear(PINC, PC4))
   {
-    Write16bitRegister(&OCR3A, ETU_TERMINAL);	// set ETU
+    Write16bitRegister(&OCR3A, terminalETU);	// set ETU
     Write16bitRegister(&TCNT3, 1);				// TCNT3 = 1	
     TIFR3 |= _BV(OCF3A);						// Reset OCR3A compare flag		
     TCCR3A = 0x0C;								// set OC3C to 1
@@ -613,6 +726,9 @@ uint8_t WaitForTerminalData(uint16_t max_cycles)
   uint16_t c = 0;
   volatile uint8_t bit;
 
+  if(LineActive(LINE_TERMINAL))
+    return LineWaitData(LINE_TERMINAL, max_cycles, 0);
+
   do{
     bit = bit_is_set(PINC, PC4);		
     c = c + 1;
@@ -652,6 +768,9 @@ uint8_t GetByteTerminalNoParity(
   uint8_t i, byte, parity;
   uint32_t cnt;
 
+  if(LineActive(LINE_TERMINAL))
+    return LineReceive(LINE_TERMINAL, inverse_convention, 0, r_byte, max_wait);
+
   TCCR3A = 0x0C;										// set OC3C because of chip behavior
   DDRC &= ~(_BV(PC4));								// Set PC4 (OC3C) as input	
   PORTC |= _BV(PC4);									// enable pull-up	
@@ -680,7 +799,7 @@ uint8_t GetByteTerminalNoParity(
   }
 
   Write16bitRegister(&TCNT3, 1);
-  Write16bitRegister(&OCR3A, (uint16_t)(ETU_TERMINAL * 0.4));
+  Write16bitRegister(&OCR3A, terminalETUSample);
   TIFR3 |= _BV(OCF3A); // Reset OCR3A compare flag		
 
   // Wait until the timer/counter 3 reaches the value in OCR3A
@@ -689,7 +808,7 @@ uint8_t GetByteTerminalNoParity(
 
   // check result and set timer for next bit
   bit = bit_is_set(PINC, PC4);	
-  Write16bitRegister(&OCR3A, ETU_TERMINAL);			// OCR3A = 1 ETU => next bit at 1.5 ETU
+  Write16bitRegister(&OCR3A, terminalETU);			// OCR3A = 1 ETU => next bit at 1.5 ETU
   *r_byte = 0;
   byte = 0;
   parity = 0;	
@@ -725,7 +844,7 @@ uint8_t GetByteTerminalNoParity(
 
   // wait 0.5 ETUs to for parity bit to be completely received
   //Write16bitRegister(&OCR3A, 186);	
-  Write16bitRegister(&OCR3A, ETU_HALF(ETU_TERMINAL));	
+  Write16bitRegister(&OCR3A, terminalETUHalf);	
   while(bit_is_clear(TIFR3, OCF3A));
   TIFR3 |= _BV(OCF3A);	
 
@@ -764,6 +883,9 @@ uint8_t GetByteTerminalParity(
 {
   uint8_t result;
 
+  if(LineActive(LINE_TERMINAL))
+    return LineReceive(LINE_TERMINAL, inverse_convention, 1, r_byte, max_wait);
+
   result = GetByteTerminalNoParity(inverse_convention, r_byte, max_wait);
   if(result == RET_ERROR)
   {
@@ -774,8 +896,7 @@ uint8_t GetByteTerminalParity(
     // set I/O low for at least 1 ETU starting at 10.5 ETU from start bit	
     TCCR3A = 0x0C;							// OC3C set to 1 on compare		
     DDRC |= _BV(PC4);						// Set PC4 (OC3C) as output
-    Write16bitRegister(&OCR3A, 
-        ETU_LESS_THAN_HALF(ETU_TERMINAL));
+    Write16bitRegister(&OCR3A, terminalETULessThanHalf);
     Write16bitRegister(&TCNT3, 1);
     TIFR3 |= _BV(OCF3A);					// Reset OCR3A compare flag	
 
@@ -783,8 +904,7 @@ uint8_t GetByteTerminalParity(
 
     while(bit_is_clear(TIFR3, OCF3A));
     TIFR3 |= _BV(OCF3A);
-    Write16bitRegister(&OCR3A, 
-        ETU_EXTENDED(ETU_TERMINAL));
+    Write16bitRegister(&OCR3A, terminalETUExtended);
     while(bit_is_clear(TIFR3, OCF3A));
     TIFR3 |= _BV(OCF3A);
 
@@ -794,7 +914,7 @@ uint8_t GetByteTerminalParity(
     PORTC |= _BV(PC4);
 
     // wait for the last ETU to complete
-    Write16bitRegister(&OCR3A, ETU_LESS_THAN_HALF(ETU_TERMINAL));
+    Write16bitRegister(&OCR3A, terminalETULessThanHalf);
     while(bit_is_clear(TIFR3, OCF3A));
     TIFR3 |= _BV(OCF3A);
   }
@@ -804,6 +924,31 @@ uint8_t GetByteTerminalParity(
 
 /* SCD to ICC functions */
 
+/**
+ * Sets the ETU used by the ICC functions, e.g. after a PPS exchange.
+ * The values derived from the ETU are computed here so that the byte
+ * routines do not need any arithmetic.
+ *
+ * @param etu the length of one ETU in timer 1 clocks. ActivateICC
+ * restores the default value, ETU_ICC
+ */
+void SetICCETU(uint16_t etu)
+{
+  iccETU = etu;
+  iccETUHalf = ETU_HALF(etu);
+  iccETULessThanHalf = (uint16_t)(((uint32_t)etu * 46) / 100);
+  iccETUExtended = (uint16_t)(((uint32_t)etu * 1075) / 1000);
+  LineUpdate(LINE_ICC);
+}
+
+/**
+ * @return the length of one ICC ETU in timer 1 clocks
+ */
+uint16_t GetICCETU()
+{
+  return iccETU;
+}
+
 /**
  * Returns non-zero if ICC is inserted, zero otherwise
  */
@@ -862,7 +1007,13 @@ void LoopICCETU(uint8_t nEtus)
 {
   uint8_t i;
 
-  Write16bitRegister(&OCR1A, ETU_ICC);	// set ETU
+  if(LineActive(LINE_ICC))
+  {
+    LineLoop(LINE_ICC, nEtus);
+    return;
+  }
+
+  Write16bitRegister(&OCR1A, iccETU);	// set ETU
   TCCR1A = 0x30;							// set OC1B to 1 on compare match
   Write16bitRegister(&TCNT1, 1);			// TCNT1 = 1	
   TIFR1 |= _BV(OCF1A);					// Reset OCR1A compare flag		
@@ -887,6 +1038,9 @@ uint8_t WaitForICCData(uint32_t max_cycles)
   uint32_t c = 0;
   volatile uint8_t bit;
 
+  if(LineActive(LINE_ICC))
+    return LineWaitData(LINE_ICC, max_cycles, 0);
+
   do{
     bit = bit_is_set(PINB, PB6);		
     c = c + 1;
@@ -900,6 +1054,46 @@ uint8_t WaitForICCData(uint32_t max_cycles)
   return result;	
 }
 
+/**
+ * Loops until the I/O line from ICC becomes low or the given number of
+ * ICC ETUs elapses. This is used for the character and block waiting
+ * times of T=1.
+ *
+ * @param nEtus the maximum number of ETUs to wait. Loops forever if 0
+ * @return 0 if the I/O line is 0, non-zero otherwise
+ *
+ * The ICC clock counter must be already started
+ */
+uint8_t WaitForICCDataETU(uint32_t nEtus)
+{
+  uint32_t i = 0;
+
+  if(LineActive(LINE_ICC))
+    return LineWaitData(LINE_ICC, 0, nEtus);
+
+  TCCR1A = 0x30;							// set OC1B to 1 on compare match
+  DDRB &= ~(_BV(PB6));					// Set I/O (PB6) to reception mode
+#if PULL_UP_HIZ_ICC
+  PORTB |= _BV(PB6);
+#endif
+  Write16bitRegister(&OCR1A, iccETU);
+  Write16bitRegister(&TCNT1, 1);
+  TIFR1 |= _BV(OCF1A);					// Reset OCR1A compare flag
+
+  while(bit_is_set(PINB, PB6))
+  {
+    if(bit_is_set(TIFR1, OCF1A))
+    {
+      TIFR1 |= _BV(OCF1A);
+      i = i + 1;
+      if(nEtus != 0 && i == nEtus)
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
 /**
  * Receives a byte from the ICC without parity checking
  * 
@@ -915,6 +1109,9 @@ uint8_t GetByteICCNoParity(uint8_t inverse_convention, uint8_t *r_byte)
   volatile uint8_t bit;
   uint8_t i, byte, parity;
 
+  if(LineActive(LINE_ICC))
+    return LineReceive(LINE_ICC, inverse_convention, 0, r_byte, 0);
+
   TCCR1A = 0x30;									// set OC1B to 1 on compare match
   DDRB &= ~(_BV(PB6));							// Set I/O (PB6) to reception mode
 
@@ -928,7 +1125,7 @@ uint8_t GetByteICCNoParity(uint8_t inverse_convention, uint8_t *r_byte)
   while(bit_is_set(PINB, PB6));	
 
   Write16bitRegister(&TCNT1, 1);					// TCNT1 = 1		
-  Write16bitRegister(&OCR1A, ETU_HALF(ETU_ICC));	// OCR1A 0.5 ETU
+  Write16bitRegister(&OCR1A, iccETUHalf);	// OCR1A 0.5 ETU
   TIFR1 |= _BV(OCF1A);							// Reset OCR1A compare flag		
 
   while(bit_is_clear(TIFR1, OCF1A));
@@ -936,7 +1133,7 @@ uint8_t GetByteICCNoParity(uint8_t inverse_convention, uint8_t *r_byte)
 
   // check result and set timer for next bit
   bit = bit_is_set(PINB, PB6);	
-  Write16bitRegister(&OCR1A, ETU_ICC);			// OCR1A = 1 ETU => next bit at 1.5 ETU
+  Write16bitRegister(&OCR1A, iccETU);			// OCR1A = 1 ETU => next bit at 1.5 ETU
   *r_byte = 0;
   byte = 0;
   parity = 0;	
@@ -970,7 +1167,7 @@ uint8_t GetByteICCNoParity(uint8_t inverse_convention, uint8_t *r_byte)
   bit = bit_is_set(PINB, PB6);
 
   // wait 0.5 ETUs to for parity bit to be completely received
-  Write16bitRegister(&OCR1A, ETU_HALF(ETU_ICC));	
+  Write16bitRegister(&OCR1A, iccETUHalf);	
   while(bit_is_clear(TIFR1, OCF1A));
   TIFR1 |= _BV(OCF1A);		
 
@@ -1003,6 +1200,9 @@ uint8_t GetByteICCParity(uint8_t inverse_convention, uint8_t *r_byte)
 {
   uint8_t result;
 
+  if(LineActive(LINE_ICC))
+    return LineReceive(LINE_ICC, inverse_convention, 1, r_byte, 0);
+
   result = GetByteICCNoParity(inverse_convention, r_byte);
   if(result != 0)
   {
@@ -1014,7 +1214,7 @@ uint8_t GetByteICCParity(uint8_t inverse_convention, uint8_t *r_byte)
     TCCR1A = 0x30;							// set OC1B on compare match
     DDRB |= _BV(PB6);						// Set PB6 (OC1B) as output		
     Write16bitRegister(&OCR1A, 
-        ETU_LESS_THAN_HALF(ETU_ICC));		
+        iccETULessThanHalf);		
     Write16bitRegister(&TCNT1, 1);					
     TIFR1 |= _BV(OCF1A);					// Reset OCF1A compare flag	
     TCCR1A = 0x20;							// clear OC1B on compare match
@@ -1022,7 +1222,7 @@ uint8_t GetByteICCParity(uint8_t inverse_convention, uint8_t *r_byte)
     while(bit_is_clear(TIFR1, OCF1A));
     TIFR1 |= _BV(OCF1A);		
     Write16bitRegister(&OCR1A, 
-        ETU_EXTENDED(ETU_ICC));				// OCR1A > 1 ETU		
+        iccETUExtended);				// OCR1A > 1 ETU		
     while(bit_is_clear(TIFR1, OCF1A));
     TIFR1 |= _BV(OCF1A);
 
@@ -1032,7 +1232,7 @@ uint8_t GetByteICCParity(uint8_t inverse_convention, uint8_t *r_byte)
     PORTB |= _BV(PB6);
 
     // wait for the last ETU to complete
-    Write16bitRegister(&OCR1A, ETU_LESS_THAN_HALF(ETU_ICC));
+    Write16bitRegister(&OCR1A, iccETULessThanHalf);
     while(bit_is_clear(TIFR1, OCF1A));
     TIFR1 |= _BV(OCF1A);
   }
@@ -1056,12 +1256,18 @@ void SendByteICCNoParity(uint8_t byte, uint8_t inverse_convention)
   if(!IsICCInserted())
     return;	
 
+  if(LineActive(LINE_ICC))
+  {
+    LineSend(LINE_ICC, byte, inverse_convention, 0);
+    return;
+  }
+
   // this code is needed to be sure that the I/O line will not
   // toggle to low when we set DDRB6 as output
   TCCR1A = 0x30;								// Set OC1B on compare
   PORTB |= _BV(PB6);							// Put to high	
   DDRB |= _BV(PB6);							// Set PB6 (OC1B) as output	
-  Write16bitRegister(&OCR1A, ETU_ICC);	
+  Write16bitRegister(&OCR1A, iccETU);	
   Write16bitRegister(&TCNT1, 1);
   TIFR1 |= _BV(OCF1A);						// Reset OCF1A compare flag		
 
@@ -1144,6 +1350,13 @@ uint8_t SendByteICCParity(uint8_t byte, uint8_t inverse_convention)
   uint8_t i;
   volatile uint8_t tmp;
 
+  if(LineActive(LINE_ICC))
+  {
+    if(!IsICCInserted())
+      return 1;
+    return LineSend(LINE_ICC, byte, inverse_convention, 1);
+  }
+
   SendByteICCNoParity(byte, inverse_convention);
 
   // wait for one ETU to read I/O line
@@ -1152,7 +1365,7 @@ uint8_t SendByteICCParity(uint8_t byte, uint8_t inverse_convention)
   // if there is aparity error try 4 times to resend
   if(bit_is_clear(PINB, PB6))
   {
-    Write16bitRegister(&OCR1A, ETU_ICC);	
+    Write16bitRegister(&OCR1A, iccETU);	
     Write16bitRegister(&TCNT1, 1);			
     TIFR1 |= _BV(OCF1A);					// Reset OCF1A compare flag		
     TCCR1A = 0x30;							// set OC1B to 1
@@ -1202,6 +1415,12 @@ void SetICCResetLine(uint8_t high)
  */
 uint8_t ActivateICC(uint8_t warm)
 {
+  // the I/O line is driven low while the ICC is powered up
+  StopLine(LINE_ICC);
+
+  // any reset brings the ICC back to the default rate
+  SetICCETU(ETU_ICC);
+
   if(warm)
   {
     // Put RST to low
@@ -1255,12 +1474,15 @@ uint8_t ActivateICC(uint8_t warm)
 #endif
 
     TCCR1A = 0x30;						// set OC1B (PB6) to 1 on compare match
-    Write16bitRegister(&OCR1A, ETU_ICC);// ETU = 372 * (F_TIMER1 / F_TIMER0)
+    Write16bitRegister(&OCR1A, iccETU);// ETU = 372 * (F_TIMER1 / F_TIMER0)
     TCCR1B = ICC_CLK_TCCR1B;		    // Start timer 1, CTC, CLK based on TCCR1B
     TCCR1C = 0x40;						// Force compare match on OC1B so that
     // we get the I/O line to high	
   }
 
+  // receive the ATR in the background
+  StartLine(LINE_ICC);
+
   return 0;
 }
 
@@ -1269,6 +1491,8 @@ uint8_t ActivateICC(uint8_t warm)
  */
 void DeactivateICC()
 {
+  StopLine(LINE_ICC);
+
   // Set reset to low 
   PORTD &= ~(_BV(PD4));
   DDRD |= _BV(PD4);	
@@ -1312,3 +1536,1150 @@ void DisableICCInsertInterrupt()
   EIMSK &= ~(_BV(INT1));
 }
 
+
+
+/* Relay functions */
+
+/**
+ * Timer and port registers used to relay bytes on one of the I/O lines.
+ * The terminal line uses timer 3 (OC3C, clocked by the terminal) and the
+ * ICC line uses timer 1 (OC1B), so one line can receive a byte while the
+ * other one is sending the previous bytes.
+ */
+typedef struct {
+  volatile uint8_t *tccr;     // timer control register A
+  volatile uint8_t *tifr;     // timer interrupt flag register
+  volatile uint16_t *ocr;     // output compare register A
+  volatile uint16_t *tcnt;    // timer counter
+  volatile uint8_t *port;
+  volatile uint8_t *ddr;
+  volatile uint8_t *pin;
+  uint8_t io;                 // I/O line bit
+  uint8_t ocf;                // compare flag bit
+  uint8_t high;               // TCCR value to set the I/O line to 1
+  uint8_t low;                // TCCR value to clear the I/O line to 0
+  uint8_t pullup;             // non-zero to enable the pull-up when input
+  uint16_t etu;
+  uint16_t sample;            // delay from the start bit to its sample
+  uint8_t timeout;            // error returned when no byte is received
+  uint8_t nak;                // error returned when a byte sent is refused
+} RelayLine;
+
+static RelayLine relayTerminal = {
+  &TCCR3A, &TIFR3, &OCR3A, &TCNT3, &PORTC, &DDRC, &PINC,
+  PC4, OCF3A, 0x0C, 0x08, 1,
+  ETU_TERMINAL, (uint16_t)(ETU_TERMINAL * 0.4), // updated by StartRelay
+  RET_TERMINAL_TIME_OUT, RET_TERMINAL_SEND_RESPONSE
+};
+
+static RelayLine relayICC = {
+  &TCCR1A, &TIFR1, &OCR1A, &TCNT1, &PORTB, &DDRB, &PINB,
+  PB6, OCF1A, 0x30, 0x20, PULL_UP_HIZ_ICC,
+  ETU_ICC, ETU_HALF(ETU_ICC),                   // updated by StartRelay
+  RET_ICC_TIME_OUT, RET_ICC_SEND_CMD
+};
+
+static const RelayLine *relaySrc;   // line receiving the bytes
+static const RelayLine *relayDst;   // line sending the bytes
+static uint8_t relaySrcInverse;
+static uint8_t relayDstInverse;
+static uint8_t relayGuard;          // extra ETUs between bytes sent
+static uint8_t *relayBytes;         // ring of bytes received
+static uint16_t relaySize;
+static uint16_t relayReceived;
+static uint16_t relaySent;
+static uint16_t relayRxIndex;
+static uint16_t relayTxIndex;
+static uint8_t relayTxBit;          // next compare match of the byte sent
+static uint8_t relayTxByte;         // byte sent, in line order
+static uint8_t relayTxParity;
+static uint8_t relayTxResult;
+
+/**
+ * Advances the transmission of the relayed bytes. This function never
+ * blocks: it handles at most one compare match of the destination timer
+ * and it must be called at least once every ETU while bytes are pending.
+ *
+ * The byte is sent with the same timing as SendByteTerminalParity and
+ * SendByteICCParity: the start bit is visible after the first compare
+ * match, the error signal is sampled 11 ETUs after the start bit and
+ * the next start bit is at least 12 + relayGuard ETUs after this one.
+ * Bytes refused by the receiver are not repeated, the error is returned
+ * by the next call to RelayNextByte or EndRelay instead.
+ */
+static void RelayTransmit()
+{
+  const RelayLine *dst = relayDst;
+  uint8_t m, i, byte;
+
+  if(relayTxBit != 0)
+  {
+    if(bit_is_clear(*dst->tifr, dst->ocf))
+      return;
+    *dst->tifr |= _BV(dst->ocf);
+
+    m = relayTxBit++;
+    if(m <= 8)
+      *dst->tccr = (relayTxByte & _BV(m - 1)) ? dst->high : dst->low;
+    else if(m == 9)
+      *dst->tccr = relayTxParity ? dst->high : dst->low;
+    else if(m == 10)
+      *dst->tccr = dst->high;
+    else if(m == 11)
+    {
+      *dst->ddr &= ~(_BV(dst->io));
+      *dst->port |= _BV(dst->io);
+    }
+    else if(m == 12 && bit_is_clear(*dst->pin, dst->io))
+      relayTxResult = dst->nak;
+
+    if(m < 12 + relayGuard)
+      return;
+
+    relayTxBit = 0;
+    relaySent++;
+  }
+
+  if(relaySent == relayReceived || relayTxResult != 0)
+    return;
+
+  // check we have clock from terminal to avoid damage, timer 3 is not
+  // used by the receiver when the terminal is the destination
+  if(dst == &relayTerminal && IsTerminalClock() == 0)
+  {
+    relayTxResult = RET_TERMINAL_NO_CLOCK;
+    return;
+  }
+
+  // convert the byte to line order and compute the parity bit
+  byte = relayBytes[relayTxIndex];
+  if(++relayTxIndex == relaySize)
+    relayTxIndex = 0;
+  if(relayDstInverse)
+  {
+    m = ~byte;
+    byte = 0;
+    for(i = 0; i < 8; i++)
+      if(m & _BV(7 - i)) byte |= _BV(i);
+  }
+  m = 0;
+  for(i = 0; i < 8; i++)
+    if(byte & _BV(i)) m ^= 1;
+  relayTxByte = byte;
+  relayTxParity = relayDstInverse ? !m : m;
+
+  // the start bit will be visible after the next compare match
+  *dst->tccr = dst->high;
+  *dst->port |= _BV(dst->io);
+  *dst->ddr |= _BV(dst->io);
+  Write16bitRegister(dst->ocr, dst->etu);
+  Write16bitRegister(dst->tcnt, 1);
+  *dst->tifr |= _BV(dst->ocf);
+  *dst->tccr = dst->low;
+  relayTxBit = 1;
+}
+
+/**
+ * Waits for the next compare match of the receiving line while
+ * sending the bytes already received
+ */
+static void RelayWaitSample()
+{
+  const RelayLine *src = relaySrc;
+
+  while(bit_is_clear(*src->tifr, src->ocf))
+    RelayTransmit();
+  *src->tifr |= _BV(src->ocf);
+}
+
+/**
+ * Prepares the lines to relay bytes from one side to the other. Each byte
+ * received with RelayNextByte is sent to the destination one ETU after
+ * its parity bit has been received (or after the previous byte has been
+ * sent), so the latency of the relay is about one byte instead of the
+ * whole command or response.
+ *
+ * @param direction RELAY_TERMINAL_TO_ICC or RELAY_ICC_TO_TERMINAL
+ * @param src_inverse different than 0 if inverse convention is used
+ * by the source
+ * @param dst_inverse different than 0 if inverse convention is used
+ * by the destination
+ * @param dst_guard number of ETUs added to the 12 ETUs between the
+ * start bits of the bytes sent to the destination
+ * @param bytes ring used to hold the bytes received until they are sent
+ * @param size size of the ring
+ *
+ * The terminal and ICC clock counters must be already started
+ */
+void StartRelay(
+        uint8_t direction,
+        uint8_t src_inverse,
+        uint8_t dst_inverse,
+        uint8_t dst_guard,
+        uint8_t *bytes,
+        uint16_t size)
+{
+  // the relay polls both timers
+  LineSuspend(1);
+
+  relayTerminal.etu = terminalETU;
+  relayTerminal.sample = terminalETUSample;
+  relayICC.etu = iccETU;
+  relayICC.sample = iccETUHalf;
+
+  if(direction == RELAY_TERMINAL_TO_ICC)
+  {
+    relaySrc = &relayTerminal;
+    relayDst = &relayICC;
+  }
+  else
+  {
+    relaySrc = &relayICC;
+    relayDst = &relayTerminal;
+  }
+
+  relaySrcInverse = src_inverse;
+  relayDstInverse = dst_inverse;
+  relayGuard = dst_guard;
+  relayBytes = bytes;
+  relaySize = size;
+  relayReceived = 0;
+  relaySent = 0;
+  relayRxIndex = 0;
+  relayTxIndex = 0;
+  relayTxBit = 0;
+  relayTxResult = 0;
+
+  // both lines start as input, the OCxx pins set to 1 because of
+  // chip behavior
+  *relaySrc->tccr = relaySrc->high;
+  *relaySrc->ddr &= ~(_BV(relaySrc->io));
+  if(relaySrc->pullup)
+    *relaySrc->port |= _BV(relaySrc->io);
+  else
+    *relaySrc->port &= ~(_BV(relaySrc->io));
+
+  *relayDst->tccr = relayDst->high;
+  *relayDst->ddr &= ~(_BV(relayDst->io));
+  *relayDst->port |= _BV(relayDst->io);
+}
+
+/**
+ * Receives the next byte of the relay, without parity error signalling,
+ * and queues it for the destination. The bytes received before are sent
+ * while waiting for this one.
+ *
+ * @param r_byte contains the byte read on return
+ * @param max_wait the maximum number of cycles to wait for the start bit.
+ * Give 0 to wait indefinitely.
+ * @return zero if the byte was received and queued. Otherwise it returns
+ * RET_TERMINAL_RESET_LOW or RET_TERMINAL_NO_CLOCK if the terminal is the
+ * source and has reset or stopped the clock, RET_TERMINAL_TIME_OUT or
+ * RET_ICC_TIME_OUT if no byte was received within max_wait,
+ * RET_ERR_MEMORY if the ring is full, the error of a previous byte
+ * sent (see RelayTransmit) or RET_ERROR if the byte has a parity error.
+ * Bytes with a parity error are not sent to the destination.
+ *
+ * @sa StartRelay
+ */
+uint8_t RelayNextByte(uint8_t *r_byte, uint32_t max_wait)
+{
+  const RelayLine *src = relaySrc;
+  volatile uint8_t bit;
+  uint8_t i, byte, parity;
+  uint32_t cnt;
+
+  *r_byte = 0;
+
+  // wait for reset or start bit
+  cnt = 0;
+  while(bit_is_set(*src->pin, src->io))
+  {
+    RelayTransmit();
+    if(relayTxResult != 0)
+      return relayTxResult;
+
+    // timer 3 is free while the terminal is the source and the
+    // receiver is idle
+    if(src == &relayTerminal)
+    {
+      if(GetTerminalResetLine() == 0)
+        return RET_TERMINAL_RESET_LOW;
+      if(IsTerminalClock() == 0)
+        return RET_TERMINAL_NO_CLOCK;
+    }
+
+    cnt = cnt + 1;
+    if(max_wait != 0 && cnt == max_wait)
+      return src->timeout;
+  }
+
+  Write16bitRegister(src->tcnt, 1);
+  Write16bitRegister(src->ocr, src->sample);
+  *src->tifr |= _BV(src->ocf);
+  RelayWaitSample();
+
+  // check result and set timer for next bit
+  bit = bit_is_set(*src->pin, src->io);
+  Write16bitRegister(src->ocr, src->etu);
+  if(bit)
+    return RET_ERROR;
+
+  // read the byte in correct conversion mode
+  byte = 0;
+  parity = 0;
+  for(i = 0; i < 8; i++)
+  {
+    RelayWaitSample();
+    bit = bit_is_set(*src->pin, src->io);
+
+    if(relaySrcInverse && bit == 0)
+    {
+      byte = byte | _BV(7-i);
+      parity = parity ^ 1;
+    }
+    else if(relaySrcInverse == 0 && bit != 0)
+    {
+      byte = byte | _BV(i);
+      parity = parity ^ 1;
+    }
+  }
+
+  // read the parity bit and wait for it to be completely received
+  RelayWaitSample();
+  bit = bit_is_set(*src->pin, src->io);
+  Write16bitRegister(src->ocr, ETU_HALF(src->etu));
+  RelayWaitSample();
+
+  if((relaySrcInverse && parity == (bit != 0)) ||
+      (!relaySrcInverse && parity != (bit != 0)))
+    return RET_ERROR;
+
+  if((uint16_t)(relayReceived - relaySent) >= relaySize)
+    return RET_ERR_MEMORY;
+
+  relayBytes[relayRxIndex] = byte;
+  if(++relayRxIndex == relaySize)
+    relayRxIndex = 0;
+  relayReceived++;
+  *r_byte = byte;
+
+  // start sending the byte if the destination is idle
+  RelayTransmit();
+
+  return 0;
+}
+
+/**
+ * Waits until all the bytes received by the relay have been sent to
+ * the destination, including the guard time of the last byte
+ *
+ * @return zero if all the bytes have been sent, or the error of the
+ * first byte that could not be sent (see RelayTransmit)
+ *
+ * @sa StartRelay
+ */
+uint8_t EndRelay()
+{
+  while(relayTxResult == 0 &&
+      (relayTxBit != 0 || relaySent != relayReceived))
+    RelayTransmit();
+
+  // the engines start again on the next call of a byte function and not
+  // here, as a byte received before the next StartRelay would be lost
+  LineSuspend(0);
+
+  return relayTxResult;
+}
+
+
+/* Interrupt-driven line functions */
+
+#define LINE_OFF  0                 // engine stopped, timer polled as before
+#define LINE_IDLE 1                 // waiting for a start bit or a byte to send
+#define LINE_RX   2                 // receiving a byte
+#define LINE_TX   3                 // sending a byte
+
+#define LINE_QUEUE_MASK (LINE_QUEUE_SIZE - 1)
+
+/**
+ * State of the interrupt-driven byte engine of one I/O line. While the
+ * engine runs, each compare match of the line timer raises an interrupt
+ * that samples or drives one bit, so bytes are received into a queue even
+ * when no function is waiting for them and the blocking byte functions
+ * above only have to wait on the queues.
+ *
+ * The start bits of the ICC are detected by the pin change interrupt of
+ * PB6. The terminal I/O line (PC4) has no pin change interrupt on this
+ * chip, so its start bits are found by sampling the line LINE_OVERSAMPLE
+ * times per ETU while idle.
+ */
+typedef struct {
+  RelayLine *regs;                  // timer and port registers of the line
+  volatile uint8_t *timsk;          // timer interrupt mask register
+  uint8_t ocie;                     // compare match interrupt enable bit
+  uint8_t edge;                     // non-zero if start bits raise PCINT6
+  uint8_t enabled;                  // set by StartLine, cleared by StopLine
+  uint8_t suspended;                // set while the relay uses the timers
+  volatile uint8_t state;
+  volatile uint8_t matches;         // compare matches, wrapping at 256
+  volatile uint8_t match;           // compare matches in the current byte
+  volatile uint8_t ticks;           // ETUs elapsed while idle
+  uint8_t subtick;
+  uint8_t subticks;                 // compare matches per ETU while idle
+  uint16_t idle;                    // compare period while idle
+  uint16_t etu;
+  uint16_t sample;                  // delay from the start bit to its sample
+  uint16_t half;
+  uint16_t lessThanHalf;
+  uint16_t extended;
+  uint8_t shift;                    // byte received or sent, in line order
+  uint8_t parity;
+  uint8_t error;                    // non-zero while signalling an error
+  uint8_t retries;
+  uint8_t inverse;                  // convention of the bytes received
+  uint8_t signal;                   // non-zero to signal parity errors
+  uint8_t txInverse;                // convention of the bytes sent
+  uint8_t txSignal;                 // non-zero to repeat refused bytes
+  volatile uint8_t txResult;
+  volatile uint8_t overrun;         // non-zero if a byte was dropped
+  volatile uint8_t rxHead;
+  volatile uint8_t rxTail;
+  volatile uint8_t txHead;
+  volatile uint8_t txTail;
+  uint8_t rx[LINE_QUEUE_SIZE];      // bytes received, in line order
+  uint8_t rxParity[LINE_QUEUE_SIZE];// parity of the 9 levels received
+  uint8_t tx[LINE_QUEUE_SIZE];
+} LineEngine;
+
+static LineEngine lines[2] = {
+  {&relayTerminal, &TIMSK3, OCIE3A, 0},   // LINE_TERMINAL
+  {&relayICC, &TIMSK1, OCIE1A, 1}         // LINE_ICC
+};
+
+static void (*lineIdleHook)(void);
+
+static void LineStartBit(LineEngine *l);
+
+/**
+ * Converts a byte between the logical and the line order of the inverse
+ * convention. The conversion is its own inverse.
+ *
+ * @param byte the byte to convert
+ * @return the converted byte
+ */
+static uint8_t LineInverse(uint8_t byte)
+{
+  uint8_t i, result = 0;
+
+  byte = ~byte;
+  for(i = 0; i < 8; i++)
+    if(byte & _BV(7 - i)) result |= _BV(i);
+
+  return result;
+}
+
+/**
+ * Starts sending the next byte queued on a line. The start bit is visible
+ * after the next compare match, as in SendByteICCNoParity.
+ *
+ * @param l the engine of the line
+ */
+static void LineStartByte(LineEngine *l)
+{
+  RelayLine *r = l->regs;
+  uint8_t i, byte, parity;
+
+  byte = l->tx[l->txHead];
+  if(l->txInverse)
+    byte = LineInverse(byte);
+  parity = 0;
+  for(i = 0; i < 8; i++)
+    if(byte & _BV(i)) parity ^= 1;
+  l->shift = byte;
+  l->parity = l->txInverse ? !parity : parity;
+
+  if(l->edge)
+    PCMSK0 &= ~(_BV(PCINT6));
+  *r->tccr = r->high;
+  *r->port |= _BV(r->io);
+  *r->ddr |= _BV(r->io);
+  Write16bitRegister(r->ocr, l->etu);
+  Write16bitRegister(r->tcnt, 1);
+  *r->tifr |= _BV(r->ocf);
+  *r->tccr = r->low;
+  l->match = 0;
+  l->state = LINE_TX;
+}
+
+/**
+ * Puts a line back to idle after a byte, or starts sending the next
+ * byte queued
+ *
+ * @param l the engine of the line
+ */
+static void LineRest(LineEngine *l)
+{
+  RelayLine *r = l->regs;
+
+  if(l->txHead != l->txTail)
+  {
+    LineStartByte(l);
+    return;
+  }
+
+  l->state = LINE_IDLE;
+  l->subtick = 0;
+  Write16bitRegister(r->ocr, l->idle);
+  Write16bitRegister(r->tcnt, 1);
+  *r->tifr |= _BV(r->ocf);
+
+  if(l->edge)
+  {
+    PCIFR |= _BV(PCIF0);
+    PCMSK0 |= _BV(PCINT6);
+    if(bit_is_clear(*r->pin, r->io))
+      LineStartBit(l);
+  }
+}
+
+/**
+ * Starts receiving a byte once its start bit has been detected
+ *
+ * @param l the engine of the line
+ */
+static void LineStartBit(LineEngine *l)
+{
+  RelayLine *r = l->regs;
+
+  if(l->edge)
+    PCMSK0 &= ~(_BV(PCINT6));
+  Write16bitRegister(r->tcnt, 1);
+  Write16bitRegister(r->ocr, l->sample);
+  *r->tifr |= _BV(r->ocf);
+  l->shift = 0;
+  l->parity = 0;
+  l->error = 0;
+  l->match = 0;
+  l->state = LINE_RX;
+}
+
+/**
+ * Handles one compare match of a line receiving a byte. The bits are
+ * sampled and the parity error signalled with the same timing as
+ * GetByteICCParity and GetByteTerminalParity.
+ *
+ * @param l the engine of the line
+ */
+static void LineReceiveBit(LineEngine *l)
+{
+  RelayLine *r = l->regs;
+  uint8_t m, level, next;
+
+  m = ++l->match;
+  level = bit_is_set(*r->pin, r->io) ? 1 : 0;
+
+  if(m == 1)
+  {
+    // a start bit shorter than half an ETU is a glitch
+    if(level)
+      LineRest(l);
+    else
+      Write16bitRegister(r->ocr, l->etu);
+  }
+  else if(m <= 9)
+  {
+    if(level)
+      l->shift |= _BV(m - 2);
+    l->parity ^= level;
+  }
+  else if(m == 10)
+  {
+    l->parity ^= level;
+    next = (l->rxTail + 1) & LINE_QUEUE_MASK;
+    if(next == l->rxHead)
+      l->overrun = 1;
+    else
+    {
+      l->rx[l->rxTail] = l->shift;
+      l->rxParity[l->rxTail] = l->parity;
+      l->rxTail = next;
+    }
+
+    if(l->signal && l->parity != (l->inverse ? 1 : 0))
+    {
+      // set I/O low for at least 1 ETU starting at 10.5 ETU from start bit
+      l->error = 1;
+      *r->tccr = r->high;
+      *r->ddr |= _BV(r->io);
+      Write16bitRegister(r->ocr, l->half + l->lessThanHalf);
+      *r->tccr = r->low;
+    }
+    else
+      Write16bitRegister(r->ocr, l->half);
+  }
+  else if(l->error == 0 || m == 13)
+    LineRest(l);
+  else if(m == 11)
+  {
+    *r->tccr = r->high;
+    Write16bitRegister(r->ocr, l->extended);
+  }
+  else
+  {
+    // set I/O to high (input) and wait for the last ETU to complete
+    *r->ddr &= ~(_BV(r->io));
+    *r->port |= _BV(r->io);
+    Write16bitRegister(r->ocr, l->lessThanHalf);
+  }
+}
+
+/**
+ * Handles one compare match of a line sending a byte. The byte is sent
+ * with the same timing as SendByteICCParity and SendByteTerminalParity,
+ * refused bytes being sent again up to 4 times when txSignal is set.
+ *
+ * @param l the engine of the line
+ */
+static void LineSendBit(LineEngine *l)
+{
+  RelayLine *r = l->regs;
+  uint8_t m;
+
+  m = ++l->match;
+  if(m <= 8)
+    *r->tccr = (l->shift & _BV(m - 1)) ? r->high : r->low;
+  else if(m == 9)
+    *r->tccr = l->parity ? r->high : r->low;
+  else if(m == 10)
+    *r->tccr = r->high;
+  else if(m == 11)
+  {
+    *r->ddr &= ~(_BV(r->io));
+    *r->port |= _BV(r->io);
+    if(l->txSignal == 0)
+      goto endbyte;
+  }
+  else if(m == 12)
+  {
+    if(bit_is_set(*r->pin, r->io))
+      goto endbyte;
+    if(l->retries == 4)
+    {
+      l->txResult = 1;
+      goto endbyte;
+    }
+    l->retries++;
+  }
+  else if(m == 14)
+  {
+    // wait 2 ETUs before resending
+    LineStartByte(l);
+  }
+
+  return;
+
+endbyte:
+  l->retries = 0;
+  if(l->txResult != 0)
+    l->txHead = l->txTail;
+  else
+    l->txHead = (l->txHead + 1) & LINE_QUEUE_MASK;
+  LineRest(l);
+}
+
+/**
+ * Handles one compare match of a line timer
+ *
+ * @param l the engine of the line
+ */
+static void LineTimer(LineEngine *l)
+{
+  l->matches++;
+  if(l->state == LINE_IDLE)
+  {
+    if(l->edge == 0 && bit_is_clear(*l->regs->pin, l->regs->io))
+    {
+      LineStartBit(l);
+      return;
+    }
+    if(++l->subtick == l->subticks)
+    {
+      l->subtick = 0;
+      l->ticks++;
+    }
+  }
+  else if(l->state == LINE_RX)
+    LineReceiveBit(l);
+  else if(l->state == LINE_TX)
+    LineSendBit(l);
+}
+
+/**
+ * Interrupt routine for Timer1 Compare Match A, the ETU timer of the ICC
+ */
+ISR(TIMER1_COMPA_vect)
+{
+  LineTimer(&lines[LINE_ICC]);
+}
+
+/**
+ * Interrupt routine for Timer3 Compare Match A, the ETU timer of the
+ * terminal. This interrupt is also used by SleepUntilTerminalClock just
+ * to wake up the CPU, while the engine of the terminal is stopped.
+ */
+ISR(TIMER3_COMPA_vect)
+{
+  LineTimer(&lines[LINE_TERMINAL]);
+}
+
+/**
+ * Interrupt routine for the pin change interrupts of port B, used to
+ * detect the start bits of the ICC
+ */
+ISR(PCINT0_vect)
+{
+  LineEngine *l = &lines[LINE_ICC];
+
+  if(l->state == LINE_IDLE && bit_is_clear(PINB, PB6))
+    LineStartBit(l);
+}
+
+/**
+ * Stops the engine of a line. A byte being received or sent is dropped
+ * and the line is left as input, with the timer polled as before.
+ *
+ * @param l the engine of the line
+ */
+static void LineHalt(LineEngine *l)
+{
+  RelayLine *r = l->regs;
+  uint8_t sreg;
+
+  sreg = SREG;
+  cli();
+  *l->timsk &= ~(_BV(l->ocie));
+  if(l->edge)
+  {
+    PCMSK0 &= ~(_BV(PCINT6));
+    PCICR &= ~(_BV(PCIE0));
+  }
+  if(l->state == LINE_TX)
+  {
+    *r->tccr = r->high;
+    *r->ddr &= ~(_BV(r->io));
+    *r->port |= _BV(r->io);
+  }
+  l->state = LINE_OFF;
+  Write16bitRegister(r->ocr, l->etu);
+  *r->tifr |= _BV(r->ocf);
+  SREG = sreg;
+}
+
+/**
+ * Starts or stops the engine of a line according to its settings and the
+ * current ETU. Stopping and starting again also applies a new ETU.
+ *
+ * @param line LINE_TERMINAL or LINE_ICC
+ */
+static void LineUpdate(uint8_t line)
+{
+  LineEngine *l = &lines[line];
+  RelayLine *r = l->regs;
+  uint8_t sreg;
+
+  if(l->state != LINE_OFF)
+    LineHalt(l);
+
+  if(!LINE_ISR || !l->enabled || l->suspended)
+    return;
+
+  if(line == LINE_ICC)
+  {
+    if(iccETU < ICC_MIN_ISR_ETU)
+      return;
+    l->etu = iccETU;
+    l->half = iccETUHalf;
+    l->sample = iccETUHalf;
+    l->lessThanHalf = iccETULessThanHalf;
+    l->extended = iccETUExtended;
+    l->idle = iccETU;
+    l->subticks = 1;
+  }
+  else
+  {
+    if(terminalETU < TERMINAL_MIN_ISR_ETU)
+      return;
+    l->etu = terminalETU;
+    l->half = terminalETUHalf;
+    // the start bit is found up to 1 / LINE_OVERSAMPLE ETUs late
+    l->sample = terminalETUHalf - terminalETU / (2 * LINE_OVERSAMPLE);
+    l->lessThanHalf = terminalETULessThanHalf;
+    l->extended = terminalETUExtended;
+    l->idle = terminalETU / LINE_OVERSAMPLE;
+    l->subticks = LINE_OVERSAMPLE;
+  }
+
+  sreg = SREG;
+  cli();
+  l->rxHead = l->rxTail = 0;
+  l->txHead = l->txTail = 0;
+  l->overrun = 0;
+  l->retries = 0;
+  l->txResult = 0;
+
+  // the line starts as input, the OCxx pin set to 1 because of
+  // chip behavior
+  *r->tccr = r->high;
+  *r->ddr &= ~(_BV(r->io));
+  if(r->pullup)
+    *r->port |= _BV(r->io);
+  else
+    *r->port &= ~(_BV(r->io));
+
+  if(l->edge)
+    PCICR |= _BV(PCIE0);
+  LineRest(l);
+  *l->timsk |= _BV(l->ocie);
+  SREG = sreg;
+}
+
+/**
+ * Suspends the engines of both lines while the relay functions poll the
+ * timers, or allows them to start again
+ *
+ * @param suspend non-zero to suspend the engines
+ */
+static void LineSuspend(uint8_t suspend)
+{
+  uint8_t line;
+
+  for(line = LINE_TERMINAL; line <= LINE_ICC; line++)
+  {
+    lines[line].suspended = suspend;
+    if(suspend)
+      LineUpdate(line);
+  }
+}
+
+/**
+ * Checks the engine of a line before using it, starting it again if it
+ * was suspended by the relay functions
+ *
+ * @param line LINE_TERMINAL or LINE_ICC
+ * @return non-zero if the engine of the line is running
+ */
+static uint8_t LineActive(uint8_t line)
+{
+  LineEngine *l = &lines[line];
+
+  if(l->state == LINE_OFF && l->enabled && !l->suspended)
+    LineUpdate(line);
+
+  return l->state != LINE_OFF;
+}
+
+/**
+ * Calls the idle hook, if any, while a line waits
+ */
+static void LineIdle()
+{
+  if(lineIdleHook != NULL)
+    lineIdleHook();
+}
+
+/**
+ * Checks for terminal clock while the engine of the terminal uses the
+ * timer 3, without resetting the timer as IsTerminalClock does.
+ *
+ * Interrupts are only disabled while reading the counter, so the
+ * interrupts of the engines are not delayed by the wait below. As those
+ * interrupts may also stretch the wait until the counter has cleared at
+ * OCR3A and come back to the same value, a compare match since the first
+ * reading, either pending or already handled, also counts as clock.
+ *
+ * @return non-zero if we have some terminal clock, zero otherwise
+ */
+static uint8_t LineTerminalClock()
+{
+  LineEngine *l = &lines[LINE_TERMINAL];
+  uint8_t matches;
+  uint16_t first, second;
+
+  matches = l->matches;
+  first = ReadCounterTerminal();
+  // wait for at least 2 terminal clock cycles at the lowest frequency
+  _delay_us(2);
+  second = ReadCounterTerminal();
+
+  // the flag is read before the count, as the interrupt clears it
+  return first != second || bit_is_set(TIFR3, OCF3A) ||
+    l->matches != matches;
+}
+
+/**
+ * Receives the next byte queued by the engine of a line, waiting for it
+ * if necessary
+ *
+ * @param line LINE_TERMINAL or LINE_ICC
+ * @param inverse_convention different than 0 if inverse convention is
+ * to be used
+ * @param signal non-zero to signal parity errors to the sender
+ * @param r_byte contains the byte read on return
+ * @param max_wait the maximum number of cycles to wait for the start bit.
+ * Give 0 to wait indefinitely.
+ * @return zero if read was successful, RET_ERROR if the byte has a parity
+ * error or the engine was stopped, RET_ERR_MEMORY if bytes were dropped
+ * because the queue was full, RET_TERMINAL_RESET_LOW or
+ * RET_TERMINAL_NO_CLOCK if the terminal has reset or stopped the clock,
+ * or the timeout error of the line if max_wait has elapsed
+ */
+static uint8_t LineReceive(
+    uint8_t line,
+    uint8_t inverse_convention,
+    uint8_t signal,
+    uint8_t *r_byte,
+    uint32_t max_wait)
+{
+  LineEngine *l = &lines[line];
+  uint8_t byte, parity;
+  uint32_t cnt = 0;
+
+  l->inverse = inverse_convention;
+  l->signal = signal;
+  *r_byte = 0;
+
+  if(l->overrun)
+  {
+    l->overrun = 0;
+    return RET_ERR_MEMORY;
+  }
+
+  while(l->rxHead == l->rxTail)
+  {
+    if(l->state == LINE_OFF)
+      return RET_ERROR;
+
+    if(line == LINE_TERMINAL)
+    {
+      if(GetTerminalResetLine() == 0)
+        return RET_TERMINAL_RESET_LOW;
+      if(LineTerminalClock() == 0)
+        return RET_TERMINAL_NO_CLOCK;
+    }
+
+    if(l->state == LINE_IDLE)
+      LineIdle();
+
+    cnt = cnt + 1;
+    if(max_wait != 0 && cnt == max_wait)
+      return l->regs->timeout;
+  }
+
+  byte = l->rx[l->rxHead];
+  parity = l->rxParity[l->rxHead];
+  l->rxHead = (l->rxHead + 1) & LINE_QUEUE_MASK;
+
+  if(inverse_convention)
+    byte = LineInverse(byte);
+  *r_byte = byte;
+  if(parity != (inverse_convention ? 1 : 0))
+    return RET_ERROR;
+
+  return 0;
+}
+
+/**
+ * Sends a byte with the engine of a line and waits until it has been sent
+ *
+ * @param line LINE_TERMINAL or LINE_ICC
+ * @param byte byte to be sent
+ * @param inverse_convention different than 0 if inverse convention is
+ * to be used
+ * @param signal non-zero to send the byte again, up to 4 times, when
+ * the receiver signals a parity error
+ * @return 0 if successful, non-zero otherwise
+ */
+static uint8_t LineSend(
+    uint8_t line,
+    uint8_t byte,
+    uint8_t inverse_convention,
+    uint8_t signal)
+{
+  LineEngine *l = &lines[line];
+  uint8_t sreg;
+
+  sreg = SREG;
+  cli();
+  l->txInverse = inverse_convention;
+  l->txSignal = signal;
+  l->txResult = 0;
+  l->tx[l->txTail] = byte;
+  l->txTail = (l->txTail + 1) & LINE_QUEUE_MASK;
+  if(l->state == LINE_IDLE)
+    LineStartByte(l);
+  SREG = sreg;
+
+  while(l->txHead != l->txTail || l->state == LINE_TX)
+  {
+    if(l->state == LINE_OFF)
+      return RET_ERROR;
+
+    // check we have clock from terminal to avoid damage
+    if(line == LINE_TERMINAL && LineTerminalClock() == 0)
+    {
+      LineHalt(l);
+      LineUpdate(line);
+      return RET_ERROR;
+    }
+  }
+
+  return l->txResult;
+}
+
+/**
+ * Waits for a number of ETUs counted by the engine of a line. Only the
+ * ETUs elapsed while the line is idle are counted.
+ *
+ * @param line LINE_TERMINAL or LINE_ICC
+ * @param nEtus the number of ETUs to wait
+ * @return zero if completed, or the timeout error of the line if
+ * the timer has stopped
+ */
+static uint8_t LineLoop(uint8_t line, uint32_t nEtus)
+{
+  LineEngine *l = &lines[line];
+  uint8_t last;
+  uint32_t cnt = 0;
+
+  // the current ETU is only partly elapsed
+  last = l->ticks;
+  nEtus = nEtus + 1;
+
+  while(nEtus != 0)
+  {
+    if(l->ticks != last)
+    {
+      last++;
+      nEtus--;
+      cnt = 0;
+    }
+    else if(l->state == LINE_OFF || ++cnt == MAX_WAIT_TERMINAL_CLK)
+      return l->regs->timeout;
+  }
+
+  return 0;
+}
+
+/**
+ * Waits until the engine of a line receives a start bit
+ *
+ * @param line LINE_TERMINAL or LINE_ICC
+ * @param max_cycles the maximum number of cycles to wait, or 0
+ * @param nEtus the maximum number of ETUs to wait, or 0
+ * @return 0 if a byte is being or has been received, non-zero otherwise
+ */
+static uint8_t LineWaitData(
+    uint8_t line,
+    uint32_t max_cycles,
+    uint32_t nEtus)
+{
+  LineEngine *l = &lines[line];
+  uint8_t last;
+  uint32_t c = 0, etus = 0;
+
+  last = l->ticks;
+  while(l->rxHead == l->rxTail && l->state != LINE_RX)
+  {
+    if(l->state == LINE_OFF)
+      return 1;
+
+    if(l->state == LINE_IDLE)
+      LineIdle();
+
+    c = c + 1;
+    if(max_cycles != 0 && c == max_cycles)
+      return 1;
+
+    while(l->ticks != last)
+    {
+      last++;
+      etus++;
+    }
+    if(nEtus != 0 && etus >= nEtus)
+      return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Starts the interrupt-driven byte engine of a line. While the engine
+ * runs, the bytes sent by the other side are received and queued in the
+ * background, and the byte functions of the line (e.g. GetByteICCParity
+ * or LoopTerminalETU) use the engine instead of polling the timer. This
+ * lets the firmware log, write the EEPROM or service the USB (see
+ * SetLineIdleHook) while the line is busy, without missing start bits.
+ *
+ * The engine is not started while the ETU of the line is below
+ * ICC_MIN_ISR_ETU or TERMINAL_MIN_ISR_ETU, or when LINE_ISR is 0. The
+ * byte functions then poll the timer as before. The relay functions
+ * suspend the engines until EndRelay.
+ *
+ * @param line LINE_TERMINAL or LINE_ICC
+ * @return zero if the engine is running, RET_ERROR otherwise
+ *
+ * ActivateICC and StartCounterTerminal start the engine of their line.
+ */
+uint8_t StartLine(uint8_t line)
+{
+  lines[line].enabled = 1;
+  LineUpdate(line);
+
+  return (lines[line].state == LINE_OFF) ? RET_ERROR : 0;
+}
+
+/**
+ * Stops the interrupt-driven byte engine of a line. Bytes queued and
+ * not read yet are dropped.
+ *
+ * @param line LINE_TERMINAL or LINE_ICC
+ */
+void StopLine(uint8_t line)
+{
+  lines[line].enabled = 0;
+  LineUpdate(line);
+}
+
+/**
+ * @param line LINE_TERMINAL or LINE_ICC
+ * @return non-zero if the byte engine of the line is running
+ */
+uint8_t IsLineRunning(uint8_t line)
+{
+  return lines[line].state != LINE_OFF;
+}
+
+/**
+ * @param line LINE_TERMINAL or LINE_ICC
+ * @return the number of bytes received by the engine of a line and not
+ * read yet
+ */
+uint8_t LineBytesReceived(uint8_t line)
+{
+  return (lines[line].rxTail - lines[line].rxHead) & LINE_QUEUE_MASK;
+}
+
+/**
+ * Sets a function called repeatedly while the byte functions wait for
+ * a line driven by its engine, e.g. to service the USB. The function is
+ * only called while no byte is being received, and it should return
+ * within a few milliseconds since the waits that count cycles instead
+ * of ETUs are extended by the time spent in it.
+ *
+ * @param hook the function to call, or NULL
+ */
+void SetLineIdleHook(void (*hook)(void))
+{
+  lineIdleHook = hook;
+}
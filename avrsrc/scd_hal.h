@@ -52,6 +52,8 @@
 #define ICC_VCC_DELAY_US 50   
 #define PULL_UP_HIZ_ICC	1		        // Set to 1 to enable pull-ups when setting
                                         // the I/O-ICC line to Hi-Z
+#define LINE_ISR 1                      // Set to 1 to drive the I/O lines from
+                                        // interrupts, see StartLine
 #define F_CPU 16000000UL                // Set this to the correct frequency (generally CLK = CLK_IO)
 #define REF_CPU 16000000                // This should never be changed
 #define CPU_FACTOR ((uint8_t)(REF_CPU / F_CPU)) // Dependent on current frequency
@@ -95,6 +97,36 @@
 #define ICC_RST_WAIT 200000             // Used for card reset; 50000 * ((CLK_IO / 4) / F_TIMER0)
 #endif
 
+// Smallest ICC ETU, in timer 1 clocks, selected during PPS. The ICC byte
+// routines poll the timer and need about 124 CPU cycles per bit
+#if ((ICC_CLK_TCCR1B & 0x07) == 0x01)
+#define ICC_MIN_ETU 124
+#else
+#define ICC_MIN_ETU 16
+#endif
+
+// Smallest terminal ETU, in terminal clocks, accepted during PPS. With a
+// terminal clock of up to 5 MHz this leaves about 100 CPU cycles per bit
+#define TERMINAL_MIN_ETU 32
+
+// Smallest ETUs used by the interrupt-driven line engines, which need
+// about 150 CPU cycles per interrupt. With shorter ETUs, e.g. after a
+// PPS, the byte functions poll the timers instead
+#if ((ICC_CLK_TCCR1B & 0x07) == 0x01)
+#define ICC_MIN_ISR_ETU 372
+#else
+#define ICC_MIN_ISR_ETU 47
+#endif
+#define TERMINAL_MIN_ISR_ETU 372
+
+// Samples per ETU of the idle terminal I/O line, which has no pin change
+// interrupt, to find the start bits
+#define LINE_OVERSAMPLE 4
+
+// Size of the queue of bytes received and sent by each line engine,
+// must be a power of 2
+#define LINE_QUEUE_SIZE 16
+
 /* General SCD functions */
 
 /// Retrieves the value of the sync counter
@@ -106,6 +138,9 @@ void SetCounter();
 /// Resets to 0 the value of the sync counter
 void ResetCounter();
 
+/// Retrieves a timestamp with a finer resolution than the sync counter
+uint32_t GetTimestamp();
+
 /// Enables the Watch Dog Timer
 void EnableWDT(uint16_t ms);
 
@@ -154,6 +189,12 @@ void StopTimerT2();
 /// Increments the sync counter
 void IncrementCounter();
 
+/// Sets the ETU used with the terminal, in terminal clocks
+void SetTerminalETU(uint16_t etu);
+
+/// Returns the ETU used with the terminal, in terminal clocks
+uint16_t GetTerminalETU();
+
 /// Reads the value of the terminal counter
 uint16_t ReadCounterTerminal();
 
@@ -190,6 +231,12 @@ uint8_t LoopTerminalETU(uint32_t nEtus);
 
 /** SCD to ICC functions **/
 
+/// Sets the ETU used with the ICC, in timer 1 clocks
+void SetICCETU(uint16_t etu);
+
+/// Returns the ETU used with the ICC, in timer 1 clocks
+uint16_t GetICCETU();
+
 /// Returns non-zero if ICC is inserted, zero otherwise
 uint8_t IsICCInserted();
 
@@ -208,6 +255,9 @@ void LoopICCETU(uint8_t nEtus);
 /// Loops for max_cycles or until the I/O line from ICC becomes low
 uint8_t WaitForICCData(uint32_t max_cycles);
 
+/// Loops until the I/O line from the ICC becomes low or nEtus elapse
+uint8_t WaitForICCDataETU(uint32_t nEtus);
+
 /// Receives a byte from the ICC without parity checking
 uint8_t GetByteICCNoParity(uint8_t inverse_convention, uint8_t *r_byte);
 
@@ -235,4 +285,52 @@ void EnableICCInsertInterrupt();
 /// Disable the ICC insert interrupt
 void DisableICCInsertInterrupt();
 
+
+/** Relay functions **/
+
+/// Relay direction from the terminal to the ICC
+#define RELAY_TERMINAL_TO_ICC 0
+
+/// Relay direction from the ICC to the terminal
+#define RELAY_ICC_TO_TERMINAL 1
+
+/// Prepares the lines to relay bytes in the given direction
+void StartRelay(
+        uint8_t direction,
+        uint8_t src_inverse,
+        uint8_t dst_inverse,
+        uint8_t dst_guard,
+        uint8_t *bytes,
+        uint16_t size);
+
+/// Receives the next byte of the relay while sending the previous ones
+uint8_t RelayNextByte(uint8_t *r_byte, uint32_t max_wait);
+
+/// Waits until all the bytes received by the relay have been sent
+uint8_t EndRelay();
+
+
+/** Interrupt-driven line functions **/
+
+/// The terminal I/O line, driven by timer 3
+#define LINE_TERMINAL 0
+
+/// The ICC I/O line, driven by timer 1
+#define LINE_ICC 1
+
+/// Starts the interrupt-driven byte engine of a line
+uint8_t StartLine(uint8_t line);
+
+/// Stops the interrupt-driven byte engine of a line
+void StopLine(uint8_t line);
+
+/// Returns non-zero if the byte engine of a line is running
+uint8_t IsLineRunning(uint8_t line);
+
+/// Returns the number of bytes received by a line and not read yet
+uint8_t LineBytesReceived(uint8_t line);
+
+/// Sets the function called while the byte functions wait for a line
+void SetLineIdleHook(void (*hook)(void));
+
 #endif // _SCD_HAL_H_
@@ -34,10 +34,25 @@
 #include "scd_logger.h"
 #include "scd_values.h"
 
+/** State of LogEncode **/
+typedef struct {
+  log_write_t write;                  // NULL to only count the bytes
+  uint16_t length;                    // bytes encoded so far
+  uint8_t nout;                       // bytes in out not yet written
+  uint8_t out[LOG_ENCODE_BLOCK];
+  uint16_t nhistory;                  // bytes of the chain so far
+  uint8_t history[LOG_CHAIN_WINDOW];  // last bytes of the chain
+  uint8_t nrecent;                    // fine differences in recent
+  uint32_t recent[LOG_CHAIN_RECENT];  // last ones of the chain, newest first
+} log_encoder_t;
+
 
 /**
  * Function to reset the log structure
  *
+ * The event mask is kept, as it is a setting of the logger and not part
+ * of the log.
+ *
  * @param logger the log structure
  */
 void ResetLogger(log_struct_t *logger)
@@ -47,35 +62,170 @@ void ResetLogger(log_struct_t *logger)
 
   memset(logger->log_buffer, 0, LOG_BUFFER_SIZE);
   logger->position = 0;
+  logger->sent = 0;
+  logger->last = LOG_NO_ENTRY;
+  logger->timed = 0;
+  logger->flush_len = 0;
+  logger->flush_end = 0;
+  logger->flush_check = 0;
+  logger->nindex = 0;
+}
+
+/**
+ * Marks the current position of the log, so that the next entry starts
+ * there instead of being merged into the last run.
+ *
+ * @param logger the log structure
+ * @return the current position of the log, zero if logger is NULL
+ */
+uint16_t LogMark(log_struct_t *logger)
+{
+  if(logger == NULL)
+    return 0;
+
+  logger->last = LOG_NO_ENTRY;
+  return logger->position;
 }
 
 /**
  * Function used to log one byte of data. 
  *
+ * Consecutive bytes of the same type are stored as a run (see LOG_RUN),
+ * which costs one byte per logged byte instead of two.
+ *
  * @param logger the log structure
  * @param type the kind of data to be logged
  * @param byte_a the byte to be logged
- * @return zero if the logging was done or non-zero if some error
- * (e.g. out of memory or wrong tag) ocurred
+ * @return zero if the logging was done or the event is not in the event
+ * mask of the logger, non-zero if some error (e.g. out of memory or wrong
+ * tag) ocurred
  */
 uint8_t LogByte1(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a)
 {
+  uint16_t last;
+
   if(logger == NULL)
     return RET_ERR_PARAM;
   if((type & 0x03) != 0x00)
     return RET_ERR_PARAM;
+  if((logger->mask & LogTypeMask(type)) == 0)
+    return 0;
+
+  last = logger->last;
+  if(last != LOG_NO_ENTRY &&
+      logger->log_buffer[last] == (type | LOG_RUN) &&
+      logger->log_buffer[last + 1] < 0xFF)
+  {
+    // extend the current run
+    if(logger->position > LOG_BUFFER_SIZE - 1)
+      return RET_ERR_MEMORY;
+    logger->log_buffer[last + 1]++;
+    logger->log_buffer[logger->position++] = byte_a;
+    return 0;
+  }
+  else if(last != LOG_NO_ENTRY && logger->log_buffer[last] == type)
+  {
+    // turn the last entry into a run of 2 bytes
+    if(logger->position > LOG_BUFFER_SIZE - 2)
+      return RET_ERR_MEMORY;
+    logger->log_buffer[last + 2] = logger->log_buffer[last + 1];
+    logger->log_buffer[last] = type | LOG_RUN;
+    logger->log_buffer[last + 1] = 2;
+    logger->log_buffer[last + 3] = byte_a;
+    logger->position = last + 4;
+    return 0;
+  }
+
   if(logger->position > LOG_BUFFER_SIZE - 2)
     return RET_ERR_MEMORY;
 
+  logger->last = logger->position;
   logger->log_buffer[logger->position++] = type;
   logger->log_buffer[logger->position++] = byte_a;
 
   return 0;
 }
 
+/**
+ * Function used to log a number of bytes of the same type, such as the
+ * data field of a command or response once it has been exchanged.
+ *
+ * The bytes are added to the current run if possible and otherwise stored
+ * in new runs of up to 255 bytes, checking and reserving the space once
+ * for each run instead of once for each byte.
+ *
+ * @param logger the log structure
+ * @param type the kind of data to be logged, a type of 1-byte entries
+ * @param data the bytes to be logged
+ * @param len the number of bytes to be logged
+ * @return zero if the logging was done or non-zero if some error
+ * (e.g. out of memory or wrong tag) ocurred
+ * @sa LogByte1
+ */
+uint8_t LogBytes(log_struct_t *logger, SCD_LOG_BYTE type,
+    const uint8_t *data, uint16_t len)
+{
+  uint16_t last, n;
+  uint8_t result;
+
+  if(logger == NULL || (data == NULL && len > 0))
+    return RET_ERR_PARAM;
+  if((type & 0x03) != 0x00)
+    return RET_ERR_PARAM;
+  if((logger->mask & LogTypeMask(type)) == 0)
+    return 0;
+
+  while(len > 0)
+  {
+    last = logger->last;
+    if(last != LOG_NO_ENTRY &&
+        logger->log_buffer[last] == (type | LOG_RUN) &&
+        logger->log_buffer[last + 1] < 0xFF)
+    {
+      // fill the current run
+      n = 0xFF - logger->log_buffer[last + 1];
+      if(n > len)
+        n = len;
+      if(logger->position > LOG_BUFFER_SIZE - n)
+        return RET_ERR_MEMORY;
+      logger->log_buffer[last + 1] += n;
+    }
+    else if(len == 1 ||
+        (last != LOG_NO_ENTRY && logger->log_buffer[last] == type))
+    {
+      // a single entry, or one that LogByte1 turns into a run
+      result = LogByte1(logger, type, *data);
+      if(result != 0)
+        return result;
+      data++;
+      len--;
+      continue;
+    }
+    else
+    {
+      // start a new run
+      n = (len > 0xFF) ? 0xFF : len;
+      if(logger->position > LOG_BUFFER_SIZE - n - 2)
+        return RET_ERR_MEMORY;
+      logger->last = logger->position;
+      logger->log_buffer[logger->position++] = type | LOG_RUN;
+      logger->log_buffer[logger->position++] = n;
+    }
+
+    memcpy(&logger->log_buffer[logger->position], data, n);
+    logger->position += n;
+    data += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
 /**
  * Function used to log two bytes of data.
  *
+ * In version 2 of the log this is stored as a run of 2 bytes.
+ *
  * @param logger the log structure
  * @param type the kind of data to be logged
  * @param byte_a the first byte to be logged
@@ -90,10 +240,14 @@ uint8_t LogByte2(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a,
     return RET_ERR_PARAM;
   if((type & 0x03) != 0x01)
     return RET_ERR_PARAM;
-  if(logger->position > LOG_BUFFER_SIZE - 3)
+  if((logger->mask & LogTypeMask(type)) == 0)
+    return 0;
+  if(logger->position > LOG_BUFFER_SIZE - 4)
     return RET_ERR_MEMORY;
 
+  logger->last = LOG_NO_ENTRY;
   logger->log_buffer[logger->position++] = type;
+  logger->log_buffer[logger->position++] = 2;
   logger->log_buffer[logger->position++] = byte_a;
   logger->log_buffer[logger->position++] = byte_b;
 
@@ -119,9 +273,12 @@ uint8_t LogByte3(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a,
     return RET_ERR_PARAM;
   if((type & 0x03) != 0x02)
     return RET_ERR_PARAM;
+  if((logger->mask & LogTypeMask(type)) == 0)
+    return 0;
   if(logger->position > LOG_BUFFER_SIZE - 4)
     return RET_ERR_MEMORY;
 
+  logger->last = LOG_NO_ENTRY;
   logger->log_buffer[logger->position++] = type;
   logger->log_buffer[logger->position++] = byte_a;
   logger->log_buffer[logger->position++] = byte_b;
@@ -149,9 +306,12 @@ uint8_t LogByte4(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a,
     return RET_ERR_PARAM;
   if((type & 0x03) != 0x03)
     return RET_ERR_PARAM;
+  if((logger->mask & LogTypeMask(type)) == 0)
+    return 0;
   if(logger->position > LOG_BUFFER_SIZE - 5)
     return RET_ERR_MEMORY;
 
+  logger->last = LOG_NO_ENTRY;
   logger->log_buffer[logger->position++] = type;
   logger->log_buffer[logger->position++] = byte_a;
   logger->log_buffer[logger->position++] = byte_b;
@@ -161,3 +321,454 @@ uint8_t LogByte4(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a,
   return 0;
 }
 
+/**
+ * Function used to log a time value.
+ *
+ * The time is stored as the difference from the previous time logged,
+ * encoded as a varint, which takes 2 or 3 bytes instead of 5 for close
+ * events. The first time after ResetLogger, or a time lower than the
+ * previous one, is stored as an absolute value with LogByte4. The fine
+ * times (LOG_TIME_FINE) are relative to the previous fine time.
+ *
+ * @param logger the log structure
+ * @param type the kind of time to be logged, one of LOG_TIME_*
+ * @param time the time value
+ * @return zero if the logging was done or non-zero if error
+ */
+uint8_t LogTime(log_struct_t *logger, SCD_LOG_BYTE type, uint32_t time)
+{
+  uint32_t delta, *last;
+  uint8_t result, timed;
+
+  if(logger == NULL)
+    return RET_ERR_PARAM;
+  if((type & 0x03) != 0x03)
+    return RET_ERR_PARAM;
+  if((logger->mask & LogTypeMask(type)) == 0)
+    return 0;
+
+  last = &logger->time;
+  timed = LOG_TIMED;
+  if(type == LOG_TIME_FINE)
+  {
+    last = &logger->time_fine;
+    timed = LOG_TIMED_FINE;
+  }
+
+  if((logger->timed & timed) == 0 || time < *last)
+  {
+    result = LogByte4(logger, type, (time & 0xFF), ((time >> 8) & 0xFF),
+        ((time >> 16) & 0xFF), ((time >> 24) & 0xFF));
+    if(result == 0)
+    {
+      *last = time;
+      logger->timed |= timed;
+    }
+    return result;
+  }
+
+  // a 32-bit varint takes at most 5 bytes
+  if(logger->position > LOG_BUFFER_SIZE - 6)
+    return RET_ERR_MEMORY;
+
+  delta = time - *last;
+  logger->last = LOG_NO_ENTRY;
+  logger->log_buffer[logger->position++] = type & 0xFC;
+  while(delta > 0x7F)
+  {
+    logger->log_buffer[logger->position++] = (delta & 0x7F) | 0x80;
+    delta = delta >> 7;
+  }
+  logger->log_buffer[logger->position++] = delta;
+  *last = time;
+
+  return 0;
+}
+
+/**
+ * Returns the size of a version 2 entry of the log.
+ *
+ * @param log the log entries
+ * @param pos the position of the entry
+ * @param end the position after the last entry
+ * @return the size of the entry, header included
+ */
+static uint16_t LogEntrySize(const uint8_t *log, uint16_t pos, uint16_t end)
+{
+  uint8_t header = log[pos];
+  uint16_t n = 1;
+
+  if((header & 0x03) == LOG_RUN)
+    return (pos + 1 < end) ? log[pos + 1] + 2 : 1;
+  if((header & 0x03) == 0 && LogTypeMask(header) == LOG_MASK_TIME)
+  {
+    while(pos + n < end && (log[pos + n++] & 0x80));
+    return n;
+  }
+
+  return (header & 0x03) + 2;
+}
+
+/**
+ * Tells if an entry holds bytes that can be part of a chain: the bytes
+ * sent to or received from the terminal or the ICC, as 1-byte entries
+ * or runs.
+ *
+ * @param header the header of the entry
+ * @return non-zero if the entry can be part of a chain
+ */
+static uint8_t LogChainData(uint8_t header)
+{
+  return (header & 0xFC) >= LOG_BYTE_TO_TERMINAL &&
+    (header & 0xFC) <= LOG_BYTE_FROM_ICC && (header & 0x03) <= LOG_RUN;
+}
+
+/**
+ * Tells if an entry is a time difference that can be part of a chain,
+ * of LOG_TIME_GENERAL or LOG_TIME_FINE.
+ *
+ * @param header the header of the entry
+ * @return non-zero if the entry can be part of a chain
+ */
+static uint8_t LogChainTime(uint8_t header)
+{
+  return header == (LOG_TIME_GENERAL & 0xFC) ||
+    header == (LOG_TIME_FINE & 0xFC);
+}
+
+/**
+ * Finds the entries of the chain that can start at a data entry: the
+ * data entries of its type or the paired type and the time differences
+ * between them. Two entries of the same type must have a time between
+ * them, as they would be one entry when decoded.
+ *
+ * The chain is only used if it cannot be longer than its entries, taking
+ * its bytes as tokens of bytes without copies and its time differences
+ * at their size in the entries, so that LogEncode never makes the log
+ * longer (e.g. with 1-byte entries one after the other).
+ *
+ * @param log the log entries
+ * @param pos the position of the first entry of the chain
+ * @param end the position after the last entry that can be in the chain
+ * @return the position after the last data entry of the chain, or pos if
+ * there are less than two data entries to chain or the chain could be
+ * longer than its entries
+ */
+static uint16_t LogChainEnd(const uint8_t *log, uint16_t pos, uint16_t end)
+{
+  uint16_t start = pos, chain = pos, size, n, cost = 2, chain_cost = 0;
+  uint8_t base = log[pos] & 0xFC, last = 0xFF, count = 0;
+
+  while(pos < end)
+  {
+    size = LogEntrySize(log, pos, end);
+    if(size > end - pos)
+      break;
+
+    if(LogChainData(log[pos]) && ((log[pos] ^ base) & 0xF8) == 0)
+    {
+      if((log[pos] & 0xFC) == last)
+        break;
+      last = log[pos] & 0xFC;
+      count++;
+      n = ((log[pos] & 0x03) == LOG_RUN) ? size - 2 : 1;
+      cost += n + (n + LOG_CHAIN_MAX_BYTES - 1) / LOG_CHAIN_MAX_BYTES;
+      chain = pos + size;
+      chain_cost = cost;
+    }
+    else if(LogChainTime(log[pos]))
+    {
+      last = 0xFF;
+      cost += size;
+    }
+    else
+      break;
+    pos += size;
+  }
+
+  if(count < 2 || chain_cost > chain - start)
+    return start;
+
+  return chain;
+}
+
+/**
+ * Adds a byte to the encoded log. The bytes are passed to the write
+ * function of the encoder in blocks of LOG_ENCODE_BLOCK bytes.
+ *
+ * @param enc the state of the encoder
+ * @param byte the byte to add
+ */
+static void EncodeByte(log_encoder_t *enc, uint8_t byte)
+{
+  enc->length++;
+  if(enc->write == NULL)
+    return;
+
+  enc->out[enc->nout++] = byte;
+  if(enc->nout == LOG_ENCODE_BLOCK)
+  {
+    enc->write(enc->out, enc->nout);
+    enc->nout = 0;
+  }
+}
+
+/**
+ * Adds a value to the encoded log as a varint, as done by LogTime.
+ *
+ * @param enc the state of the encoder
+ * @param value the value to add
+ */
+static void EncodeVarint(log_encoder_t *enc, uint32_t value)
+{
+  while(value > 0x7F)
+  {
+    EncodeByte(enc, (value & 0x7F) | 0x80);
+    value = value >> 7;
+  }
+  EncodeByte(enc, value);
+}
+
+/**
+ * Adds bytes of a chain to the encoded log as they are, in tokens of up
+ * to LOG_CHAIN_MAX_BYTES bytes.
+ *
+ * @param enc the state of the encoder
+ * @param data the bytes
+ * @param len the number of bytes
+ * @param paired non-zero for bytes of the paired type
+ */
+static void EncodeChainLiteral(log_encoder_t *enc, const uint8_t *data,
+    uint8_t len, uint8_t paired)
+{
+  uint8_t n;
+
+  while(len > 0)
+  {
+    n = (len > LOG_CHAIN_MAX_BYTES) ? LOG_CHAIN_MAX_BYTES : len;
+    EncodeByte(enc, n | (paired ? LOG_CHAIN_PAIRED : 0));
+    for(len -= n; n > 0; n--)
+      EncodeByte(enc, *data++);
+  }
+}
+
+/**
+ * Adds the bytes of a data entry to a chain. The bytes that repeat at
+ * least LOG_CHAIN_MIN_COPY earlier bytes of the chain, up to
+ * LOG_CHAIN_WINDOW bytes back, become a copy of them, which is found by
+ * trying each offset in turn as there is no memory for anything faster.
+ *
+ * @param enc the state of the encoder
+ * @param data the bytes
+ * @param len the number of bytes
+ * @param paired non-zero for bytes of the paired type
+ */
+static void EncodeChainBytes(log_encoder_t *enc, const uint8_t *data,
+    uint8_t len, uint8_t paired)
+{
+  uint16_t dist, max, best_dist = 0;
+  uint8_t i = 0, start = 0, n, best, byte;
+
+  while(i < len)
+  {
+    // longest match, the bytes of the chain before data[i] are in history
+    best = 0;
+    max = (enc->nhistory < LOG_CHAIN_WINDOW) ?
+      enc->nhistory : LOG_CHAIN_WINDOW;
+    for(dist = 1; dist <= max && best < LOG_CHAIN_MAX_COPY; dist++)
+    {
+      for(n = 0; n < LOG_CHAIN_MAX_COPY && i + n < len; n++)
+      {
+        if(n < dist)
+          byte = enc->history[(enc->nhistory - dist + n) % LOG_CHAIN_WINDOW];
+        else
+          byte = data[i + n - dist];
+        if(byte != data[i + n])
+          break;
+      }
+      if(n > best)
+      {
+        best = n;
+        best_dist = dist;
+      }
+    }
+
+    if(best < LOG_CHAIN_MIN_COPY)
+      best = 1;
+    else
+    {
+      EncodeChainLiteral(enc, data + start, i - start, paired);
+      EncodeByte(enc, LOG_CHAIN_COPY | (best - LOG_CHAIN_MIN_COPY) |
+          (paired ? LOG_CHAIN_COPY_PAIRED : 0));
+      EncodeByte(enc, best_dist - 1);
+      start = i + best;
+    }
+
+    for(; best > 0; best--, i++)
+      enc->history[enc->nhistory++ % LOG_CHAIN_WINDOW] = data[i];
+  }
+
+  EncodeChainLiteral(enc, data + start, len - start, paired);
+}
+
+/**
+ * Adds a LOG_TIME_FINE difference to a chain, as a token with its low
+ * bits, or as the change from a recent difference when it is close.
+ *
+ * @param enc the state of the encoder
+ * @param delta the difference
+ */
+static void EncodeChainFine(log_encoder_t *enc, uint32_t delta)
+{
+  uint32_t diff = 0;
+  uint8_t i;
+
+  for(i = 0; i < enc->nrecent; i++)
+  {
+    diff = delta - enc->recent[i] + 2;
+    if(diff <= 3)
+      break;
+  }
+
+  if(i < enc->nrecent)
+    EncodeByte(enc, LOG_CHAIN_FINE_RECENT | (i << 2) | (uint8_t)diff);
+  else
+  {
+    EncodeByte(enc, LOG_CHAIN_FINE | (delta & 0x1F));
+    EncodeVarint(enc, delta >> 5);
+    if(enc->nrecent < LOG_CHAIN_RECENT)
+      enc->nrecent++;
+    i = enc->nrecent - 1;
+  }
+
+  // the difference becomes the newest one
+  for(; i > 0; i--)
+    enc->recent[i] = enc->recent[i - 1];
+  enc->recent[0] = delta;
+}
+
+/**
+ * Adds a chain to the encoded log, see SCD_LOG_BYTE.
+ *
+ * @param enc the state of the encoder
+ * @param log the log entries
+ * @param pos the position of the first entry of the chain
+ * @param end the position after the last entry of the chain, as given
+ * by LogChainEnd
+ */
+static void EncodeChain(log_encoder_t *enc, const uint8_t *log,
+    uint16_t pos, uint16_t end)
+{
+  uint32_t delta;
+  uint8_t base, header, n, shift;
+
+  base = log[pos] & 0xFC;
+  enc->nhistory = 0;
+  enc->nrecent = 0;
+  EncodeByte(enc, base | LOG_CHAIN);
+
+  while(pos < end)
+  {
+    header = log[pos++];
+    if(LogChainTime(header))
+    {
+      delta = 0;
+      shift = 0;
+      do{
+        delta |= (uint32_t)(log[pos] & 0x7F) << shift;
+        shift += 7;
+      }while(log[pos++] & 0x80);
+
+      if(header == (LOG_TIME_FINE & 0xFC))
+        EncodeChainFine(enc, delta);
+      else if(delta < 0x20)
+        EncodeByte(enc, LOG_CHAIN_TIME_SHORT | delta);
+      else
+      {
+        EncodeByte(enc, LOG_CHAIN_TIME);
+        EncodeVarint(enc, delta);
+      }
+      continue;
+    }
+
+    n = 1;
+    if((header & 0x03) == LOG_RUN)
+      n = log[pos++];
+    EncodeChainBytes(enc, &log[pos], n, (header & 0xFC) != base);
+    pos += n;
+  }
+
+  EncodeByte(enc, LOG_CHAIN_END);
+}
+
+/**
+ * Encodes the log to version 3 (see SCD_LOG_BYTE), as written to the
+ * EEPROM log. The bytes of the exchanges and the time differences
+ * between them become chains, where the bytes cost about one byte each
+ * in both directions, bytes repeated from the same chain (e.g. the
+ * header of a command sent again with Le) cost less and so do the
+ * differences close to a recent one. Other entries are kept as they are.
+ *
+ * A chain does not go over the start of a transaction in the index of
+ * the logger, so that the log of a transaction can be decoded alone;
+ * the offset of each transaction in the encoded log is stored in its
+ * index entry. The log itself is not changed, so it can be encoded
+ * again with the same result, e.g. once to get the length of the
+ * encoded log and once to copy it. The encoded log is never longer than
+ * the entries (see LogChainEnd), so space for the entries holds it.
+ *
+ * @param logger the log structure
+ * @param end the position after the last entry to encode
+ * @param write the function that gets the encoded bytes, in blocks of
+ * up to LOG_ENCODE_BLOCK bytes, or NULL to only get the length
+ * @return the length of the encoded log
+ */
+uint16_t LogEncode(log_struct_t *logger, uint16_t end, log_write_t write)
+{
+  log_encoder_t enc;
+  const uint8_t *log;
+  uint16_t pos, next, limit;
+  uint8_t i = 0;
+
+  if(logger == NULL)
+    return 0;
+
+  log = logger->log_buffer;
+  enc.write = write;
+  enc.length = 0;
+  enc.nout = 0;
+
+  for(pos = 0; pos < end; pos = next)
+  {
+    // a chain ends before the next transaction
+    for(; i < logger->nindex && logger->index[i].offset <= pos; i++)
+      logger->index[i].encoded = enc.length;
+    limit = end;
+    if(i < logger->nindex && logger->index[i].offset < end)
+      limit = logger->index[i].offset;
+
+    next = pos;
+    if(LogChainData(log[pos]))
+      next = LogChainEnd(log, pos, limit);
+    if(next > pos)
+    {
+      EncodeChain(&enc, log, pos, next);
+      continue;
+    }
+
+    next = pos + LogEntrySize(log, pos, end);
+    if(next > end)
+      next = end;
+    for(; pos < next; pos++)
+      EncodeByte(&enc, log[pos]);
+  }
+
+  // transactions that start at the end
+  for(; i < logger->nindex; i++)
+    logger->index[i].encoded = enc.length;
+
+  if(write != NULL && enc.nout > 0)
+    write(enc.out, enc.nout);
+
+  return enc.length;
+}
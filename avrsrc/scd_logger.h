@@ -42,13 +42,79 @@
 #define LOG_BUFFER_SIZE 3900    // static for simplicity
 // we are restricted here by the memory capacity
 
+#define LOG_FORMAT_VERSION 3    // encoding of the log, see SCD_LOG_BYTE
+#define LOG_RUN 0x01            // YY bits of a run of 1-byte entries
+#define LOG_CHAIN 0x02          // YY bits of a chain of data (version 3)
+#define LOG_CHAIN_WINDOW 128    // bytes searched back for a copy, up to 256
+#define LOG_CHAIN_RECENT 8      // fine time differences kept by a chain
+#define LOG_ENCODE_BLOCK 16     // bytes passed at once to a log_write_t
+#define LOG_NO_ENTRY 0xFFFF     // no entry can be extended
+#define LOG_INDEX_SIZE 4        // transactions indexed in one log
+#define LOG_TIMED 0x01          // bit of timed for the sync counter times
+#define LOG_TIMED_FINE 0x02     // bit of timed for LOG_TIME_FINE
+
+/**
+ * Classes of log events, used in the event mask of the logger. Events of
+ * a class that is not in the mask are dropped by the logging functions.
+ */
+#define LOG_MASK_ATR 0x01           // ATR bytes from ICC and to terminal
+#define LOG_MASK_TERMINAL_DATA 0x02 // bytes from and to the terminal
+#define LOG_MASK_ICC_DATA 0x04      // bytes from and to the ICC
+#define LOG_MASK_USB 0x08           // USB events
+#define LOG_MASK_TERMINAL 0x10      // terminal events and errors
+#define LOG_MASK_ICC 0x20           // ICC events and errors
+#define LOG_MASK_TIME 0x40          // time events
+#define LOG_MASK_GENERAL 0x80       // memory, watchdog and debug events
+#define LOG_MASK_ALL 0xFF
+
+/**
+ * Tokens of a chain (version 3 of the log), see SCD_LOG_BYTE
+ */
+#define LOG_CHAIN_END 0x00          // end of the chain
+#define LOG_CHAIN_PAIRED 0x40       // bit of the bytes of the paired type
+#define LOG_CHAIN_TIME 0x40         // LOG_TIME_GENERAL difference, varint
+#define LOG_CHAIN_FINE 0x80         // LOG_TIME_FINE difference, 5 bits
+#define LOG_CHAIN_FINE_RECENT 0xA0  // LOG_TIME_FINE close to a recent one
+#define LOG_CHAIN_COPY 0xC0         // bytes copied from the chain
+#define LOG_CHAIN_COPY_PAIRED 0x10  // bit of a copy of the paired type
+#define LOG_CHAIN_TIME_SHORT 0xE0   // LOG_TIME_GENERAL difference, 5 bits
+#define LOG_CHAIN_MIN_COPY 3        // bytes of the shortest copy
+#define LOG_CHAIN_MAX_COPY 18       // bytes of the longest copy
+#define LOG_CHAIN_MAX_BYTES 63      // bytes of the longest token of bytes
+
+/** Start of a transaction in the log, see LogTransaction **/
+typedef struct {
+    uint16_t offset;        // position of its first entry in the log
+    uint16_t encoded;       // its offset once encoded, see LogEncode
+    uint32_t time;          // time when it started (ms counter)
+    uint8_t number;         // transaction number (transaction counter)
+} log_index_t;
+
 /** Structure used to keep the log **/
 struct log_struct {
     uint8_t log_buffer[LOG_BUFFER_SIZE];
     uint32_t position;
+    uint32_t sent;          // entries before this were streamed to the host
+    uint8_t live;           // set to stream the log to the host (AT+CLIVE)
+    uint16_t last;          // last entry if it is a 1-byte entry or a run
+    uint32_t time;          // last time logged, if timed has LOG_TIMED
+    uint32_t time_fine;     // last LOG_TIME_FINE, if timed has LOG_TIMED_FINE
+    uint8_t timed;          // kinds of time logged since ResetLogger
+    uint8_t mask;           // classes of events to log, see LOG_MASK_ALL
+    uint16_t flush_addr;    // EEPROM record of a log not yet copied there
+    uint16_t flush_seq;     // sequence number of that record
+    uint16_t flush_len;     // bytes of the log not yet copied, 0 if none
+    uint16_t flush_tail;    // oldest record of the ring before that commit
+    uint16_t flush_end;     // end of the entries encoded in that record
+    uint16_t flush_check;   // check of the fields above, kept over a reset
+    log_index_t index[LOG_INDEX_SIZE];  // transactions in the log
+    uint8_t nindex;         // number of entries in index
 };
 typedef struct log_struct log_struct_t;
 
+/** Receives the bytes of the log encoded by LogEncode **/
+typedef void (*log_write_t)(const uint8_t *data, uint8_t len);
+
 /**
   * Definition of log direction bits, used in some methods to select
   * which part of a transaction to log
@@ -67,6 +133,45 @@ typedef enum {
  * used for the encoding of the type (6 bits) and YY (2 bits) to specify
  * how many bytes follow (b'00 -> 1, b'01 -> 2, b'10 -> 3 or b'11 -> 4).
  * These are defined next.
+ *
+ * Version 2 of the log (LOG_FORMAT_VERSION) keeps the same types but
+ * changes the meaning of some YY values:
+ * - YY = b'01 (LOG_RUN) is a run of 1-byte entries of the same type,
+ *   followed by the number of bytes N (2 to 255) and then the N bytes.
+ * - a LOG_TIME_* type with YY = b'00 is followed by the difference from
+ *   the previous time as a varint (7 bits per byte, least significant
+ *   first, with bit 7 set in all but the last byte). With YY = b'11 the
+ *   time is absolute, as in version 1. The first time after ResetLogger
+ *   is always absolute.
+ *
+ * LOG_TIME_FINE is a time type added to version 2, in units of 4 us
+ * (see GetTimestamp). Its differences are taken from the previous
+ * LOG_TIME_FINE, separately from the other times.
+ *
+ * Version 3 of the log is the one written to EEPROM by LogEncode, while
+ * the log in SRAM and the live trace (AT+CLIVE) keep version 2 entries.
+ * It adds the chain: a data type (LOG_BYTE_TO_TERMINAL to
+ * LOG_BYTE_FROM_ICC) with YY = b'10 (LOG_CHAIN), which holds the bytes
+ * sent both ways in a series of exchanges and the time differences
+ * between them. The bytes are of the type of the chain (the base type)
+ * or of the paired type, with bit 2 flipped (e.g. LOG_BYTE_FROM_ICC for
+ * LOG_BYTE_TO_ICC). A chain is a list of tokens ending with 0x00:
+ * - 0x01 to 0x3F: N = 1 to 63 bytes of the base type follow;
+ * - 0x41 to 0x7F: N = (token & 0x3F) bytes of the paired type follow;
+ * - 0x40: a LOG_TIME_GENERAL difference follows as a varint;
+ * - b'100ttttt: a LOG_TIME_FINE difference with t as its low 5 bits,
+ *   followed by the rest (difference >> 5) as a varint;
+ * - b'101iiidd: a LOG_TIME_FINE difference of R + dd - 2, where R is
+ *   entry i of the list of the last LOG_CHAIN_RECENT fine differences
+ *   of the chain (newest first). Each fine difference is put first in
+ *   the list, replacing R if given this way;
+ * - b'110Dnnnn: n + 3 bytes of the base (D = 0) or paired (D = 1) type
+ *   copied from the bytes of the chain, starting O bytes back, where O
+ *   is the next byte plus one (the bytes copied can overlap);
+ * - b'111ttttt: a LOG_TIME_GENERAL difference of t.
+ * Consecutive bytes of the same type are one entry, a run or a 1-byte
+ * entry if there is only one, so the version 2 entries are given back
+ * as they were.
  */
 typedef enum {
     // EMV/ISO-7816 data bytes
@@ -93,6 +198,7 @@ typedef enum {
     LOG_TERMINAL_ERROR_SEND = (0x14 << 2 | 0x00),           // 0x50
     LOG_TERMINAL_NO_CLOCK = (0x15 << 2 | 0x00),             // 0x54
     LOG_TERMINAL_MORE_TIME = (0x16 << 2 | 0x00),            // 0x58
+    LOG_TERMINAL_PPS = (0x17 << 2 | 0x00),                  // 0x5C
 
     // ICC events
     LOG_ICC_ACTIVATED = (0x20 << 2 | 0x00),                 // 0x80
@@ -115,6 +221,9 @@ typedef enum {
     LOG_DEBUG_TEST3 = (0x36 << 2 | 0x00),                   // 0xD8
     LOG_DEBUG_TEST4 = (0x37 << 2 | 0x00),                   // 0xDC
 
+    // Fine time, saved as the other times
+    LOG_TIME_FINE = (0x38 << 2 | 0x03),                     // 0xE3
+
 }SCD_LOG_BYTE;
 
 /**
@@ -130,9 +239,16 @@ typedef enum{
 /// Reset the log buffer and position
 void ResetLogger(log_struct_t *logger);
 
+/// Marks the current position of the log as the start of an entry
+uint16_t LogMark(log_struct_t *logger);
+
 /// Log one byte of data
 uint8_t LogByte1(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a);
 
+/// Log a number of bytes of the same type, as runs
+uint8_t LogBytes(log_struct_t *logger, SCD_LOG_BYTE type,
+        const uint8_t *data, uint16_t len);
+
 /// Log two bytes of data
 uint8_t LogByte2(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a,
         uint8_t byte_b);
@@ -145,6 +261,57 @@ uint8_t LogByte3(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a,
 uint8_t LogByte4(log_struct_t *logger, SCD_LOG_BYTE type, uint8_t byte_a,
         uint8_t byte_b, uint8_t byte_c, uint8_t byte_d);
 
+/// Log a time value, relative to the previous one if possible
+uint8_t LogTime(log_struct_t *logger, SCD_LOG_BYTE type, uint32_t time);
+
+/// Encode the log to version 3, as written to EEPROM
+uint16_t LogEncode(log_struct_t *logger, uint16_t end, log_write_t write);
+
+/**
+ * Returns the class of a log event, as one of the LOG_MASK_* bits
+ */
+static inline uint8_t LogTypeMask(SCD_LOG_BYTE type)
+{
+    uint8_t t = type >> 2;
+
+    if(t < 0x08)
+        return LOG_MASK_ATR << (t >> 1);
+    if(t < 0x10)
+        return LOG_MASK_USB;
+    if(t < 0x20)
+        return LOG_MASK_TERMINAL;
+    if(t < 0x30)
+        return LOG_MASK_ICC;
+    if(t < 0x32 || t == (LOG_TIME_FINE >> 2))
+        return LOG_MASK_TIME;
+    return LOG_MASK_GENERAL;
+}
+
+/**
+ * Logs one byte of data like LogByte1, but adds it inline to the current
+ * run when possible. Use this where bytes are logged one at a time
+ * between the bytes of an exchange. The logger must not be NULL.
+ */
+static inline uint8_t LogByte1Fast(log_struct_t *logger, SCD_LOG_BYTE type,
+        uint8_t byte_a)
+{
+    uint16_t last = logger->last;
+
+    if((logger->mask & LogTypeMask(type)) == 0)
+        return 0;
+    if(last != LOG_NO_ENTRY &&
+            logger->log_buffer[last] == (type | LOG_RUN) &&
+            logger->log_buffer[last + 1] < 0xFF &&
+            logger->position < LOG_BUFFER_SIZE)
+    {
+        logger->log_buffer[last + 1]++;
+        logger->log_buffer[logger->position++] = byte_a;
+        return 0;
+    }
+
+    return LogByte1(logger, type, byte_a);
+}
+
 
 #endif // _SCD_LOGGER_H_
 
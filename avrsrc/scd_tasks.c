@@ -0,0 +1,219 @@
+/**
+ * \file
+ * \brief	scd_tasks.c source file
+ *
+ * This file implements a cooperative task scheduler. The applications
+ * drive the terminal and ICC lines themselves, which must meet the timing
+ * of each byte, and the other work of the SCD (servicing the USB host,
+ * draining the log, updating the LCD) is done by tasks run in the time
+ * the applications spend waiting for the lines (see SetLineIdleHook).
+ *
+ * The task table follows the one of the LUFA scheduler, with a run flag
+ * and a group for each task, but the tasks are run on demand by RunTasks
+ * instead of from a loop that never returns.
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <avr/io.h>
+#include <stddef.h>
+
+#include "scd_hal.h"
+#include "scd_tasks.h"
+#include "scd_values.h"
+
+// static vars
+static task_entry_t tasks[MAX_TASKS];
+static uint8_t tasksRunning = 0;      // set while RunTasks runs the tasks
+
+
+/**
+ * Returns the entry of a task in the table
+ *
+ * @param task the function of the task
+ * @return the entry or NULL if the task is not in the table
+ */
+static task_entry_t* FindTask(task_fn_t task)
+{
+  uint8_t i;
+
+  for(i = 0; i < MAX_TASKS; i++)
+    if(tasks[i].task == task)
+      return &tasks[i];
+
+  return NULL;
+}
+
+/**
+ * Changes the mode of a task. The run statistics are restarted when the
+ * task is started, so they only cover the time it has been running.
+ *
+ * @param entry the entry of the task
+ * @param mode TASK_RUN or TASK_STOP
+ */
+static void SetEntryMode(task_entry_t *entry, uint8_t mode)
+{
+  if(mode == TASK_RUN && entry->mode != TASK_RUN)
+  {
+    entry->runs = 0;
+    entry->maxgap = 0;
+  }
+  entry->mode = mode;
+}
+
+/**
+ * Adds a task to the table. If the task is already in the table only
+ * its group and mode are changed.
+ *
+ * @param task the function of the task. It must return within a few
+ * milliseconds, as the lines are not served while it runs.
+ * @param group the group of the task, see SetGroupMode
+ * @param mode TASK_RUN to start the task, TASK_STOP otherwise
+ * @return zero if success, RET_ERR_MEMORY if the table is full
+ */
+uint8_t AddTask(task_fn_t task, uint8_t group, uint8_t mode)
+{
+  task_entry_t *entry;
+
+  if(task == NULL)
+    return RET_ERR_PARAM;
+
+  entry = FindTask(task);
+  if(entry == NULL)
+  {
+    entry = FindTask(NULL);
+    if(entry == NULL)
+      return RET_ERR_MEMORY;
+    entry->task = task;
+    entry->mode = TASK_STOP;
+  }
+
+  entry->group = group;
+  SetEntryMode(entry, mode);
+
+  return 0;
+}
+
+/**
+ * Removes a task from the table
+ *
+ * @param task the function of the task
+ */
+void RemoveTask(task_fn_t task)
+{
+  task_entry_t *entry;
+
+  entry = FindTask(task);
+  if(entry != NULL && task != NULL)
+  {
+    entry->task = NULL;
+    entry->mode = TASK_STOP;
+  }
+}
+
+/**
+ * Starts or stops a task
+ *
+ * @param task the function of the task
+ * @param mode TASK_RUN or TASK_STOP
+ */
+void SetTaskMode(task_fn_t task, uint8_t mode)
+{
+  task_entry_t *entry;
+
+  entry = FindTask(task);
+  if(entry != NULL && task != NULL)
+    SetEntryMode(entry, mode);
+}
+
+/**
+ * Starts or stops all the tasks of a group
+ *
+ * @param group the group of the tasks
+ * @param mode TASK_RUN or TASK_STOP
+ */
+void SetGroupMode(uint8_t group, uint8_t mode)
+{
+  uint8_t i;
+
+  for(i = 0; i < MAX_TASKS; i++)
+    if(tasks[i].task != NULL && tasks[i].group == group)
+      SetEntryMode(&tasks[i], mode);
+}
+
+/**
+ * Runs each started task once, in the order they were added. This is
+ * the idle hook of the lines (see SetLineIdleHook) and can also be
+ * called from any other wait of the applications.
+ *
+ * The time between two runs of each task is measured with the sync
+ * counter, so GetTask gives the worst latency seen by the task. Calls
+ * made from within a task return without running any task.
+ */
+void RunTasks(void)
+{
+  uint8_t i;
+  uint32_t now, gap;
+
+  if(tasksRunning)
+    return;
+  tasksRunning = 1;
+
+  for(i = 0; i < MAX_TASKS; i++)
+  {
+    if(tasks[i].task == NULL || tasks[i].mode != TASK_RUN)
+      continue;
+
+    now = GetCounter();
+    if(tasks[i].runs > 0)
+    {
+      gap = now - tasks[i].last;
+      if(gap > tasks[i].maxgap)
+        tasks[i].maxgap = gap;
+    }
+    tasks[i].last = now;
+    if(tasks[i].runs < 0xFFFF)
+      tasks[i].runs++;
+
+    tasks[i].task();
+  }
+
+  tasksRunning = 0;
+}
+
+/**
+ * Returns the entry of a task in the table, which has the number of
+ * runs and the longest time between two runs since it was started
+ *
+ * @param task the function of the task
+ * @return the entry or NULL if the task is not in the table
+ */
+const task_entry_t* GetTask(task_fn_t task)
+{
+  if(task == NULL)
+    return NULL;
+
+  return FindTask(task);
+}
@@ -0,0 +1,79 @@
+/**
+ * \file
+ * \brief scd_tasks.h header file
+ *
+ * This file defines the cooperative task scheduler used to service the
+ * USB, the log and the user interface while an application waits for
+ * the terminal or the ICC
+ *
+ * Copyright (C) 2013 Omar Choudary (omar.choudary@cl.cam.ac.uk)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SCD_TASKS_H_
+#define _SCD_TASKS_H_
+
+#include <stdint.h>
+
+#define MAX_TASKS 6             // size of the task table
+
+#define TASK_STOP 0             // the task is not run by RunTasks
+#define TASK_RUN 1              // the task is run by RunTasks
+
+#define TASK_GROUP_HOST 1       // tasks using the USB host
+#define TASK_GROUP_UI 2         // tasks using the LCD and buttons
+#define TASK_GROUP_TEST 3       // tasks added by the host simulator
+
+/// A task, run to completion by RunTasks
+typedef void (*task_fn_t)(void);
+
+/// Entry of the task table, see AddTask
+typedef struct {
+    task_fn_t task;     // function of the task, NULL if the entry is free
+    uint8_t group;      // group of the task, see SetGroupMode
+    uint8_t mode;       // TASK_RUN or TASK_STOP
+    uint16_t runs;      // number of runs since the task was started
+    uint32_t last;      // sync counter at the last run
+    uint32_t maxgap;    // longest time between two runs, in counter units
+} task_entry_t;
+
+/// Add a task to the table or change the group and mode of a task
+uint8_t AddTask(task_fn_t task, uint8_t group, uint8_t mode);
+
+/// Remove a task from the table
+void RemoveTask(task_fn_t task);
+
+/// Start or stop a task
+void SetTaskMode(task_fn_t task, uint8_t mode);
+
+/// Start or stop all the tasks of a group
+void SetGroupMode(uint8_t group, uint8_t mode);
+
+/// Run each started task once
+void RunTasks(void);
+
+/// Return the entry of a task, with its run statistics
+const task_entry_t* GetTask(task_fn_t task);
+
+#endif // _SCD_TASKS_H_
@@ -59,6 +59,8 @@ typedef enum retstat{
     RET_ICC_TIME_OUT =                   0x1D,
     RET_ICC_SEND_CMD =                   0x1E,
     RET_ICC_GET_RESPONSE =               0x1F,
+    RET_ICC_PPS =                        0x50,
+    RET_ICC_T1_BLOCK =                   0x51,
 
     // Terminal conditions
     RET_TERMINAL_RESET_LOW =             0x20,
@@ -67,6 +69,7 @@ typedef enum retstat{
     RET_TERMINAL_SEND_RESPONSE =         0x22,
     RET_TERMINAL_ENCRYPTED_PIN =         0x23,
     RET_TERMINAL_NO_CLOCK =              0x24,
+    RET_TERMINAL_PPS =                   0x25,
 
     // EMV protocol/command errors
     RET_EMV_SELECT =                     0x30,
@@ -44,6 +44,7 @@
 #include "apps.h"
 #include "emv.h"
 #include "terminal.h"
+#include "scd.h"
 #include "scd_hal.h"
 #include "serial.h"
 #include "scd_io.h"
@@ -62,6 +63,10 @@ static const char strAT_CTUSB[] = "AT+CTUSB";
 static const char strAT_CLET[] = "AT+CLET";
 static const char strAT_CDPIN[] = "AT+CDPIN";
 static const char strAT_CGEE[] = "AT+CGEE";
+static const char strAT_CGEEB[] = "AT+CGEEB";
+static const char strAT_CGLOG[] = "AT+CGLOG";
+static const char strAT_CGIDX[] = "AT+CGIDX";
+static const char strAT_CGTRN[] = "AT+CGTRN";
 static const char strAT_CEEE[] = "AT+CEEE";
 static const char strAT_CGBM[] = "AT+CGBM";
 static const char strAT_CCINIT[] = "AT+CCINIT";
@@ -69,9 +74,31 @@ static const char strAT_CCAPDU[] = "AT+CCAPDU";
 static const char strAT_UDATA[] = "AT+UDATA";
 static const char strAT_CCEND[] = "AT+CCEND";
 static const char strAT_CTWAIT[] = "AT+CTWAIT";
+static const char strAT_CBIN[] = "AT+CBIN";
+static const char strAT_CCBATCH[] = "AT+CCBATCH";
+static const char strAT_CLIVE[] = "AT+CLIVE";
+static const char strAT_CLOGM[] = "AT+CLOGM";
 static const char strAT_RBAD[] = "AT BAD\r\n";
 static const char strAT_ROK[] = "AT OK\r\n";
 static const char strAT_RTRESET[] = "AT TRESET\r\n";
+static const char strAT_RSTOP[] = "AT STOP\r\n";
+
+/// Reply to AT+CLOGM, the two zeros are replaced by the event mask
+static char strAT_RLOGM[] = "AT LOGM=00\r\n";
+
+/// Set to 1 if APDU exchanges with the host use binary frames (AT+CBIN)
+static uint8_t hostFraming = 0;
+
+static const char* LogMaskCommand(const char *atparams,
+    log_struct_t *logger);
+static const char* GetATParams(const char *data, const char *cmd);
+static uint8_t GetHostPayload(AT_CMD *atcmd, uint8_t *data, uint16_t *len,
+    uint16_t maxlen);
+static uint8_t SendHostPayload(FRAME_TYPE type, const uint8_t *data,
+    uint16_t len);
+static uint8_t SendHostStatus(FRAME_TYPE type);
+static FRAME_TYPE RunHostBatch(const uint8_t *batch, uint16_t len,
+    uint8_t convention, uint8_t TC1, log_struct_t *logger);
 
 
 /**
@@ -87,19 +114,19 @@ static const char strAT_RTRESET[] = "AT TRESET\r\n";
  * processed by the SCD, as sent by the serial host
  * @param logger the log structure or NULL if no log is desired
  * @return a NUL ('\0') terminated string representing the response of this
- * method if success, or NULL if any error occurs. The caller is responsible for
- * eliberating the space ocuppied by the response.
+ * method if success, or NULL if any error occurs. The response is a constant
+ * string that must not be modified or freed by the caller.
  */
-char* ProcessSerialData(const char* data, log_struct_t *logger)
+const char* ProcessSerialData(const char* data, log_struct_t *logger)
 {   
-  char *atparams = NULL;
+  const char *atparams = NULL;
   AT_CMD atcmd;
   uint8_t result = 0;
-  char *str_ret = NULL;
+  const char *str_ret = NULL;
 
   result = ParseATCommand(data, &atcmd, &atparams);
   if(result != 0)
-    return strdup(strAT_RBAD);
+    return strAT_RBAD;
 
   if(atcmd == AT_CRST)
   {
@@ -112,66 +139,200 @@ char* ProcessSerialData(const char* data, log_struct_t *logger)
   {
     result = Terminal(logger);
     if (result == 0)
-      str_ret = strdup(strAT_ROK);
+      str_ret = strAT_ROK;
     else
-      str_ret = strdup(strAT_RBAD);
+      str_ret = strAT_RBAD;
   }
   else if(atcmd == AT_CTUSB)
   {
     result = TerminalUSB(logger);
     if (result == 0)
-      str_ret = strdup(strAT_ROK);
+      str_ret = strAT_ROK;
     else
-      str_ret = strdup(strAT_RBAD);
+      str_ret = strAT_RBAD;
   }
   else if(atcmd == AT_CLET)
   {
     result = ForwardData(logger);
     if (result == 0)
-      str_ret = strdup(strAT_ROK);
+      str_ret = strAT_ROK;
+    else
+      str_ret = strAT_RBAD;
+  }
+  else if(atcmd == AT_CLIVE)
+  {
+    // Same as AT+CLET, but the log goes to the host instead of EEPROM
+    if(logger)
+      logger->live = 1;
+    result = ForwardData(logger);
+    if(logger)
+      logger->live = 0;
+    if (result == 0)
+      str_ret = strAT_ROK;
     else
-      str_ret = strdup(strAT_RBAD);
+      str_ret = strAT_RBAD;
   }
   else if(atcmd == AT_CDPIN)
   {
     result = DummyPIN(logger);
     if (result == 0)
-      str_ret = strdup(strAT_ROK);
+      str_ret = strAT_ROK;
     else
-      str_ret = strdup(strAT_RBAD);
+      str_ret = strAT_RBAD;
   }
   else if(atcmd == AT_CGEE)
   {
     // Return EEPROM contents in Intel HEX format
     SendEEPROMHexVSerial();
-    str_ret = strdup(strAT_ROK);
+    str_ret = strAT_ROK;
+  }
+  else if(atcmd == AT_CGEEB)
+  {
+    // Return EEPROM contents in binary
+    if(SendEEPROMBinVSerial())
+      str_ret = strAT_RBAD;
+    else
+      str_ret = strAT_ROK;
+  }
+  else if(atcmd == AT_CGLOG)
+  {
+    // AT+CGLOG=SSXXXX returns the log records of session SS from
+    // sequence number XXXX, AT+CGLOG all of them
+    if(atparams != NULL && strlen(atparams) < 6)
+      return strAT_RBAD;
+    if(atparams != NULL)
+      result = SendLogEEPROMVSerial(
+          hexCharsToByte(atparams[0], atparams[1]),
+          (hexCharsToByte(atparams[2], atparams[3]) << 8) |
+          hexCharsToByte(atparams[4], atparams[5]));
+    else
+      result = SendLogEEPROMVSerial(
+          ~eeprom_read_byte((uint8_t*)EEPROM_LOG_SESSION), 0);
+    if(result == 0)
+      str_ret = strAT_ROK;
+    else
+      str_ret = strAT_RBAD;
+  }
+  else if(atcmd == AT_CGIDX)
+  {
+    // Return the transaction index of the EEPROM log
+    if(SendLogIndexVSerial())
+      str_ret = strAT_RBAD;
+    else
+      str_ret = strAT_ROK;
+  }
+  else if(atcmd == AT_CGTRN)
+  {
+    // AT+CGTRN=XX returns the log of transaction XX
+    if(atparams == NULL || strlen(atparams) < 2)
+      return strAT_RBAD;
+    if(SendTransactionVSerial(hexCharsToByte(atparams[0], atparams[1])))
+      str_ret = strAT_RBAD;
+    else
+      str_ret = strAT_ROK;
   }
   else if(atcmd == AT_CEEE)
   {
     ResetEEPROM();
-    str_ret = strdup(strAT_ROK);
+    str_ret = strAT_ROK;
   }
   else if(atcmd == AT_CGBM)
   {
     RunBootloader();
-    str_ret = strdup(strAT_ROK);
+    str_ret = strAT_ROK;
   }
   else if(atcmd == AT_CCINIT)
   {
     result = TerminalVSerial(logger);
     if (result == 0)
-      str_ret = strdup(strAT_ROK);
+      str_ret = strAT_ROK;
     else
-      str_ret = strdup(strAT_RBAD);
+      str_ret = strAT_RBAD;
+  }
+  else if(atcmd == AT_CLOGM)
+  {
+    str_ret = LogMaskCommand(atparams, logger);
+  }
+  else if(atcmd == AT_CBIN)
+  {
+    // AT+CBIN=0 goes back to hex encoded AT commands
+    if(atparams != NULL && atparams[0] == '0')
+      hostFraming = 0;
+    else
+      hostFraming = 1;
+    str_ret = strAT_ROK;
   }
   else
   {
-    str_ret = strdup(strAT_RBAD);
+    str_ret = strAT_RBAD;
   }
 
   return str_ret;
 } 
 
+/**
+ * This method handles the AT+CLOGM command. AT+CLOGM=XX sets the event
+ * mask and keeps it in EEPROM, AT+CLOGM returns the current mask.
+ *
+ * @param atparams the parameters of the command or NULL if there are none
+ * @param logger the log structure
+ * @return the response to the command
+ */
+static const char* LogMaskCommand(const char *atparams,
+    log_struct_t *logger)
+{
+  if(logger == NULL)
+    return strAT_RBAD;
+
+  if(atparams != NULL)
+  {
+    if(strlen(atparams) < 2)
+      return strAT_RBAD;
+    logger->mask = hexCharsToByte(atparams[0], atparams[1]);
+    eeprom_write_byte((uint8_t*)EEPROM_LOG_MASK, logger->mask);
+    return strAT_ROK;
+  }
+
+  strAT_RLOGM[8] = nibbleToHexChar(logger->mask, 1);
+  strAT_RLOGM[9] = nibbleToHexChar(logger->mask, 0);
+
+  return strAT_RLOGM;
+}
+
+/**
+ * This method answers a control command sent by the host while an
+ * application (e.g. AT+CLIVE) is running. It is run as a task of the
+ * scheduler (see scd_tasks.h), so it does not wait for the host.
+ *
+ * Only AT+CLOGM is accepted, as the other commands would start another
+ * application or use the lines of the running one, and they are answered
+ * with AT BAD. The reply is sent as a FRAME_REPLY frame with the text of
+ * the AT response, so that the host can tell it apart from the trace
+ * frames and from the reply of the running application.
+ *
+ * @param logger the log structure used by the running application
+ * @return zero if a command was answered or none was received, non-zero
+ * if the reply could not be sent
+ */
+uint8_t ServiceHostControl(log_struct_t *logger)
+{
+  const char *buf, *reply;
+  const char *atparams = NULL;
+  AT_CMD atcmd;
+  uint16_t len;
+
+  buf = PollHostLine(&len);
+  if(buf == NULL)
+    return 0;
+
+  if(ParseATCommand(buf, &atcmd, &atparams) == 0 && atcmd == AT_CLOGM)
+    reply = LogMaskCommand(atparams, logger);
+  else
+    reply = strAT_RBAD;
+
+  return SendHostFrame(FRAME_REPLY, (const uint8_t*)reply, strlen(reply));
+}
+
 /**
  * This method parses a data stream that should correspond to an AT command
  * and returns the type of command and any parameters.
@@ -184,9 +345,10 @@ char* ProcessSerialData(const char* data, log_struct_t *logger)
  * command are located or is NULL if there are no parameters
  * @return 0 if success, non-zero otherwise
  */
-uint8_t ParseATCommand(const char *data, AT_CMD *atcmd, char **atparams)
+uint8_t ParseATCommand(const char *data, AT_CMD *atcmd,
+    const char **atparams)
 {
-  uint8_t len, pos;
+  uint16_t len;
 
   *atparams = NULL;
   *atcmd = AT_NONE;
@@ -220,16 +382,49 @@ uint8_t ParseATCommand(const char *data, AT_CMD *atcmd, char **atparams)
       *atcmd = AT_CLET;
       return 0;
     }
+    else if(strstr(data, strAT_CLIVE) == data)
+    {
+      *atcmd = AT_CLIVE;
+      return 0;
+    }
+    else if(strstr(data, strAT_CLOGM) == data)
+    {
+      *atcmd = AT_CLOGM;
+      *atparams = GetATParams(data, strAT_CLOGM);
+      return 0;
+    }
     else if(strstr(data, strAT_CDPIN) == data)
     {
       *atcmd = AT_CDPIN;
       return 0;
     }
+    else if(strstr(data, strAT_CGEEB) == data)
+    {
+      *atcmd = AT_CGEEB;
+      return 0;
+    }
     else if(strstr(data, strAT_CGEE) == data)
     {
       *atcmd = AT_CGEE;
       return 0;
     }
+    else if(strstr(data, strAT_CGLOG) == data)
+    {
+      *atcmd = AT_CGLOG;
+      *atparams = GetATParams(data, strAT_CGLOG);
+      return 0;
+    }
+    else if(strstr(data, strAT_CGIDX) == data)
+    {
+      *atcmd = AT_CGIDX;
+      return 0;
+    }
+    else if(strstr(data, strAT_CGTRN) == data)
+    {
+      *atcmd = AT_CGTRN;
+      *atparams = GetATParams(data, strAT_CGTRN);
+      return 0;
+    }
     else if(strstr(data, strAT_CEEE) == data)
     {
       *atcmd = AT_CEEE;
@@ -245,20 +440,22 @@ uint8_t ParseATCommand(const char *data, AT_CMD *atcmd, char **atparams)
       *atcmd = AT_CCINIT;
       return 0;
     }
+    else if(strstr(data, strAT_CCBATCH) == data)
+    {
+      *atcmd = AT_CCBATCH;
+      *atparams = GetATParams(data, strAT_CCBATCH);
+      return 0;
+    }
     else if(strstr(data, strAT_CCAPDU) == data)
     {
       *atcmd = AT_CCAPDU;
-      pos = strlen(strAT_CCAPDU);
-      if((strlen(data) > pos + 1) && data[pos] == '=')
-        *atparams = &data[pos + 1];
+      *atparams = GetATParams(data, strAT_CCAPDU);
       return 0;
     }
     else if(strstr(data, strAT_UDATA) == data)
     {
       *atcmd = AT_UDATA;
-      pos = strlen(strAT_UDATA);
-      if((strlen(data) > pos + 1) && data[pos] == '=')
-        *atparams = &data[pos + 1];
+      *atparams = GetATParams(data, strAT_UDATA);
       return 0;
     }
     else if(strstr(data, strAT_CCEND) == data)
@@ -271,11 +468,35 @@ uint8_t ParseATCommand(const char *data, AT_CMD *atcmd, char **atparams)
       *atcmd = AT_CTWAIT;
       return 0;
     }
+    else if(strstr(data, strAT_CBIN) == data)
+    {
+      *atcmd = AT_CBIN;
+      *atparams = GetATParams(data, strAT_CBIN);
+      return 0;
+    }
   }
 
   return 0;
 }
 
+/**
+ * This method returns the parameters of an AT command, which follow the
+ * '=' after the name of the command.
+ *
+ * @param data a NUL ('\0') terminated string with the AT command
+ * @param cmd the name of the command, which data starts with
+ * @return a pointer to the parameters in data, or NULL if there are none
+ */
+static const char* GetATParams(const char *data, const char *cmd)
+{
+  uint16_t pos = strlen(cmd);
+
+  if((strlen(data) > pos + 1) && data[pos] == '=')
+    return &data[pos + 1];
+
+  return NULL;
+}
+
 
 /**
  * This method reads the content of the EEPROM and transmits it in Intel
@@ -356,6 +577,326 @@ uint8_t SendEEPROMHexVSerial()
   return 0;
 }
 
+/**
+ * This method reads the content of the EEPROM and transmits it in binary
+ * to the Virtual Serial port: the length of the data (2 bytes, LSB first),
+ * the EEPROM contents and their CRC32 (4 bytes, LSB first). This is less
+ * than half the size of the Intel Hex dump and needs no formatting. It is
+ * the responsibility of the caller to make sure the virtual serial port
+ * is availble.
+ *
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t SendEEPROMBinVSerial()
+{
+  uint8_t eedata[64];
+  uint16_t eeaddr;
+  uint32_t crc;
+  uint8_t i;
+
+  eedata[0] = EEPROM_SIZE & 0xFF;
+  eedata[1] = (EEPROM_SIZE >> 8) & 0xFF;
+  if(SendHostBytes(eedata, 2, 0))
+    return RET_ERROR;
+
+  crc = 0xFFFFFFFF;
+  for(eeaddr = 0; eeaddr < EEPROM_SIZE; eeaddr += sizeof(eedata))
+  {
+    eeprom_read_block(eedata, (void*)eeaddr, sizeof(eedata));
+    for(i = 0; i < sizeof(eedata); i++)
+      crc = UpdateCRC32(crc, eedata[i]);
+    if(SendHostBytes(eedata, sizeof(eedata), 0))
+      return RET_ERROR;
+  }
+
+  crc = crc ^ 0xFFFFFFFF;
+  for(i = 0; i < 4; i++)
+    eedata[i] = (crc >> (8 * i)) & 0xFF;
+  if(SendHostBytes(eedata, 4, 1))
+    return RET_ERROR;
+
+  return 0;
+}
+
+/**
+ * This method sends to the Virtual Serial port the records of the EEPROM
+ * log written from the given sequence number, so that a host polling the
+ * SCD only transfers the new log entries. The reply is in binary: the log
+ * session (1 byte), the sequence number of the first record sent and the
+ * one of the next record to be written (2 bytes each, LSB first), the
+ * number of bytes (2 bytes, LSB first), the concatenated log entries of
+ * the records and their CRC32 (4 bytes, LSB first).
+ *
+ * The session changes each time the log is erased (see ResetEEPROM). If
+ * the session is not the current one all the records in the log ring are
+ * sent. If the first record sent is not the one requested, the records in
+ * between were overwritten before the host read them. Records whose log
+ * was not copied (see CommitLogEEPROM) add no bytes, as the ring only
+ * holds older data for them.
+ *
+ * @param session the log session that the host last read
+ * @param seq the sequence number of the first record that the host needs
+ * @return zero if success, non-zero otherwise
+ * @sa WriteLogEEPROM
+ */
+uint8_t SendLogEEPROMVSerial(uint8_t session, uint16_t seq)
+{
+  uint8_t eedata[64];
+  log_ring_t ring;
+  uint16_t eeaddr, start, first, total, used, rlen, len;
+  uint32_t crc;
+  uint8_t i, pending;
+
+  ReadLogRingState(&ring);
+  if(session != eeprom_read_byte((uint8_t*)EEPROM_LOG_SESSION) ||
+      (int16_t)(seq - ring.seq) > 0)
+    seq = ring.seq - 0x8000;
+
+  // skip the records that the host already has
+  first = ring.seq;
+  start = ring.tail;
+  used = LogRingUsed(&ring);
+  while(start != ring.head)
+  {
+    ReadLogRing(start, eedata, EEPROM_LOG_RECORD_HEADER);
+    first = eedata[0] | (eedata[1] << 8);
+    if((int16_t)(first - seq) >= 0)
+      break;
+    rlen = EEPROM_LOG_RECORD_HEADER +
+      ((eedata[2] | (eedata[3] << 8)) & ~EEPROM_LOG_RECORD_PENDING);
+    if(rlen > used)
+      start = ring.head;
+    else
+    {
+      start = LogRingAddress(start, rlen);
+      used -= rlen;
+    }
+    first = ring.seq;
+  }
+
+  // a record that does not fit (e.g. not written yet) ends the log
+  total = 0;
+  for(eeaddr = start; eeaddr != ring.head; )
+  {
+    ReadLogRing(eeaddr, eedata, EEPROM_LOG_RECORD_HEADER);
+    rlen = eedata[2] | (eedata[3] << 8);
+    pending = (rlen & EEPROM_LOG_RECORD_PENDING) != 0;
+    rlen = EEPROM_LOG_RECORD_HEADER + (rlen & ~EEPROM_LOG_RECORD_PENDING);
+    if(rlen > used)
+    {
+      ring.head = eeaddr;
+      break;
+    }
+    if(!pending)
+      total += rlen - EEPROM_LOG_RECORD_HEADER;
+    used -= rlen;
+    eeaddr = LogRingAddress(eeaddr, rlen);
+  }
+
+  eedata[0] = eeprom_read_byte((uint8_t*)EEPROM_LOG_SESSION);
+  eedata[1] = first & 0xFF;
+  eedata[2] = (first >> 8) & 0xFF;
+  eedata[3] = ring.seq & 0xFF;
+  eedata[4] = (ring.seq >> 8) & 0xFF;
+  eedata[5] = total & 0xFF;
+  eedata[6] = (total >> 8) & 0xFF;
+  if(SendHostBytes(eedata, 7, 0))
+    return RET_ERROR;
+
+  crc = 0xFFFFFFFF;
+  for(eeaddr = start; eeaddr != ring.head; )
+  {
+    eeaddr = ReadLogRing(eeaddr, eedata, EEPROM_LOG_RECORD_HEADER);
+    rlen = eedata[2] | (eedata[3] << 8);
+    if(rlen & EEPROM_LOG_RECORD_PENDING)
+    {
+      eeaddr = LogRingAddress(eeaddr, rlen & ~EEPROM_LOG_RECORD_PENDING);
+      continue;
+    }
+    while(rlen > 0)
+    {
+      len = rlen;
+      if(len > sizeof(eedata))
+        len = sizeof(eedata);
+      eeaddr = ReadLogRing(eeaddr, eedata, len);
+      for(i = 0; i < len; i++)
+        crc = UpdateCRC32(crc, eedata[i]);
+      if(SendHostBytes(eedata, len, 0))
+        return RET_ERROR;
+      rlen -= len;
+    }
+  }
+
+  crc = crc ^ 0xFFFFFFFF;
+  for(i = 0; i < 4; i++)
+    eedata[i] = (crc >> (8 * i)) & 0xFF;
+  if(SendHostBytes(eedata, 4, 1))
+    return RET_ERROR;
+
+  return 0;
+}
+
+/**
+ * This method sends to the Virtual Serial port the valid entries of the
+ * transaction index of the EEPROM log, so that a host can find a
+ * transaction without reading the whole log. The reply is in binary: the
+ * number of entries (1 byte), then for each entry the transaction number
+ * (1 byte), the sequence number of its record, its offset in the log
+ * entries of the record and its length (2 bytes each), the time when it
+ * started and the CRC32 of the ATR from the ICC (4 bytes each), and at the
+ * end the CRC32 of the entries (4 bytes). All values are LSB first.
+ *
+ * @return zero if success, non-zero otherwise
+ * @sa ReadLogIndex
+ */
+uint8_t SendLogIndexVSerial()
+{
+  log_trans_t trans[EEPROM_LOG_NINDEX];
+  uint8_t data[15];
+  uint32_t crc;
+  uint8_t i, k, count = 0;
+
+  for(i = 0; i < EEPROM_LOG_NINDEX; i++)
+    if(ReadLogIndex(i, &trans[count]) == 0)
+      count++;
+  if(SendHostBytes(&count, 1, 0))
+    return RET_ERROR;
+
+  crc = 0xFFFFFFFF;
+  for(i = 0; i < count; i++)
+  {
+    data[0] = trans[i].number;
+    data[1] = trans[i].seq & 0xFF;
+    data[2] = (trans[i].seq >> 8) & 0xFF;
+    data[3] = trans[i].offset & 0xFF;
+    data[4] = (trans[i].offset >> 8) & 0xFF;
+    data[5] = trans[i].length & 0xFF;
+    data[6] = (trans[i].length >> 8) & 0xFF;
+    for(k = 0; k < 4; k++)
+    {
+      data[7 + k] = (trans[i].time >> (8 * k)) & 0xFF;
+      data[11 + k] = (trans[i].atr >> (8 * k)) & 0xFF;
+    }
+    for(k = 0; k < sizeof(data); k++)
+      crc = UpdateCRC32(crc, data[k]);
+    if(SendHostBytes(data, sizeof(data), 0))
+      return RET_ERROR;
+  }
+
+  crc = crc ^ 0xFFFFFFFF;
+  for(i = 0; i < 4; i++)
+    data[i] = (crc >> (8 * i)) & 0xFF;
+  if(SendHostBytes(data, 4, 1))
+    return RET_ERROR;
+
+  return 0;
+}
+
+/**
+ * This method sends to the Virtual Serial port the log entries of one
+ * transaction, found through the transaction index of the EEPROM log.
+ * The reply is in binary: the transaction number (1 byte), the number of
+ * bytes (2 bytes, LSB first), the log entries and their CRC32 (4 bytes,
+ * LSB first). Nothing is sent if the transaction is not in the index
+ * or its record was overwritten.
+ *
+ * @param number the transaction number
+ * @return zero if success, non-zero otherwise
+ * @sa ReadLogIndex
+ */
+uint8_t SendTransactionVSerial(uint8_t number)
+{
+  uint8_t eedata[64];
+  log_trans_t trans;
+  uint16_t eeaddr, len;
+  uint32_t crc;
+  uint8_t i;
+
+  if(ReadLogIndex(number % EEPROM_LOG_NINDEX, &trans) ||
+      trans.number != number)
+    return RET_ERROR;
+
+  eedata[0] = number;
+  eedata[1] = trans.length & 0xFF;
+  eedata[2] = (trans.length >> 8) & 0xFF;
+  if(SendHostBytes(eedata, 3, 0))
+    return RET_ERROR;
+
+  crc = 0xFFFFFFFF;
+  eeaddr = LogRingAddress(trans.record,
+      EEPROM_LOG_RECORD_HEADER + trans.offset);
+  while(trans.length > 0)
+  {
+    len = trans.length;
+    if(len > sizeof(eedata))
+      len = sizeof(eedata);
+    eeaddr = ReadLogRing(eeaddr, eedata, len);
+    for(i = 0; i < len; i++)
+      crc = UpdateCRC32(crc, eedata[i]);
+    if(SendHostBytes(eedata, len, 0))
+      return RET_ERROR;
+    trans.length -= len;
+  }
+
+  crc = crc ^ 0xFFFFFFFF;
+  for(i = 0; i < 4; i++)
+    eedata[i] = (crc >> (8 * i)) & 0xFF;
+  if(SendHostBytes(eedata, 4, 1))
+    return RET_ERROR;
+
+  return 0;
+}
+
+/**
+ * This method sends the pending entries in the log buffer to the host as a
+ * FRAME_TRACE frame, so that a live trace is not limited by the size of the
+ * buffer. The buffer acts as a queue: entries are appended by the LogByte
+ * functions and removed from the front once sent. The frame is sent even if
+ * binary frames (AT+CBIN) are not enabled, as the host tells it apart from
+ * the text replies by its type byte.
+ *
+ * @param logger the log structure
+ * @param maxlen the maximum number of log bytes to send, used to bound the
+ * time spent between two exchanges
+ * @return zero if success, non-zero otherwise
+ */
+uint8_t SendLogHost(log_struct_t *logger, uint16_t maxlen)
+{
+  uint16_t len;
+  uint8_t result;
+
+  if(logger == NULL || logger->position == logger->sent)
+    return 0;
+
+  len = logger->position - logger->sent;
+  if(len > maxlen)
+    len = maxlen;
+  result = SendHostFrame(FRAME_TRACE, &logger->log_buffer[logger->sent], len);
+  logger->sent += len;
+
+  // the entries sent or moved below can no longer be extended
+  logger->last = LOG_NO_ENTRY;
+
+  // the index only applies to a log written to EEPROM
+  logger->nindex = 0;
+
+  if(logger->sent == logger->position)
+  {
+    logger->position = 0;
+    logger->sent = 0;
+  }
+  else if(logger->sent >= LOG_BUFFER_SIZE / 2)
+  {
+    // make room for new entries when the queue does not empty
+    memmove(logger->log_buffer, &logger->log_buffer[logger->sent],
+        logger->position - logger->sent);
+    logger->position -= logger->sent;
+    logger->sent = 0;
+  }
+
+  return result;
+}
+
 /***
  * Method to convert data bytes into hex characters
  *
@@ -377,6 +918,200 @@ void BytesToHexChars(char* dest, uint8_t *data, uint32_t len)
 }
 
 
+/**
+ * This method receives the next APDU related command from the host, either
+ * as a hex encoded AT command or, after AT+CBIN, as a binary frame.
+ *
+ * The payload of AT+CCAPDU and AT+UDATA, or of the equivalent frames, is
+ * stored in binary form in data. Malformed commands or frames (e.g. bad hex
+ * digits, a bad CRC or a payload too large) are consumed and reported as
+ * AT_NONE so that the caller can reply with an error and continue.
+ *
+ * @param atcmd stores the type of command received
+ * @param data the buffer for the payload of the command
+ * @param len stores the length of the payload
+ * @param maxlen the size of the data buffer
+ * @return zero if a command was received, non-zero if no data was
+ * available from the host
+ */
+static uint8_t GetHostPayload(AT_CMD *atcmd, uint8_t *data, uint16_t *len,
+    uint16_t maxlen)
+{
+  const char *buf;
+  const char *atparams = NULL;
+  uint16_t i, lbuf, lparams;
+  uint8_t type;
+
+  *atcmd = AT_NONE;
+  *len = 0;
+
+  if(hostFraming)
+  {
+    if(GetHostFrame(&type, data, len, maxlen))
+    {
+      // frame already consumed, let the caller report the error
+      *len = 0;
+      return 0;
+    }
+
+    if(type == FRAME_CAPDU)
+      *atcmd = AT_CCAPDU;
+    else if(type == FRAME_UDATA)
+      *atcmd = AT_UDATA;
+    else if(type == FRAME_TWAIT)
+      *atcmd = AT_CTWAIT;
+    else if(type == FRAME_END)
+      *atcmd = AT_CCEND;
+    else if(type == FRAME_BATCH)
+      *atcmd = AT_CCBATCH;
+
+    return 0;
+  }
+
+  buf = GetHostLine(&lbuf);
+  if(buf == NULL)
+    return RET_ERROR;
+
+  if(ParseATCommand(buf, atcmd, &atparams) != 0)
+    goto endbad;
+
+  if(atparams != NULL)
+  {
+    lparams = lbuf - (atparams - buf);
+    if((lparams % 2) != 0 || lparams / 2 > maxlen)
+      goto endbad;
+    for(i = 0; i < lparams / 2; i++)
+      data[i] = hexCharsToByte(atparams[2*i], atparams[2*i + 1]);
+    *len = lparams / 2;
+  }
+
+  return 0;
+
+endbad:
+  *atcmd = AT_NONE;
+  return 0;
+}
+
+/**
+ * This method sends an APDU related payload to the host, either as hex
+ * characters followed by CRLF or, after AT+CBIN, as a binary frame.
+ *
+ * @param type the type of the frame, used only in binary mode
+ * @param data the payload
+ * @param len the length of the payload, at most HOST_APDU_SIZE
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t SendHostPayload(FRAME_TYPE type, const uint8_t *data,
+    uint16_t len)
+{
+  char reply[2 * HOST_APDU_SIZE + 3];
+  uint16_t i;
+
+  if(hostFraming)
+    return SendHostFrame(type, data, len);
+
+  if(len > HOST_APDU_SIZE)
+    return RET_ERR_PARAM;
+
+  for(i = 0; i < len; i++)
+  {
+    reply[2*i] = nibbleToHexChar(data[i], 1);
+    reply[2*i + 1] = nibbleToHexChar(data[i], 0);
+  }
+  reply[2*len] = '\r';
+  reply[2*len + 1] = '\n';
+  reply[2*len + 2] = 0;
+
+  return SendHostData(reply);
+}
+
+/**
+ * This method sends a status reply (OK, BAD, STOP or TRESET) to the host,
+ * either as an AT response or, after AT+CBIN, as an empty binary frame.
+ *
+ * @param type one of FRAME_OK, FRAME_BAD, FRAME_STOP or FRAME_TRESET
+ * @return zero if success, non-zero otherwise
+ */
+static uint8_t SendHostStatus(FRAME_TYPE type)
+{
+  if(hostFraming)
+    return SendHostFrame(type, NULL, 0);
+
+  if(type == FRAME_OK)
+    return SendHostData(strAT_ROK);
+  else if(type == FRAME_TRESET)
+    return SendHostData(strAT_RTRESET);
+  else if(type == FRAME_STOP)
+    return SendHostData(strAT_RSTOP);
+
+  return SendHostData(strAT_RBAD);
+}
+
+/**
+ * This method runs the steps of an AT+CCBATCH script back-to-back against
+ * the card, sending each response to the host as soon as it is received.
+ *
+ * The script is checked before any step runs, so a malformed script has no
+ * effect on the card. See BATCH_COND for the format of each step.
+ *
+ * @param batch the script
+ * @param len the length of the script
+ * @param convention the convention used by the card
+ * @param TC1 the TC1 byte of the card's ATR
+ * @param logger the log structure or NULL if a log is not desired
+ * @return FRAME_OK if all the steps ran, FRAME_STOP if a condition stopped
+ * the batch or FRAME_BAD if the script is malformed or a step failed
+ */
+static FRAME_TYPE RunHostBatch(const uint8_t *batch, uint16_t len,
+    uint8_t convention, uint8_t TC1, log_struct_t *logger)
+{
+  uint8_t reply[HOST_APDU_SIZE];
+  const uint8_t *step;
+  uint16_t pos, lreply, sw;
+  CAPDU *command;
+  RAPDU *response;
+
+  for(pos = 0; pos < len; pos += 4 + batch[pos + 3])
+  {
+    if(pos + 4 > len || batch[pos + 3] < 5 || pos + 4 + batch[pos + 3] > len)
+      return FRAME_BAD;
+    if(batch[pos] > BATCH_SW_NE)
+      return FRAME_BAD;
+  }
+
+  for(pos = 0; pos < len; pos += 4 + step[3])
+  {
+    step = &batch[pos];
+    command = MakeCommand(step[4], step[5], step[6], step[7], step[8],
+        &step[9], step[3] - 5);
+    if(command == NULL)
+      return FRAME_BAD;
+
+    response = TerminalSendT0Command(command, convention, TC1, logger);
+    FreeCAPDU(command);
+    if(response == NULL)
+      return FRAME_BAD;
+
+    reply[0] = response->repStatus->sw1;
+    reply[1] = response->repStatus->sw2;
+    lreply = response->lenData;
+    if(lreply > HOST_APDU_SIZE - 2)
+      lreply = HOST_APDU_SIZE - 2;
+    if(lreply > 0)
+      memcpy(&reply[2], response->repData, lreply);
+    FreeRAPDU(response);
+    SendHostPayload(FRAME_RAPDU, reply, lreply + 2);
+
+    sw = ((uint16_t)step[1] << 8) | step[2];
+    if(step[0] == BATCH_SW_EQ && (((uint16_t)reply[0] << 8) | reply[1]) != sw)
+      return FRAME_STOP;
+    if(step[0] == BATCH_SW_NE && (((uint16_t)reply[0] << 8) | reply[1]) == sw)
+      return FRAME_STOP;
+  }
+
+  return FRAME_OK;
+}
+
 /*uint8_t SendHostBigData(char *data)
   {
   uint32_t len;
@@ -410,18 +1145,16 @@ uint8_t TerminalUSB(log_struct_t *logger)
 {
   //uint8_t convention, proto, TC1, TA3, TB3;
   uint8_t t_inverse = 0, t_TC1 = 0;
-  uint8_t tmp, i, lparams, error;
-  char *buf = NULL;
-  char *atparams = NULL;
-  char reply[USB_BUF_SIZE];
-  uint8_t *data;
-  uint32_t len;
+  uint8_t error;
+  uint8_t data[HOST_APDU_SIZE];
+  uint8_t *stream;
+  uint16_t i, len;
+  uint32_t lstream;
   AT_CMD atcmd;
-  RAPDU *response = NULL;
   CAPDU *command = NULL;
 
   // Send OK to host to get first ATR
-  SendHostData(strAT_ROK);
+  SendHostStatus(FRAME_OK);
 
   // Now wait for start of transaction from Terminal
   if(lcdAvailable)
@@ -459,17 +1192,9 @@ uint8_t TerminalUSB(log_struct_t *logger)
     }
 
     // Get the next ATR from host
-    buf = GetHostData(USB_BUF_SIZE);
-    if(buf == NULL)
-    {
-      error = RET_ERROR;
-      goto enderror;
-    }
-
-    error = ParseATCommand(buf, &atcmd, &atparams);
+    error = GetHostPayload(&atcmd, data, &len, HOST_APDU_SIZE);
     if(error != 0)
       goto enderror;
-    len = strlen(atparams);
     if(atcmd != AT_UDATA)
     {
       error = RET_ERROR;
@@ -477,15 +1202,13 @@ uint8_t TerminalUSB(log_struct_t *logger)
     }
 
     // Send the rest of ATR to the terminal
-    for(i = 0; i < len/2; i++)
+    for(i = 0; i < len; i++)
     {
-      tmp = hexCharsToByte(atparams[2*i], atparams[2*i + 1]);
-      SendByteTerminalNoParity(tmp, t_inverse);
+      SendByteTerminalNoParity(data[i], t_inverse);
       if(logger)
-        LogByte1(logger, LOG_BYTE_ATR_TO_TERMINAL, tmp);
+        LogByte1(logger, LOG_BYTE_ATR_TO_TERMINAL, data[i]);
       LoopTerminalETU(2);
     }
-    free(buf); buf = NULL;
 
     // update transaction counter
     nCounter++;
@@ -500,28 +1223,24 @@ uint8_t TerminalUSB(log_struct_t *logger)
       {
         // we assume a timeout due to restart, and signal this to USB host, who
         // should be sending back a new ATR
-        SendHostData(strAT_RTRESET);
+        SendHostStatus(FRAME_TRESET);
 
         // restart external loop
         break;
       }
 
       // send command to USB host
-      data = SerializeCommand(command, &len);
+      stream = SerializeCommand(command, &lstream);
       FreeCAPDU(command);
-      if(data == NULL)
+      if(stream == NULL)
         break;
-      BytesToHexChars(reply, data, len);
-      free(data); data = NULL;
-      reply[2*len] = '\r';
-      reply[2*len + 1] = '\n';
-      reply[2*len + 2] = 0;
-      SendHostData(reply);
+      SendHostPayload(FRAME_CAPDU, stream, lstream);
+      free(stream);
 
 askhost:
       // receive response from USB
-      buf = GetHostData(USB_BUF_SIZE);
-      if(buf == NULL)
+      error = GetHostPayload(&atcmd, data, &len, HOST_APDU_SIZE);
+      if(error != 0)
       {
         error = RET_USB_ERR_RECEIVE;
         if(logger)
@@ -532,10 +1251,6 @@ askhost:
         goto enderror;
       }
 
-      error = ParseATCommand(buf, &atcmd, &atparams);
-      if(error)
-        goto enderror;
-      lparams = strlen(atparams);
       if(atcmd == AT_CCEND)
       {
         if(logger)
@@ -547,7 +1262,6 @@ askhost:
         SendByteTerminalNoParity(0x60, t_inverse);
         if(logger)
           LogByte1(logger, LOG_TERMINAL_MORE_TIME, 0x60);
-        free(buf); buf = NULL;
         goto askhost;
       }
       else if(atcmd != AT_UDATA)
@@ -557,24 +1271,22 @@ askhost:
       }
 
       // Send response to terminal
-      for(i = 0; i < lparams/2; i++)
+      for(i = 0; i < len; i++)
       {
-        tmp = hexCharsToByte(atparams[2*i], atparams[2*i + 1]);
-        error = SendByteTerminalParity(tmp, t_inverse);
+        error = SendByteTerminalParity(data[i], t_inverse);
         if(error)
         {
           if(logger)
           {
             LogCurrentTime(logger);
-            LogByte1(logger, LOG_TERMINAL_ERROR_SEND, response->repData[i]);
+            LogByte1(logger, LOG_TERMINAL_ERROR_SEND, data[i]);
           }
           goto enderror;
         }
         if(logger)
-          LogByte1(logger, LOG_BYTE_TO_TERMINAL, tmp);
+          LogByte1(logger, LOG_BYTE_TO_TERMINAL, data[i]);
         LoopTerminalETU(2);
       }
-      free(buf); buf = NULL;
     } // end internal loop
   } // end external loop
 
@@ -583,7 +1295,6 @@ endgood:
 
 enderror:
   DeactivateICC();
-  free(buf); buf = NULL;
   if((error == RET_TERMINAL_TIME_OUT) || (error == RET_TERMINAL_NO_CLOCK))
   {
     // these errors are logged and used as a signal to stop
@@ -608,6 +1319,9 @@ enderror:
  * back the RAPDUs received from the card. This method should be called
  * upon reciving the AT+CCINIT serial command.
  *
+ * Several CAPDUs can be sent at once with AT+CCBATCH, in which case the
+ * responses are followed by OK, STOP or BAD (see RunHostBatch).
+ *
  * This function never returns, after completion it will restart the SCD.
  *
  * @param logger the log structure or NULL if a log is not desired
@@ -616,10 +1330,9 @@ enderror:
 uint8_t TerminalVSerial(log_struct_t *logger)
 {
   uint8_t convention, proto, TC1, TA3, TB3;
-  uint8_t tmp, i, lparams, ldata, result;
-  char *buf, *atparams = NULL;
-  char reply[512];
-  uint8_t data[256];
+  uint8_t result;
+  uint8_t data[HOST_BATCH_SIZE];
+  uint16_t len;
   AT_CMD atcmd;
   RAPDU *response = NULL;
   CAPDU *command = NULL;
@@ -639,56 +1352,41 @@ uint8_t TerminalVSerial(log_struct_t *logger)
     goto enderror;
   }
 
-  if(proto != 0) // Not implemented yet ...
-  {
-    fprintf(stderr, "bad ICC proto\n");
-    _delay_ms(500);
-    goto enderror;
-  }
-
   // If all is well so far announce the host so we get more data
-  SendHostData(strAT_ROK);
+  SendHostStatus(FRAME_OK);
 
   // Loop continuously until the host ends the transaction or
   // we get an error
   while(1)
   {
-    buf = GetHostData(255);
-    if(buf == NULL)
+    if(GetHostPayload(&atcmd, data, &len, HOST_BATCH_SIZE))
     {
       _delay_ms(100);
       continue;
     }
 
-    tmp = ParseATCommand(buf, &atcmd, &atparams);
-    lparams = strlen(atparams);
-
     if(atcmd == AT_CCEND)
     {
       result = 0;
       break;
     }
-    else if(atcmd != AT_CCAPDU || atparams == NULL || lparams < 10 || (lparams % 2) != 0)
+    else if(atcmd == AT_CCBATCH)
     {
-      SendHostData(strAT_RBAD);
-      free(buf);
+      SendHostStatus(RunHostBatch(data, len, convention, TC1, logger));
       continue;
     }
-
-    memset(data, 0, 256);
-    for(i = 0; i < lparams/2; i++)
+    else if(atcmd != AT_CCAPDU || len < 5 || len > HOST_APDU_SIZE)
     {
-      data[i] = hexCharsToByte(atparams[2*i], atparams[2*i + 1]);
+      SendHostStatus(FRAME_BAD);
+      continue;
     }
-    free(buf);
 
-    ldata = (lparams - 10) / 2;
     command = MakeCommand(
         data[0], data[1], data[2], data[3], data[4],
-        &data[5], ldata);
+        &data[5], len - 5);
     if(command == NULL)
     {
-      SendHostData(strAT_RBAD);
+      SendHostStatus(FRAME_BAD);
       continue;
     }
 
@@ -697,25 +1395,20 @@ uint8_t TerminalVSerial(log_struct_t *logger)
     FreeCAPDU(command);
     if(response == NULL)
     {
-      FreeCAPDU(command);
-      SendHostData(strAT_RBAD);
+      SendHostStatus(FRAME_BAD);
       continue;
     }
 
-    memset(reply, 0, 512);
-    reply[0] = nibbleToHexChar(response->repStatus->sw1, 1);
-    reply[1] = nibbleToHexChar(response->repStatus->sw1, 0);
-    reply[2] = nibbleToHexChar(response->repStatus->sw2, 1);
-    reply[3] = nibbleToHexChar(response->repStatus->sw2, 0);
-    for(i = 0; i < response->lenData; i++)
-    {
-      reply[4 + i*2] = nibbleToHexChar(response->repData[i], 1);
-      reply[5 + i*2] = nibbleToHexChar(response->repData[i], 0);
-    }
-    reply[4 + i] = '\r';
-    reply[5 + i] = '\n';
+    // Reply with SW1 SW2 followed by the response data
+    data[0] = response->repStatus->sw1;
+    data[1] = response->repStatus->sw2;
+    len = response->lenData;
+    if(len > HOST_APDU_SIZE - 2)
+      len = HOST_APDU_SIZE - 2;
+    if(len > 0)
+      memcpy(&data[2], response->repData, len);
     FreeRAPDU(response);
-    SendHostData(reply);
+    SendHostPayload(FRAME_RAPDU, data, len + 2);
   } // end while(1)
 
 enderror:
@@ -41,6 +41,10 @@
 #include "scd_logger.h"
 
 #define USB_BUF_SIZE    512
+#define HOST_APDU_SIZE  261         // CAPDU header or RAPDU status plus data
+#define HOST_BATCH_SIZE 512         // maximum size of an AT+CCBATCH script
+#define HOST_TRACE_CHUNK 123        // log bytes streamed per gap, 2 packets
+#define HOST_TRACE_PERIOD 20        // counter units before a partial chunk
 
 extern uint8_t lcdAvailable;                // if LCD is available
 extern uint16_t revision;                   // current SVN revision in BCD
@@ -59,25 +63,85 @@ typedef enum {
     AT_CLET,        // Log an EMV transaction
     AT_CDPIN,       // Log an EMV transaction with dummy PIN
     AT_CGEE,        // Get EEPROM contents
+    AT_CGEEB,       // Get EEPROM contents in binary
+    AT_CGLOG,       // Get the EEPROM log records from a sequence number
+    AT_CGIDX,       // Get the transaction index of the EEPROM log
+    AT_CGTRN,       // Get one transaction of the EEPROM log by number
     AT_CEEE,        // Erase EEPROM contents
     AT_CGBM,        // Go into bootloader mode
     AT_CCINIT,      // Initialise a card transaction
     AT_CCAPDU,      // Send raw terminal CAPDU
     AT_CCEND,       // Ends the current card transaction
     AT_UDATA,       // Send USB data to SCD
+    AT_CBIN,        // Switch APDU exchanges to binary frames
+    AT_CCBATCH,     // Send a batch of raw terminal CAPDUs
+    AT_CLIVE,       // Log an EMV transaction, streaming the log
+    AT_CLOGM,       // Get or set the event mask of the logger
     AT_DUMMY
 }AT_CMD;
 
+/**
+ * Enum defining the types of binary frames exchanged with the host after
+ * AT+CBIN. Each frame is the type byte, the payload length (2 bytes, LSB
+ * first), the payload and a CRC-16 XMODEM (2 bytes, LSB first) computed
+ * over all the previous bytes of the frame.
+ */
+typedef enum {
+    FRAME_OK = 0x01,        // Command accepted, no payload
+    FRAME_BAD = 0x02,       // Command rejected, no payload
+    FRAME_STOP = 0x03,      // Batch stopped by a condition, no payload
+    FRAME_CAPDU = 0x10,     // CAPDU header and data
+    FRAME_RAPDU = 0x11,     // RAPDU status bytes and data
+    FRAME_UDATA = 0x12,     // Raw data to be sent to the terminal
+    FRAME_TWAIT = 0x13,     // Request more time from Terminal
+    FRAME_TRESET = 0x14,    // Terminal reset, a new ATR is expected
+    FRAME_BATCH = 0x15,     // Batch of CAPDUs, see BATCH_COND
+    FRAME_TRACE = 0x20,     // Log entries streamed during AT+CLIVE
+    FRAME_REPLY = 0x21,     // Reply to a command sent while an app runs
+    FRAME_END = 0x1F        // Ends the current transaction
+}FRAME_TYPE;
+
+/**
+ * Enum defining the conditions of the steps in an AT+CCBATCH script. Each
+ * step is the condition, the expected SW1 and SW2, the length of the CAPDU
+ * and the CAPDU (header and data). The condition is checked against the
+ * status of the step's response, and the batch stops if it fails.
+ */
+typedef enum {
+    BATCH_ANY = 0,          // Always continue with the next step
+    BATCH_SW_EQ = 1,        // Continue only if the status is SW1 SW2
+    BATCH_SW_NE = 2         // Continue only if the status is not SW1 SW2
+}BATCH_COND;
+
 
 /// Process serial data received from the host
-char* ProcessSerialData(const char* data, log_struct_t *logger);
+const char* ProcessSerialData(const char* data, log_struct_t *logger);
+
+/// Answer the control commands sent by the host while an application runs
+uint8_t ServiceHostControl(log_struct_t *logger);
 
 /// Parse an AT command received from the host
-uint8_t ParseATCommand(const char *data, AT_CMD *command, char **atparams);
+uint8_t ParseATCommand(const char *data, AT_CMD *command,
+    const char **atparams);
 
 /// Send EEPROM content as Intel Hex format to the virtual serial port
 uint8_t SendEEPROMHexVSerial();
 
+/// Send EEPROM content in binary, with its length and CRC32
+uint8_t SendEEPROMBinVSerial();
+
+/// Send the EEPROM log records of the given session from a sequence number
+uint8_t SendLogEEPROMVSerial(uint8_t session, uint16_t seq);
+
+/// Send the valid entries of the transaction index of the EEPROM log
+uint8_t SendLogIndexVSerial();
+
+/// Send the log of one transaction, found through the index
+uint8_t SendTransactionVSerial(uint8_t number);
+
+/// Send pending log entries to the host, draining the log buffer
+uint8_t SendLogHost(log_struct_t *logger, uint16_t maxlen);
+
 /// Virtual Serial Terminal application
 uint8_t TerminalVSerial(log_struct_t *logger);
 
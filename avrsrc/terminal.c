@@ -47,9 +47,10 @@
 #define TRIGGER 1
 
 // ------------------------------------------------
-// Static declarations
-static RAPDU* TerminalSendT0CommandR(CAPDU* tmpCommand, RAPDU *tmpResponse,
-    uint8_t inverse_convention, uint8_t TC1, log_struct_t *logger);
+// Global variables
+
+/// Size of the response buffer of TerminalSendT0Command
+uint8_t terminalResponseMax = TERMINAL_RESPONSE_SIZE;
 
 //--------------------------------------------------------------------
 // Constants
@@ -76,10 +77,17 @@ static const uint8_t bAIDList[42] = {
 /**
  * This function handles the process of sending a command for
  * the protocol T=0, including the intermediate GET_RESPONSE
- * for the different command classes. Because of the
- * recursivity of this method, it introduces an initial
- * delay of 16 ICC ETUs to allow the card to be ready for
- * a new command
+ * for the different command classes. Each command sent is
+ * preceded by a delay of 16 ICC ETUs to allow the card to be
+ * ready for a new command. If the ICC uses T=1 (see iccProtocol) the
+ * command is sent with TransmitT1Command instead, as T=1
+ * returns the response data without GET_RESPONSE
+ *
+ * The response data of all the commands is received into a single
+ * buffer of terminalResponseMax bytes, allocated before the first
+ * command. A GET_RESPONSE asks for no more than the space left in
+ * this buffer, so when the buffer is full the 61xx status of the last
+ * response is returned together with the data received so far.
  * 
  * @param cmd Command APDU to be sent
  * @param inverse_convention different than 0 if inverse convention
@@ -95,139 +103,119 @@ RAPDU* TerminalSendT0Command(
     uint8_t TC1,
     log_struct_t *logger)
 {
-  CAPDU *tmpCommand;
-
-  tmpCommand = CopyCAPDU(cmd);
-  if(tmpCommand == NULL) return NULL;
-
-  return TerminalSendT0CommandR(
-      tmpCommand, NULL, inverse_convention, TC1, logger);
-}
-
+  CAPDU *command;
+  RAPDU *response;
+  EMVStatus last;
+  uint8_t len, room;
 
-/**
- * This function handles the process of sending a command for
- * the protocol T=0, including the intermediate GET_RESPONSE
- * for the different command classes. This function should
- * should only be used by TerminalSendT0Command
- * 
- * @param cmd Command APDU to be sent
- * @param tmpResponse temporary response data used by this method
- * @param inverse_convention different than 0 if inverse convention
- * is to be used
- * @param TC1 byte returned in the ATR
- * @param logger a pointer to a log structure or NULL if no log is desired
- * @return the RAPDU created from the card reply, or NULL
- * if a response APDU cannot be constructed
- * @sa TerminalSendT0Command
- */
-static RAPDU* TerminalSendT0CommandR(
-    CAPDU *tmpCommand,
-    RAPDU *tmpResponse,
-    uint8_t inverse_convention,
-    uint8_t TC1,
-    log_struct_t *logger)
-{
-  RAPDU *response, *tmp;
+  if(iccProtocol == 1)
+    return TransmitT1Command(inverse_convention, TC1, cmd, logger);
 
+  command = CopyCAPDU(cmd);
+  if(command == NULL)
+    return NULL;
+  response = (RAPDU*)ExchangeAlloc(sizeof(RAPDU));
+  if(response == NULL)
+    goto enderror;
+  response->lenData = 0;
+  response->repStatus = (EMVStatus*)ExchangeAlloc(sizeof(EMVStatus));
+  response->repData = NULL;
+  if(terminalResponseMax > 0)
+    response->repData = (uint8_t*)ExchangeAlloc(terminalResponseMax);
+  if(response->repStatus == NULL ||
+      (terminalResponseMax > 0 && response->repData == NULL))
+    goto enderror;
+
+  // SW1 is never 0, so the first status cannot match this
+  last.sw1 = 0;
+  last.sw2 = 0;
+  while(1)
+  {
 #if TRIGGER
-  // Make sure the trigger signals are low so we can watch them going high
-  JTAG_P1_Low();
-  JTAG_P3_Low();
+    // Make sure the trigger signals are low so we can watch them going high
+    JTAG_P1_Low();
+    JTAG_P3_Low();
 #endif
 
-  LoopICCETU(16); // wait for card to be ready to receive new command
+    LoopICCETU(16); // wait for card to be ready to receive new command
 
-  if(SendT0Command(inverse_convention, TC1, tmpCommand, logger))
-  {
-    FreeRAPDU(tmpResponse);
-    FreeCAPDU(tmpCommand);
-    return NULL;
-  }
+    if(SendT0Command(inverse_convention, TC1, command, logger))
+      goto enderror;
 
 #if TRIGGER
-  /* Code below used to create a trigger signal */
-  if(TC1 > 0)
-  {
-    asm volatile("nop\n\t"::);
-    JTAG_P1_High();
-    if(TC1 == 2) JTAG_P3_High();
-    _delay_ms(1);
+    /* Code below used to create a trigger signal */
+    if(TC1 > 0)
+    {
+      asm volatile("nop\n\t"::);
+      JTAG_P1_High();
+      if(TC1 == 2) JTAG_P3_High();
+      _delay_ms(1);
 
-    JTAG_P1_Low();
-    if(TC1 == 2) JTAG_P3_Low();
-  }
+      JTAG_P1_Low();
+      if(TC1 == 2) JTAG_P3_Low();
+    }
 #endif
 
-  tmp = ReceiveT0Response(inverse_convention, tmpCommand->cmdHeader, logger);
-
-  if(tmp == NULL || tmp->repStatus == NULL)
-  {
-    FreeRAPDU(tmpResponse);
-    FreeCAPDU(tmpCommand);
-    return NULL;
-  }
+    // the data of each response is added after the data received so far
+    room = terminalResponseMax - response->lenData;
+    if(ReceiveT0Data(inverse_convention, command->cmdHeader,
+          (room > 0) ? &(response->repData[response->lenData]) : NULL,
+          room, &len, response->repStatus, T0_NULL_KEEP, logger))
+      goto enderror;
+    response->lenData += len;
+    room -= len;
+
+    // a card repeating the same status without any data would keep
+    // us here forever, so we stop and return that status
+    if(len == 0 &&
+        response->repStatus->sw1 == last.sw1 &&
+        response->repStatus->sw2 == last.sw2)
+      break;
+    last = *(response->repStatus);
 
-  response = CopyRAPDU(tmp);
-  if(response == NULL)
-  {
-    FreeRAPDU(tmpResponse);
-    FreeRAPDU(tmp);
-    FreeCAPDU(tmpCommand);
-    return NULL;
-  }
+    if(last.sw1 == (uint8_t)SW1_MORE_DATA ||
+        last.sw1 == (uint8_t)SW1_WARNING1 ||
+        last.sw1 == (uint8_t)SW1_WARNING2)
+    {
+      if(room == 0)
+        break;
 
-  // If there was already some data from an early response keep it.
-  // else just keep the last response. In case this last response
-  // is bad this will be seen in the status bytes
-  if(tmpResponse != NULL && tmpResponse->repData != NULL &&
-      tmpResponse->lenData != 0)
-  {
-    response->lenData = tmpResponse->lenData + tmp->lenData;
-    response->repData = (uint8_t*)realloc(response->repData,
-        (response->lenData) * sizeof(uint8_t));
-    if(response->repData == NULL)
+      FreeCAPDU(command);
+      command = MakeCommandC(CMD_GET_RESPONSE, NULL, 0);
+      if(command == NULL)
+        goto enderror;
+
+      // SW2 = 0 stands for 256 bytes
+      if(last.sw1 == (uint8_t)SW1_MORE_DATA)
+        command->cmdHeader->p3 =
+          (last.sw2 == 0 || last.sw2 > room) ? room : last.sw2;
+    }
+    else if(last.sw1 == (uint8_t)SW1_WRONG_LENGTH)
     {
-      FreeRAPDU(tmpResponse);
-      FreeRAPDU(tmp);
-      FreeRAPDU(response);
-      FreeCAPDU(tmpCommand);
-      return NULL;
+      if(last.sw2 == 0 || last.sw2 > room)
+        break;
+      command->cmdHeader->p3 = last.sw2;
     }
-    memcpy(response->repData, tmpResponse->repData, tmpResponse->lenData);
-    memcpy(&(response->repData[tmpResponse->lenData]), tmp->repData, tmp->lenData);
-  }
-  FreeRAPDU(tmp);
-  FreeRAPDU(tmpResponse);
-
-  if(response->repStatus->sw1 == (uint8_t)SW1_MORE_DATA ||
-      response->repStatus->sw1 == (uint8_t)SW1_WARNING1 ||
-      response->repStatus->sw1 == (uint8_t)SW1_WARNING2)
-  {
-    FreeCAPDU(tmpCommand);
-    CAPDU *cmdGet = MakeCommandC(CMD_GET_RESPONSE, NULL, 0);
-    if(cmdGet == NULL)
+    else
     {
-      FreeRAPDU(response);
-      return NULL;
+      // For any other result we return the APDU, which could be either
+      // success or not
+      break;
     }
-
-    if(response->repStatus->sw1 == (uint8_t)SW1_MORE_DATA)
-      cmdGet->cmdHeader->p3 = response->repStatus->sw2;
-
-    return TerminalSendT0CommandR(
-        cmdGet, response, inverse_convention, TC1, logger);
   }
-  else if(response->repStatus->sw1 == (uint8_t)SW1_WRONG_LENGTH)
+
+  FreeCAPDU(command);
+  if(response->lenData == 0 && response->repData != NULL)
   {
-    tmpCommand->cmdHeader->p3 = response->repStatus->sw2;
-    return TerminalSendT0CommandR(
-        tmpCommand, response, inverse_convention, TC1, logger);
+    ExchangeFree(response->repData);
+    response->repData = NULL;
   }
-
-  // For any other result we return the APDU, which could be either success or not
-  FreeCAPDU(tmpCommand);
   return response;
+
+enderror:
+  FreeCAPDU(command);
+  FreeRAPDU(response);
+  return NULL;
 }
 
 /**
@@ -304,17 +292,20 @@ APPINFO* InitializeTransaction(
     const FCITemplate *fci,
     log_struct_t *logger)
 {
-  TLV *pdol;
+  TLVCursor pdol;
+  TLV gpo;
   ByteArray *data;
   CAPDU *command;
   RAPDU *response;
   APPINFO *appInfo;
 
-  pdol = GetPDOL(fci);
-  if(pdol == NULL) return NULL;
-  pdol->tag1 = 0x83;
-  pdol->tag2 = 0;
-  data = SerializeTLV(pdol);
+  // send the PDOL value under the command template tag '83'
+  GetPDOL(fci, &pdol);
+  gpo.tag1 = 0x83;
+  gpo.tag2 = 0;
+  gpo.len = pdol.len;
+  gpo.value = (uint8_t*)pdol.value;
+  data = SerializeTLV(&gpo);
   if(data == NULL) return NULL;
 
   command = MakeCommandC(CMD_GET_PROCESSING_OPTS, data->bytes, data->len);
@@ -357,7 +348,9 @@ RECORD* GetTransactionData(
     ByteArray *offlineAuthData,
     log_struct_t *logger)
 {
-  RECORD *data, *tmp;
+  RECORD *data;
+  RECORD tmp;
+  TLVCursor record, obj;
   CAPDU *command;
   RAPDU *response;
   AFL* afl;
@@ -365,8 +358,9 @@ RECORD* GetTransactionData(
 
   if(appInfo == NULL || appInfo->aflList == NULL) return NULL;
   data = (RECORD*)malloc(sizeof(RECORD));
-  data->count = 0;
-  data->objects = NULL;
+  if(data == NULL) return NULL;
+  data->len = 0;
+  data->data = NULL;
 
   if(offlineAuthData != NULL)
   {
@@ -440,15 +434,24 @@ RECORD* GetTransactionData(
         }
       } // end if(offlineAuthData != NULL ...)
 
-      tmp = ParseRECORD(response->repData, response->lenData);
+      // check the record in place and append its objects to the data
+      InitTLVCursor(&record, response->repData, response->lenData, 1);
+      k = (NextTLV(&record) || record.tag1 != 0x70 ||
+          EnterTLV(&record, &obj));
+      if(!k)
+      {
+        while(NextTLV(&obj) == RET_SUCCESS);
+        tmp.len = record.len;
+        tmp.data = (uint8_t*)record.value;
+        k = (obj.left != 0 || AddRECORD(data, &tmp));
+      }
       FreeRAPDU(response);
-      if(AddRECORD(data, tmp))
+      if(k)
       {
         FreeRECORD(data);
         FreeCAPDU(command);
         return NULL;
       }
-      FreeRECORD(tmp);
     } // end for(j = afl->recordStart; j <= afl->recordEnd; j++)
   } // end for(i = 0; i < appInfo->count; i++)
 
@@ -566,7 +569,7 @@ FCITemplate* SelectFromPSE(
   CAPDU* command = NULL;
   RAPDU* response = NULL;
   RECORDList* rlist = NULL;
-  TLV* adfName = NULL;
+  TLVCursor adfName;
   uint8_t more, status, k, i;
   volatile uint8_t tmp;
 
@@ -606,10 +609,12 @@ FCITemplate* SelectFromPSE(
   {
     while(1)
     {
-      adfName = rlist->objects[k]->objects[0];
+      InitTLVCursor(&adfName, rlist->objects[k]->data,
+          rlist->objects[k]->len, 1);
+      NextTLV(&adfName);
       fprintf(stderr, "%d:", k + 1);
-      for(i = 0; i < adfName->len && i < 7; i++)
-        fprintf(stderr, "%02X", adfName->value[i]);
+      for(i = 0; i < adfName.len && i < 7; i++)
+        fprintf(stderr, "%02X", adfName.value[i]);
       _delay_ms(200);
 
       do{
@@ -630,8 +635,10 @@ FCITemplate* SelectFromPSE(
 
   // select application, either by means of user or automatically
   // as here; modify as needed
-  adfName = rlist->objects[k]->objects[0];
-  command = MakeCommandC(CMD_SELECT, adfName->value, adfName->len);
+  InitTLVCursor(&adfName, rlist->objects[k]->data,
+      rlist->objects[k]->len, 1);
+  NextTLV(&adfName);
+  command = MakeCommandC(CMD_SELECT, adfName.value, adfName.len);
   if(command == NULL) goto clean;
   response = TerminalSendT0Command(command, convention, TC1, logger);
   FreeCAPDU(command);
@@ -718,160 +725,159 @@ RAPDU* SendGenerateAC(
     uint8_t convention,
     uint8_t TC1,
     AC_REQ_TYPE acType,
-    const TLV* cdol,
+    const TLVCursor *cdol,
     const GENERATE_AC_PARAMS *params,
     log_struct_t *logger)
 {
   CAPDU* command;
   RAPDU* response;
   uint8_t* data;
-  uint8_t i, j, k, len;
-  TLV* tlv;
+  uint8_t i, j, len;
+  TLVCursor dol;
+
+  if(cdol == NULL || cdol->value == NULL || params == NULL) return NULL;
 
-  if(cdol == NULL || params == NULL) return NULL;
+  // get the length of the command data from the CDOL
+  len = 0;
+  InitTLVCursor(&dol, cdol->value, cdol->len, 0);
+  while(NextTLV(&dol) == RET_SUCCESS)
+    len += dol.len;
 
   // make the command data to be sent
   data = NULL;
-  len = 0;
+  if(len > 0)
+  {
+    data = (uint8_t*)malloc(len * sizeof(uint8_t));
+    if(data == NULL) return NULL;
+  }
   i = 0;
-  k = 0;
-  while(k < cdol->len)
+  InitTLVCursor(&dol, cdol->value, cdol->len, 0);
+  while(NextTLV(&dol) == RET_SUCCESS)
   {
-    tlv = ParseTLV(&(cdol->value[k]), cdol->len - k, 0);
-    k += 2;
-    if(tlv == NULL) continue;
-    if(tlv->tag2 != 0) k += 1;
-    len += tlv->len;
-    data = (uint8_t*)realloc(data, len * sizeof(uint8_t));
-    if(data == NULL)
-    {
-      FreeTLV(tlv);
-      return NULL;
-    }
 
-    if(tlv->tag1 == 0x9F && tlv->tag2 == 0x02)
+    if(dol.tag1 == 0x9F && dol.tag2 == 0x02)
     {
-      for(j = 0; j < tlv->len && j < sizeof(params->amount); j++)
+      for(j = 0; j < dol.len && j < sizeof(params->amount); j++)
         data[i++] = params->amount[j];
-      while(j < tlv->len)
+      while(j < dol.len)
       {
         data[i++] = 0;
         j++;
       }
     }
-    else if(tlv->tag1 == 0x9F && tlv->tag2 == 0x03) 
+    else if(dol.tag1 == 0x9F && dol.tag2 == 0x03) 
     {
-      for(j = 0; j < tlv->len && j < sizeof(params->amountOther); j++)
+      for(j = 0; j < dol.len && j < sizeof(params->amountOther); j++)
         data[i++] = params->amountOther[j];
-      while(j < tlv->len)
+      while(j < dol.len)
       {
         data[i++] = 0;
         j++;
       }
     }
-    else if(tlv->tag1 == 0x9F && tlv->tag2 == 0x1A)
+    else if(dol.tag1 == 0x9F && dol.tag2 == 0x1A)
     {
-      for(j = 0; j < tlv->len && j < sizeof(params->terminalCountryCode); j++)
+      for(j = 0; j < dol.len && j < sizeof(params->terminalCountryCode); j++)
         data[i++] = params->terminalCountryCode[j];
-      while(j < tlv->len)
+      while(j < dol.len)
       {
         data[i++] = 0;
         j++;
       }
     }
-    else if(tlv->tag1 == 0x95)
+    else if(dol.tag1 == 0x95)
     {
-      for(j = 0; j < tlv->len && j < sizeof(params->tvr); j++)
+      for(j = 0; j < dol.len && j < sizeof(params->tvr); j++)
         data[i++] = params->tvr[j];
-      while(j < tlv->len)
+      while(j < dol.len)
       {
         data[i++] = 0;
         j++;
       }
     }
-    else if(tlv->tag1 == 0x5F && tlv->tag2 == 0x2A)
+    else if(dol.tag1 == 0x5F && dol.tag2 == 0x2A)
     {
-      for(j = 0; j < tlv->len && j < sizeof(params->terminalCurrencyCode); j++)
+      for(j = 0; j < dol.len && j < sizeof(params->terminalCurrencyCode); j++)
         data[i++] = params->terminalCurrencyCode[j];
-      while(j < tlv->len)
+      while(j < dol.len)
       {
         data[i++] = 0;
         j++;
       }
     }
-    else if(tlv->tag1 == 0x8A)
+    else if(dol.tag1 == 0x8A)
     {
-      for(j = 0; j < tlv->len && j < sizeof(params->arc); j++)
+      for(j = 0; j < dol.len && j < sizeof(params->arc); j++)
         data[i++] = params->arc[j];
-      while(j < tlv->len)
+      while(j < dol.len)
       {
         data[i++] = 0;
         j++;
       }
     }
-    else if(tlv->tag1 == 0x91)
+    else if(dol.tag1 == 0x91)
     {
-      for(j = 0; j < tlv->len && j < sizeof(params->IssuerAuthData); j++)
+      for(j = 0; j < dol.len && j < sizeof(params->IssuerAuthData); j++)
         data[i++] = params->IssuerAuthData[j];
-      while(j < tlv->len)
+      while(j < dol.len)
       {
         data[i++] = 0;
         j++;
       }
     }
-    else if(tlv->tag1 == 0x9A)
+    else if(dol.tag1 == 0x9A)
     {
-      for(j = 0; j < tlv->len && j < sizeof(params->transactionDate); j++)
+      for(j = 0; j < dol.len && j < sizeof(params->transactionDate); j++)
         data[i++] = params->transactionDate[j];
-      while(j < tlv->len)
+      while(j < dol.len)
       {
         data[i++] = 0;
         j++;
       }
     }
-    else if(tlv->tag1 == 0x9C)
+    else if(dol.tag1 == 0x9C)
     {
       data[i++] = params->transactionType;
     }
-    else if(tlv->tag1 == 0x9F && tlv->tag2 == 0x37)
+    else if(dol.tag1 == 0x9F && dol.tag2 == 0x37)
     {
-      for(j = 0; j < tlv->len && j < sizeof(params->unpredictableNumber); j++)
+      for(j = 0; j < dol.len && j < sizeof(params->unpredictableNumber); j++)
         data[i++] = params->unpredictableNumber[j];
-      while(j < tlv->len)
+      while(j < dol.len)
       {
         data[i++] = 0;
         j++;
       }
     }
-    else if(tlv->tag1 == 0x9F && tlv->tag2 == 0x35)
+    else if(dol.tag1 == 0x9F && dol.tag2 == 0x35)
     {
       data[i++] = params->terminalType;
     }
-    else if(tlv->tag1 == 0x9F && tlv->tag2 == 0x45)
+    else if(dol.tag1 == 0x9F && dol.tag2 == 0x45)
     {
-      for(j = 0; j < tlv->len && j < sizeof(params->dataAuthCode); j++)
+      for(j = 0; j < dol.len && j < sizeof(params->dataAuthCode); j++)
         data[i++] = params->dataAuthCode[j];
-      while(j < tlv->len)
+      while(j < dol.len)
       {
         data[i++] = 0;
         j++;
       }
     }
-    else if(tlv->tag1 == 0x9F && tlv->tag2 == 0x4C)
+    else if(dol.tag1 == 0x9F && dol.tag2 == 0x4C)
     {
-      for(j = 0; j < tlv->len && j < sizeof(params->iccDynamicNumber); j++)
+      for(j = 0; j < dol.len && j < sizeof(params->iccDynamicNumber); j++)
         data[i++] = params->iccDynamicNumber[j];
-      while(j < tlv->len)
+      while(j < dol.len)
       {
         data[i++] = 0;
         j++;
       }
     }
-    else if(tlv->tag1 == 0x9F && tlv->tag2 == 0x34)
+    else if(dol.tag1 == 0x9F && dol.tag2 == 0x34)
     {
-      for(j = 0; j < tlv->len && j < sizeof(params->cvmResults); j++)
+      for(j = 0; j < dol.len && j < sizeof(params->cvmResults); j++)
         data[i++] = params->cvmResults[j];
-      while(j < tlv->len)
+      while(j < dol.len)
       {
         data[i++] = 0;
         j++;
@@ -879,15 +885,14 @@ RAPDU* SendGenerateAC(
     }
     else  // any other data
     {
-      for(j = 0; j < tlv->len; j++)
+      for(j = 0; j < dol.len; j++)
         data[i++] = 0;
     }
-
-    FreeTLV(tlv);
   } //end while
 
 
   command = MakeCommandC(CMD_GENERATE_AC, data, len);
+  if(data != NULL) free(data);
   if(command == NULL) return NULL;
   command->cmdHeader->p1 = (uint8_t)acType;
   response = TerminalSendT0Command(command, convention, TC1, logger);
@@ -949,32 +954,30 @@ RAPDU* SignDynamicData(
  */
 uint8_t ParsePSD(RECORDList* rlist, const uint8_t *data, uint8_t lenData)
 {
-  RECORD *rec, *adf;
-  TLV *obj;
-  uint8_t i;
+  RECORD *adf;
+  TLVCursor rec, obj;
 
-  if(rlist == NULL) return RET_ERROR;
-  rec = ParseRECORD(data, lenData);
-  if(rec == NULL) return RET_ERROR;
+  if(rlist == NULL || data == NULL) return RET_ERROR;
+  InitTLVCursor(&rec, data, lenData, 1);
+  if(NextTLV(&rec) || rec.tag1 != 0x70 || EnterTLV(&rec, &obj))
+    return RET_ERROR;
 
   // parse each adf and put it in the list
-  for(i = 0; i < rec->count; i++)
+  while(NextTLV(&obj) == RET_SUCCESS)
   {
-    obj = rec->objects[i];
-    adf = ParseManyTLV(obj->value, obj->len);
-    if(adf == NULL || obj->tag1 != EMV_TAG1_APPLICATION_TEMPLATE || 
-        obj->tag2 != EMV_TAG2_APPLICATION_TEMPLATE)
-    {
-      FreeRECORD(rec);
+    if(obj.tag1 != EMV_TAG1_APPLICATION_TEMPLATE || 
+        obj.tag2 != EMV_TAG2_APPLICATION_TEMPLATE)
+      return RET_ERROR;
+    adf = ParseManyTLV(obj.value, obj.len);
+    if(adf == NULL)
       return RET_ERROR;
-    }
 
     rlist->count++;
     rlist->objects = (RECORD**)realloc(rlist->objects, rlist->count * sizeof(RECORD*));
     rlist->objects[rlist->count-1] = adf;
   }
 
-  FreeRECORD(rec);
+  if(obj.left != 0) return RET_ERROR;
   return RET_SUCCESS;
 }
 
@@ -1123,26 +1126,16 @@ uint8_t GetSFIFromSELECT(const RAPDU *response)
  * returned in application selection
  *
  * @param fci FCI Template to search for the PDOL
- * @returns a pointer to the TLV representing the PDOL or 
- * NULL if the PDOL was not found or an error ocurred
+ * @param pdol cursor placed on the PDOL if found. Its value
+ * points inside the FCI Template.
+ * @returns zero if the PDOL was found, non-zero if it was
+ * not found or an error ocurred
  */
-TLV* GetPDOLFromFCI(const FCITemplate *fci)
+uint8_t GetPDOLFromFCI(const FCITemplate *fci, TLVCursor *pdol)
 {
-  uint8_t i;
-  TLV *tmp;
+  if(fci == NULL) return RET_ERROR;
 
-  if(fci == NULL || fci->fciData == NULL || 
-      fci->fciData->count == 0 || fci->fciData->objects == NULL)
-    return NULL;
-
-  for(i = 0; i < fci->fciData->count; i++)
-  {
-    tmp = fci->fciData->objects[i];
-    if(tmp != NULL && tmp->tag1 == 0x9F && tmp->tag2 == 0x38)
-      return tmp;
-  }
-
-  return NULL;
+  return GetTLVFromRECORD(fci->fciData, 0x9F, 0x38, pdol);
 }
 
 /**
@@ -1152,29 +1145,21 @@ TLV* GetPDOLFromFCI(const FCITemplate *fci)
  * or does not contain a PDOL. This method returns
  * the tag as given in the FCI Template (usually '9F38').
  * In order to use it for GET_PROCESSING_OPTS you need
- * to change to tag to '83'.
+ * to send its value with the tag '83'.
  *
  * @param fci FCI Template containing or not a PDOL. If
- * NULL then a default PDOL will be returned
- * @return TLV object contianing a PDOL
+ * NULL then a default (empty) PDOL will be returned
+ * @param pdol cursor to be placed on the PDOL
  * @sa GetPDOLFromFCI
  */
-TLV* GetPDOL(const FCITemplate *fci)
+void GetPDOL(const FCITemplate *fci, TLVCursor *pdol)
 {
-  TLV *pdol = NULL;
+  if(GetPDOLFromFCI(fci, pdol) == RET_SUCCESS)
+    return;
 
-  if(fci != NULL) pdol = GetPDOLFromFCI(fci);
-  if(pdol == NULL)
-  {
-    pdol = (TLV*)malloc(sizeof(TLV));
-    if(pdol == NULL) return NULL;
-    pdol->value = NULL;
-    pdol->len = 0;
-    pdol->tag1 = 0x9F;
-    pdol->tag2 = 0x38;
-  }
-
-  return pdol;
+  InitTLVCursor(pdol, NULL, 0, 1);
+  pdol->tag1 = 0x9F;
+  pdol->tag2 = 0x38;
 }
 
 /**
@@ -1253,49 +1238,37 @@ ByteArray* GetDataObject(
 FCITemplate* ParseFCI(const uint8_t *data, uint8_t lenData)
 {
   FCITemplate *fci;
-  uint8_t i, len;
+  TLVCursor tlv, obj;
 
   if(data == NULL || lenData == 0)
     return NULL;
 
-  i = 0;
-  if(lenData < 4 || data[i++] != 0x6F) return NULL;
-  len = data[i++];
-  if(len == EMV_EXTRA_LENGTH_BYTE) len = data[i++];
-  if(len > lenData - 2) return NULL;
+  InitTLVCursor(&tlv, data, lenData, 1);
+  if(NextTLV(&tlv) || tlv.tag1 != 0x6F || EnterTLV(&tlv, &obj))
+    return NULL;
 
   // get DF Name
-  if(data[i++] != 0x84) return NULL;
-  len = data[i++];
-  if(len == EMV_EXTRA_LENGTH_BYTE) len = data[i++];
-  if(len > lenData - 4) return NULL;
+  if(NextTLV(&obj) || obj.tag1 != 0x84 || obj.len == 0) return NULL;
 
   fci = (FCITemplate*)malloc(sizeof(FCITemplate));
   if(fci == NULL) return NULL;
-  fci->dfName = (uint8_t*)malloc(len * sizeof(uint8_t));
+  fci->fciData = NULL;
+  fci->dfName = (uint8_t*)malloc(obj.len * sizeof(uint8_t));
   if(fci->dfName == NULL)
   {
     free(fci);
     return NULL;
   }
-  memcpy(fci->dfName, &data[i], len);
-  fci->lenDFName = len;
-  i += len;
+  memcpy(fci->dfName, obj.value, obj.len);
+  fci->lenDFName = obj.len;
 
   // get FCI Proprietary template (sfi, app label, etc...)
-  if(data[i++] != 0xA5)
-  {
-    FreeFCITemplate(fci);
-    return NULL;
-  }
-  len = data[i++];
-  if(len == EMV_EXTRA_LENGTH_BYTE) len = data[i++];
-  if(len > (lenData - fci->lenDFName))
+  if(NextTLV(&obj) || obj.tag1 != 0xA5)
   {
     FreeFCITemplate(fci);
     return NULL;
   }
-  fci->fciData = ParseManyTLV(&data[i], len);
+  fci->fciData = ParseManyTLV(obj.value, obj.len);
   if(fci->fciData == NULL)
   {
     FreeFCITemplate(fci);
@@ -1305,6 +1278,134 @@ FCITemplate* ParseFCI(const uint8_t *data, uint8_t lenData)
   return fci;
 }
 
+/**
+ * This function starts a cursor over a stream of concatenated
+ * TLV objects, such as the value of a constructed TLV or a Data
+ * Object List. The cursor is placed before the first object, so
+ * NextTLV must be called to get it.
+ *
+ * @param tlv the cursor to be started
+ * @param data stream of bytes to be parsed. This stream is not
+ * copied and must be kept while the cursor is used.
+ * @param lenData total length in bytes of data
+ * @param includeValue if this parameter is 0 then only the tag and
+ * length of each TLV are parsed (useful for Data Object Lists). If
+ * this parameter is non-zero then each TLV also has a value
+ */
+void InitTLVCursor(
+    TLVCursor *tlv,
+    const uint8_t *data,
+    uint16_t lenData,
+    uint8_t includeValue)
+{
+  tlv->data = data;
+  tlv->left = (data == NULL) ? 0 : lenData;
+  tlv->includeValue = includeValue;
+  tlv->tag1 = 0;
+  tlv->tag2 = 0;
+  tlv->len = 0;
+  tlv->value = NULL;
+}
+
+/**
+ * This function moves a cursor to the next TLV object of its
+ * stream. The tag, length and value of the object are available
+ * in the cursor, without any memory being allocated.
+ *
+ * @param tlv the cursor to be moved
+ * @return zero if the cursor is on a new object, non-zero if the
+ * end of the stream was reached or the next object is not a valid
+ * BER-TLV. In both cases the cursor is not moved, so the stream was
+ * parsed completely only if the left field of the cursor is zero.
+ */
+uint8_t NextTLV(TLVCursor *tlv)
+{
+  const uint8_t *p;
+  uint16_t left;
+  uint8_t tag1, tag2, len;
+
+  p = tlv->data;
+  left = tlv->left;
+  if(left < 2) return RET_ERROR;
+
+  tag1 = *p++;
+  left--;
+  tag2 = 0;
+  if((tag1 & 0x1F) == 0x1F)
+  {
+    tag2 = *p++;
+    left--;
+    if(left == 0) return RET_ERROR;
+  }
+
+  len = *p++;
+  left--;
+  if(len == EMV_EXTRA_LENGTH_BYTE)  // for len > 127
+  {
+    if(left == 0) return RET_ERROR;
+    len = *p++;
+    left--;
+  }
+  else if(len > 127)
+    return RET_ERROR;
+
+  tlv->value = NULL;
+  if(tlv->includeValue != 0)
+  {
+    if(len > left) return RET_ERROR;
+    tlv->value = p;
+    p += len;
+    left -= len;
+  }
+
+  tlv->tag1 = tag1;
+  tlv->tag2 = tag2;
+  tlv->len = len;
+  tlv->data = p;
+  tlv->left = left;
+
+  return RET_SUCCESS;
+}
+
+/**
+ * This function starts a cursor over the objects inside the
+ * current object of another cursor, which must be a constructed
+ * BER-TLV (such as a record or a FCI Template)
+ *
+ * @param tlv the cursor placed on the constructed object
+ * @param inner the cursor to be started over its value
+ * @return zero if success, non-zero if the object is not constructed
+ */
+uint8_t EnterTLV(const TLVCursor *tlv, TLVCursor *inner)
+{
+  if(tlv == NULL || inner == NULL || tlv->value == NULL ||
+      (tlv->tag1 & 0x20) == 0)
+    return RET_ERROR;
+
+  InitTLVCursor(inner, tlv->value, tlv->len, 1);
+
+  return RET_SUCCESS;
+}
+
+/**
+ * This function moves a cursor to the next TLV object that has
+ * the given tag, skipping the objects before it
+ *
+ * @param tlv the cursor to be moved
+ * @param tag1 the first (or only) tag of the interested TLV
+ * @param tag2 the second tag of the interested TLV or 0 if the
+ * tag is only 1 byte
+ * @return zero if the object was found, non-zero otherwise
+ */
+uint8_t FindTLV(TLVCursor *tlv, uint8_t tag1, uint8_t tag2)
+{
+  while(NextTLV(tlv) == RET_SUCCESS)
+    if(tlv->tag1 == tag1 && tlv->tag2 == tag2)
+      return RET_SUCCESS;
+
+  return RET_ERROR;
+}
+
 /**
  * This function parses a stream of data and returns a TLV object if
  * the data contains a valid BER-TLV object
@@ -1408,18 +1509,15 @@ TLV* CopyTLV(const TLV *data)
  */
 RECORD* ParseRECORD(const uint8_t *data, uint8_t lenData)
 {
-  uint8_t i, len;
+  TLVCursor tlv;
 
   if(data == NULL || lenData == 0)
     return NULL;
 
-  i = 0;
-  if(lenData < 4 || data[i++] != 0x70) return NULL;
-  len = data[i++];
-  if(len == EMV_EXTRA_LENGTH_BYTE) len = data[i++];
-  if(len > lenData - 2) return NULL;
+  InitTLVCursor(&tlv, data, lenData, 1);
+  if(NextTLV(&tlv) || tlv.tag1 != 0x70) return NULL;
 
-  return ParseManyTLV(&data[i], len);
+  return ParseManyTLV(tlv.value, tlv.len);
 }
 
 /**
@@ -1434,25 +1532,23 @@ RECORD* ParseRECORD(const uint8_t *data, uint8_t lenData)
  * This function allocates the necessary memory for the extra data
  * needed in the dest RECORD object. If there is not sufficient
  * memory (indicated by a non-zero return value) then the contents
- * of this RECORD will be truncated or NULL.
+ * of this RECORD are not changed.
  */
 uint8_t AddRECORD(RECORD *dest, const RECORD *src)
 {
-  uint8_t i, k;
+  uint8_t *data;
 
-  if(dest == NULL || src == NULL || src->objects == NULL) return RET_ERROR;
+  if(dest == NULL || src == NULL || src->data == NULL) return RET_ERROR;
+  if(src->len == 0) return 0;
+  if(src->len > 0xFFFF - dest->len) return RET_ERROR;
 
-  k = dest->count + src->count;
-  dest->objects = (TLV**)realloc(dest->objects, k * sizeof(TLV*));
-  if(dest->objects == NULL)
+  data = (uint8_t*)realloc(dest->data, dest->len + src->len);
+  if(data == NULL)
     return RET_ERROR;
 
-  for(i = 0; i < src->count; i++)
-  {
-    dest->objects[dest->count] = CopyTLV(src->objects[i]);
-    if(dest->objects[dest->count] == NULL) return RET_ERROR;
-    dest->count++;
-  }
+  memcpy(&data[dest->len], src->data, src->len);
+  dest->data = data;
+  dest->len += src->len;
 
   return 0;
 }
@@ -1465,24 +1561,23 @@ uint8_t AddRECORD(RECORD *dest, const RECORD *src)
  * @param tag2 the second tag of the interested TLV. This is to
  * be used only in cases where the TLV we are looking for
  * has a 2-byte tag. If the tag is only 1 byte then put 0 here.
- * @return a const pointer to the TLV within the RECORD structure
- * or NULL if the TLV cannot be found or some error occurs
- *
+ * @param tlv cursor placed on the TLV if found. Its value points
+ * inside the RECORD structure, so it can be used only while the
+ * RECORD exists.
+ * @return zero if the TLV was found, non-zero if the TLV cannot
+ * be found or some error occurs
  */
-TLV* GetTLVFromRECORD(RECORD *rec, uint8_t tag1, uint8_t tag2)
+uint8_t GetTLVFromRECORD(
+    const RECORD *rec,
+    uint8_t tag1,
+    uint8_t tag2,
+    TLVCursor *tlv)
 {
-  TLV *tlv;
-  uint8_t i;
+  if(rec == NULL || tlv == NULL) return RET_ERROR;
 
-  if(rec == NULL) return NULL;
-  for(i = 0; i < rec->count; i++)
-  {
-    tlv = rec->objects[i];
-    if(tlv != NULL && tlv->tag1 == tag1 && tlv->tag2 == tag2)
-      return tlv;
-  }
+  InitTLVCursor(tlv, rec->data, rec->len, 1);
 
-  return NULL;
+  return FindTLV(tlv, tag1, tag2);
 }
 
 /**
@@ -1499,34 +1594,26 @@ TLV* GetTLVFromRECORD(RECORD *rec, uint8_t tag1, uint8_t tag2)
 RECORD* ParseManyTLV(const uint8_t *data, uint8_t lenData)
 {
   RECORD *rec;
-  TLV *obj;
-  uint8_t i;
+  TLVCursor tlv;
 
   if(data == NULL || lenData == 0)
     return NULL;
 
+  // check all the objects before making a single copy of them
+  InitTLVCursor(&tlv, data, lenData, 1);
+  while(NextTLV(&tlv) == RET_SUCCESS);
+  if(tlv.left != 0) return NULL;
+
   rec = (RECORD*)malloc(sizeof(RECORD));
   if(rec == NULL) return NULL;
-  rec->count = 0;
-  rec->objects = NULL;
-  i = 0;
-
-  while(i < lenData)
+  rec->data = (uint8_t*)malloc(lenData * sizeof(uint8_t));
+  if(rec->data == NULL)
   {
-    obj = ParseTLV(&(data[i]), lenData - i, 1);
-    if(obj == NULL)
-    {
-      FreeRECORD(rec);
-      return NULL;
-    }
-    i += 2 + obj->len;
-    if(obj->tag2 != 0) i++;
-    if(obj->len > 127) i++;
-
-    rec->count++;
-    rec->objects = (TLV**)realloc(rec->objects, rec->count * sizeof(TLV*));
-    rec->objects[rec->count-1] = obj;
+    free(rec);
+    return NULL;
   }
+  memcpy(rec->data, data, lenData);
+  rec->len = lenData;
 
   return rec;
 }
@@ -1545,36 +1632,18 @@ RECORD* ParseManyTLV(const uint8_t *data, uint8_t lenData)
  */
 uint8_t AmountPositionInCDOLRecord(const RECORD *record)
 {
-  uint8_t i;
-  TLV *cdol1 = NULL, *obj;
-
-  if(record == NULL) return 0;
-
-  for(i = 0; i < record->count; i++)
-    if(record->objects[i] != NULL && record->objects[i]->tag1 == 0x8C)
-    {
-      cdol1 = record->objects[i];
-      break;
-    }
+  TLVCursor cdol1, obj;
+  uint8_t pos;
 
-  if(cdol1 == NULL) return 0;
+  if(GetTLVFromRECORD(record, 0x8C, 0, &cdol1)) return 0;
 
-  i = 0;
-  while(i < cdol1->len)
+  InitTLVCursor(&obj, cdol1.value, cdol1.len, 0);
+  pos = 0;
+  while(NextTLV(&obj) == RET_SUCCESS)
   {
-    obj = ParseTLV(&(cdol1->value[i]), cdol1->len - i, 0);
-    if(obj == NULL) return 0;
-
-    if(obj->tag1 == 0x9F && obj->tag2 == 0x02)
-    {
-      free(obj);
-      return i + 1;
-    }
-
-    i += 2;
-    if(obj->tag2 != 0) i++;
-
-    free(obj);
+    if(obj.tag1 == 0x9F && obj.tag2 == 0x02)
+      return pos + 1;
+    pos = (uint8_t)(obj.data - cdol1.value);
   }
 
   return 0;
@@ -1647,20 +1716,12 @@ void FreeTLV(TLV *data)
  */
 void FreeRECORD(RECORD *data)
 {
-  uint8_t i;
-
   if(data == NULL) return;
 
-  if(data->objects != NULL)
+  if(data->data != NULL)
   {
-    for(i = 0; i < data->count; i++)
-      if(data->objects[i] != NULL)
-      {
-        FreeTLV(data->objects[i]);
-        data->objects[i] = NULL;
-      }
-    free(data->objects);
-    data->objects = NULL;
+    free(data->data);
+    data->data = NULL;
   }
   free(data);
 }
@@ -36,10 +36,17 @@
 /// Maximum number of command-response pairs recorded when logging
 #define MAX_EXCHANGES 50
 
+/// Default size of the response buffer of TerminalSendT0Command, which
+/// is at most 255 as the length of a RAPDU is a single byte
+#ifndef TERMINAL_RESPONSE_SIZE
+#define TERMINAL_RESPONSE_SIZE 255
+#endif
+
 /* Global external variables */
 extern CRP* transactionData[MAX_EXCHANGES];     // used to log data
 extern uint8_t nTransactions;                   // used to log data
 extern uint8_t nCounter;                        // number of transactions
+extern uint8_t terminalResponseMax;             // see TerminalSendT0Command
 
 // -------------------------------------------------------------------
 // Structures and enums used by the terminal
@@ -76,11 +83,29 @@ typedef struct {
 } TLV;
 
 /**
- * Structure defining a record (constructed BER-TLV object)
+ * Cursor over a stream of BER-TLV objects. The cursor does not own
+ * any memory: the tag and length of the current object are parsed in
+ * place and value points inside the stream, which must be kept until
+ * the cursor is no longer used. See InitTLVCursor and NextTLV.
  */
 typedef struct {
-    uint8_t count;
-    TLV **objects;
+    const uint8_t *data;        // next object in the stream
+    uint16_t left;              // bytes left in the stream from data
+    uint8_t includeValue;       // 0 for Data Object Lists (no values)
+    uint8_t tag1;               // first tag of the current object
+    uint8_t tag2;               // second tag of the current object or 0
+    uint8_t len;                // length of the current object
+    const uint8_t *value;       // value of the current object or NULL
+} TLVCursor;
+
+/**
+ * Structure defining a record (constructed BER-TLV object). The
+ * TLV objects of the record are kept as they were received, one
+ * after the other, and can be read with a TLVCursor.
+ */
+typedef struct {
+    uint16_t len;
+    uint8_t *data;
 } RECORD;
 
 /**
@@ -213,7 +238,7 @@ RAPDU* SendGenerateAC(
         uint8_t convention,
         uint8_t TC1,
         AC_REQ_TYPE acType,
-        const TLV* cdol,
+        const TLVCursor *cdol,
         const GENERATE_AC_PARAMS *params,
         log_struct_t *logger);
 
@@ -228,10 +253,10 @@ RAPDU* SignDynamicData(
 uint8_t GetSFIFromSELECT(const RAPDU *response);
 
 /// Returns the PDOL TLV from a FCI
-TLV* GetPDOLFromFCI(const FCITemplate *fci);
+uint8_t GetPDOLFromFCI(const FCITemplate *fci, TLVCursor *pdol);
 
 /// Returns a PDOL TLV from a FCI or a default one
-TLV* GetPDOL(const FCITemplate *fci);
+void GetPDOL(const FCITemplate *fci, TLVCursor *pdol);
 
 /// Return the specified primitive data object from the card
 ByteArray* GetDataObject(
@@ -241,7 +266,11 @@ ByteArray* GetDataObject(
         log_struct_t *logger);
 
 /// Returns a TLV from a RECORD based on its tag
-TLV* GetTLVFromRECORD(RECORD *rec, uint8_t tag1, uint8_t tag2);
+uint8_t GetTLVFromRECORD(
+        const RECORD *rec,
+        uint8_t tag1,
+        uint8_t tag2,
+        TLVCursor *tlv);
 
 /// Get the position of the Authorized Amount value inside CDOL1 if exists
 uint8_t AmountPositionInCDOLRecord(const RECORD *record);
@@ -249,6 +278,22 @@ uint8_t AmountPositionInCDOLRecord(const RECORD *record);
 /// Parse a FCI Template object from a data stream
 FCITemplate* ParseFCI(const uint8_t *data, uint8_t lenData);
 
+/// Start a cursor over a stream of TLV objects
+void InitTLVCursor(
+        TLVCursor *tlv,
+        const uint8_t *data,
+        uint16_t lenData,
+        uint8_t includeValue);
+
+/// Move a cursor to the next TLV object of its stream
+uint8_t NextTLV(TLVCursor *tlv);
+
+/// Start a cursor over the objects inside a constructed TLV
+uint8_t EnterTLV(const TLVCursor *tlv, TLVCursor *inner);
+
+/// Move a cursor to the next TLV object with the given tag
+uint8_t FindTLV(TLVCursor *tlv, uint8_t tag1, uint8_t tag2);
+
 /// Parse a TLV object from a data stream
 TLV* ParseTLV(const uint8_t *data, uint8_t lenData, uint8_t includeValue);
 
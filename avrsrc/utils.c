@@ -155,15 +155,116 @@ uint8_t LogCurrentTime(log_struct_t *logger)
     return RET_ERR_PARAM;
 
   time = GetCounter();
-  LogByte4(
-      logger,
-      LOG_TIME_GENERAL,
-      (time & 0xFF),
-      ((time >> 8) & 0xFF),
-      ((time >> 16) & 0xFF),
-      ((time >> 24) & 0xFF));
+  LogTime(logger, LOG_TIME_GENERAL, time);
 
   return 0;
 }
 
+/**
+ * Retrieve a fine timestamp (see GetTimestamp) and write it to log
+ *
+ * @param logger the logger struct used for logging the time. This should not be
+ * NULL.
+ * @return zero if success, non-zero otherwise.
+ */
+uint8_t LogTimestamp(log_struct_t *logger)
+{
+  if(logger == NULL)
+    return RET_ERR_PARAM;
+
+  LogTime(logger, LOG_TIME_FINE, GetTimestamp());
+
+  return 0;
+}
+
+/**
+ * Updates a CRC32 (IEEE 802.3, as in zlib) with one byte. The CRC must
+ * start as 0xFFFFFFFF and be inverted at the end.
+ *
+ * @param crc the current value of the CRC
+ * @param data the byte to add
+ * @return the updated CRC
+ */
+uint32_t UpdateCRC32(uint32_t crc, uint8_t data)
+{
+  uint8_t i;
+
+  crc = crc ^ data;
+  for(i = 0; i < 8; i++)
+  {
+    if(crc & 1)
+      crc = (crc >> 1) ^ 0xEDB88320;
+    else
+      crc = crc >> 1;
+  }
+
+  return crc;
+}
 
+/**
+ * Adds a transaction to the index of the log, so that it can be found
+ * in the EEPROM log without decoding it (see WriteLogEEPROM). This should
+ * be called once the transaction has started (e.g. after its ATR).
+ *
+ * @param logger the log structure
+ * @param start the position of the log where the transaction starts,
+ * as returned by LogMark before starting it
+ * @param time the value of the ms counter when it started
+ * @param number the transaction number (transaction counter)
+ * @return zero if success, non-zero otherwise.
+ */
+uint8_t LogTransaction(log_struct_t *logger, uint16_t start, uint32_t time,
+    uint8_t number)
+{
+  log_index_t *entry;
+
+  if(logger == NULL)
+    return RET_ERR_PARAM;
+  if(logger->nindex == LOG_INDEX_SIZE)
+    return RET_ERROR;
+
+  entry = &logger->index[logger->nindex++];
+  entry->offset = start;
+  entry->time = time;
+  entry->number = number;
+
+  return 0;
+}
+
+/**
+ * Computes the CRC32 of the ATR bytes from the ICC in part of the log,
+ * used to identify the card of a transaction.
+ *
+ * @param logger the log structure
+ * @param start the position of the first entry
+ * @param end the position after the last entry
+ * @return the CRC32 (as zlib.crc32) of the LOG_BYTE_ATR_FROM_ICC bytes
+ */
+uint32_t LogATRCRC32(const log_struct_t *logger, uint16_t start,
+    uint16_t end)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  uint16_t n;
+  uint8_t header;
+
+  // walk the entries, see SCD_LOG_BYTE
+  while(start < end)
+  {
+    header = logger->log_buffer[start++];
+    if((header & 0x03) == LOG_RUN)
+      n = logger->log_buffer[start++];
+    else if((header & 0x03) == 0 && LogTypeMask(header) == LOG_MASK_TIME)
+    {
+      while(start < end && (logger->log_buffer[start++] & 0x80));
+      continue;
+    }
+    else
+      n = (header & 0x03) + 1;
+
+    for(; n > 0 && start < end; n--, start++)
+      if((header & 0xFC) == LOG_BYTE_ATR_FROM_ICC)
+        crc = UpdateCRC32(crc, logger->log_buffer[start]);
+  }
+
+  return crc ^ 0xFFFFFFFF;
+}
@@ -56,5 +56,19 @@ void SleepUntilCardInserted();
 /// Retrieve relative time value and writes it to log
 uint8_t LogCurrentTime(log_struct_t *logger);
 
+/// Logs a fine timestamp, to time the bytes of an exchange
+uint8_t LogTimestamp(log_struct_t *logger);
+
+/// Updates a CRC32 (IEEE 802.3, as in zlib) with one byte
+uint32_t UpdateCRC32(uint32_t crc, uint8_t data);
+
+/// Adds a transaction to the index of the log
+uint8_t LogTransaction(log_struct_t *logger, uint16_t start, uint32_t time,
+    uint8_t number);
+
+/// CRC32 of the ATR bytes from the ICC in part of the log
+uint32_t LogATRCRC32(const log_struct_t *logger, uint16_t start,
+    uint16_t end);
+
 #endif // _UTILS_H_
 
@@ -8,6 +8,9 @@ class AT_CMD:
     AT_CLET = 'AT+CLET\r\n'
     AT_CDPIN = 'AT+CDPIN\r\n'
     AT_CGEE = 'AT+CGEE\r\n'
+    AT_CGEEB = 'AT+CGEEB\r\n'
+    AT_CGLOG = 'AT+CGLOG\r\n'
+    AT_CGIDX = 'AT+CGIDX\r\n'
     AT_CEEE = 'AT+CEEE\r\n'
     AT_CGBM = 'AT+CGBM\r\n'
     AT_CCINIT = 'AT+CCINIT\r\n'
@@ -15,4 +18,42 @@ class AT_CMD:
     AT_CTWAIT = 'AT+CTWAIT\r\n'
     AT_CUDATA = 'AT+UDATA\r\n'
     AT_CCEND = 'AT+CCEND\r\n'
+    AT_CBIN = 'AT+CBIN\r\n'
+    AT_CCBATCH = 'AT+CCBATCH\r\n'
+    AT_CLIVE = 'AT+CLIVE\r\n'
+    AT_CLOGM = 'AT+CLOGM\r\n'
+    AT_CBIN_OFF = 'AT+CBIN=0\r\n'
+
+class FRAME:
+    """Defines the binary frame types used after AT+CBIN"""
+    OK = 0x01
+    BAD = 0x02
+    STOP = 0x03
+    CAPDU = 0x10
+    RAPDU = 0x11
+    UDATA = 0x12
+    TWAIT = 0x13
+    TRESET = 0x14
+    BATCH = 0x15
+    TRACE = 0x20
+    REPLY = 0x21
+    END = 0x1F
+
+class LOG_MASK:
+    """Defines the classes of log events used in the AT+CLOGM event mask"""
+    ATR = 0x01
+    TERMINAL_DATA = 0x02
+    ICC_DATA = 0x04
+    USB = 0x08
+    TERMINAL = 0x10
+    ICC = 0x20
+    TIME = 0x40
+    GENERAL = 0x80
+    ALL = 0xFF
+
+class BATCH_COND:
+    """Defines the conditions of the steps in an AT+CCBATCH script"""
+    ANY = 0
+    SW_EQ = 1
+    SW_NE = 2
 
@@ -29,6 +29,9 @@ import sys
 import shlex, subprocess
 import time
 import argparse # you need Python v2.7 or later
+import os
+import binascii
+import struct
 from atcmds import *
 from scdtrace import *
 
@@ -85,18 +88,305 @@ def serial_geteepromhex(port, filename):
   fid.close()
   ser.close()
 
-def serial_terminal(port, fid = sys.stdin):
+def write_intel_hex(data, filename):
+  """
+  Writes a string of bytes as an Intel Hex file with 32-byte records, in
+  the same format as the AT+CGEE dump of the SCD.
+
+  Args:
+    data: the string of bytes, starting at address 0
+    filename: path of the file to store the Intel Hex records
+  """
+
+  fid = open(filename, 'w')
+  for addr in range(0, len(data), 32):
+    chunk = data[addr:addr + 32]
+    record = struct.pack('>BHB', len(chunk), addr, 0) + chunk
+    check = (-sum(ord(c) for c in record)) & 0xFF
+    fid.write(':' + binascii.hexlify(record).upper() + '%02X\r\n' % check)
+  fid.write(':00000001FF\r\n')
+  fid.close()
+
+def serial_geteeprombin(port, filename):
+  """
+  Requests the SCD to send the EEPROM contents in binary (AT+CGEEB): the
+  length (2 bytes, LSB first), the contents and their CRC32 (4 bytes, LSB
+  first). The contents are saved as a binary file or, if the filename
+  ends in .hex, exported as an Intel Hex file.
+
+  Args:
+    port: the virtual port to communicate with the SCD
+    filename: path of the file to store the EEPROM contents
+
+  Returns: True if success, False otherwise
+  """
+
+  ser = serial.Serial(port)
+  ser.write(AT_CMD.AT_CGEEB)
+  ser.flush()
+
+  header = ser.read(2)
+  if header == 'AT':
+    # the SCD rejected the command, e.g. older firmware without AT+CGEEB
+    print 'AT' + ser.readline().rstrip('\r\n')
+    ser.close()
+    return False
+  length = struct.unpack('<H', header)[0]
+  data = ser.read(length)
+  crc = struct.unpack('<I', ser.read(4))[0]
+  line = ser.readline()
+  ser.close()
+
+  if len(data) != length or crc != (binascii.crc32(data) & 0xFFFFFFFF):
+    print 'Bad EEPROM dump (length or CRC32)'
+    return False
+
+  if filename.lower().endswith('.hex'):
+    write_intel_hex(data, filename)
+  else:
+    fid = open(filename, 'wb')
+    fid.write(data)
+    fid.close()
+
+  return line.find('AT OK') >= 0
+
+def serial_pulllog(port, filename):
+  """
+  Requests the SCD to send the log entries written to its EEPROM since
+  the last pull (AT+CGLOG) and appends them to the given file. The log
+  session and the sequence number of the next record to pull are kept in
+  filename.cursor. If the SCD log was erased since the last pull, the new
+  log is appended after the old one.
+
+  The reply of the SCD is the log session (1 byte), the sequence number of
+  the first record sent and of the next record to be written (2 bytes
+  each, LSB first), the number of bytes (2 bytes, LSB first), the log
+  entries of the records and their CRC32 (4 bytes, LSB first).
+
+  Args:
+    port: the virtual port to communicate with the SCD
+    filename: path of the file to append the log to
+
+  Returns: the number of log bytes appended, or -1 if error
+  """
+
+  cursor = None
+  if os.path.exists(filename + '.cursor'):
+    fid = open(filename + '.cursor', 'r')
+    cursor = [int(x) for x in fid.read().split()]
+    fid.close()
+
+  ser = serial.Serial(port)
+  if cursor is None:
+    ser.write(AT_CMD.AT_CGLOG)
+  else:
+    ser.write('AT+CGLOG=%02X%04X\r\n' % (cursor[0], cursor[1]))
+  ser.flush()
+
+  header = ser.read(7)
+  if header[0:2] == 'AT':
+    # the SCD rejected the command, e.g. older firmware without AT+CGLOG
+    print header + ser.readline().rstrip('\r\n')
+    ser.close()
+    return -1
+  session, first, nextseq, length = struct.unpack('<BHHH', header)
+  data = ser.read(length)
+  crc = struct.unpack('<I', ser.read(4))[0]
+  line = ser.readline()
+  ser.close()
+
+  if len(data) != length or crc != (binascii.crc32(data) & 0xFFFFFFFF):
+    print 'Bad log data (length or CRC32)'
+    return -1
+  if cursor is not None and session != cursor[0]:
+    print 'The SCD log was erased, appending the new log'
+  elif cursor is not None and first != cursor[1]:
+    print '%d log records were overwritten before this pull' % \
+        ((first - cursor[1]) & 0xFFFF)
+
+  fid = open(filename, 'ab')
+  fid.write(data)
+  fid.close()
+  fid = open(filename + '.cursor', 'w')
+  fid.write('%d %d\n' % (session, nextseq))
+  fid.close()
+
+  if line.find('AT OK') < 0:
+    return -1
+  return length
+
+def serial_getindex(port):
+  """
+  Requests the transaction index of the SCD log (AT+CGIDX). The reply of
+  the SCD is the number of transactions (1 byte), 15 bytes for each one
+  (number, sequence number of its record, offset and length of its log
+  entries in the record, start time in ms and CRC32 of its ATR, LSB
+  first) and the CRC32 of the entries (4 bytes, LSB first).
+
+  Args:
+    port: the virtual port to communicate with the SCD
+
+  Returns: a list of tuples (number, seq, offset, length, time, atr),
+  or None if error
+  """
+
+  ser = serial.Serial(port)
+  ser.write(AT_CMD.AT_CGIDX)
+  ser.flush()
+
+  header = ser.read(1)
+  if header == 'A':
+    # the SCD rejected the command, e.g. older firmware without AT+CGIDX
+    print header + ser.readline().rstrip('\r\n')
+    ser.close()
+    return None
+  count = ord(header)
+  data = ser.read(15 * count)
+  crc = struct.unpack('<I', ser.read(4))[0]
+  line = ser.readline()
+  ser.close()
+
+  if len(data) != 15 * count or crc != (binascii.crc32(data) & 0xFFFFFFFF):
+    print 'Bad transaction index (length or CRC32)'
+    return None
+  if line.find('AT OK') < 0:
+    return None
+  return [struct.unpack('<BHHHII', data[k:k + 15])
+      for k in range(0, len(data), 15)]
+
+def serial_gettrans(port, number, filename):
+  """
+  Requests the log entries of one transaction from the SCD (AT+CGTRN=XX),
+  found through the transaction index, and saves them to the given file.
+  The reply of the SCD is the transaction number (1 byte), the number of
+  bytes (2 bytes, LSB first), the log entries and their CRC32 (4 bytes,
+  LSB first).
+
+  Args:
+    port: the virtual port to communicate with the SCD
+    number: the transaction number
+    filename: path of the file to store the log entries
+
+  Returns: the number of log bytes saved, or -1 if error
+  """
+
+  ser = serial.Serial(port)
+  ser.write('AT+CGTRN=%02X\r\n' % (number & 0xFF))
+  ser.flush()
+
+  header = ser.read(3)
+  if header[0:2] == 'AT':
+    # the transaction is not in the index or older firmware
+    print header + ser.readline().rstrip('\r\n')
+    ser.close()
+    return -1
+  length = struct.unpack('<H', header[1:3])[0]
+  data = ser.read(length)
+  crc = struct.unpack('<I', ser.read(4))[0]
+  line = ser.readline()
+  ser.close()
+
+  if len(data) != length or crc != (binascii.crc32(data) & 0xFFFFFFFF):
+    print 'Bad log data (length or CRC32)'
+    return -1
+
+  fid = open(filename, 'wb')
+  fid.write(data)
+  fid.close()
+
+  if line.find('AT OK') < 0:
+    return -1
+  return length
+
+def crc16_xmodem(data, crc = 0):
+  """
+  Computes the CRC-16 (XMODEM, polynomial 0x1021) used by the binary frames.
+
+  Args:
+    data is the string of bytes, crc the initial value
+
+  Returns: the CRC value
+  """
+
+  for c in data:
+    crc = crc ^ (ord(c) << 8)
+    for i in range(8):
+      if crc & 0x8000:
+        crc = ((crc << 1) ^ 0x1021) & 0xFFFF
+      else:
+        crc = (crc << 1) & 0xFFFF
+  return crc
+
+def write_frame(ser, ftype, data = ''):
+  """
+  Sends a binary frame to the SCD: type, length (LSB first), payload
+  and CRC-16 (LSB first).
+
+  Args:
+    ser is the open serial port, ftype the frame type (see FRAME),
+    data the payload as a string of bytes
+  """
+
+  frame = struct.pack('<BH', ftype, len(data)) + data
+  frame = frame + struct.pack('<H', crc16_xmodem(frame))
+  ser.write(frame)
+  ser.flush()
+
+def read_frame(ser, first = None):
+  """
+  Reads a binary frame from the SCD.
+
+  Args:
+    ser is the open serial port
+    first is the first byte of the frame if it was already read
+
+  Returns: a tuple (type, payload) or (None, None) if the CRC is wrong
+  """
+
+  if first is None:
+    header = ser.read(3)
+  else:
+    header = first + ser.read(2)
+  ftype, length = struct.unpack('<BH', header)
+  data = ser.read(length)
+  crc, = struct.unpack('<H', ser.read(2))
+  if crc != crc16_xmodem(header + data):
+    return (None, None)
+  return (ftype, data)
+
+def set_binary(ser, binary):
+  """
+  Enables or disables the binary frames for APDU exchanges.
+
+  Args:
+    ser is the open serial port, binary is True to enable the frames
+
+  Returns: True if success, False otherwise
+  """
+
+  if binary:
+    ser.write(AT_CMD.AT_CBIN)
+  else:
+    ser.write(AT_CMD.AT_CBIN_OFF)
+  ser.flush()
+  line = ser.readline()
+  return line.find('AT OK') >= 0
+
+def serial_terminal(port, fid = sys.stdin, binary = False):
   """
   Requests the SCD to act as an interactive terminal. A card must be inserted into the SCD.
 
   Args:
     port is the serial port used for communication between host and SCD.
     fid is the file descriptor for the file containing the sequence of commands.
+    binary is True to exchange the APDUs as binary frames.
 
   Returns: True if ended correctly, False otherwise
   """
 
   ser = serial.Serial(port)
+  if binary:
+    return serial_terminal_binary(ser, fid)
   ser.write(AT_CMD.AT_CCINIT)
   ser.flush()
   line = ser.readline()
@@ -127,18 +417,181 @@ def serial_terminal(port, fid = sys.stdin):
       line = ser.readline()
       print 'Response: ', line
 
-def serial_card(port, fid = sys.stdin):
+def serial_terminal_binary(ser, fid):
+  """
+  Same as serial_terminal, exchanging the APDUs as binary frames.
+
+  Args:
+    ser is the open serial port.
+    fid is the file descriptor for the file containing the sequence of commands.
+
+  Returns: True if ended correctly, False otherwise
+  """
+
+  if not set_binary(ser, True):
+    print 'Error enabling binary frames'
+    ser.close()
+    fid.close()
+    return False
+
+  ser.write(AT_CMD.AT_CCINIT)
+  ser.flush()
+  ftype, data = read_frame(ser)
+  if ftype != FRAME.OK:
+    print 'Error initialising card'
+    ser.close()
+    fid.close()
+    return False
+
+  while True:
+    line = fid.readline().rstrip('\r\n')
+    if line.find('0000000000') == 0:
+      fid.close()
+      write_frame(ser, FRAME.END)
+      line = ser.readline()
+      print 'Response: ', line
+      result = line.find('AT OK') >= 0 and set_binary(ser, False)
+      ser.close();
+      return result
+    else:
+      print 'Sending CAPDU: ', line
+      write_frame(ser, FRAME.CAPDU, binascii.unhexlify(line))
+      ftype, data = read_frame(ser)
+      if ftype == FRAME.RAPDU:
+        print 'Response: ', binascii.hexlify(data).upper()
+      else:
+        print 'Response: BAD'
+
+def make_batch(lines, maxlen):
+  """
+  Encodes CAPDUs into AT+CCBATCH scripts. Each line is a CAPDU optionally
+  followed by a condition: '=SWSW' to continue only if the response status
+  is SWSW, or '!SWSW' to continue only if it is not.
+
+  Args:
+    lines is the list of lines, maxlen the maximum size of a script
+
+  Returns: a list of scripts, each a string of bytes
+  """
+
+  batches = []
+  batch = ''
+  for line in lines:
+    tokens = line.split()
+    cond, sw = BATCH_COND.ANY, '\x00\x00'
+    if len(tokens) > 1 and tokens[1][0] == '=':
+      cond, sw = BATCH_COND.SW_EQ, binascii.unhexlify(tokens[1][1:5])
+    elif len(tokens) > 1 and tokens[1][0] == '!':
+      cond, sw = BATCH_COND.SW_NE, binascii.unhexlify(tokens[1][1:5])
+    capdu = binascii.unhexlify(tokens[0])
+    step = struct.pack('<B', cond) + sw + struct.pack('<B', len(capdu)) + capdu
+    if len(batch) + len(step) > maxlen:
+      batches.append(batch)
+      batch = ''
+    batch = batch + step
+  if len(batch) > 0:
+    batches.append(batch)
+  return batches
+
+def serial_terminal_batch(port, fid = sys.stdin, binary = False):
+  """
+  Requests the SCD to act as a terminal and run all the commands in the
+  given file back-to-back, using AT+CCBATCH. A card must be inserted into
+  the SCD.
+
+  Args:
+    port is the serial port used for communication between host and SCD.
+    fid is the file descriptor for the file containing the sequence of
+    commands, each optionally followed by a condition (see make_batch).
+    binary is True to exchange the APDUs as binary frames.
+
+  Returns: True if all the commands ran, False otherwise
+  """
+
+  lines = []
+  for line in fid:
+    if line.find('0000000000') == 0:
+      break
+    if len(line.strip()) > 0:
+      lines.append(line.strip())
+  fid.close()
+
+  ser = serial.Serial(port)
+  if binary and not set_binary(ser, True):
+    print 'Error enabling binary frames'
+    ser.close()
+    return False
+
+  ser.write(AT_CMD.AT_CCINIT)
+  ser.flush()
+  if binary:
+    ftype, data = read_frame(ser)
+    ok = ftype == FRAME.OK
+  else:
+    ok = ser.readline().find('AT OK') >= 0
+  if not ok:
+    print 'Error initialising card'
+    ser.close()
+    return False
+
+  # text scripts are limited by the size of an AT command line
+  if binary:
+    batches = make_batch(lines, 512)
+  else:
+    batches = make_batch(lines, 249)
+
+  result = True
+  for batch in batches:
+    if binary:
+      write_frame(ser, FRAME.BATCH, batch)
+    else:
+      ser.write('AT+CCBATCH=' + binascii.hexlify(batch).upper() + '\r\n')
+      ser.flush()
+    while True:
+      if binary:
+        ftype, data = read_frame(ser)
+        if ftype == FRAME.RAPDU:
+          print 'Response: ', binascii.hexlify(data).upper()
+          continue
+        status = {FRAME.OK: 'OK', FRAME.STOP: 'STOP'}.get(ftype, 'BAD')
+      else:
+        line = ser.readline().rstrip('\r\n')
+        if line.find('AT ') != 0:
+          print 'Response: ', line
+          continue
+        status = line[3:]
+      break
+    print 'Batch: ', status
+    if status != 'OK':
+      result = False
+      break
+
+  if binary:
+    write_frame(ser, FRAME.END)
+  else:
+    ser.write(AT_CMD.AT_CCEND)
+    ser.flush()
+  line = ser.readline()
+  if binary:
+    set_binary(ser, False)
+  ser.close()
+  return result and line.find('AT OK') >= 0
+
+def serial_card(port, fid = sys.stdin, binary = False):
   """
   Requests the SCD to act as an interactive card. A terminal should be
   connected when requested.
 
   Args:
-    port is the 
+    port is the serial port used for communication between host and SCD.
     fid is the file descriptor for the file containing the sequence of responses.
+    binary is True to exchange the APDUs as binary frames.
 
   Returns: True if ended correctly, False otherwise.
   """
   ser = serial.Serial(port)
+  if binary:
+    return serial_card_binary(ser, fid)
   ser.write(AT_CMD.AT_CTUSB)
   ser.flush()
   line = ser.readline()
@@ -173,6 +626,121 @@ def serial_card(port, fid = sys.stdin):
       elif line.find('AT BAD') >= 0:
         return False
 
+def serial_card_binary(ser, fid):
+  """
+  Same as serial_card, exchanging the data as binary frames.
+
+  Args:
+    ser is the open serial port.
+    fid is the file descriptor for the file containing the sequence of responses.
+
+  Returns: True if ended correctly, False otherwise.
+  """
+
+  if not set_binary(ser, True):
+    print 'Error enabling binary frames'
+    ser.close()
+    fid.close()
+    return False
+
+  ser.write(AT_CMD.AT_CTUSB)
+  ser.flush()
+  ftype, data = read_frame(ser)
+  if ftype != FRAME.OK:
+    print 'Error initialising card'
+    ser.close()
+    fid.close()
+    return False
+
+  while True:
+    line = fid.readline().rstrip('\r\n')
+    if line.find('0000000000') == 0:
+      fid.close()
+      print 'Waiting for final result'
+      write_frame(ser, FRAME.END)
+      line = ser.readline()
+      result = line.find('AT OK') >= 0 and set_binary(ser, False)
+      ser.close();
+      return result
+    else:
+      print 'Sending data: ', line
+      write_frame(ser, FRAME.UDATA, binascii.unhexlify(line))
+      ftype, data = read_frame(ser)
+      if ftype == FRAME.CAPDU:
+        print 'Data from Terminal: ', binascii.hexlify(data).upper()
+      elif ftype == FRAME.TRESET:
+        print 'Terminal reset'
+      else:
+        return False
+
+
+def serial_livetrace(port, filename):
+  """
+  Requests the SCD to log a card-reader transaction, streaming the log
+  over the serial port instead of writing it to EEPROM. The log entries
+  are written to the given file as they arrive, in the same format as
+  the log stored in EEPROM. The replies to the commands sent by other
+  programs during the transaction (e.g. AT+CLOGM) are printed.
+
+  Args:
+    port: the virtual port to communicate with the SCD
+    filename: path of the file to store the log
+
+  Returns: True if success, False otherwise
+  """
+
+  fid = open(filename, 'wb')
+  ser = serial.Serial(port)
+  ser.write(AT_CMD.AT_CLIVE)
+  ser.flush()
+
+  total = 0
+  while True:
+    c = ser.read(1)
+    if ord(c) == FRAME.TRACE:
+      ftype, data = read_frame(ser, c)
+      if ftype is None:
+        print 'Bad trace frame'
+        continue
+      fid.write(data)
+      fid.flush()
+      total = total + len(data)
+    elif ord(c) == FRAME.REPLY:
+      ftype, data = read_frame(ser, c)
+      if ftype is None:
+        print 'Bad reply frame'
+        continue
+      print 'Reply: ', data.rstrip('\r\n')
+    else:
+      line = c + ser.readline()
+      break
+
+  fid.close()
+  ser.close()
+  print 'Received %d log bytes' % total
+  return line.find('AT OK') >= 0
+
+def serial_logmask(port, mask = None):
+  """
+  Sets the event mask of the SCD logger, which is kept in EEPROM, or
+  retrieves the current mask if none is given. See LOG_MASK for the bits.
+
+  Args:
+    port: the virtual port to communicate with the SCD
+    mask: the new event mask, or None to read the current one
+
+  Returns: the reply line of the SCD
+  """
+
+  ser = serial.Serial(port)
+  if mask is None:
+    ser.write(AT_CMD.AT_CLOGM)
+  else:
+    ser.write('AT+CLOGM=%02X\r\n' % mask)
+  ser.flush()
+  line = ser.readline()
+  ser.close()
+  return line.rstrip('\r\n')
 
 def visualise_scd_eeprom(port, filename):
   """
@@ -181,10 +749,12 @@ def visualise_scd_eeprom(port, filename):
 
   Args:
       port: the virtual serial port to communicate with the SCD
-      filename: the path to a file used to store the EEPROM hex
-      file which will be parsed.
+      filename: the path to a file used to store the EEPROM contents
+      which will be parsed, in Intel Hex if it ends in .hex and in
+      binary otherwise.
   """
-  serial_geteepromhex(port, filename)
+  if not serial_geteeprombin(port, filename):
+    raise Exception('Could not retrieve the EEPROM contents')
   trace = SCDTrace(filename)
   trace.process_data(True)
 
@@ -207,6 +777,22 @@ def main():
       '--logt',
       action = 'store_true',
       help= 'log a card-reader transaction.')
+  parser.add_argument(
+      '--livetrace',
+      nargs = 1,
+      default = False,
+      metavar = 'filename',
+      help= 'log a card-reader transaction, streaming the log to the given file\
+          instead of EEPROM, so it is not limited by the size of the EEPROM.')
+  parser.add_argument(
+      '--logmask',
+      nargs = '?',
+      const = '',
+      default = False,
+      metavar = 'mask',
+      help= 'get, or set to the given hex value, the mask of events that the SCD logs.\
+          Bits: 01 ATR, 02 terminal data, 04 ICC data, 08 USB, 10 terminal events,\
+          20 ICC events, 40 time, 80 memory/watchdog/debug. E.g. F0 logs only events and times')
   parser.add_argument(
       '--dummypin',
       action = 'store_true',
@@ -247,6 +833,31 @@ def main():
       default = False,
       metavar = 'filename',
       help='retrieve the EEPROM contents as an Intel Hex file and save to specified file')
+  parser.add_argument(
+      '--geteeprom',
+      nargs = 1,
+      default = False,
+      metavar = 'filename',
+      help='retrieve the EEPROM contents in binary, which is faster than --geteepromhex,\
+          and save them to the specified file (exported as Intel Hex if it ends in .hex)')
+  parser.add_argument(
+      '--pulllog',
+      nargs = 1,
+      default = False,
+      metavar = 'filename',
+      help='append to the specified file the log entries written to the EEPROM since\
+          the last pull into the same file. Name it .log to parse it with scdtrace.py')
+  parser.add_argument(
+      '--getindex',
+      action = 'store_true',
+      help='show the index of the transactions kept in the EEPROM log')
+  parser.add_argument(
+      '--gettrans',
+      nargs = 2,
+      default = False,
+      metavar = ('number', 'filename'),
+      help='save the log entries of the transaction with the given number (see --getindex)\
+          to the specified file. Name it .log to parse it with scdtrace.py')
   parser.add_argument(
       '--eraseeeprom',
       action = 'store_true',
@@ -267,6 +878,16 @@ def main():
       default = False,
       metavar = 'filename',
       help='program the SCD via USB with the given Intel Hex file')
+  parser.add_argument(
+      '--batch',
+      action = 'store_true',
+      help='send the CAPDUs of --userterminal in batches (AT+CCBATCH) that the SCD runs back-to-back.\
+          Each CAPDU may be followed by a condition: =9000 to stop unless the status is 9000,\
+          or !6A83 to stop if the status is 6A83')
+  parser.add_argument(
+      '--binary',
+      action = 'store_true',
+      help='exchange the APDUs of --userterminal and --usercard as binary frames instead of hex AT commands')
   parser.add_argument('-v',
       '--verbose',
       action = 'store_true',
@@ -294,7 +915,10 @@ def main():
   elif args.userterminal != False:
     try:
       print "Starting user terminal...\n"
-      result = serial_terminal(args.port, args.userterminal)
+      if args.batch:
+        result = serial_terminal_batch(args.port, args.userterminal, args.binary)
+      else:
+        result = serial_terminal(args.port, args.userterminal, args.binary)
       if result == True:
         print "All done"
       else:
@@ -305,7 +929,7 @@ def main():
   elif args.usercard != False:
     try:
       print "Starting user card, follow SCD screen..."
-      result = serial_card(args.port, args.usercard)
+      result = serial_card(args.port, args.usercard, args.binary)
       if result == True:
         print "All done"
       else:
@@ -323,6 +947,26 @@ def main():
         print "Some error ocurred during communication, check log"
     except:
       print "Error sending command"
+  elif args.livetrace != False:
+    try:
+      print "Preparing to stream transaction log, follow SCD screen..."
+      result = serial_livetrace(args.port, args.livetrace[0])
+      if result == True:
+        print "All done"
+      else:
+        print "Some error ocurred during communication, check log"
+    except:
+      print "Error occurred"
+      raise
+  elif args.logmask != False:
+    try:
+      if args.logmask == '':
+        print serial_logmask(args.port)
+      else:
+        print serial_logmask(args.port, int(args.logmask, 16))
+    except:
+      print "Error occurred"
+      raise
   elif args.dummypin == True:
     try:
       print "Preparing to log transaction with dummy PIN, follow SCD screen..."
@@ -341,6 +985,51 @@ def main():
     except:
       print "Error occurred"
       raise
+  elif args.geteeprom != False:
+    try:
+      print "Retrieving EEPROM contents..."
+      if serial_geteeprombin(args.port, args.geteeprom[0]):
+        print "Done"
+      else:
+        print "Some error ocurred during communication"
+    except:
+      print "Error occurred"
+      raise
+  elif args.pulllog != False:
+    try:
+      print "Retrieving new log entries..."
+      result = serial_pulllog(args.port, args.pulllog[0])
+      if result >= 0:
+        print "Appended %d bytes" % result
+      else:
+        print "Some error ocurred during communication"
+    except:
+      print "Error occurred"
+      raise
+  elif args.getindex == True:
+    try:
+      index = serial_getindex(args.port)
+      if index is not None:
+        print "Number  Record  Offset  Length  Time (ms)   ATR CRC32"
+        for entry in index:
+          print "%6d  %6d  %6d  %6d  %10d  %08X" % entry
+      else:
+        print "Some error ocurred during communication"
+    except:
+      print "Error occurred"
+      raise
+  elif args.gettrans != False:
+    try:
+      print "Retrieving transaction %s..." % args.gettrans[0]
+      result = serial_gettrans(args.port, int(args.gettrans[0]),
+          args.gettrans[1])
+      if result >= 0:
+        print "Saved %d bytes" % result
+      else:
+        print "Some error ocurred during communication"
+    except:
+      print "Error occurred"
+      raise
   elif args.eraseeeprom == True:
     try:
       print "Erasing EEPROM contents..."
@@ -67,6 +67,7 @@ class SCDTrace:
         parse_data: not sure yet
         process_data: performs all the necessary parsing of a file. Use this!
         parse_intel_hex: parse a file in Intel Hex format (such as SCD EEPROM)
+        parse_binary: parse a binary EEPROM dump (from AT+CGEEB) or log
         extract_log_data: get log data from the larger parsed EEPROM contents
         split_events: split bytes into clusters of events
         print_events: print event information on standard output
@@ -104,6 +105,7 @@ class SCDTrace:
                 0x14: "Error sending byte to terminal",
                 0x15: "No clock from terminal",
                 0x16: "More time requested to terminal",
+                0x17: "Rate (PPS1) set by terminal PPS",
                 0x20: "ICC activated",
                 0x21: "ICC deactivated",
                 0x22: "ICC reset high",
@@ -118,6 +120,7 @@ class SCDTrace:
                 0x35: "Debug event type 2",
                 0x36: "Debug event type 3",
                 0x37: "Debug event type 4",
+                0x38: "Fine time (4 us units)",
                 }
         #self.errors = []
         #self.warnings = []
@@ -171,14 +174,26 @@ class SCDTrace:
         @Returns:
             None
         """
-        self.bigtrace = self.parse_intel_hex(self.filename)
-        self.log_data = self.extract_log_data(self.bigtrace)
+        if self.filename.lower().endswith('.log'):
+            # log bytes pulled with clis.py --pulllog, version 3 or older
+            self.log_data = self.parse_binary(self.filename)
+            self.log_version = 3
+        elif self.filename.lower().endswith('.hex'):
+            self.bigtrace = self.parse_intel_hex(self.filename)
+            self.log_data = self.extract_log_data(self.bigtrace)
+        else:
+            self.bigtrace = self.parse_binary(self.filename)
+            self.log_data = self.extract_log_data(self.bigtrace)
         if len(self.log_data) < 2:
             print "No data available"
             return
         if verbose:
+            print "Log version: ", self.log_version
             print "Log bytes: \n", self.log_data
-        self.events_list = self.split_events(self.log_data)
+        if self.log_version == 3:
+            self.log_data = self.decode_chains(self.log_data)
+            self.log_version = 2
+        self.events_list = self.split_events(self.log_data, self.log_version)
         self.print_events(self.events_list, verbose)
 
     def parse_intel_hex(self, filename):
@@ -214,6 +229,24 @@ class SCDTrace:
 
         return bigtrace
 
+    def parse_binary(self, filename):
+        """
+        Parses a binary file containing an SCD EEPROM dump, or the log
+        bytes pulled with AT+CGLOG, and returns a string of bytes in the
+        same format as parse_intel_hex.
+
+        @Args:
+            filename: the name of the file to be parsed
+
+        @Returns:
+            a string of bytes representing the parsed file.
+        """
+        f = open(filename, 'rb')
+        bigtrace = b2a_hex(f.read()).upper()
+        f.close()
+
+        return bigtrace
+
     def extract_log_data(self, bigtrace):
         """
         Extracts the log data bytes from the parsed full log trace.
@@ -223,22 +256,240 @@ class SCDTrace:
         The EEPROM of the SCD has 4K. The first 128 bytes contain metadata, with
         the following important fields (starting from 0):
         bytes 4-7: last counter value
-        bytes 72-73: address of last log byte
+        bytes 72-73: address of last log byte (versions 1 and 2)
+        byte 74: version of the log in EEPROM (1 if not 2 to 5)
+        bytes 80-127: metadata slots of the log ring (versions 3 to 5)
         byte 128: start of log data
         
+        In versions 1 and 2 the log data is linear, up to the address of the
+        last log byte. In version 3 the log data (up to byte 4064, or 3920
+        in versions 4 and 5 which keep a transaction index after it) is a
+        ring of records, each one with a header (sequence number and length,
+        2 bytes each, LSB first) followed by version 2 log entries (version
+        3 entries in version 5, see decode_chains). Bit 15 of
+        the length is set until the log of the record has been copied, and
+        such records are skipped as they only hold older data. The state
+        of the ring is in one of 6 metadata slots of 8 bytes: the sequence
+        number of the next record, the address of the next record (head), the
+        address of the oldest record (tail) and a check word (seq ^ head ^
+        tail ^ 0xA55A), 2 bytes each, LSB first. The newest valid slot gives
+        the state and the records from tail to head are joined in order.
+
         In the following take in consideration that each character in the
         bigtrace string actually represents a nibble (i.e. half a byte).
 
         @Args:
             bigtrace: the string of bytes representing the parsed EEPROM data
 
+        The version of the log entries (1 to 3, see split_events and
+        decode_chains) is stored in self.log_version.
+
         @Returns:
             a string of bytes representing the log data
         """
+        version = int(bigtrace[74*2:75*2], 16)
+        if version in (3, 4, 5):
+            self.log_version = 3 if version == 5 else 2
+            return self.extract_log_ring(bigtrace, version)
+
         last_byte = int(bigtrace[72*2:74*2], 16)
+        self.log_version = 1
+        if version == 2:
+            self.log_version = 2
         return bigtrace[128*2:last_byte*2]
 
-    def split_events(self, data):
+    def extract_log_ring(self, bigtrace, version=3):
+        """
+        Reassembles the log ring of a version 3 to 5 EEPROM log, see
+        extract_log_data.
+
+        @Args:
+            bigtrace: the string of bytes representing the parsed EEPROM data
+            version: the version of the log in EEPROM (3 to 5)
+
+        @Returns:
+            a string of bytes with the log entries of the records, from the
+            oldest to the newest
+        """
+        start, end = 128, 4064
+        if version in (4, 5):
+            end = 3920
+        le16 = lambda addr: int(bigtrace[addr*2+2:addr*2+4] +
+                                bigtrace[addr*2:addr*2+2], 16)
+
+        state = None
+        for slot in range(80, 128, 8):
+            seq, head, tail, check = [le16(slot + 2*k) for k in range(4)]
+            if check != seq ^ head ^ tail ^ 0xA55A:
+                continue
+            if not (start <= head < end and start <= tail < end):
+                continue
+            if state is None or 0 < ((seq - state[0]) & 0xFFFF) < 0x8000:
+                state = (seq, head, tail)
+        if state is None:
+            return ''
+
+        # unroll the ring so that records can be read across its end
+        size = end - start
+        ring = bigtrace[start*2:end*2] * 2
+        addr = state[2] - start
+        used = (state[1] - state[2]) % size
+        data = ''
+        while used >= 4:
+            length = int(ring[addr*2+6:addr*2+8] + ring[addr*2+4:addr*2+6], 16)
+            pending = length & 0x8000
+            length &= 0x7FFF
+            if length + 4 > used:
+                break
+            if not pending:
+                data += ring[addr*2+8:(addr+4+length)*2]
+            addr = (addr + 4 + length) % size
+            used -= length + 4
+        return data
+
+    def decode_chains(self, data):
+        """
+        Decodes the chains of a version 3 log back to the version 2 entries
+        they hold, keeping the other entries as they are.
+
+        A chain is a data type (0x02 to 0x05) with YY = b'10, followed by
+        tokens up to a 0x00 token:
+        0x01 to 0x3F: N bytes of the type of the chain follow;
+        0x41 to 0x7F: N = (token & 0x3F) bytes of the paired type (the type
+        of the chain with bit 0 flipped, e.g. 0x05 for 0x04) follow;
+        0x40: a general time (0x31) difference follows as a varint;
+        b'100ttttt: a fine time (0x38) difference with t as its low 5 bits,
+        followed by the rest (difference >> 5) as a varint;
+        b'101iiidd: a fine time difference of R + dd - 2, where R is entry
+        i of the list of the last 8 fine differences of the chain (newest
+        first). Each fine difference is put first in the list, replacing R
+        if given this way;
+        b'110Dnnnn: n + 3 bytes of the type of the chain (D = 0) or of the
+        paired type (D = 1) copied from the bytes of the chain, starting
+        O bytes back, where O is the next byte plus one;
+        b'111ttttt: a general time difference of t.
+        Consecutive bytes of the same type are one entry, a run (YY = b'01)
+        or a 1-byte entry if there is only one.
+
+        @Args:
+            data: string of bytes containing a version 3 log from the SCD.
+
+        @Returns:
+            a string of bytes with the version 2 entries of the log, which
+            stop at the first invalid token
+        """
+        data_len = len(data)
+        byte = lambda k: int(data[k:k+2], 16)
+        out = ""
+        i = 0
+
+        def varint(i):
+            value, shift = 0, 0
+            while i < data_len and shift < 35:
+                byte_value = byte(i)
+                i += 2
+                value |= (byte_value & 0x7F) << shift
+                shift += 7
+                if byte_value & 0x80 == 0:
+                    break
+            return value, i
+
+        def entries(runs):
+            result = ""
+            for (kind, chars) in runs:
+                if len(chars) == 2:
+                    result += "%02X" % (kind << 2) + chars
+                else:
+                    result += "%02X%02X" % (kind << 2 | 1, len(chars) / 2)
+                    result += chars
+            return result
+
+        while i < data_len:
+            header = byte(i)
+            i += 2
+            kind = header >> 2
+            if header & 0x03 != 0x02 or kind < 0x02 or kind > 0x05:
+                # the other entries are kept as they are
+                if header & 0x03 == 0x01:
+                    n = byte(i) + 1 if i < data_len else 0
+                elif header & 0x03 == 0 and kind in (0x30, 0x31, 0x38):
+                    n = 0
+                    while i + 2*n < data_len:
+                        n += 1
+                        if byte(i + 2*n - 2) & 0x80 == 0:
+                            break
+                else:
+                    n = (header & 0x03) + 1
+                out += data[i-2:i+2*n]
+                i += 2*n
+                continue
+
+            chain = ""      # bytes of the chain, for the copies
+            runs = []       # [type, bytes] of the data entries
+            recent = []     # last fine differences, newest first
+            valid = True
+            while i < data_len:
+                token = byte(i)
+                i += 2
+                if token == 0x00:
+                    break
+                if token < 0x80 and token != 0x40:
+                    chars = data[i:i + 2*(token & 0x3F)]
+                    i += len(chars)
+                elif 0xC0 <= token < 0xE0:
+                    offset = byte(i) + 1 if i < data_len else data_len
+                    i += 2
+                    if offset > len(chain) / 2:
+                        valid = False
+                        break
+                    chars = ""
+                    for k in range(((token & 0x0F) + 3)):
+                        chars += (chain + chars)[-2*offset:][:2]
+                else:
+                    if token >= 0xE0:
+                        kind, delta = 0x31, token & 0x1F
+                    elif token == 0x40:
+                        kind = 0x31
+                        delta, i = varint(i)
+                    elif token >= 0xA0:
+                        k = (token >> 2) & 0x07
+                        if k >= len(recent):
+                            valid = False
+                            break
+                        kind = 0x38
+                        delta = recent.pop(k) + (token & 0x03) - 2
+                    else:
+                        kind = 0x38
+                        delta, i = varint(i)
+                        delta = (token & 0x1F) | (delta << 5)
+                        recent = recent[:7]
+                    if kind == 0x38:
+                        recent.insert(0, delta)
+                    out += entries(runs)
+                    runs = []
+                    out += "%02X" % (kind << 2)
+                    while delta > 0x7F:
+                        out += "%02X" % ((delta & 0x7F) | 0x80)
+                        delta >>= 7
+                    out += "%02X" % delta
+                    continue
+
+                # bytes of the chain, added to the last entry of their type
+                kind = header >> 2
+                if token & (0x40 if token < 0x80 else 0x10):
+                    kind ^= 0x01
+                chain += chars
+                if not runs or runs[-1][0] != kind:
+                    runs.append([kind, ""])
+                runs[-1][1] += chars
+            out += entries(runs)
+            if not valid:
+                break
+        #end while
+
+        return out
+
+    def split_events(self, data, version=1):
         """
         Split a string of bytes representing a parsed log from the SCD and
         clusters the bytes into separate events. Consecutive bytes of the same
@@ -248,9 +499,19 @@ class SCDTrace:
         L1 = XXXXXXYY defines what the next byte(s) mean, where XXXXXX is
         used for the encoding of the type (6 bits) and YY (2 bits) to specify
         how many bytes follow (b'00 -> 1, b'01 -> 2, b'10 -> 3 or b'11 -> 4).
+
+        In version 2 of the log, YY = b'01 means that L2 is a count N
+        followed by N bytes of the same type. For the time types (0x30, 0x31
+        and 0x38), YY = b'00 means that a varint follows (7 bits per byte,
+        least significant first) with the difference from the previous time,
+        while YY = b'11 gives an absolute time as in version 1. The fine time
+        (0x38, in units of 4 us) is relative to the previous fine time only.
+        Time events are returned as 4 bytes of absolute time in both
+        versions.
         
         @Args:
             data: string of bytes containing a log from the SCD.
+            version: the version of the log format (1 or 2)
 
         @Returns:
             list of (type, data) items
@@ -262,6 +523,7 @@ class SCDTrace:
         events_list = []
         data_len = len(data)
         last_type = 0xFF
+        last_time = {0x30: 0, 0x38: 0}
         event_data = ""
         i = 0
         while i < data_len:
@@ -269,6 +531,14 @@ class SCDTrace:
             i += 2
             byte_type = (byte_value & 0xFF) >> 2
             bytes_following = (byte_value & 0x03) + 1
+            is_time = byte_type in (0x30, 0x31, 0x38)
+            base = 0x38 if byte_type == 0x38 else 0x30
+
+            if version == 2 and bytes_following == 2:
+                if i + 2 > data_len:
+                    break
+                bytes_following = int(data[i:i+2], 16)
+                i += 2
 
             # If this happens then either the file is corrupted or we have
             # reached the end of the log data. In either case we stop.
@@ -283,6 +553,25 @@ class SCDTrace:
                 last_type = byte_type
                 event_data = ""
 
+            if version == 2 and is_time and bytes_following == 1:
+                delta = 0
+                shift = 0
+                while i < data_len:
+                    byte_value = int(data[i:i+2], 16)
+                    i += 2
+                    delta |= (byte_value & 0x7F) << shift
+                    shift += 7
+                    if byte_value & 0x80 == 0:
+                        break
+                last_time[base] = (last_time[base] + delta) & 0xFFFFFFFF
+                for k in range(4):
+                    event_data += "%02X" % ((last_time[base] >> (8 * k)) & 0xFF)
+                continue
+
+            if is_time and bytes_following == 4:
+                last_time[base] = int(data[i+6:i+8] + data[i+4:i+6] +
+                        data[i+2:i+4] + data[i:i+2], 16)
+
             for k in range(bytes_following):
                 event_data += data[i:i+2]
                 i += 2
@@ -311,6 +600,7 @@ class SCDTrace:
         @Throws:
             None
         """
+        last_fine = None
         for event_type, data in events_list:
             len_data = len(data)
             print("event: ", hex(event_type), self.event_dict[event_type])
@@ -318,6 +608,16 @@ class SCDTrace:
             if event_type == 0x30 or event_type == 0x31:
                 time = data[6:8] + data[4:6] + data[2:4] + data[0:2]
                 print("time in ms: ", int(time, 16) * 1024 / 1000)
+            if event_type == 0x38:
+                # consecutive fine times are in the same event
+                for k in range(0, len_data - 7, 8):
+                    fine = int(data[k+6:k+8] + data[k+4:k+6] +
+                            data[k+2:k+4] + data[k:k+2], 16)
+                    print("time in us: ", fine * 4)
+                    if last_fine is not None:
+                        print("since previous fine time in us: ",
+                                ((fine - last_fine) & 0xFFFFFFFF) * 4)
+                    last_fine = fine
             if event_type == 0x02 or event_type == 0x05:
                 if len_data > 6:
                     try:
@@ -341,7 +641,9 @@ def main():
     parser = argparse.ArgumentParser(description='SCD log parser')
     parser.add_argument(
             'log_file',
-            help='the file containing the log (Intel hex format)')
+            help='the file containing the log (Intel hex format if it ends\
+            in .hex, log bytes from clis.py --pulllog if it ends in .log,\
+            binary EEPROM dump otherwise)')
     parser.add_argument('-v',
             '--verbose',
             action = 'store_true',